@@ -1,2 +1,3 @@
 gcc -Os -s -fno-asynchronous-unwind-tables -fno-stack-protector -ffunction-sections -fdata-sections \
--Wl,--gc-sections -DNDEBUG -o minirtmp librtmp/*.c minirtmp.c minirtmp_player.c minirtmp_test.c system.c -lpthread -lfdk-aac
\ No newline at end of file
+-Wl,--gc-sections -DNDEBUG -DCRYPTO -o minirtmp librtmp/*.c minirtmp.c minirtmp_player.c minirtmp_mux.c minirtmp_pool.c minirtmp_test.c system.c -lpthread -lfdk-aac -lssl -lcrypto
+gcc -O2 -DNDEBUG -DCRYPTO -o minirtmp_bench librtmp/*.c minirtmp.c minirtmp_player.c minirtmp_mux.c minirtmp_pool.c minirtmp_bench.c system.c -lpthread -lssl -lcrypto
@@ -36,6 +36,110 @@ static const AMFObjectProperty AMFProp_Invalid = { { 0, 0 }, AMF_INVALID };
 static const AMFObject AMFObj_Invalid = { 0, 0 };
 static const AVal AV_empty = { 0, 0 };
 
+static int amfprop_decode(AMFObjectProperty *prop, const char *pBuffer, int nSize, int bDecodeName, AMFArena *arena);
+static int amf_decode(AMFObject *obj, const char *pBuffer, int nSize, int bDecodeName, AMFArena *arena);
+static int amf_decode_array(AMFObject *obj, const char *pBuffer, int nSize, int nArrayLen, int bDecodeName, AMFArena *arena);
+static int amf3_decode(AMFObjectProperty *prop, const char *pBuffer, int nSize, int bMarker, AMFArena *arena);
+static int amf_add_prop(AMFObject *obj, const AMFObjectProperty *prop, AMFArena *arena);
+static void amf3cd_add_prop(AMF3ClassDef *cd, AVal *prop, AMFArena *arena);
+
+/* AMFArena */
+
+#define ARENA_ALIGN(n)   (((n) + 7) & ~7)
+#define ARENA_MIN_BLOCK  4096
+
+/* nesting limit of the bounded decoders */
+#define AMF_MAX_DEPTH    32
+
+typedef struct AMFArenaBlock
+{
+    struct AMFArenaBlock *next;
+    union
+    {
+        int size;
+        double align;
+    } u;
+} AMFArenaBlock;
+
+void AMF_ArenaInit(AMFArena *arena, void *scratch, int nSize)
+{
+    memset(arena, 0, sizeof(AMFArena));
+    arena->a_scratch = arena->a_buf = (char *)scratch;
+    arena->a_scratchSize = arena->a_size = scratch ? nSize : 0;
+}
+
+void *AMF_ArenaAlloc(AMFArena *arena, int nSize)
+{
+    nSize = ARENA_ALIGN(nSize);
+    if (arena->a_used + nSize > arena->a_size)
+    {
+        int nBlock = nSize > ARENA_MIN_BLOCK ? nSize : ARENA_MIN_BLOCK;
+        AMFArenaBlock *block = malloc(sizeof(AMFArenaBlock) + nBlock);
+        if (!block)
+            return NULL;
+        block->next = arena->a_blocks;
+        block->u.size = nBlock;
+        arena->a_blocks = block;
+        arena->a_buf = (char *)(block + 1);
+        arena->a_size = nBlock;
+        arena->a_used = 0;
+    }
+    arena->a_last = arena->a_used;
+    arena->a_used += nSize;
+    return arena->a_buf + arena->a_last;
+}
+
+/* grow the latest allocation in place when possible, copy otherwise */
+static void *arena_grow(AMFArena *arena, void *ptr, int nOldSize, int nSize)
+{
+    void *res;
+    if (ptr && (char *)ptr == arena->a_buf + arena->a_last && arena->a_last + nSize <= arena->a_size)
+    {
+        arena->a_used = arena->a_last + ARENA_ALIGN(nSize);
+        return ptr;
+    }
+    res = AMF_ArenaAlloc(arena, nSize);
+    if (res && ptr)
+        memcpy(res, ptr, nOldSize);
+    return res;
+}
+
+/* keeps the latest heap block, so a reused arena stops spilling after warm up */
+void AMF_ArenaReset(AMFArena *arena)
+{
+    AMFArenaBlock *block = arena->a_blocks;
+    if (block)
+    {
+        AMFArenaBlock *keep = block;
+        block = block->next;
+        while (block)
+        {
+            AMFArenaBlock *next = block->next;
+            free(block);
+            block = next;
+        }
+        keep->next = NULL;
+        arena->a_buf  = (char *)(keep + 1);
+        arena->a_size = keep->u.size;
+    }
+    arena->a_used = arena->a_last = 0;
+}
+
+void AMF_ArenaFree(AMFArena *arena)
+{
+    AMFArenaBlock *block = arena->a_blocks;
+    while (block)
+    {
+        AMFArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->a_blocks = NULL;
+    arena->a_buf  = arena->a_scratch;
+    arena->a_size = arena->a_scratchSize;
+    arena->a_used = arena->a_last = 0;
+}
+
 /* Data is Big-Endian */
 unsigned short AMF_DecodeInt16(const char *data)
 {
@@ -389,189 +493,730 @@ char *AMFProp_Encode(AMFObjectProperty *prop, char *pBuffer, char *pBufEnd)
 #define AMF3_INTEGER_MAX    268435455
 #define AMF3_INTEGER_MIN    -268435456
 
-int AMF3ReadInteger(const char *data, int32_t *valp)
+/* Reference tables of one top level AMF3 value. Lookups are plain indexing,
+ * the tables only live for the decode call and come from a stack scratch arena. */
+#define AMF3_TABLES_SCRATCH 4096
+
+typedef struct AMF3Refs
+{
+    AMFArena *arena;                /* decoded tree, NULL for heap */
+    AMFArena tables;
+    AVal *strings;
+    int numStrings;
+    AMFObjectProperty *objects;     /* objects, arrays, dates, xml and byte arrays */
+    int numObjects;
+    AMF3ClassDef *traits;
+    int numTraits;
+    int depth;
+    int budget;                     /* props heap clones may still copy */
+} AMF3Refs;
+
+static int amf3_value(AMF3Refs *refs, AMFObjectProperty *prop, const char *p, const char *end);
+
+/* returns a new slot for the caller to fill, tables grow by 16 like object props */
+static void *amf3_table_add(AMF3Refs *refs, void *table, int *num, int nElem)
 {
-    int i = 0;
-    int32_t val = 0;
+    void **pTable = (void **)table;
+    char *res;
+    if (!(*num & 0x0f))
+    {
+        int nSize = (*num + 16)*nElem;
+        void *grown = arena_grow(&refs->tables, *pTable, *num*nElem, nSize);
+        if (!grown)
+            return NULL;
+        *pTable = grown;
+    }
+    res = (char *)*pTable + (*num)++*nElem;
+    return res;
+}
 
-    while (i <= 2)
-    {                /* handle first 3 bytes */
-        if (data[i] & 0x80)
-        {            /* byte used */
-            val <<= 7;        /* shift up */
-            val |= (data[i] & 0x7f);    /* add bits */
-            i++;
-        } else
+static int amf3_is_container(const AMFObjectProperty *prop)
+{
+    return prop->p_type == AMF_OBJECT || prop->p_type == AMF_ECMA_ARRAY || prop->p_type == AMF_STRICT_ARRAY;
+}
+
+/* referenced objects share props inside an arena, heap trees need their own
+ * copy for AMF_Reset. The budget stops small inputs that nest references
+ * from expanding into huge trees. */
+static int amf_clone(AMF3Refs *refs, AMFObject *dst, const AMFObject *src)
+{
+    int i, nSize = ((src->o_num + 15) & ~15)*sizeof(AMFObjectProperty);
+    if (refs->arena || !src->o_num)
+    {
+        *dst = *src;
+        return TRUE;
+    }
+    dst->o_num = 0;
+    if ((refs->budget -= src->o_num) < 0 || !(dst->o_props = malloc(nSize)))
+    {
+        dst->o_props = NULL;
+        return FALSE;
+    }
+    memcpy(dst->o_props, src->o_props, src->o_num*sizeof(AMFObjectProperty));
+    for (i = 0; i < src->o_num; i++, dst->o_num++)
+    {
+        AMFObjectProperty *prop = &dst->o_props[i];
+        if (amf3_is_container(prop) &&
+            !amf_clone(refs, &prop->p_vu.p_object, &src->o_props[i].p_vu.p_object))
         {
-            break;
+            dst->o_num++;
+            return FALSE;
         }
     }
+    return TRUE;
+}
 
-    if (i > 2)
-    {                /* use 4th byte, all 8bits */
-        val <<= 8;
-        val |= data[3];
+static int amf3_u29(const char *p, const char *end, uint32_t *val)
+{
+    uint32_t res = 0;
+    int i;
+    if (p < end && !(*p & 0x80))
+    {   /* short strings and small integers */
+        *val = *p;
+        return 1;
+    }
+    for (i = 0; i < 4; i++)
+    {
+        unsigned char c;
+        if (p + i >= end)
+            return -1;
+        c = p[i];
+        if (i == 3)
+        {   /* 4th byte uses all 8 bits */
+            *val = (res << 8) | c;
+            return 4;
+        }
+        res = (res << 7) | (c & 0x7f);
+        if (!(c & 0x80))
+            break;
+    }
+    *val = res;
+    return i + 1;
+}
 
-        /* range check */
-        if (val > AMF3_INTEGER_MAX)
-            val -= (1 << 29);
-    } else
-    {                /* use 7bits of last unparsed byte (0xxxxxxx) */
-        val <<= 7;
-        val |= data[i];
+static int amf3_string(AMF3Refs *refs, const char *p, const char *end, AVal *str)
+{
+    AVal *slot;
+    uint32_t ref;
+    int len = amf3_u29(p, end, &ref);
+    if (len < 0)
+        return -1;
+    if (!(ref & 1))
+    {   /* reference */
+        if ((ref >> 1) >= (uint32_t)refs->numStrings)
+            return -1;
+        *str = refs->strings[ref >> 1];
+        return len;
     }
+    ref >>= 1;
+    if (ref > (uint32_t)(end - p - len))
+        return -1;
+    str->av_val = (char *)p + len;
+    str->av_len = ref;
+    if (!ref)
+        return len;     /* empty string is never sent by reference */
+    if (refs->numStrings & 0x0f)
+        slot = &refs->strings[refs->numStrings++];
+    else if (!(slot = amf3_table_add(refs, &refs->strings, &refs->numStrings, sizeof(AVal))))
+        return -1;
+    /* field by field, a whole AVal copy would reload the stores above at once */
+    slot->av_val = str->av_val;
+    slot->av_len = ref;
+    return len + ref;
+}
 
-    *valp = val;
-    return i > 2 ? 4 : i + 1;
+/* ref is the U29 header with the inline bit clear */
+static int amf3_object_ref(AMF3Refs *refs, AMFObjectProperty *prop, uint32_t ref)
+{
+    AMFObjectProperty *src;
+    if ((ref >> 1) >= (uint32_t)refs->numObjects)
+        return FALSE;
+    src = &refs->objects[ref >> 1];
+    prop->p_type = src->p_type;
+    prop->p_vu = src->p_vu;
+    prop->p_UTCoffset = src->p_UTCoffset;
+    if (amf3_is_container(src))
+        return amf_clone(refs, &prop->p_vu.p_object, &src->p_vu.p_object);
+    return TRUE;
 }
 
-int AMF3ReadString(const char *data, AVal *str)
+/* decodes a value straight into the next prop of obj, it only counts once complete */
+static int amf3_member(AMF3Refs *refs, AMFObject *obj, const AVal *name, const char *p, const char *end)
 {
-    int32_t ref = 0;
+    AMFObjectProperty *member;
     int len;
-    assert(str != 0);
+    if (!(obj->o_num & 0x0f))
+    {
+        int nSize = (obj->o_num + 16)*sizeof(AMFObjectProperty);
+        AMFObjectProperty *props = refs->arena ? arena_grow(refs->arena, obj->o_props, obj->o_num*sizeof(AMFObjectProperty), nSize) :
+                                                 realloc(obj->o_props, nSize);
+        if (!props)
+            return -1;
+        obj->o_props = props;
+    }
+    member = &obj->o_props[obj->o_num];
+    if (!name)
+        name = &AV_empty;
+    /* field by field, names are usually fresh from amf3_string */
+    member->p_name.av_val = name->av_val;
+    member->p_name.av_len = name->av_len;
+    if ((len = amf3_value(refs, member, p, end)) >= 0)
+        obj->o_num++;
+    return len;
+}
 
-    len = AMF3ReadInteger(data, &ref);
-    data += len;
+static int amf3_members(AMF3Refs *refs, AMFObjectProperty *prop, const char *p, const char *end, uint32_t ref, int slot)
+{
+    static const AVal av_DEFAULT_ATTRIBUTE = AVC("DEFAULT_ATTRIBUTE");
+    const char *start = p;
+    AMFObject *obj = &prop->p_vu.p_object;
+    AMF3ClassDef *cd;
+    AVal name;
+    int len, i, nTraits;
 
-    if ((ref & 0x1) == 0)
-    {                /* reference: 0xxx */
-        uint32_t refIndex = (ref >> 1);
-        RTMP_Log(RTMP_LOGDEBUG, "%s, string reference, index: %d, not supported, ignoring!", __FUNCTION__, refIndex);
-        str->av_val = NULL;
-        str->av_len = 0;
-        return len;
+    if (!(ref & 2))
+    {   /* traits reference */
+        if ((ref >> 2) >= (uint32_t)refs->numTraits)
+            return -1;
+        nTraits = ref >> 2;
     } else
     {
-        uint32_t nSize = (ref >> 1);
-
-        str->av_val = (char *)data;
-        str->av_len = nSize;
+        AMF3ClassDef cdInline;
+        uint32_t nMembers = ref >> 4;
+        memset(&cdInline, 0, sizeof(cdInline));
+        cdInline.cd_externalizable = (ref >> 2) & 1;
+        cdInline.cd_dynamic = (ref >> 3) & 1;
+        if ((len = amf3_string(refs, p, end, &cdInline.cd_name)) < 0 || nMembers > (uint32_t)(end - p))
+            return -1;
+        p += len;
+        for (i = 0; i < (int)nMembers; i++)
+        {
+            if ((len = amf3_string(refs, p, end, &name)) < 0)
+                break;
+            p += len;
+            amf3cd_add_prop(&cdInline, &name, &refs->tables);
+            if (cdInline.cd_num != i + 1)
+                break;
+        }
+        nTraits = refs->numTraits;
+        cd = i == (int)nMembers ? amf3_table_add(refs, &refs->traits, &refs->numTraits, sizeof(AMF3ClassDef)) : NULL;
+        if (!cd)
+            return -1;
+        *cd = cdInline;
+        RTMP_Log(RTMP_LOGDEBUG, "Class name: %.*s, externalizable: %d, dynamic: %d, classMembers: %d",
+                 cd->cd_name.av_len, cd->cd_name.av_val, cd->cd_externalizable, cd->cd_dynamic, cd->cd_num);
+    }
 
-        return len + nSize;
+    /* members may add traits and move the table, so cd is looked up again after each value */
+    prop->p_type = AMF_OBJECT;
+    if (refs->traits[nTraits].cd_externalizable)
+    {   /* only flex.messaging.io wrappers are known, they carry a single value */
+        if ((len = amf3_member(refs, obj, &av_DEFAULT_ATTRIBUTE, p, end)) < 0)
+            return -1;
+        p += len;
+    } else
+    {
+        for (i = 0; i < refs->traits[nTraits].cd_num; i++)
+        {   /* sealed */
+            if ((len = amf3_member(refs, obj, &refs->traits[nTraits].cd_props[i], p, end)) < 0)
+                return -1;
+            p += len;
+        }
+        while (refs->traits[nTraits].cd_dynamic)
+        {
+            if ((len = amf3_string(refs, p, end, &name)) < 0)
+                return -1;
+            p += len;
+            if (!name.av_len)
+                break;
+            if ((len = amf3_member(refs, obj, &name, p, end)) < 0)
+                return -1;
+            p += len;
+        }
     }
-    return len;
+    refs->objects[slot] = *prop;
+    return p - start;
 }
 
-int AMF3Prop_Decode(AMFObjectProperty *prop, const char *pBuffer, int nSize, int bDecodeName)
+static int amf3_array(AMF3Refs *refs, AMFObjectProperty *prop, const char *p, const char *end, uint32_t nDense, int slot)
 {
-    int nOriginalSize = nSize;
-    AMF3DataType type;
+    const char *start = p;
+    AVal name;
+    int len;
 
-    prop->p_name.av_len = 0;
-    prop->p_name.av_val = NULL;
+    prop->p_type = AMF_STRICT_ARRAY;
+    for (;;)
+    {   /* associative part, terminated by empty name */
+        if ((len = amf3_string(refs, p, end, &name)) < 0)
+            return -1;
+        p += len;
+        if (!name.av_len)
+            break;
+        if ((len = amf3_member(refs, &prop->p_vu.p_object, &name, p, end)) < 0)
+            return -1;
+        p += len;
+        prop->p_type = AMF_ECMA_ARRAY;
+    }
+    if (nDense > (uint32_t)(end - p))
+        return -1;
+    while (nDense--)
+    {
+        if ((len = amf3_member(refs, &prop->p_vu.p_object, NULL, p, end)) < 0)
+            return -1;
+        p += len;
+    }
+    refs->objects[slot] = *prop;
+    return p - start;
+}
 
-    if (nSize == 0 || !pBuffer)
+static int amf3_vector(AMF3Refs *refs, AMFObjectProperty *prop, const char *p, const char *end, int type, uint32_t nCount, int slot)
+{
+    const char *start = p;
+    AMFObjectProperty member;
+    int len = type == AMF3_VECTOR_DOUBLE ? 8 : 4;
+
+    if (p >= end)
+        return -1;
+    p++;    /* fixed-vector flag */
+    if (type == AMF3_VECTOR_OBJECT)
     {
-        RTMP_Log(RTMP_LOGDEBUG, "empty buffer/no buffer pointer!");
+        AVal typeName;
+        if ((len = amf3_string(refs, p, end, &typeName)) < 0)
+            return -1;
+        p += len;
+        len = 1;
+    }
+    if (nCount > (uint32_t)(end - p)/len)
         return -1;
+    prop->p_type = AMF_STRICT_ARRAY;
+    memset(&member, 0, sizeof(member));
+    member.p_type = AMF_NUMBER;
+    while (nCount--)
+    {
+        if (type == AMF3_VECTOR_OBJECT)
+            len = amf3_member(refs, &prop->p_vu.p_object, NULL, p, end);
+        else
+        {
+            if (type == AMF3_VECTOR_INT)
+                member.p_vu.p_number = (int32_t)AMF_DecodeInt32(p);
+            else if (type == AMF3_VECTOR_UINT)
+                member.p_vu.p_number = AMF_DecodeInt32(p);
+            else
+                member.p_vu.p_number = AMF_DecodeNumber(p);
+            if (!amf_add_prop(&prop->p_vu.p_object, &member, refs->arena))
+                len = -1;
+        }
+        if (len < 0)
+            return -1;
+        p += len;
     }
+    refs->objects[slot] = *prop;
+    return p - start;
+}
 
-    /* decode name */
-    if (bDecodeName)
+/* string keys become property names, other keys are dropped */
+static int amf3_dictionary(AMF3Refs *refs, AMFObjectProperty *prop, const char *p, const char *end, uint32_t nCount, int slot)
+{
+    const char *start = p;
+    AMFObjectProperty key;
+    int len;
+
+    if (p >= end || nCount > (uint32_t)(end - p)/2)
+        return -1;
+    p++;    /* weak keys flag */
+    prop->p_type = AMF_ECMA_ARRAY;
+    while (nCount--)
     {
-        AVal name;
-        int nRes = AMF3ReadString(pBuffer, &name);
+        if ((len = amf3_value(refs, &key, p, end)) < 0)
+            return -1;
+        p += len;
+        if (key.p_type != AMF_STRING)
+        {
+            if (!refs->arena)
+                AMFProp_Reset(&key);
+            key.p_vu.p_aval = AV_empty;
+        }
+        if ((len = amf3_member(refs, &prop->p_vu.p_object, &key.p_vu.p_aval, p, end)) < 0)
+            return -1;
+        p += len;
+    }
+    refs->objects[slot] = *prop;
+    return p - start;
+}
 
-        if (name.av_len <= 0)
-            return nRes;
+/* values after the marker that go to the object table, ref is their U29 header */
+static int amf3_complex(AMF3Refs *refs, AMFObjectProperty *prop, int type, const char *p, const char *end)
+{
+    uint32_t ref;
+    int len, nRes;
 
-        nSize -= nRes;
-        if (nSize <= 0)
-            return -1;
-        prop->p_name = name;
-        pBuffer += nRes;
+    if ((len = amf3_u29(p, end, &ref)) < 0)
+        return -1;
+    p += len;
+    if (!(ref & 1))
+        return amf3_object_ref(refs, prop, ref) ? len : -1;
+    if (refs->depth >= AMF_MAX_DEPTH)
+        return -1;
+
+    /* slot is taken before members are decoded, they may refer to later objects by index */
+    nRes = refs->numObjects;
+    if (!amf3_table_add(refs, &refs->objects, &refs->numObjects, sizeof(AMFObjectProperty)))
+        return -1;
+    refs->objects[nRes].p_type = AMF_NULL;
+    refs->depth++;
+    switch (type)
+    {
+    case AMF3_XML_DOC:
+    case AMF3_XML:
+    case AMF3_BYTE_ARRAY:
+        ref >>= 1;
+        if (ref > (uint32_t)(end - p))
+        {
+            nRes = -1;
+            break;
+        }
+        prop->p_type = AMF_STRING;
+        prop->p_vu.p_aval.av_val = (char *)p;
+        prop->p_vu.p_aval.av_len = ref;
+        refs->objects[nRes] = *prop;
+        nRes = ref;
+        break;
+    case AMF3_DATE:
+        if (end - p < 8)
+        {
+            nRes = -1;
+            break;
+        }
+        prop->p_type = AMF_DATE;
+        prop->p_vu.p_number = AMF_DecodeNumber(p);
+        refs->objects[nRes] = *prop;
+        nRes = 8;
+        break;
+    case AMF3_ARRAY:
+        nRes = amf3_array(refs, prop, p, end, ref >> 1, nRes);
+        break;
+    case AMF3_OBJECT:
+        nRes = amf3_members(refs, prop, p, end, ref, nRes);
+        break;
+    case AMF3_VECTOR_INT:
+    case AMF3_VECTOR_UINT:
+    case AMF3_VECTOR_DOUBLE:
+    case AMF3_VECTOR_OBJECT:
+        nRes = amf3_vector(refs, prop, p, end, type, ref >> 1, nRes);
+        break;
+    case AMF3_DICTIONARY:
+        nRes = amf3_dictionary(refs, prop, p, end, ref >> 1, nRes);
+        break;
+    default:
+        RTMP_Log(RTMP_LOGDEBUG, "%s - AMF3 unknown/unsupported datatype 0x%02x", __FUNCTION__, type);
+        nRes = -1;
     }
+    refs->depth--;
+    return nRes < 0 ? -1 : len + nRes;
+}
 
-    /* decode */
-    type = *pBuffer++;
-    nSize--;
+/* decodes one value, the property name is left untouched */
+static int amf3_value(AMF3Refs *refs, AMFObjectProperty *prop, const char *p, const char *end)
+{
+    uint32_t ref;
+    int type, len;
 
+    memset(&prop->p_vu, 0, sizeof(prop->p_vu));
+    prop->p_UTCoffset = 0;
+    prop->p_type = AMF_NULL;
+    if (p >= end)
+        return -1;
+    type = *p++;
     switch (type)
     {
     case AMF3_UNDEFINED:
     case AMF3_NULL:
-        prop->p_type = AMF_NULL;
-        break;
+        return 1;
     case AMF3_FALSE:
-        prop->p_type = AMF_BOOLEAN;
-        prop->p_vu.p_number = 0.0;
-        break;
     case AMF3_TRUE:
         prop->p_type = AMF_BOOLEAN;
-        prop->p_vu.p_number = 1.0;
-        break;
+        prop->p_vu.p_number = type == AMF3_TRUE;
+        return 1;
     case AMF3_INTEGER:
-    {
-        int32_t res = 0;
-        int len = AMF3ReadInteger(pBuffer, &res);
-        prop->p_vu.p_number = (double)res;
+        if ((len = amf3_u29(p, end, &ref)) < 0)
+            return -1;
         prop->p_type = AMF_NUMBER;
-        nSize -= len;
-        break;
-    }
+        prop->p_vu.p_number = (ref & 0x10000000) ? (int32_t)ref - (1 << 29) : (int32_t)ref;
+        return 1 + len;
     case AMF3_DOUBLE:
-        if (nSize < 8)
+        if (end - p < 8)
             return -1;
-        prop->p_vu.p_number = AMF_DecodeNumber(pBuffer);
         prop->p_type = AMF_NUMBER;
-        nSize -= 8;
-        break;
+        prop->p_vu.p_number = AMF_DecodeNumber(p);
+        return 9;
     case AMF3_STRING:
-    case AMF3_XML_DOC:
-    case AMF3_XML:
-    {
-        int len = AMF3ReadString(pBuffer, &prop->p_vu.p_aval);
+        if ((len = amf3_string(refs, p, end, &prop->p_vu.p_aval)) < 0)
+            return -1;
         prop->p_type = AMF_STRING;
-        nSize -= len;
-        break;
+        return 1 + len;
     }
-    case AMF3_DATE:
+    if ((len = amf3_complex(refs, prop, type, p, end)) < 0)
+    {   /* partially decoded heap containers are not reachable from the caller */
+        if (!refs->arena && amf3_is_container(prop))
+            AMF_Reset(&prop->p_vu.p_object);
+        return -1;
+    }
+    return 1 + len;
+}
+
+static int amf3_decode(AMFObjectProperty *prop, const char *pBuffer, int nSize, int bMarker, AMFArena *arena)
+{
+    AMF3Refs refs;
+    char scratch[AMF3_TABLES_SCRATCH];
+    const char *end = pBuffer + (nSize > 0 ? nSize : 0);
+    int nRes;
+
+    memset(&refs, 0, sizeof(refs));
+    refs.arena = arena;
+    AMF_ArenaInit(&refs.tables, scratch, sizeof(scratch));
+    refs.budget = 16*nSize + 1024;
+    if (bMarker)
+        nRes = amf3_value(&refs, prop, pBuffer, end);
+    else
+    {   /* object body without the marker */
+        memset(&prop->p_vu, 0, sizeof(prop->p_vu));
+        prop->p_UTCoffset = 0;
+        nRes = amf3_complex(&refs, prop, AMF3_OBJECT, pBuffer, end);
+        if (nRes < 0 && !arena && amf3_is_container(prop))
+            AMF_Reset(&prop->p_vu.p_object);
+    }
+    AMF_ArenaFree(&refs.tables);
+    return nRes;
+}
+
+int AMF3_DecodeValue(AMFObjectProperty *prop, const char *pBuffer, int nSize, AMFArena *arena)
+{
+    prop->p_name.av_val = NULL;
+    prop->p_name.av_len = 0;
+    return amf3_decode(prop, pBuffer, nSize, TRUE, arena);
+}
+
+int AMF3Prop_Decode(AMFObjectProperty *prop, const char *pBuffer, int nSize, int bDecodeName)
+{
+    int nRes, len = 0;
+
+    prop->p_name.av_len = 0;
+    prop->p_name.av_val = NULL;
+    if (nSize <= 0 || !pBuffer)
     {
-        int32_t res = 0;
-        int len = AMF3ReadInteger(pBuffer, &res);
+        RTMP_Log(RTMP_LOGDEBUG, "empty buffer/no buffer pointer!");
+        return -1;
+    }
+    if (bDecodeName)
+    {   /* a lone name is not referenceable from the value, no tables needed */
+        uint32_t ref;
+        len = amf3_u29(pBuffer, pBuffer + nSize, &ref);
+        if (len < 0 || !(ref & 1) || (ref >> 1) > (uint32_t)(nSize - len))
+            return -1;
+        prop->p_name.av_val = (char *)pBuffer + len;
+        prop->p_name.av_len = ref >> 1;
+        len += ref >> 1;
+        if (!prop->p_name.av_len)
+            return len;
+    }
+    nRes = amf3_decode(prop, pBuffer + len, nSize - len, TRUE, NULL);
+    return nRes < 0 ? -1 : len + nRes;
+}
 
-        nSize -= len;
-        pBuffer += len;
+int AMF3_Decode(AMFObject *obj, const char *pBuffer, int nSize, int bAMFData)
+{
+    AMFObjectProperty prop;
+    int nRes;
 
-        if ((res & 0x1) == 0)
-        {            /* reference */
-            uint32_t nIndex = (res >> 1);
-            RTMP_Log(RTMP_LOGDEBUG, "AMF3_DATE reference: %d, not supported!", nIndex);
-        } else
-        {
-            if (nSize < 8)
-                return -1;
+    obj->o_num = 0;
+    obj->o_props = NULL;
+    if (bAMFData && nSize > 0 && *pBuffer != AMF3_OBJECT)
+        RTMP_Log(RTMP_LOGERROR, "AMF3 Object encapsulated in AMF stream does not start with AMF3_OBJECT!");
+    nRes = amf3_decode(&prop, pBuffer, nSize, bAMFData, NULL);
+    if (nRes < 0)
+        return -1;
+    if (amf3_is_container(&prop))
+        *obj = prop.p_vu.p_object;
+    return nRes;
+}
 
-            prop->p_vu.p_number = AMF_DecodeNumber(pBuffer);
-            nSize -= 8;
-            prop->p_type = AMF_NUMBER;
-        }
+/* AMF3 encoding */
+
+void AMF3Encoder_Init(AMF3Encoder *enc)
+{
+    memset(enc, 0, sizeof(AMF3Encoder));
+    enc->e_anonTraits = -1;
+}
+
+char *AMF3_EncodeInteger(char *output, char *outend, int32_t nVal)
+{
+    uint32_t v = (uint32_t)nVal & 0x1fffffff;
+    int len = v < 0x80 ? 1 : v < 0x4000 ? 2 : v < 0x200000 ? 3 : 4;
+    if (output + len > outend)
+        return NULL;
+    switch (len)
+    {
+    case 4:
+        *output++ = (char)(((v >> 22) & 0x7f) | 0x80);
+        *output++ = (char)(((v >> 15) & 0x7f) | 0x80);
+        *output++ = (char)(((v >> 8) & 0x7f) | 0x80);
+        *output++ = (char)(v & 0xff);
         break;
+    case 3:
+        *output++ = (char)(((v >> 14) & 0x7f) | 0x80);
+        /* fall through */
+    case 2:
+        *output++ = (char)(((v >> 7) & 0x7f) | 0x80);
+        /* fall through */
+    case 1:
+        *output++ = (char)(v & 0x7f);
     }
-    case AMF3_OBJECT:
+    return output;
+}
+
+static unsigned int amf3_hash(const AVal *str)
+{
+    unsigned int h = 2166136261u;
+    int i;
+    for (i = 0; i < str->av_len; i++)
+        h = (h ^ (unsigned char)str->av_val[i])*16777619u;
+    return h;
+}
+
+/* strings sent before go out as a table index, the first AMF3_ENCODER_STRINGS are remembered */
+char *AMF3_EncodeString(AMF3Encoder *enc, char *output, char *outend, const AVal *str)
+{
+    if (str->av_len < 0 || str->av_len > AMF3_INTEGER_MAX)
+        return NULL;
+    if (str->av_len)
     {
-        int nRes = AMF3_Decode(&prop->p_vu.p_object, pBuffer, nSize, TRUE);
-        if (nRes == -1)
-            return -1;
-        nSize -= nRes;
-        prop->p_type = AMF_OBJECT;
-        break;
+        unsigned int mask = AMF3_ENCODER_STRINGS*2 - 1, i = amf3_hash(str) & mask;
+        for (; enc->e_hash[i]; i = (i + 1) & mask)
+        {
+            const AVal *s = &enc->e_strings[enc->e_hash[i] - 1];
+            if (AVMATCH(s, str))
+                return AMF3_EncodeInteger(output, outend, (enc->e_hash[i] - 1) << 1);
+        }
+        if (enc->e_numStrings < AMF3_ENCODER_STRINGS)
+        {
+            enc->e_strings[enc->e_numStrings] = *str;
+            enc->e_hash[i] = enc->e_numStrings + 1;
+        }
+        enc->e_numStrings++;    /* takes an index on the decoder side even if not remembered */
     }
-    case AMF3_ARRAY:
-    case AMF3_BYTE_ARRAY:
-    default:
-        RTMP_Log(RTMP_LOGDEBUG, "%s - AMF3 unknown/unsupported datatype 0x%02x, @%p",
-                 __FUNCTION__, (unsigned char)(*pBuffer), pBuffer);
-        return -1;
+    output = AMF3_EncodeInteger(output, outend, (str->av_len << 1) | 1);
+    if (!output || output + str->av_len > outend)
+        return NULL;
+    memcpy(output, str->av_val, str->av_len);
+    return output + str->av_len;
+}
+
+static char *amf3_encode_members(AMF3Encoder *enc, AMFObject *obj, char *pBuffer, char *pBufEnd, int bNamed)
+{
+    int i;
+    for (i = 0; i < obj->o_num && pBuffer; i++)
+    {
+        AMFObjectProperty *prop = &obj->o_props[i];
+        if (!prop->p_name.av_len != !bNamed)
+            continue;
+        if (bNamed)
+            pBuffer = AMF3_EncodeString(enc, pBuffer, pBufEnd, &prop->p_name);
+        if (pBuffer)
+            pBuffer = AMF3Prop_Encode(enc, prop, pBuffer, pBufEnd);
     }
-    if (nSize < 0)
-        return -1;
+    return pBuffer;
+}
 
-    return nOriginalSize - nSize;
+static char *amf3_encode_array(AMF3Encoder *enc, AMFObject *obj, char *pBuffer, char *pBufEnd)
+{
+    int i, nDense = 0;
+    for (i = 0; i < obj->o_num; i++)
+        nDense += !obj->o_props[i].p_name.av_len;
+    if (pBuffer >= pBufEnd)
+        return NULL;
+    *pBuffer++ = AMF3_ARRAY;
+    pBuffer = AMF3_EncodeInteger(pBuffer, pBufEnd, (nDense << 1) | 1);
+    if (pBuffer)
+        pBuffer = amf3_encode_members(enc, obj, pBuffer, pBufEnd, TRUE);
+    if (!pBuffer || pBuffer >= pBufEnd)
+        return NULL;
+    *pBuffer++ = 0x01;  /* end of associative part */
+    return amf3_encode_members(enc, obj, pBuffer, pBufEnd, FALSE);
 }
 
-int AMFProp_Decode(AMFObjectProperty *prop, const char *pBuffer, int nSize, int bDecodeName)
+/* anonymous dynamic object, traits are sent once and referenced afterwards */
+char *AMF3_Encode(AMF3Encoder *enc, AMFObject *obj, char *pBuffer, char *pBufEnd)
+{
+    if (pBuffer + 3 > pBufEnd)
+        return NULL;
+    *pBuffer++ = AMF3_OBJECT;
+    if (enc->e_anonTraits >= 0)
+        pBuffer = AMF3_EncodeInteger(pBuffer, pBufEnd, (enc->e_anonTraits << 2) | 1);
+    else
+    {
+        *pBuffer++ = 0x0b;  /* inline object, inline traits, dynamic, no sealed members */
+        *pBuffer++ = 0x01;  /* empty class name */
+        enc->e_anonTraits = enc->e_numTraits++;
+    }
+    if (pBuffer)
+        pBuffer = amf3_encode_members(enc, obj, pBuffer, pBufEnd, TRUE);
+    if (!pBuffer || pBuffer >= pBufEnd)
+        return NULL;
+    *pBuffer++ = 0x01;  /* end of dynamic members */
+    return pBuffer;
+}
+
+/* value only, names are written by the container */
+char *AMF3Prop_Encode(AMF3Encoder *enc, AMFObjectProperty *prop, char *pBuffer, char *pBufEnd)
+{
+    double d;
+    if (pBuffer >= pBufEnd)
+        return NULL;
+    switch (prop->p_type)
+    {
+    case AMF_NUMBER:
+        d = prop->p_vu.p_number;
+        if (d >= AMF3_INTEGER_MIN && d <= AMF3_INTEGER_MAX && d == (int32_t)d)
+        {
+            *pBuffer++ = AMF3_INTEGER;
+            return AMF3_EncodeInteger(pBuffer, pBufEnd, (int32_t)d);
+        }
+        /* same layout as AMF0 apart from the marker */
+        if (!(pBufEnd = AMF_EncodeNumber(pBuffer, pBufEnd, d)))
+            return NULL;
+        *pBuffer = AMF3_DOUBLE;
+        return pBufEnd;
+    case AMF_DATE:
+        if (pBuffer + 10 > pBufEnd)
+            return NULL;
+        *pBuffer++ = AMF3_DATE;
+        pBufEnd = AMF_EncodeNumber(pBuffer, pBufEnd, prop->p_vu.p_number);
+        *pBuffer = 0x01;    /* inline, no reference */
+        return pBufEnd;
+    case AMF_BOOLEAN:
+        *pBuffer++ = prop->p_vu.p_number != 0 ? AMF3_TRUE : AMF3_FALSE;
+        return pBuffer;
+    case AMF_STRING:
+        *pBuffer++ = AMF3_STRING;
+        return AMF3_EncodeString(enc, pBuffer, pBufEnd, &prop->p_vu.p_aval);
+    case AMF_NULL:
+        *pBuffer++ = AMF3_NULL;
+        return pBuffer;
+    case AMF_UNDEFINED:
+        *pBuffer++ = AMF3_UNDEFINED;
+        return pBuffer;
+    case AMF_OBJECT:
+        return AMF3_Encode(enc, &prop->p_vu.p_object, pBuffer, pBufEnd);
+    case AMF_ECMA_ARRAY:
+    case AMF_STRICT_ARRAY:
+        return amf3_encode_array(enc, &prop->p_vu.p_object, pBuffer, pBufEnd);
+    default:
+        RTMP_Log(RTMP_LOGERROR, "%s, invalid type. %d", __FUNCTION__, prop->p_type);
+        return NULL;
+    }
+}
+
+static int amfprop_decode(AMFObjectProperty *prop, const char *pBuffer, int nSize, int bDecodeName, AMFArena *arena)
 {
     int nOriginalSize = nSize, nRes;
 
@@ -636,7 +1281,7 @@ int AMFProp_Decode(AMFObjectProperty *prop, const char *pBuffer, int nSize, int
     }
     case AMF_OBJECT:
     {
-        int nRes = AMF_Decode(&prop->p_vu.p_object, pBuffer, nSize, TRUE);
+        int nRes = amf_decode(&prop->p_vu.p_object, pBuffer, nSize, TRUE, arena);
         if (nRes == -1)
             return -1;
         nSize -= nRes;
@@ -664,7 +1309,7 @@ int AMFProp_Decode(AMFObjectProperty *prop, const char *pBuffer, int nSize, int
         nSize -= 4;
 
         /* next comes the rest, mixed array has a final 0x000009 mark and names, so its an object */
-        nRes = AMF_Decode(&prop->p_vu.p_object, pBuffer + 4, nSize, TRUE);
+        nRes = amf_decode(&prop->p_vu.p_object, pBuffer + 4, nSize, TRUE, arena);
         if (nRes == -1)
             return -1;
         nSize -= nRes;
@@ -680,7 +1325,7 @@ int AMFProp_Decode(AMFObjectProperty *prop, const char *pBuffer, int nSize, int
         unsigned int nArrayLen = AMF_DecodeInt32(pBuffer);
         nSize -= 4;
 
-        nRes = AMF_DecodeArray(&prop->p_vu.p_object, pBuffer + 4, nSize, nArrayLen, FALSE);
+        nRes = amf_decode_array(&prop->p_vu.p_object, pBuffer + 4, nSize, nArrayLen, FALSE, arena);
         if (nRes == -1)
             return -1;
         nSize -= nRes;
@@ -724,12 +1369,11 @@ int AMFProp_Decode(AMFObjectProperty *prop, const char *pBuffer, int nSize, int
         break;
     }
     case AMF_AVMPLUS:
-    {
-        int nRes = AMF3_Decode(&prop->p_vu.p_object, pBuffer, nSize, TRUE);
+    {   /* any AMF3 value, with its own reference tables */
+        int nRes = amf3_decode(prop, pBuffer, nSize, TRUE, arena);
         if (nRes == -1)
             return -1;
         nSize -= nRes;
-        prop->p_type = AMF_OBJECT;
         break;
     }
     default:
@@ -917,7 +1561,7 @@ char *AMF_EncodeArray(AMFObject *obj, char *pBuffer, char *pBufEnd)
     return pBuffer;
 }
 
-int AMF_DecodeArray(AMFObject *obj, const char *pBuffer, int nSize, int nArrayLen, int bDecodeName)
+static int amf_decode_array(AMFObject *obj, const char *pBuffer, int nSize, int nArrayLen, int bDecodeName, AMFArena *arena)
 {
     int nOriginalSize = nSize, bError = FALSE, nRes;
 
@@ -933,7 +1577,7 @@ int AMF_DecodeArray(AMFObject *obj, const char *pBuffer, int nSize, int nArrayLe
             bError = TRUE;
             break;
         }
-        nRes = AMFProp_Decode(&prop, pBuffer, nSize, bDecodeName);
+        nRes = amfprop_decode(&prop, pBuffer, nSize, bDecodeName, arena);
         if (nRes == -1)
         {
             bError = TRUE;
@@ -942,7 +1586,11 @@ int AMF_DecodeArray(AMFObject *obj, const char *pBuffer, int nSize, int nArrayLe
         {
             nSize -= nRes;
             pBuffer += nRes;
-            AMF_AddProp(obj, &prop);
+            if (!amf_add_prop(obj, &prop, arena))
+            {
+                bError = TRUE;
+                break;
+            }
         }
     }
     if (bError)
@@ -951,142 +1599,7 @@ int AMF_DecodeArray(AMFObject *obj, const char *pBuffer, int nSize, int nArrayLe
     return nOriginalSize - nSize;
 }
 
-int AMF3_Decode(AMFObject *obj, const char *pBuffer, int nSize, int bAMFData)
-{
-    int len, nOriginalSize = nSize;
-    int32_t ref;
-
-    obj->o_num = 0;
-    obj->o_props = NULL;
-    if (bAMFData)
-    {
-        if (*pBuffer != AMF3_OBJECT)
-            RTMP_Log(RTMP_LOGERROR, "AMF3 Object encapsulated in AMF stream does not start with AMF3_OBJECT!");
-        pBuffer++;
-        nSize--;
-    }
-
-    ref = 0;
-    len = AMF3ReadInteger(pBuffer, &ref);
-    pBuffer += len;
-    nSize -= len;
-
-    if ((ref & 1) == 0)
-    {   /* object reference, 0xxx */
-        uint32_t objectIndex = (ref >> 1);
-
-        RTMP_Log(RTMP_LOGDEBUG, "Object reference, index: %d", objectIndex);
-    } else
-    {   /* object instance */
-        int32_t classRef = (ref >> 1);
-
-        AMF3ClassDef cd = { { 0, 0 } };
-        AMFObjectProperty prop;
-
-        if ((classRef & 0x1) == 0)
-        {   /* class reference */
-            uint32_t classIndex = (classRef >> 1);
-            RTMP_Log(RTMP_LOGDEBUG, "Class reference: %d", classIndex);
-        } else
-        {
-            int32_t classExtRef = (classRef >> 1);
-            int i, cdnum;
-
-            cd.cd_externalizable = (classExtRef & 0x1) == 1;
-            cd.cd_dynamic = ((classExtRef >> 1) & 0x1) == 1;
-
-            cdnum = classExtRef >> 2;
-
-            /* class name */
-
-            len = AMF3ReadString(pBuffer, &cd.cd_name);
-            nSize   -= len;
-            pBuffer += len;
-
-            /*std::string str = className; */
-
-            RTMP_Log(RTMP_LOGDEBUG, "Class name: %s, externalizable: %d, dynamic: %d, classMembers: %d",
-                     cd.cd_name.av_val, cd.cd_externalizable, cd.cd_dynamic, cd.cd_num);
-
-            for (i = 0; i < cdnum; i++)
-            {
-                AVal memberName;
-                if (nSize <= 0)
-                {
-invalid:
-                    RTMP_Log(RTMP_LOGDEBUG, "%s, invalid class encoding!", __FUNCTION__);
-                    return nOriginalSize;
-                }
-                len = AMF3ReadString(pBuffer, &memberName);
-                RTMP_Log(RTMP_LOGDEBUG, "Member: %s", memberName.av_val);
-                AMF3CD_AddProp(&cd, &memberName);
-                nSize   -= len;
-                pBuffer += len;
-            }
-        }
-
-        /* add as referencable object */
-
-        if (cd.cd_externalizable)
-        {
-            int nRes;
-            AVal name = AVC("DEFAULT_ATTRIBUTE");
-
-            RTMP_Log(RTMP_LOGDEBUG, "Externalizable, TODO check");
-
-            nRes = AMF3Prop_Decode(&prop, pBuffer, nSize, FALSE);
-            if (nRes == -1)
-                RTMP_Log(RTMP_LOGDEBUG, "%s, failed to decode AMF3 property!", __FUNCTION__);
-            else
-            {
-                nSize -= nRes;
-                pBuffer += nRes;
-            }
-
-            AMFProp_SetName(&prop, &name);
-            AMF_AddProp(obj, &prop);
-        } else
-        {
-            int nRes, i;
-            for (i = 0; i < cd.cd_num; i++)    /* non-dynamic */
-            {
-                if (nSize <=0)
-                    goto invalid;
-                nRes = AMF3Prop_Decode(&prop, pBuffer, nSize, FALSE);
-                if (nRes == -1)
-                    RTMP_Log(RTMP_LOGDEBUG, "%s, failed to decode AMF3 property!", __FUNCTION__);
-
-                AMFProp_SetName(&prop, AMF3CD_GetProp(&cd, i));
-                AMF_AddProp(obj, &prop);
-
-                pBuffer += nRes;
-                nSize -= nRes;
-            }
-            if (cd.cd_dynamic)
-            {
-                int len = 0;
-
-                do
-                {
-                    if (nSize <=0)
-                        goto invalid;
-                    nRes = AMF3Prop_Decode(&prop, pBuffer, nSize, TRUE);
-                    AMF_AddProp(obj, &prop);
-
-                    pBuffer += nRes;
-                    nSize -= nRes;
-
-                    len = prop.p_name.av_len;
-                }
-                while (len > 0);
-            }
-        }
-        RTMP_Log(RTMP_LOGDEBUG, "class object!");
-    }
-    return nOriginalSize - nSize;
-}
-
-int AMF_Decode(AMFObject *obj, const char *pBuffer, int nSize, int bDecodeName)
+static int amf_decode(AMFObject *obj, const char *pBuffer, int nSize, int bDecodeName, AMFArena *arena)
 {
     int nOriginalSize = nSize, nRes;
 
@@ -1102,23 +1615,58 @@ int AMF_Decode(AMFObject *obj, const char *pBuffer, int nSize, int bDecodeName)
             break;
         }
 
-        nRes = AMFProp_Decode(&prop, pBuffer, nSize, bDecodeName);
+        nRes = amfprop_decode(&prop, pBuffer, nSize, bDecodeName, arena);
         if (nRes == -1)
             return -1;
         nSize -= nRes;
         if (nSize < 0)
             return -1;
         pBuffer += nRes;
-        AMF_AddProp(obj, &prop);
+        if (!amf_add_prop(obj, &prop, arena))
+            return -1;
     }
     return nOriginalSize - nSize;
 }
 
-void AMF_AddProp(AMFObject *obj, const AMFObjectProperty *prop)
+int AMF_Decode(AMFObject *obj, const char *pBuffer, int nSize, int bDecodeName)
+{
+    return amf_decode(obj, pBuffer, nSize, bDecodeName, NULL);
+}
+
+int AMF_DecodeArena(AMFObject *obj, const char *pBuffer, int nSize, int bDecodeName, AMFArena *arena)
+{
+    return amf_decode(obj, pBuffer, nSize, bDecodeName, arena);
+}
+
+int AMF_DecodeArray(AMFObject *obj, const char *pBuffer, int nSize, int nArrayLen, int bDecodeName)
+{
+    return amf_decode_array(obj, pBuffer, nSize, nArrayLen, bDecodeName, NULL);
+}
+
+int AMFProp_Decode(AMFObjectProperty *prop, const char *pBuffer, int nSize, int bDecodeName)
+{
+    return amfprop_decode(prop, pBuffer, nSize, bDecodeName, NULL);
+}
+
+/* props grow by 16, in place when the array is still the latest arena allocation */
+static int amf_add_prop(AMFObject *obj, const AMFObjectProperty *prop, AMFArena *arena)
 {
     if (!(obj->o_num & 0x0f))
-        obj->o_props = realloc(obj->o_props, (obj->o_num + 16)*sizeof(AMFObjectProperty));
+    {
+        int nSize = (obj->o_num + 16)*sizeof(AMFObjectProperty);
+        AMFObjectProperty *props = arena ? arena_grow(arena, obj->o_props, obj->o_num*sizeof(AMFObjectProperty), nSize) :
+                                           realloc(obj->o_props, nSize);
+        if (!props)
+            return FALSE;
+        obj->o_props = props;
+    }
     memcpy(&obj->o_props[obj->o_num++], prop, sizeof(AMFObjectProperty));
+    return TRUE;
+}
+
+void AMF_AddProp(AMFObject *obj, const AMFObjectProperty *prop)
+{
+    amf_add_prop(obj, prop, NULL);
 }
 
 int AMF_CountProp(AMFObject *obj)
@@ -1169,15 +1717,216 @@ void AMF_Reset(AMFObject *obj)
 }
 
 
+/* AMFReader */
+
+static const char *amf_skip_props(const char *p, const char *end, int depth);
+
+/* returns position after the value at p, NULL if malformed or unsupported */
+static const char *amf_skip_value(const char *p, const char *end, int depth)
+{
+    unsigned int n;
+    if (p >= end || depth > AMF_MAX_DEPTH)
+        return NULL;
+    switch (*p++)
+    {
+    case AMF_NUMBER:
+        n = 8;
+        break;
+    case AMF_BOOLEAN:
+        n = 1;
+        break;
+    case AMF_STRING:
+        if (end - p < 2)
+            return NULL;
+        n = 2 + AMF_DecodeInt16(p);
+        break;
+    case AMF_NULL:
+    case AMF_UNDEFINED:
+    case AMF_UNSUPPORTED:
+        n = 0;
+        break;
+    case AMF_REFERENCE:
+        n = 2;
+        break;
+    case AMF_DATE:
+        n = 10;
+        break;
+    case AMF_LONG_STRING:
+    case AMF_XML_DOC:
+        if (end - p < 4)
+            return NULL;
+        n = AMF_DecodeInt32(p);
+        if (n > (unsigned int)(end - p) - 4)
+            return NULL;
+        n += 4;
+        break;
+    case AMF_OBJECT:
+        return amf_skip_props(p, end, depth + 1);
+    case AMF_ECMA_ARRAY:
+        if (end - p < 4)
+            return NULL;
+        return amf_skip_props(p + 4, end, depth + 1);
+    case AMF_STRICT_ARRAY:
+        if (end - p < 4)
+            return NULL;
+        n = AMF_DecodeInt32(p);
+        p += 4;
+        while (n-- && p)
+            p = amf_skip_value(p, end, depth + 1);
+        return p;
+    case AMF_AVMPLUS:
+    {   /* AMF3 length is only known after decoding, the tree is dropped right away */
+        char scratch[1024];
+        AMFArena arena;
+        AMFObjectProperty prop;
+        int nRes;
+        AMF_ArenaInit(&arena, scratch, sizeof(scratch));
+        nRes = amf3_decode(&prop, p, end - p, TRUE, &arena);
+        AMF_ArenaFree(&arena);
+        return nRes < 0 ? NULL : p + nRes;
+    }
+    default:
+        return NULL;
+    }
+    if (n > (unsigned int)(end - p))
+        return NULL;
+    return p + n;
+}
+
+static const char *amf_skip_props(const char *p, const char *end, int depth)
+{
+    while (p && end - p >= 3)
+    {
+        unsigned int nNameSize = AMF_DecodeInt16(p);
+        if (!nNameSize && p[2] == AMF_OBJECT_END)
+            return p + 3;
+        if (nNameSize > (unsigned int)(end - p) - 2)
+            return NULL;
+        p = amf_skip_value(p + 2 + nNameSize, end, depth);
+    }
+    return NULL;
+}
+
+void AMFReader_Init(AMFReader *rd, const char *pBuffer, int nSize)
+{
+    rd->r_pos = pBuffer;
+    rd->r_end = pBuffer + (nSize > 0 ? nSize : 0);
+}
+
+AMFDataType AMFReader_Peek(AMFReader *rd)
+{
+    if (rd->r_pos >= rd->r_end)
+        return AMF_INVALID;
+    return (AMFDataType)*rd->r_pos;
+}
+
+int AMFReader_Skip(AMFReader *rd)
+{
+    const char *p = amf_skip_value(rd->r_pos, rd->r_end, 0);
+    if (!p)
+    {
+        rd->r_pos = rd->r_end;
+        return FALSE;
+    }
+    rd->r_pos = p;
+    return TRUE;
+}
+
+/* the value is consumed even if it has another type, like AMFProp_GetString */
+int AMFReader_GetString(AMFReader *rd, AVal *str)
+{
+    AMFDataType type = AMFReader_Peek(rd);
+    const char *p = rd->r_pos;
+    str->av_val = NULL;
+    str->av_len = 0;
+    if (!AMFReader_Skip(rd))
+        return FALSE;
+    if (type == AMF_STRING)
+        AMF_DecodeString(p + 1, str);
+    else if (type == AMF_LONG_STRING || type == AMF_XML_DOC)
+        AMF_DecodeLongString(p + 1, str);
+    else
+        return FALSE;
+    return TRUE;
+}
+
+int AMFReader_GetNumber(AMFReader *rd, double *val)
+{
+    AMFDataType type = AMFReader_Peek(rd);
+    const char *p = rd->r_pos;
+    *val = 0.0;
+    if (!AMFReader_Skip(rd))
+        return FALSE;
+    if (type == AMF_NUMBER)
+        *val = AMF_DecodeNumber(p + 1);
+    else if (type == AMF_BOOLEAN)
+        *val = (double)AMF_DecodeBoolean(p + 1);
+    else
+        return FALSE;
+    return TRUE;
+}
+
+static int amf_find_prop(const char *p, const char *end, const AVal *name, AMFReader *value, int bRecurse, int depth)
+{
+    if (p >= end || depth > AMF_MAX_DEPTH)
+        return FALSE;
+    if (*p == AMF_ECMA_ARRAY && end - p >= 5)
+        p += 4;
+    else if (*p != AMF_OBJECT)
+        return FALSE;
+    p++;
+    while (end - p >= 3)
+    {
+        unsigned int nNameSize = AMF_DecodeInt16(p);
+        if (!nNameSize && p[2] == AMF_OBJECT_END)
+            break;
+        if (nNameSize > (unsigned int)(end - p) - 2)
+            break;
+        p += 2;
+        if ((int)nNameSize == name->av_len && !memcmp(p, name->av_val, nNameSize))
+        {
+            value->r_pos = p + nNameSize;
+            value->r_end = end;
+            return TRUE;
+        }
+        p += nNameSize;
+        if (bRecurse && amf_find_prop(p, end, name, value, bRecurse, depth + 1))
+            return TRUE;
+        p = amf_skip_value(p, end, depth);
+        if (!p)
+            break;
+    }
+    return FALSE;
+}
+
+/* looks up a named property of the object or ecma array at the read position,
+ * value is positioned at the property value, rd itself is not advanced */
+int AMFReader_FindProp(AMFReader *rd, const AVal *name, AMFReader *value, int bRecurse)
+{
+    return amf_find_prop(rd->r_pos, rd->r_end, name, value, bRecurse, 0);
+}
+
 /* AMF3ClassDefinition */
 
-void AMF3CD_AddProp(AMF3ClassDef *cd, AVal *prop)
+static void amf3cd_add_prop(AMF3ClassDef *cd, AVal *prop, AMFArena *arena)
 {
     if (!(cd->cd_num & 0x0f))
-        cd->cd_props = realloc(cd->cd_props, (cd->cd_num + 16) * sizeof(AVal));
+    {
+        int nSize = (cd->cd_num + 16) * sizeof(AVal);
+        AVal *props = arena ? arena_grow(arena, cd->cd_props, cd->cd_num * sizeof(AVal), nSize) :
+                              realloc(cd->cd_props, nSize);
+        if (!props)
+            return;
+        cd->cd_props = props;
+    }
     cd->cd_props[cd->cd_num++] = *prop;
 }
 
+void AMF3CD_AddProp(AMF3ClassDef *cd, AVal *prop)
+{
+    amf3cd_add_prop(cd, prop, NULL);
+}
+
 AVal *AMF3CD_GetProp(AMF3ClassDef *cd, int nIndex)
 {
     if (nIndex >= cd->cd_num)
@@ -52,7 +52,9 @@ typedef enum
 {
     AMF3_UNDEFINED = 0, AMF3_NULL, AMF3_FALSE, AMF3_TRUE,
     AMF3_INTEGER, AMF3_DOUBLE, AMF3_STRING, AMF3_XML_DOC, AMF3_DATE,
-    AMF3_ARRAY, AMF3_OBJECT, AMF3_XML, AMF3_BYTE_ARRAY
+    AMF3_ARRAY, AMF3_OBJECT, AMF3_XML, AMF3_BYTE_ARRAY,
+    AMF3_VECTOR_INT, AMF3_VECTOR_UINT, AMF3_VECTOR_DOUBLE, AMF3_VECTOR_OBJECT,
+    AMF3_DICTIONARY
 } AMF3DataType;
 
 typedef struct AVal
@@ -84,6 +86,28 @@ typedef struct AMFObjectProperty
     int16_t p_UTCoffset;
 } AMFObjectProperty;
 
+/* Bump allocator for decoded objects. Allocations come from the caller
+ * provided scratch buffer first and spill to heap blocks only when it is
+ * exhausted. Objects decoded into an arena must not be passed to AMF_Reset,
+ * everything is released at once by AMF_ArenaReset/AMF_ArenaFree. */
+struct AMFArenaBlock;
+
+typedef struct AMFArena
+{
+    char *a_buf;        /* current block */
+    int a_size;
+    int a_used;
+    int a_last;         /* offset of the latest allocation, it can grow in place */
+    char *a_scratch;
+    int a_scratchSize;
+    struct AMFArenaBlock *a_blocks; /* heap overflow blocks */
+} AMFArena;
+
+void AMF_ArenaInit(AMFArena *arena, void *scratch, int nSize);
+void *AMF_ArenaAlloc(AMFArena *arena, int nSize);
+void AMF_ArenaReset(AMFArena *arena);
+void AMF_ArenaFree(AMFArena *arena);
+
 char *AMF_EncodeString(char *output, char *outend, const AVal *str);
 char *AMF_EncodeNumber(char *output, char *outend, double dVal);
 char *AMF_EncodeInt16(char *output, char *outend, short nVal);
@@ -111,6 +135,7 @@ char *AMF_EncodeArray(AMFObject *obj, char *pBuffer, char *pBufEnd);
 int AMF_Decode(AMFObject *obj, const char *pBuffer, int nSize, int bDecodeName);
 int AMF_DecodeArray(AMFObject *obj, const char *pBuffer, int nSize, int nArrayLen, int bDecodeName);
 int AMF3_Decode(AMFObject *obj, const char *pBuffer, int nSize, int bDecodeName);
+int AMF_DecodeArena(AMFObject *obj, const char *pBuffer, int nSize, int bDecodeName, AMFArena *arena);
 void AMF_Dump(AMFObject *obj);
 void AMF_Reset(AMFObject *obj);
 
@@ -135,11 +160,31 @@ int AMFProp_IsValid(AMFObjectProperty *prop);
 
 char *AMFProp_Encode(AMFObjectProperty *prop, char *pBuffer, char *pBufEnd);
 int AMF3Prop_Decode(AMFObjectProperty *prop, const char *pBuffer, int nSize, int bDecodeName);
+/* Any AMF3 value with its marker. Arrays and dictionaries become ECMA arrays
+ * when they have named entries and strict arrays otherwise, vectors are
+ * strict arrays, xml and byte arrays are strings pointing into the buffer.
+ * Repeated references share props when decoded into an arena. */
+int AMF3_DecodeValue(AMFObjectProperty *prop, const char *pBuffer, int nSize, AMFArena *arena);
 int AMFProp_Decode(AMFObjectProperty *prop, const char *pBuffer, int nSize, int bDecodeName);
 
 void AMFProp_Dump(AMFObjectProperty *prop);
 void AMFProp_Reset(AMFObjectProperty *prop);
 
+/* Pull-style reader, walks an encoded AMF0 buffer without building an
+ * AMFObject tree. Strings returned point into the buffer. */
+typedef struct AMFReader
+{
+    const char *r_pos;
+    const char *r_end;
+} AMFReader;
+
+void AMFReader_Init(AMFReader *rd, const char *pBuffer, int nSize);
+AMFDataType AMFReader_Peek(AMFReader *rd);
+int AMFReader_Skip(AMFReader *rd);
+int AMFReader_GetString(AMFReader *rd, AVal *str);
+int AMFReader_GetNumber(AMFReader *rd, double *val);
+int AMFReader_FindProp(AMFReader *rd, const AVal *name, AMFReader *value, int bRecurse);
+
 typedef struct AMF3ClassDef
 {
     AVal cd_name;
@@ -152,6 +197,27 @@ typedef struct AMF3ClassDef
 void AMF3CD_AddProp(AMF3ClassDef *cd, AVal *prop);
 AVal *AMF3CD_GetProp(AMF3ClassDef *cd, int idx);
 
+/* AMF3 encoder state, strings are sent by reference after their first use.
+ * The table keeps pointers to the caller's strings, they must stay valid
+ * for as long as the encoder is used. Objects are written as anonymous
+ * dynamic objects sharing one traits entry. */
+#define AMF3_ENCODER_STRINGS 256
+
+typedef struct AMF3Encoder
+{
+    AVal e_strings[AMF3_ENCODER_STRINGS];
+    unsigned short e_hash[AMF3_ENCODER_STRINGS*2];  /* string index + 1, 0 is free */
+    int e_numStrings;
+    int e_anonTraits;   /* traits index of anonymous objects, -1 until sent */
+    int e_numTraits;
+} AMF3Encoder;
+
+void AMF3Encoder_Init(AMF3Encoder *enc);
+char *AMF3_EncodeInteger(char *output, char *outend, int32_t nVal);
+char *AMF3_EncodeString(AMF3Encoder *enc, char *output, char *outend, const AVal *str);
+char *AMF3_Encode(AMF3Encoder *enc, AMFObject *obj, char *pBuffer, char *pBufEnd);
+char *AMF3Prop_Encode(AMF3Encoder *enc, AMFObjectProperty *prop, char *pBuffer, char *pBufEnd);
+
 #ifdef __cplusplus
 }
 #endif
@@ -21,43 +21,546 @@
  *  http://www.gnu.org/copyleft/lgpl.html
  */
 
-#ifdef _DEBUG
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <assert.h>
 #include <ctype.h>
+#include <time.h>
 
 #include "rtmp_sys.h"
 #include "log.h"
 
-#define MAX_PRINT_LEN  2048
+#ifdef _WIN32
+#define LOG_TLS     __declspec(thread)
+#else
+#include <pthread.h>
+#define LOG_TLS     __thread
+#endif
+
+#define LOG_RINGS       32      /* threads with a ring at once, others log synchronously */
+#define LOG_RING_SLOTS  128     /* records per ring, power of two */
+#define LOG_MAX_ARGS    12
+#define LOG_STR_ROOM    192     /* bytes of %s arguments copied per record */
+#define LOG_SITES       256     /* rate limited call sites, power of two */
+#define LOG_SITE_BURST  20      /* records per call site per second */
+#define LOG_POLL_MS     10
+#define MAX_PRINT_LEN   2048
 
-static RTMP_LogLevel RTMP_debuglevel = RTMP_LOGERROR;
+RTMP_LogLevel RTMP_debuglevel = RTMP_LOGERROR;
+static FILE *fmsg;
 
 static const char *levels[] = {
     "CRIT", "ERROR", "WARNING", "INFO", "DEBUG", "DEBUG2"
 };
 
-static void rtmp_log_default(int level, const char *format, va_list vl)
+/* Formatting is deferred: the caller only copies its arguments by value (and
+ * %s strings into the record), the log thread runs the printf. */
+typedef union LogArg
+{
+    long long i;
+    double d;
+    const void *p;
+} LogArg;
+
+typedef struct LogRecord
+{
+    const char *format;
+    long long usec;         /* wall clock */
+    unsigned conn, stream;
+    unsigned suppressed;    /* records of this call site rate limited before this one */
+    int level, nargs;
+    LogArg args[LOG_MAX_ARGS];
+    char str[LOG_STR_ROOM];
+} LogRecord;
+
+/* single producer (the owning thread), single consumer (whoever drains) */
+typedef struct LogRing
+{
+    volatile long owner;
+    volatile long head;
+    volatile long tail;
+    volatile long dropped;  /* records lost to a full ring */
+    long reported;
+    LogRecord *slots;
+} LogRing;
+
+typedef struct LogSite
+{
+    const char *volatile format;
+    volatile long second, count, suppressed;
+} LogSite;
+
+typedef struct LogSpec
+{
+    const char *end;        /* past the conversion character */
+    const char *len;        /* start of the length modifier */
+    int stars;              /* '*' width and precision, they take int arguments */
+    int prec;
+    char lng;               /* 'H' for hh, 'L' for ll, else the modifier or 0 */
+    char conv;
+} LogSpec;
+
+static LogRing rings[LOG_RINGS];
+static LogSite sites[LOG_SITES];
+static volatile long started;
+static LOG_TLS LogRing *t_ring;
+static LOG_TLS unsigned t_conn, t_stream;
+
+#if defined(__GNUC__) || defined(__clang__)
+#define LOG_LOAD(p)         __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define LOG_STORE(p, v)     __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+static int log_cas(volatile long *p, long o, long n)
+{
+    return __atomic_compare_exchange_n(p, &o, n, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+static int log_cas_ptr(const char *volatile *p, const char *o, const char *n)
+{
+    return __atomic_compare_exchange_n(p, &o, n, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+#else
+#define LOG_LOAD(p)         (*(p))
+#define LOG_STORE(p, v)     (*(p) = (v))
+#define log_cas(p, o, n)    (InterlockedCompareExchange((p), (n), (o)) == (o))
+#define log_cas_ptr(p, o, n) (InterlockedCompareExchangePointer((void *volatile *)(p), (void *)(n), (void *)(o)) == (o))
+#endif
+
+#ifdef _WIN32
+static SRWLOCK drain_lock = SRWLOCK_INIT;
+static DWORD ring_key = FLS_OUT_OF_INDEXES;
+#define drain_enter()   AcquireSRWLockExclusive(&drain_lock)
+#define drain_leave()   ReleaseSRWLockExclusive(&drain_lock)
+#else
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+#define drain_enter()   pthread_mutex_lock(&drain_lock)
+#define drain_leave()   pthread_mutex_unlock(&drain_lock)
+#endif
+
+static long long log_now(void)
+{
+#ifdef _WIN32
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft);
+    return (long long)((((unsigned long long)ft.dwHighDateTime << 32) | ft.dwLowDateTime) / 10 - 11644473600000000ULL);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+/* parses the conversion following a '%', FALSE if it is not one we can defer */
+static int log_spec(const char *f, LogSpec *sp)
+{
+    sp->stars = 0;
+    sp->prec = -1;
+    sp->lng = 0;
+    while (*f && strchr("-+ #0", *f))
+        f++;
+    if (*f == '*')
+        sp->stars++, f++;
+    else
+        while (isdigit((unsigned char)*f))
+            f++;
+    if (*f == '.')
+    {
+        f++;
+        if (*f == '*')
+            sp->stars++, sp->prec = -2, f++;
+        else
+            for (sp->prec = 0; isdigit((unsigned char)*f); f++)
+                sp->prec = sp->prec*10 + *f - '0';
+    }
+    sp->len = f;
+    switch (*f)
+    {
+    case 'h': sp->lng = f[1] == 'h' ? 'H' : 'h'; break;
+    case 'l': sp->lng = f[1] == 'l' ? 'L' : 'l'; break;
+    case 'z': case 'j': case 't': case 'L': sp->lng = *f; break;
+    }
+    if (sp->lng)
+        f += (sp->lng == 'H' || (sp->lng == 'L' && *f == 'l')) ? 2 : 1;
+    sp->conv = *f;
+    sp->end = f + 1;
+    return *f && strchr("diuoxXceEfFgGaAsp", *f) != NULL;
+}
+
+static void log_capture(LogRecord *rec, int level, const char *format, va_list vl)
+{
+    const char *f = format;
+    LogArg *arg = rec->args, *end = rec->args + LOG_MAX_ARGS;
+    int nstr = 0;
+    LogSpec sp;
+
+    rec->format = format;
+    rec->level = level;
+    rec->conn = t_conn;
+    rec->stream = t_stream;
+    rec->usec = log_now();
+    while ((f = strchr(f, '%')) != NULL)
+    {
+        if (*++f == '%')
+        {
+            f++;
+            continue;
+        }
+        if (!log_spec(f, &sp) || arg + sp.stars + 1 > end)
+            break;
+        f = sp.end;
+        if (sp.stars > 1 || (sp.stars && sp.prec != -2))
+            (arg++)->i = va_arg(vl, int);
+        if (sp.prec == -2)
+            sp.prec = (int)((arg++)->i = va_arg(vl, int));
+        switch (sp.conv)
+        {
+        case 'd': case 'i':
+            switch (sp.lng)
+            {
+            case 'H': arg->i = (signed char)va_arg(vl, int); break;
+            case 'h': arg->i = (short)va_arg(vl, int); break;
+            case 'l': arg->i = va_arg(vl, long); break;
+            case 'L': arg->i = va_arg(vl, long long); break;
+            case 'z': case 't': arg->i = va_arg(vl, ptrdiff_t); break;
+            case 'j': arg->i = va_arg(vl, long long); break;
+            default:  arg->i = va_arg(vl, int); break;
+            }
+            break;
+        case 'u': case 'o': case 'x': case 'X':
+            switch (sp.lng)
+            {
+            case 'H': arg->i = (unsigned char)va_arg(vl, unsigned); break;
+            case 'h': arg->i = (unsigned short)va_arg(vl, unsigned); break;
+            case 'l': arg->i = va_arg(vl, unsigned long); break;
+            case 'L': case 'j': arg->i = va_arg(vl, unsigned long long); break;
+            case 'z': case 't': arg->i = va_arg(vl, size_t); break;
+            default:  arg->i = va_arg(vl, unsigned); break;
+            }
+            break;
+        case 'c':
+            arg->i = va_arg(vl, int);
+            break;
+        case 's':
+        {
+            const char *str = va_arg(vl, const char *);
+            int len, room = LOG_STR_ROOM - 1 - nstr;
+            if (room < 0)
+            {   /* earlier strings used it all, point at the terminating NUL */
+                arg->i = LOG_STR_ROOM - 1;
+                break;
+            }
+            if (!str)
+                str = "(null)";
+            for (len = 0; (sp.prec < 0 || len < sp.prec) && len < room && str[len]; len++);
+            memcpy(rec->str + nstr, str, len);
+            rec->str[nstr + len] = '\0';
+            arg->i = nstr;
+            nstr += len + 1;
+            break;
+        }
+        case 'p':
+            arg->p = va_arg(vl, void *);
+            break;
+        default:
+            arg->d = sp.lng == 'L' ? (double)va_arg(vl, long double) : va_arg(vl, double);
+            break;
+        }
+        arg++;
+    }
+    rec->nargs = (int)(arg - rec->args);
+}
+
+static int log_format(const LogRecord *rec, char *out, int size)
+{
+    const char *f = rec->format, *pct;
+    const LogArg *arg = rec->args, *end = rec->args + rec->nargs;
+    int pos = 0;
+    LogSpec sp;
+
+#define LOG_ROOM (pos < size ? size - pos : 0)
+#define LOG_ADVANCE(n) pos += (n) > 0 ? (n) : 0
+    while ((pct = strchr(f, '%')) != NULL)
+    {
+        char spec[64], *s = spec;
+        const char *c;
+        LOG_ADVANCE(snprintf(out + pos, LOG_ROOM, "%.*s", (int)(pct - f), f));
+        if (pct[1] == '%')
+        {
+            LOG_ADVANCE(snprintf(out + pos, LOG_ROOM, "%%"));
+            f = pct + 2;
+            continue;
+        }
+        if (!log_spec(pct + 1, &sp) || arg + sp.stars + 1 > end || sp.len - pct > 24)
+        {
+            LOG_ADVANCE(snprintf(out + pos, LOG_ROOM, "..."));
+            return pos;
+        }
+        for (c = pct; c < sp.len; c++)
+            if (*c == '*')
+                s += sprintf(s, "%d", (int)(arg++)->i);
+            else
+                *s++ = *c;
+        switch (sp.conv)
+        {
+        case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+            sprintf(s, "ll%c", sp.conv);
+            LOG_ADVANCE(snprintf(out + pos, LOG_ROOM, spec, arg->i));
+            break;
+        case 'c':
+            sprintf(s, "c");
+            LOG_ADVANCE(snprintf(out + pos, LOG_ROOM, spec, (int)arg->i));
+            break;
+        case 's':
+            sprintf(s, "s");
+            LOG_ADVANCE(snprintf(out + pos, LOG_ROOM, spec, rec->str + arg->i));
+            break;
+        case 'p':
+            sprintf(s, "p");
+            LOG_ADVANCE(snprintf(out + pos, LOG_ROOM, spec, arg->p));
+            break;
+        default:
+            sprintf(s, "%c", sp.conv);
+            LOG_ADVANCE(snprintf(out + pos, LOG_ROOM, spec, arg->d));
+            break;
+        }
+        arg++;
+        f = sp.end;
+    }
+    LOG_ADVANCE(snprintf(out + pos, LOG_ROOM, "%s", f));
+#undef LOG_ROOM
+#undef LOG_ADVANCE
+    return pos;
+}
+
+static void log_write(const LogRecord *rec)
 {
-    char str[MAX_PRINT_LEN] = "";
-    vsnprintf(str, MAX_PRINT_LEN - 1, format, vl);
+    char str[MAX_PRINT_LEN], ctx[32] = "";
+    time_t secs = (time_t)(rec->usec / 1000000);
+    struct tm tm;
+    log_format(rec, str, sizeof(str));
     /* Filter out 'no-name' */
     if (RTMP_debuglevel < RTMP_LOGALL && strstr(str, "no-name" ) != NULL)
         return;
-    if (level <= RTMP_debuglevel)
+#ifdef _WIN32
+    localtime_s(&tm, &secs);
+#else
+    localtime_r(&secs, &tm);
+#endif
+    if (rec->conn)
+        snprintf(ctx, sizeof(ctx), "[%u/%u] ", rec->conn, rec->stream);
+    fprintf(fmsg ? fmsg : stderr, "%02d:%02d:%02d.%06d %s: %s%s", tm.tm_hour, tm.tm_min, tm.tm_sec,
+            (int)(rec->usec % 1000000), levels[rec->level], ctx, str);
+    if (rec->suppressed)
+        fprintf(fmsg ? fmsg : stderr, " (%u similar suppressed)", rec->suppressed);
+    fputc('\n', fmsg ? fmsg : stderr);
+}
+
+static void log_drain(void)
+{
+    int i, any = 0;
+    for (i = 0; i < LOG_RINGS; i++)
     {
-        fprintf(stderr, "%s: %s\n", levels[level], str);
-        fflush(stderr);
+        LogRing *ring = &rings[i];
+        long head = LOG_LOAD(&ring->head), tail = ring->tail, dropped = LOG_LOAD(&ring->dropped);
+        for (; tail != head; tail++, any = 1)
+        {
+            log_write(&ring->slots[tail & (LOG_RING_SLOTS - 1)]);
+            LOG_STORE(&ring->tail, tail + 1);
+        }
+        if (dropped != ring->reported)
+        {
+            fprintf(fmsg ? fmsg : stderr, "WARNING: %ld log records dropped, ring full\n", dropped - ring->reported);
+            ring->reported = dropped;
+            any = 1;
+        }
+    }
+    if (any)
+        fflush(fmsg ? fmsg : stderr);
+}
+
+void RTMP_LogFlush(void)
+{
+    drain_enter();
+    log_drain();
+    drain_leave();
+}
+
+#ifdef _WIN32
+static DWORD WINAPI log_thread(void *arg)
+#else
+static void *log_thread(void *arg)
+#endif
+{
+    (void)arg;
+    for (;;)
+    {
+        RTMP_LogFlush();
+        msleep(LOG_POLL_MS);
+    }
+    return 0;
+}
+
+#ifdef _WIN32
+static void WINAPI ring_release(void *ring)
+#else
+static void ring_release(void *ring)
+#endif
+{
+    if (ring)
+        LOG_STORE(&((LogRing *)ring)->owner, 0);
+}
+
+/* started: 0 not yet, 1 starting, 2 log thread running, 3 synchronous */
+static int log_start(void)
+{
+    long state = LOG_LOAD(&started);
+    if (state || !log_cas(&started, 0, 1))
+        return state == 3 ? FALSE : TRUE;
+#ifdef _WIN32
+    ring_key = FlsAlloc(ring_release);
+    {
+        HANDLE thread = ring_key != FLS_OUT_OF_INDEXES ? CreateThread(NULL, 0, log_thread, NULL, 0, NULL) : NULL;
+        state = thread ? 2 : 3;
+        if (thread)
+            CloseHandle(thread);
+    }
+#else
+    {
+        pthread_t thread;
+        state = 3;
+        if (!pthread_key_create(&ring_key, ring_release))
+        {
+            if (!pthread_create(&thread, NULL, log_thread, NULL))
+            {
+                pthread_detach(thread);
+                state = 2;
+            } else
+                pthread_key_delete(ring_key);
+        }
+    }
+#endif
+    if (state == 2)
+        atexit(RTMP_LogFlush);
+    LOG_STORE(&started, state);
+    return state == 2;
+}
+
+static LogRing *ring_claim(void)
+{
+    int i;
+    if (!log_start())
+        return NULL;
+    for (i = 0; i < LOG_RINGS; i++)
+    {
+        LogRing *ring = &rings[i];
+        if (ring->owner || !log_cas(&ring->owner, 0, 1))
+            continue;
+        if (!ring->slots && !(ring->slots = calloc(LOG_RING_SLOTS, sizeof(LogRecord))))
+        {
+            LOG_STORE(&ring->owner, 0);
+            return NULL;
+        }
+#ifdef _WIN32
+        FlsSetValue(ring_key, ring);
+#else
+        pthread_setspecific(ring_key, ring);
+#endif
+        return ring;
     }
+    return NULL;
 }
 
-void RTMP_Log(int level, const char *format, ...)
+/* Per call site budget, keyed by the format string. Counters are updated
+ * without locking, so the limit is approximate when threads share a site. */
+static int site_allow(const char *format, unsigned *suppressed)
+{
+    unsigned h = (unsigned)(((size_t)format >> 3) * 2654435761u);
+    long second = (long)time(NULL);
+    int i;
+    for (i = 0; i < 4; i++)
+    {
+        LogSite *site = &sites[(h + i) & (LOG_SITES - 1)];
+        if (!site->format)
+            log_cas_ptr(&site->format, NULL, format);
+        if (site->format != format)
+            continue;
+        if (site->second != second)
+        {
+            *suppressed = (unsigned)site->suppressed;
+            site->suppressed = 0;
+            site->count = 0;
+            site->second = second;
+        }
+        if (++site->count <= LOG_SITE_BURST)
+            return TRUE;
+        site->suppressed++;
+        return FALSE;
+    }
+    return TRUE;
+}
+
+static void rtmp_log_default(int level, const char *format, va_list vl)
+{
+    LogRing *ring = t_ring;
+    unsigned suppressed = 0;
+    long head;
+
+    /* debug levels are opt-in floods, only warnings and up are limited */
+    if (level <= RTMP_LOGINFO && !site_allow(format, &suppressed))
+        return;
+    if (!ring && LOG_LOAD(&started) != 3)
+        ring = t_ring = ring_claim();
+    if (!ring)
+    {   /* no log thread or all rings taken */
+        LogRecord rec;
+        log_capture(&rec, level, format, vl);
+        rec.suppressed = suppressed;
+        drain_enter();
+        log_write(&rec);
+        fflush(fmsg ? fmsg : stderr);
+        drain_leave();
+        return;
+    }
+    head = ring->head;
+    if (head - LOG_LOAD(&ring->tail) >= LOG_RING_SLOTS)
+    {
+        LOG_STORE(&ring->dropped, ring->dropped + 1);
+        return;
+    }
+    log_capture(&ring->slots[head & (LOG_RING_SLOTS - 1)], level, format, vl);
+    ring->slots[head & (LOG_RING_SLOTS - 1)].suppressed = suppressed;
+    LOG_STORE(&ring->head, head + 1);
+}
+
+void RTMP_LogSetLevel(RTMP_LogLevel lvl)
+{
+    RTMP_debuglevel = lvl;
+}
+
+RTMP_LogLevel RTMP_LogGetLevel(void)
+{
+    return RTMP_debuglevel;
+}
+
+void RTMP_LogSetOutput(FILE *file)
+{
+    RTMP_LogFlush();
+    fmsg = file;
+}
+
+void RTMP_LogSetContext(unsigned conn, unsigned stream)
+{
+    t_conn = conn;
+    t_stream = stream;
+}
+
+void RTMP_LogAt(int level, const char *format, ...)
 {
     va_list args;
 
-    if (level > RTMP_debuglevel)
+    if (level > (int)RTMP_debuglevel)
         return;
 
     va_start(args, format);
@@ -67,12 +570,12 @@ void RTMP_Log(int level, const char *format, ...)
 
 static const char hexdig[] = "0123456789abcdef";
 
-void RTMP_LogHex(int level, const uint8_t *data, unsigned long len)
+void RTMP_LogHexAt(int level, const uint8_t *data, unsigned long len)
 {
     unsigned long i;
     char line[50], *ptr;
 
-    if (level > RTMP_debuglevel)
+    if (level > (int)RTMP_debuglevel)
         return;
 
     ptr = line;
@@ -98,7 +601,7 @@ void RTMP_LogHex(int level, const uint8_t *data, unsigned long len)
     }
 }
 
-void RTMP_LogHexString(int level, const uint8_t *data, unsigned long len)
+void RTMP_LogHexStringAt(int level, const uint8_t *data, unsigned long len)
 {
 #define BP_OFFSET 9
 #define BP_GRAPH 60
@@ -106,7 +609,7 @@ void RTMP_LogHexString(int level, const uint8_t *data, unsigned long len)
     char line[BP_LEN];
     unsigned long i;
 
-    if (!data || level > RTMP_debuglevel)
+    if (!data || level > (int)RTMP_debuglevel)
         return;
 
     /* in case len is zero */
@@ -150,4 +653,3 @@ void RTMP_LogHexString(int level, const uint8_t *data, unsigned long len)
 
     RTMP_Log(level, "%s", line);
 }
-#endif
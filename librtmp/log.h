@@ -37,23 +37,44 @@ typedef enum
     RTMP_LOGCRIT = 0, RTMP_LOGERROR, RTMP_LOGWARNING, RTMP_LOGINFO, RTMP_LOGDEBUG, RTMP_LOGDEBUG2, RTMP_LOGALL
 } RTMP_LogLevel;
 
+/* Levels above the ceiling are removed at compile time, calls below it only
+ * test the runtime level inline before calling out. Release builds keep
+ * warnings and up, define RTMP_LOG_CEILING to change that. */
+#ifndef RTMP_LOG_CEILING
 #ifdef _DEBUG
-
-#ifdef __GNUC__
-void RTMP_Log(int level, const char *format, ...) __attribute__ ((__format__ (__printf__, 2, 3)));
+#define RTMP_LOG_CEILING RTMP_LOGALL
 #else
-void RTMP_Log(int level, const char *format, ...);
+#define RTMP_LOG_CEILING RTMP_LOGWARNING
+#endif
 #endif
-void RTMP_LogHex(int level, const uint8_t *data, unsigned long len);
-void RTMP_LogHexString(int level, const uint8_t *data, unsigned long len);
 
-#else
+extern RTMP_LogLevel RTMP_debuglevel;
 
-#define RTMP_Log(level, format, ...)
-#define RTMP_LogHex(level, data, len)
-#define RTMP_LogHexString(level, data, len)
+#define RTMP_LOG_ON(level) ((level) <= RTMP_LOG_CEILING && (level) <= (int)RTMP_debuglevel)
+#define RTMP_Log(level, ...) \
+    do { if (RTMP_LOG_ON(level)) RTMP_LogAt(level, __VA_ARGS__); } while (0)
+#define RTMP_LogHex(level, data, len) \
+    do { if (RTMP_LOG_ON(level)) RTMP_LogHexAt(level, data, len); } while (0)
+#define RTMP_LogHexString(level, data, len) \
+    do { if (RTMP_LOG_ON(level)) RTMP_LogHexStringAt(level, data, len); } while (0)
 
+#ifdef __GNUC__
+void RTMP_LogAt(int level, const char *format, ...) __attribute__ ((__format__ (__printf__, 2, 3)));
+#else
+void RTMP_LogAt(int level, const char *format, ...);
 #endif
+void RTMP_LogHexAt(int level, const uint8_t *data, unsigned long len);
+void RTMP_LogHexStringAt(int level, const uint8_t *data, unsigned long len);
+
+/* Records go to a per-thread ring and are formatted and written by a log
+ * thread, so logging never waits on the output. */
+void RTMP_LogSetLevel(RTMP_LogLevel lvl);
+RTMP_LogLevel RTMP_LogGetLevel(void);
+void RTMP_LogSetOutput(FILE *file);
+/* connection and stream id attached to records logged from this thread */
+void RTMP_LogSetContext(unsigned conn, unsigned stream);
+/* writes everything queued so far, also run at exit */
+void RTMP_LogFlush(void);
 
 #ifdef __cplusplus
 }
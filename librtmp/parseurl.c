@@ -30,6 +30,33 @@
 #include "rtmp_sys.h"
 #include "log.h"
 
+static int UnixPathLen(const char *p, int len)
+{
+#ifndef _WIN32
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    struct stat st;
+    int n;
+
+    if (*p == '@')
+    {
+        const char *s = memchr(p, '/', len);
+        return s ? (int)(s - p) : len;
+    }
+    for (n = len; n > 0; )
+    {
+        if (n < (int)sizeof(path))
+        {
+            memcpy(path, p, n);
+            path[n] = '\0';
+            if (!stat(path, &st) && S_ISSOCK(st.st_mode))
+                return n;
+        }
+        while (--n > 0 && p[n] != '/');
+    }
+#endif
+    return len;
+}
+
 int RTMP_ParseURL(const char *url, int *protocol, AVal *host, unsigned int *port, AVal *playpath, AVal *app)
 {
     char *p, *end, *col, *ques, *slash;
@@ -69,6 +96,8 @@ int RTMP_ParseURL(const char *url, int *protocol, AVal *host, unsigned int *port
             *protocol = RTMP_PROTOCOL_RTMPTE;
         else if (len == 6 && strncasecmp(url, "rtmpts", 6) == 0)
             *protocol = RTMP_PROTOCOL_RTMPTS;
+        else if (len == 9 && strncasecmp(url, "rtmp+unix", 9) == 0)
+            *protocol = RTMP_PROTOCOL_RTMP_UNIX;
         else {
             RTMP_Log(RTMP_LOGWARNING, "Unknown protocol!\n");
             goto parsehost;
@@ -93,6 +122,16 @@ parsehost:
     ques  = strchr(p, '?');
     slash = strchr(p, '/');
 
+    if (*protocol & RTMP_FEATURE_UNIX)
+    {
+        host->av_val = p;
+        host->av_len = UnixPathLen(p, end - p);
+        RTMP_Log(RTMP_LOGDEBUG, "Parsed socket  : %.*s", host->av_len, host->av_val);
+        p += host->av_len;
+        slash = *p == '/' ? p : NULL;
+        goto parseapp;
+    }
+
     {
         int hostlen;
         if (slash)
@@ -130,6 +169,7 @@ parsehost:
         }
     }
 
+parseapp:
     if (!slash)
     {
         RTMP_Log(RTMP_LOGWARNING, "No application or playpath in URL!");
@@ -31,9 +31,13 @@
 
 #include "rtmp_sys.h"
 #include "log.h"
+#if defined(CRYPTO) && !defined(_WIN32)
+#include <pthread.h>
+#endif
 
 #define RTMP_SIG_SIZE 1536
 #define RTMP_LARGE_HEADER_SIZE 12
+#define AMF_SCRATCH_SIZE 4096   /* stack arena for decoded commands, covers typical connect/publish/play */
 
 static const int packetSize[] = { 12, 8, 4, 1 };
 
@@ -55,11 +59,17 @@ typedef enum {
     RTMPT_OPEN = 0, RTMPT_SEND, RTMPT_IDLE, RTMPT_CLOSE
 } RTMPTCmd;
 
+#define RTMPT_HDR_ROOM      512         /* POST header is written in front of the body */
+#define RTMPT_BATCH_MAX     (16*1024)   /* queued sends are posted once this big */
+#define RTMPT_MAX_INFLIGHT  2           /* idle polls outstanding while data flows */
+#define RTMPT_POLL_UNIT     8           /* ms per step of the server polling hint */
+
 static int DumpMetaData(AMFObject *obj);
 static int HandShake(RTMP *r, int FP9HandShake);
 static int SocksNegotiate(RTMP *r);
 
 static int SendConnectPacket(RTMP *r, RTMPPacket *cp);
+static void ClearCmdTemplates(RTMP *r);
 static int SendCheckBW(RTMP *r);
 static int SendCheckBWResult(RTMP *r, double txn);
 static int SendDeleteStream(RTMP *r, double dStreamId);
@@ -67,6 +77,7 @@ static int SendFCSubscribe(RTMP *r, AVal *subscribepath);
 static int SendPlay(RTMP *r);
 static int SendBytesReceived(RTMP *r);
 static int SendUsherToken(RTMP *r, AVal *usherToken);
+static void SendStreamSetup(RTMP *r);
 
 static int HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize);
 static int HandleMetadata(RTMP *r, char *body, unsigned int len);
@@ -83,9 +94,35 @@ static int WriteN(RTMP *r, const char *buffer, int n);
 static void DecodeTEA(AVal *key, AVal *text);
 
 static int HTTP_Post(RTMP *r, RTMPTCmd cmd, const char *buf, int len);
+static int HTTP_Queue(RTMP *r, const char *buf, int len);
+static int HTTP_Flush(RTMP *r);
+static int HTTP_Due(RTMP *r);
+static int HTTP_Poll(RTMP *r, uint64_t *idleEnd);
 static int HTTP_read(RTMP *r, int fill);
 
+#ifdef CRYPTO
+static TLS_CTX RTMP_TLS_ctx;
+
+static void TLS_Init(void);
+static int TLS_Connect(RTMP *r);
+
+/* RTMP_Init may run on several threads at once, the context is made once */
+#ifdef _WIN32
+static INIT_ONCE TLS_once = INIT_ONCE_STATIC_INIT;
+static BOOL CALLBACK TLS_InitOnce(PINIT_ONCE once, PVOID param, PVOID *ctx)
+{
+    TLS_Init();
+    return TRUE;
+}
+#define TLS_INIT() InitOnceExecuteOnce(&TLS_once, TLS_InitOnce, NULL, NULL)
+#else
+static pthread_once_t TLS_once = PTHREAD_ONCE_INIT;
+#define TLS_INIT() pthread_once(&TLS_once, TLS_Init)
+#endif
+#endif
+
 static void CloseInternal(RTMP *r, int reconnect);
+static void CaptureClose(RTMPSockBuf *sb);
 
 #ifndef _WIN32
 static int clk_tck;
@@ -104,6 +141,77 @@ uint32_t RTMP_GetTime()
 #endif
 }
 
+uint64_t RTMP_GetTimeUS()
+{
+#ifdef _WIN32
+    static LARGE_INTEGER freq;
+    LARGE_INTEGER t;
+    if (!freq.QuadPart) QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&t);
+    return (uint64_t)(t.QuadPart / freq.QuadPart * 1000000 + t.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart);
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+}
+
+static int HistBucket(uint64_t us)
+{
+    uint32_t v = us > 0xffffffff ? 0xffffffff : (uint32_t)us;
+    int shift;
+    if (v < RTMP_HIST_SUB)
+        return v;
+    for (shift = 31; !(v >> shift); shift--);
+    shift -= RTMP_HIST_SUB_BITS;
+    return ((shift + 1) << RTMP_HIST_SUB_BITS) + (int)(v >> shift) - RTMP_HIST_SUB;
+}
+
+void RTMP_HistAdd(RTMP_HIST *h, uint64_t us)
+{
+    uint64_t *b = &h->h_bucket[HistBucket(us)];
+    RTMP_STAT_ADD(&h->h_count, 1);
+    RTMP_STAT_ADD(&h->h_sum, us);
+    RTMP_STAT_ADD(b, 1);
+    if (us > RTMP_STAT_LOAD(&h->h_max))
+        RTMP_STAT_SET(&h->h_max, us);
+}
+
+uint64_t RTMP_HistPercentile(const RTMP_HIST *h, double pct)
+{
+    uint64_t want = (uint64_t)(h->h_count * pct / 100.0 + 0.5), seen = 0;
+    int i, shift;
+    if (!h->h_count)
+        return 0;
+    if (!want)
+        want = 1;
+    for (i = 0; i < RTMP_HIST_BUCKETS - 1; i++)
+        if ((seen += h->h_bucket[i]) >= want)
+            break;
+    if (i < RTMP_HIST_SUB)
+        return i;
+    shift = (i >> RTMP_HIST_SUB_BITS) - 1;
+    return ((uint64_t)(RTMP_HIST_SUB + (i & (RTMP_HIST_SUB - 1))) << shift) + ((uint64_t)1 << shift) - 1;
+}
+
+void RTMP_GetStats(RTMP *r, RTMP_STATS *stats)
+{
+    const uint64_t *src = (const uint64_t *)&r->m_stats;
+    uint64_t *dst = (uint64_t *)stats;
+    size_t i;
+    for (i = 0; i < sizeof(RTMP_STATS)/sizeof(uint64_t); i++)
+        dst[i] = RTMP_STAT_LOAD(&src[i]);
+    stats->s_recvCalls = RTMP_STAT_LOAD(&r->m_sb.sb_recvs);
+    stats->s_sendCalls = RTMP_STAT_LOAD(&r->m_sb.sb_sends);
+}
+
+static void StatsMessage(uint64_t *msgs, uint64_t *bytes, const RTMPPacket *packet)
+{
+    int type = packet->m_packetType < RTMP_STATS_TYPES ? packet->m_packetType : 0;
+    RTMP_STAT_ADD(&msgs[type], 1);
+    RTMP_STAT_ADD(&bytes[type], packet->m_nBodySize);
+}
+
 void RTMP_UserInterrupt()
 {
     RTMP_ctrlC = TRUE;
@@ -165,7 +273,13 @@ void RTMP_Free(RTMP *r)
 
 void RTMP_Init(RTMP *r)
 {
+    static unsigned connIds;
     memset(r, 0, sizeof(RTMP));
+#if defined(__GNUC__) || defined(__clang__)
+    r->m_connId = __atomic_add_fetch(&connIds, 1, __ATOMIC_RELAXED);
+#else
+    r->m_connId = InterlockedIncrement((volatile LONG *)&connIds);
+#endif
     r->m_sb.sb_socket = -1;
     r->m_inChunkSize = RTMP_DEFAULT_CHUNKSIZE;
     r->m_outChunkSize = RTMP_DEFAULT_CHUNKSIZE;
@@ -177,6 +291,9 @@ void RTMP_Init(RTMP *r)
     r->m_fVideoCodecs = 252.0;
     r->Link.timeout = 30;
     r->Link.swfAge = 30;
+#ifdef CRYPTO
+    TLS_INIT();
+#endif
 }
 
 void RTMP_EnableWrite(RTMP *r)
@@ -191,7 +308,7 @@ double RTMP_GetDuration(RTMP *r)
 
 int RTMP_IsConnected(RTMP *r)
 {
-    return r->m_sb.sb_socket != -1;
+    return r->m_sb.sb_socket != -1 || r->m_sb.sb_transport;
 }
 
 int RTMP_Socket(RTMP *r)
@@ -332,8 +449,8 @@ void RTMP_SetupStream(RTMP *r, int protocol, AVal *host, unsigned int port, AVal
     }
 }
 
-enum { OPT_STR = 0, OPT_INT, OPT_BOOL, OPT_CONN };
-static const char *optinfo[] = { "string", "integer", "boolean", "AMF" };
+enum { OPT_STR = 0, OPT_INT, OPT_BOOL, OPT_CONN, OPT_NAME };
+static const char *optinfo[] = { "string", "integer", "boolean", "AMF", "name" };
 
 #define OFF(x)    offsetof(struct RTMP,x)
 
@@ -386,6 +503,24 @@ static struct urlopt {
     "Publisher username" },
 { AVC("pubPasswd"), OFF(Link.pubPasswd),     OPT_STR, 0,
     "Publisher password" },
+{ AVC("rtmptBatch"), OFF(m_batchMS),         OPT_INT, 0,
+    "RTMPT send batching interval in milliseconds" },
+{ AVC("tlsNoVerify"), OFF(Link.lFlags),      OPT_BOOL, RTMP_LF_NOVF,
+    "Skip TLS certificate verification" },
+{ AVC("pingInterval"), OFF(m_pingMS),        OPT_INT, 0,
+    "Ping the server every this many milliseconds to measure RTT" },
+{ AVC("sndbuf"),    OFF(Link.sockopts.sndbuf), OPT_INT, 0,
+    "Socket send buffer size in bytes" },
+{ AVC("rcvbuf"),    OFF(Link.sockopts.rcvbuf), OPT_INT, 0,
+    "Socket receive buffer size in bytes" },
+{ AVC("notsentLowat"), OFF(Link.sockopts.notsentLowat), OPT_INT, 0,
+    "Unsent bytes the kernel queues before writes block" },
+{ AVC("pacingRate"), OFF(Link.sockopts.pacingRate), OPT_INT, 0,
+    "Kernel pacing rate limit in bytes per second" },
+{ AVC("busyPoll"),  OFF(Link.sockopts.busyPoll), OPT_INT, 0,
+    "Busy poll the device this many microseconds on reads" },
+{ AVC("tcpCongestion"), OFF(Link.sockopts.congestion), OPT_NAME, sizeof(((RTMP_SOCKOPTS *)0)->congestion),
+    "TCP congestion control, e.g. bbr" },
 { { NULL, 0 }, 0, 0}
 };
 
@@ -536,6 +671,12 @@ int RTMP_SetOpt(RTMP *r, const AVal *opt, AVal *arg)
             if (parseAMF(&r->Link.extras, arg, &r->Link.edepth))
                 return FALSE;
             break;
+        case OPT_NAME:  /* copied into a buffer of omisc bytes */
+            if (arg->av_len >= options[i].omisc)
+                return FALSE;
+            memcpy(v, arg->av_val, arg->av_len);
+            ((char *)v)[arg->av_len] = '\0';
+            break;
         }
         break;
     }
@@ -545,6 +686,7 @@ int RTMP_SetOpt(RTMP *r, const AVal *opt, AVal *arg)
         RTMP_OptUsage();
         return FALSE;
     }
+    ClearCmdTemplates(r);
     return TRUE;
 }
 
@@ -555,6 +697,7 @@ int RTMP_SetupURL(RTMP *r, char *url)
     int ret, len;
     unsigned int port = 0;
 
+    ClearCmdTemplates(r);
     if (ptr)
         *ptr = '\0';
 
@@ -629,6 +772,12 @@ int RTMP_SetupURL(RTMP *r, char *url)
             {
                 len = r->Link.hostname.av_len + r->Link.app.av_len + sizeof("rtmpte://:65535/");
                 r->Link.tcUrl.av_val = malloc(len);
+                if (r->Link.protocol & RTMP_FEATURE_UNIX)
+                    r->Link.tcUrl.av_len = snprintf(r->Link.tcUrl.av_val, len,
+                        "rtmp+unix://%.*s/%.*s",
+                        r->Link.hostname.av_len, r->Link.hostname.av_val,
+                        r->Link.app.av_len, r->Link.app.av_val);
+                else
                 r->Link.tcUrl.av_len = snprintf(r->Link.tcUrl.av_val, len,
                     "%s://%.*s:%d/%.*s",
                     RTMPProtocolStringsLower[r->Link.protocol],
@@ -691,17 +840,139 @@ finish:
     return ret;
 }
 
+#ifndef _WIN32
+/* @name is an abstract address, its length excludes the padding */
+static int UnixAddr(struct sockaddr_un *addr, const AVal *path)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (!path->av_len || path->av_len >= (int)sizeof(addr->sun_path))
+    {
+        RTMP_Log(RTMP_LOGERROR, "Invalid Unix socket path %.*s", path->av_len, path->av_val);
+        return FALSE;
+    }
+    memcpy(addr->sun_path, path->av_val, path->av_len);
+    if (addr->sun_path[0] == '@')
+        addr->sun_path[0] = '\0';
+    return TRUE;
+}
+#endif
+
+static socklen_t SockAddrLen(const struct sockaddr *sa)
+{
+#ifndef _WIN32
+    if (sa->sa_family == AF_UNIX)
+    {
+        const char *path = ((const struct sockaddr_un *)sa)->sun_path;
+        return offsetof(struct sockaddr_un, sun_path) + 1 + strlen(path + !path[0]);
+    }
+#endif
+    return sizeof(struct sockaddr_in);
+}
+
+static void SockSet(RTMP *r, int level, int name, const char *what, int v)
+{
+    if (v && setsockopt(r->m_sb.sb_socket, level, name, (char *)&v, sizeof(v)))
+        RTMP_Log(RTMP_LOGWARNING, "%s, setting %s to %d failed: %d", __FUNCTION__, what, v, GetSockError());
+}
+
+static uint64_t SockGet(RTMP *r, int level, int name)
+{
+    int v = 0;
+    socklen_t len = sizeof(v);
+    if (getsockopt(r->m_sb.sb_socket, level, name, (char *)&v, &len))
+        return 0;
+    return (unsigned int)v;
+}
+
+/* applies Link.sockopts, then records what the kernel made of them */
+static void SockTune(RTMP *r, int family)
+{
+    const RTMP_SOCKOPTS *o = &r->Link.sockopts;
+#ifndef _WIN32
+    int tcp = family != AF_UNIX;
+#else
+    int tcp = 1;
+#endif
+    SockSet(r, SOL_SOCKET, SO_SNDBUF, "SO_SNDBUF", o->sndbuf);
+    SockSet(r, SOL_SOCKET, SO_RCVBUF, "SO_RCVBUF", o->rcvbuf);
+    RTMP_STAT_SET(&r->m_stats.s_sndbuf, SockGet(r, SOL_SOCKET, SO_SNDBUF));
+    RTMP_STAT_SET(&r->m_stats.s_rcvbuf, SockGet(r, SOL_SOCKET, SO_RCVBUF));
+    RTMP_STAT_SET(&r->m_stats.s_pacingRate, 0);
+#ifdef SO_MAX_PACING_RATE
+    SockSet(r, SOL_SOCKET, SO_MAX_PACING_RATE, "SO_MAX_PACING_RATE", o->pacingRate);
+    {
+        uint64_t rate = SockGet(r, SOL_SOCKET, SO_MAX_PACING_RATE);
+        RTMP_STAT_SET(&r->m_stats.s_pacingRate, rate == 0xffffffff ? 0 : rate);
+    }
+#endif
+#ifdef SO_BUSY_POLL
+    SockSet(r, SOL_SOCKET, SO_BUSY_POLL, "SO_BUSY_POLL", o->busyPoll);
+    RTMP_STAT_SET(&r->m_stats.s_busyPoll, SockGet(r, SOL_SOCKET, SO_BUSY_POLL));
+#endif
+    /* only TCP paces in the kernel, elsewhere WriteN does */
+    r->m_paceRate = 0;
+    if (o->pacingRate && (!tcp || RTMP_STAT_LOAD(&r->m_stats.s_pacingRate) != (uint64_t)o->pacingRate))
+    {
+        r->m_paceRate = o->pacingRate;
+        RTMP_STAT_SET(&r->m_stats.s_pacingRate, o->pacingRate);
+    }
+    if (!tcp)
+        return;
+#ifdef TCP_NOTSENT_LOWAT
+    SockSet(r, IPPROTO_TCP, TCP_NOTSENT_LOWAT, "TCP_NOTSENT_LOWAT", o->notsentLowat);
+    RTMP_STAT_SET(&r->m_stats.s_notsentLowat, SockGet(r, IPPROTO_TCP, TCP_NOTSENT_LOWAT));
+#endif
+#ifdef TCP_CONGESTION
+    {
+        socklen_t len = sizeof(r->m_congestion) - 1;
+        if (o->congestion[0] &&
+            setsockopt(r->m_sb.sb_socket, IPPROTO_TCP, TCP_CONGESTION, o->congestion, strlen(o->congestion)))
+            RTMP_Log(RTMP_LOGWARNING, "%s, setting TCP_CONGESTION to %s failed: %d", __FUNCTION__, o->congestion, GetSockError());
+        memset(r->m_congestion, 0, sizeof(r->m_congestion));
+        if (getsockopt(r->m_sb.sb_socket, IPPROTO_TCP, TCP_CONGESTION, r->m_congestion, &len))
+            r->m_congestion[0] = '\0';
+    }
+#endif
+}
+
+static int SockFamily(RTMP *r)
+{
+    struct sockaddr_storage ss;
+    socklen_t len = sizeof(ss);
+    ss.ss_family = AF_INET;
+    getsockname(r->m_sb.sb_socket, (struct sockaddr *)&ss, &len);
+    return ss.ss_family;
+}
+
+void RTMP_SetPacing(RTMP *r, int rate)
+{
+    r->Link.sockopts.pacingRate = rate > 0 ? rate : 0;
+    if (!RTMP_IsConnected(r))
+        return;
+#ifdef SO_MAX_PACING_RATE
+    if (!rate)
+    {   /* SockTune leaves a 0 alone */
+        unsigned int unlimited = ~0U;
+        setsockopt(r->m_sb.sb_socket, SOL_SOCKET, SO_MAX_PACING_RATE, (char *)&unlimited, sizeof(unlimited));
+    }
+#endif
+    SockTune(r, SockFamily(r));
+}
+
 int RTMP_Connect0(RTMP *r, struct sockaddr *service)
 {
     int on = 1;
+    RTMP_LogSetContext(r->m_connId, 0);
     r->m_sb.sb_timedout = FALSE;
     r->m_pausing = 0;
     r->m_fDuration = 0.0;
 
-    r->m_sb.sb_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    r->m_sb.sb_socket = socket(service->sa_family, SOCK_STREAM, 0);
     if (r->m_sb.sb_socket != -1)
     {
-        if (connect(r->m_sb.sb_socket, service, sizeof(struct sockaddr)) < 0)
+        SockTune(r, service->sa_family);    /* buffer sizes count for the window scale only before connect */
+        if (connect(r->m_sb.sb_socket, service, SockAddrLen(service)) < 0)
         {
             int err = GetSockError();
             RTMP_Log(RTMP_LOGERROR, "%s, failed to connect socket. %d (%s)", __FUNCTION__, err, strerror(err));
@@ -733,7 +1004,8 @@ int RTMP_Connect0(RTMP *r, struct sockaddr *service)
         }
     }
 
-    if (setsockopt(r->m_sb.sb_socket, IPPROTO_TCP, TCP_NODELAY, (char *) &on, sizeof(on)))
+    if (service->sa_family == AF_INET &&
+        setsockopt(r->m_sb.sb_socket, IPPROTO_TCP, TCP_NODELAY, (char *) &on, sizeof(on)))
     {
         RTMP_Log(RTMP_LOGERROR, "%s, Setting socket nodelay failed!", __FUNCTION__);
     }
@@ -744,9 +1016,17 @@ int RTMP_Connect1(RTMP *r, RTMPPacket *cp)
 {
     if (r->Link.protocol & RTMP_FEATURE_SSL)
     {
+#ifdef CRYPTO
+        if (!TLS_Connect(r))
+        {
+            RTMP_Close(r);
+            return FALSE;
+        }
+#else
         RTMP_Log(RTMP_LOGERROR, "%s, no SSL/TLS support", __FUNCTION__);
         RTMP_Close(r);
         return FALSE;
+#endif
     }
     if (r->Link.protocol & RTMP_FEATURE_HTTP)
     {
@@ -786,6 +1066,20 @@ int RTMP_Connect(RTMP *r, RTMPPacket *cp)
     if (!r->Link.hostname.av_len)
         return FALSE;
 
+    if (r->Link.protocol & RTMP_FEATURE_UNIX)
+    {
+#ifdef _WIN32
+        RTMP_Log(RTMP_LOGERROR, "%s, no Unix domain sockets on this platform", __FUNCTION__);
+        return FALSE;
+#else
+        struct sockaddr_un addr;
+        if (!UnixAddr(&addr, &r->Link.hostname) || !RTMP_Connect0(r, (struct sockaddr *)&addr))
+            return FALSE;
+        r->m_bSendCounter = TRUE;
+        return RTMP_Connect1(r, cp);
+#endif
+    }
+
     memset(&service, 0, sizeof(struct sockaddr_in));
     service.sin_family = AF_INET;
 
@@ -809,6 +1103,80 @@ int RTMP_Connect(RTMP *r, RTMPPacket *cp)
     return RTMP_Connect1(r, cp);
 }
 
+int RTMP_Listen(const char *url)
+{
+    AVal host, playpath, app;
+    unsigned int port;
+    int protocol, fd = -1, on = 1;
+    struct sockaddr_in in;
+    struct sockaddr *addr = (struct sockaddr *)&in;
+#ifndef _WIN32
+    struct sockaddr_un un;
+    struct stat st;
+#endif
+
+    if (!RTMP_ParseURL(url, &protocol, &host, &port, &playpath, &app))
+        return -1;
+    free(playpath.av_val);
+    if (protocol & RTMP_FEATURE_UNIX)
+    {
+#ifdef _WIN32
+        RTMP_Log(RTMP_LOGERROR, "%s, no Unix domain sockets on this platform", __FUNCTION__);
+        return -1;
+#else
+        if (!UnixAddr(&un, &host))
+            return -1;
+        if (un.sun_path[0] && !stat(un.sun_path, &st) && S_ISSOCK(st.st_mode))
+            unlink(un.sun_path);
+        addr = (struct sockaddr *)&un;
+#endif
+    } else
+    {
+        memset(&in, 0, sizeof(in));
+        in.sin_family = AF_INET;
+        in.sin_addr.s_addr = htonl(INADDR_ANY);
+        in.sin_port = htons(port ? port : 1935);
+        if (host.av_len && !add_addr_info(&in, &host, port ? port : 1935))
+            return -1;
+    }
+    fd = socket(addr->sa_family, SOCK_STREAM, 0);
+    if (fd != -1 && addr->sa_family == AF_INET)
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, (char *)&on, sizeof(on));
+    if (fd == -1 || bind(fd, addr, SockAddrLen(addr)) || listen(fd, 16))
+    {
+        int err = GetSockError();
+        RTMP_Log(RTMP_LOGERROR, "%s, can't listen on %s. %d (%s)", __FUNCTION__, url, err, strerror(err));
+        if (fd != -1)
+            closesocket(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int RTMP_Accept(RTMP *r, int listenfd)
+{
+    int fd, on = 1;
+    while ((fd = accept(listenfd, NULL, NULL)) == -1 && GetSockError() == EINTR && !RTMP_ctrlC);
+    if (fd == -1)
+    {
+        int err = GetSockError();
+        RTMP_Log(RTMP_LOGERROR, "%s, accept failed. %d (%s)", __FUNCTION__, err, strerror(err));
+        return FALSE;
+    }
+    RTMP_LogSetContext(r->m_connId, 0);
+    r->m_sb.sb_socket = fd;
+    r->m_sb.sb_timedout = FALSE;
+    {
+        SET_RCVTIMEO(tv, r->Link.timeout);
+        if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv, sizeof(tv)))
+            RTMP_Log(RTMP_LOGERROR, "%s, Setting socket timeout to %ds failed!", __FUNCTION__, r->Link.timeout);
+    }
+    /* fails harmlessly on Unix domain sockets */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (char *)&on, sizeof(on));
+    SockTune(r, SockFamily(r));
+    return TRUE;
+}
+
 static int SocksNegotiate(RTMP *r)
 {
     unsigned long addr;
@@ -878,8 +1246,41 @@ int RTMP_ConnectStream(RTMP *r, int seekTime)
     return r->m_bPlaying;
 }
 
+int RTMP_WaitConnect(RTMP *r)
+{
+    RTMPPacket packet = { 0 };
+    while (!r->m_bConnected && RTMP_IsConnected(r) && RTMP_ReadPacket(r, &packet))
+    {
+        if (RTMPPacket_IsReady(&packet))
+        {
+            if (packet.m_nBodySize)
+                RTMP_ClientPacket(r, &packet);
+            RTMPPacket_Free(&packet);
+        }
+    }
+    return r->m_bConnected;
+}
+
+int RTMP_ResumeConnect(RTMP *r, AVal *playpath)
+{
+    if (!r->m_bConnected || !RTMP_IsConnected(r))
+        return FALSE;
+    if (playpath && playpath->av_val)
+    {
+        free(r->Link.playpath0.av_val);
+        r->Link.playpath0 = *playpath;
+        r->Link.playpath = r->Link.playpath0;
+        playpath->av_val = NULL;
+        playpath->av_len = 0;
+    }
+    r->Link.lFlags &= ~RTMP_LF_HOLD;
+    SendStreamSetup(r);
+    return TRUE;
+}
+
 int RTMP_ReconnectStream(RTMP *r, int seekTime)
 {
+    RTMP_STAT_ADD(&r->m_stats.s_reconnects, 1);
     RTMP_DeleteStream(r);
     RTMP_SendCreateStream(r);
     return RTMP_ConnectStream(r, seekTime);
@@ -962,6 +1363,8 @@ int RTMP_GetNextMediaPacket(RTMP *r, RTMPPacket *packet)
 int RTMP_ClientPacket(RTMP *r, RTMPPacket *packet)
 {
     int bHasMediaPacket = 0;
+    if (r->m_pingMS && RTMP_GetTimeUS() - r->m_pingLast >= (uint64_t)r->m_pingMS * 1000)
+        RTMP_SendPing(r);    /* an unanswered ping is simply replaced */
     switch (packet->m_packetType)
     {
     case RTMP_PACKET_TYPE_CHUNK_SIZE:
@@ -1005,9 +1408,11 @@ int RTMP_ClientPacket(RTMP *r, RTMPPacket *packet)
             r->m_mediaStamp = packet->m_nTimeStamp;
         break;
     case RTMP_PACKET_TYPE_FLEX_STREAM_SEND:
-        /* flex stream send */
-        RTMP_Log(RTMP_LOGDEBUG, "%s, flex stream send, size %u bytes, not supported, ignoring",
-                 __FUNCTION__, packet->m_nBodySize);
+        /* flex stream send, AMF0 data behind a format byte, values may switch to AMF3.
+         * Only parsed for duration and friends, it has no FLV tag type. */
+        RTMP_Log(RTMP_LOGDEBUG, "%s, received: flex stream send %u bytes", __FUNCTION__, packet->m_nBodySize);
+        if (packet->m_nBodySize > 1)
+            HandleMetadata(r, packet->m_body + 1, packet->m_nBodySize - 1);
         break;
     case RTMP_PACKET_TYPE_FLEX_SHARED_OBJECT:
         /* flex shared object */
@@ -1052,8 +1457,8 @@ int RTMP_ClientPacket(RTMP *r, RTMPPacket *packet)
         RTMP_Log(RTMP_LOGDEBUG, "%s, received: invoke %u bytes", __FUNCTION__, packet->m_nBodySize);
         /*RTMP_LogHex(packet.m_body, packet.m_nBodySize); */
 
-        // @remark debug info by http://github.com/ossrs/srs
-        while (1)
+        // @remark debug info by http://github.com/ossrs/srs, only worth decoding when it gets printed
+        while (RTMP_LOG_ON(RTMP_LOGINFO))
         {
             // String(_result)
             char *p = packet->m_body;
@@ -1061,20 +1466,20 @@ int RTMP_ClientPacket(RTMP *r, RTMPPacket *packet)
             // Marker.
             if (nb < 1)
             {
-                RTMP_Log(RTMP_LOGERROR, "ignore string marker for nb=%d", nb);
+                RTMP_Log(RTMP_LOGDEBUG, "ignore string marker for nb=%d", nb);
                 break;
             }
             AMFDataType t = (AMFDataType)p[0];
             if (t != AMF_STRING)
             {
-                RTMP_Log(RTMP_LOGERROR, "ignore string marker for type=%d", t);
+                RTMP_Log(RTMP_LOGDEBUG, "ignore string marker for type=%d", t);
                 break;
             }
             nb--; p++;
             // String content.
             if (nb < 2)
             {
-                RTMP_Log(RTMP_LOGERROR, "ignore string data for nb=%d", nb);
+                RTMP_Log(RTMP_LOGDEBUG, "ignore string data for nb=%d", nb);
                 break;
             }
             AVal _result;
@@ -1085,20 +1490,20 @@ int RTMP_ClientPacket(RTMP *r, RTMPPacket *packet)
             // Marker
             if (nb < 1)
             {
-                RTMP_Log(RTMP_LOGERROR, "ignore number marker for nb=%d", nb);
+                RTMP_Log(RTMP_LOGDEBUG, "ignore number marker for nb=%d", nb);
                 break;
             }
             t = (AMFDataType)p[0];
             if (t != AMF_NUMBER)
             {
-                RTMP_Log(RTMP_LOGERROR, "ignore number marker for type=%d", t);
+                RTMP_Log(RTMP_LOGDEBUG, "ignore number marker for type=%d", t);
                 break;
             }
             nb--; p++;
             // Number content.
             if (nb < 8)
             {
-                RTMP_Log(RTMP_LOGERROR, "ignore number data for nb=%d", nb);
+                RTMP_Log(RTMP_LOGDEBUG, "ignore number data for nb=%d", nb);
                 break;
             }
             double tid = AMF_DecodeNumber(p); (void)tid;
@@ -1108,28 +1513,32 @@ int RTMP_ClientPacket(RTMP *r, RTMPPacket *packet)
             // Marker
             if (nb < 1)
             {
-                RTMP_Log(RTMP_LOGERROR, "ignore object marker for nb=%d", nb);
+                RTMP_Log(RTMP_LOGDEBUG, "ignore object marker for nb=%d", nb);
                 break;
             }
             t = (AMFDataType)p[0];
             if (t != AMF_OBJECT)
             {
-                RTMP_Log(RTMP_LOGERROR, "ignore object marker for type=%d", t);
+                RTMP_Log(RTMP_LOGDEBUG, "ignore object marker for type=%d", t);
                 break;
             }
             nb--; p++;
             // Object info content
             AMFObject obj;
+            char scratch[AMF_SCRATCH_SIZE];
+            AMFArena arena;
+            AMF_ArenaInit(&arena, scratch, sizeof(scratch));
             if (nb < 3)
             {
-                RTMP_Log(RTMP_LOGERROR, "ignore object eof for nb=%d", nb);
+                RTMP_Log(RTMP_LOGDEBUG, "ignore object eof for nb=%d", nb);
                 break;
             }
-            int nRes = AMF_Decode(&obj, p, nb, TRUE);
-            AMF_Reset(&obj);
+            int nRes = AMF_DecodeArena(&obj, p, nb, TRUE, &arena);
+            // the info object is not used, drop all its blocks so early exits below leak nothing
+            AMF_ArenaFree(&arena);
             if (nRes < 0)
             {
-                RTMP_Log(RTMP_LOGERROR, "decode object failed, ret=%d", nRes);
+                RTMP_Log(RTMP_LOGDEBUG, "decode object failed, ret=%d", nRes);
                 break;
             }
             nb -= nRes; p += nRes;
@@ -1138,26 +1547,26 @@ int RTMP_ClientPacket(RTMP *r, RTMPPacket *packet)
             // Marker
             if (nb < 1)
             {
-                RTMP_Log(RTMP_LOGERROR, "ignore object marker for nb=%d", nb);
+                RTMP_Log(RTMP_LOGDEBUG, "ignore object marker for nb=%d", nb);
                 break;
             }
             t = (AMFDataType)p[0];
             if (t != AMF_OBJECT)
             {
-                RTMP_Log(RTMP_LOGERROR, "ignore object marker for type=%d", t);
+                RTMP_Log(RTMP_LOGDEBUG, "ignore object marker for type=%d", t);
                 break;
             }
             nb--; p++;
             // Object data content
             if (nb < 3)
             {
-                RTMP_Log(RTMP_LOGERROR, "ignore object eof for nb=%d", nb);
+                RTMP_Log(RTMP_LOGDEBUG, "ignore object eof for nb=%d", nb);
                 break;
             }
-            if ((nRes = AMF_Decode(&obj, p, nb, TRUE)) < 0)
+            if ((nRes = AMF_DecodeArena(&obj, p, nb, TRUE, &arena)) < 0)
             {
-                AMF_Reset(&obj);
-                RTMP_Log(RTMP_LOGERROR, "decode object failed, ret=%d", nRes);
+                AMF_ArenaFree(&arena);
+                RTMP_Log(RTMP_LOGDEBUG, "decode object failed, ret=%d", nRes);
                 break;
             }
             nb -= nRes; p += nRes;
@@ -1196,7 +1605,7 @@ int RTMP_ClientPacket(RTMP *r, RTMPPacket *packet)
                     break;
                 }
             }
-            AMF_Reset(&obj);
+            AMF_ArenaFree(&arena);
             // Print info.
             if (_srs_pid > 0)
             {
@@ -1256,6 +1665,7 @@ static int ReadN(RTMP *r, char *buffer, int n)
 {
     int nOriginalSize = n;
     int avail;
+    uint64_t idleEnd = 0;
     char *ptr;
 
     r->m_sb.sb_timedout = FALSE;
@@ -1276,13 +1686,14 @@ static int ReadN(RTMP *r, char *buffer, int n)
                 int ret;
                 if (r->m_sb.sb_size < 13 || refill)
                 {
-                    if (!r->m_unackd)
+                    if ((ret = HTTP_Poll(r, &idleEnd)) == -2)
                     {
-                        if (HTTP_Post(r, RTMPT_IDLE, "", 1) < 0)
-                        {
-                            RTMP_Close(r);
-                            return 0;
-                        }
+                        r->m_sb.sb_timedout = TRUE;
+                        return 0;
+                    } else if (ret < 0)
+                    {
+                        RTMP_Close(r);
+                        return 0;
                     }
                     if (RTMPSockBuf_Fill(&r->m_sb) < 1)
                     {
@@ -1331,6 +1742,7 @@ static int ReadN(RTMP *r, char *buffer, int n)
             r->m_sb.sb_size -= nRead;
             nBytes = nRead;
             r->m_nBytesIn += nRead;
+            RTMP_STAT_ADD(&r->m_stats.s_bytesIn, nRead);
             if (r->m_bSendCounter && r->m_nBytesIn > (r->m_nBytesInSent + r->m_nClientBW/10))
                 if (!SendBytesReceived(r))
                     return FALSE;
@@ -1354,18 +1766,34 @@ static int ReadN(RTMP *r, char *buffer, int n)
     return nOriginalSize - n;
 }
 
+static void StatsWrite(RTMP *r, int n, uint64_t start)
+{
+    RTMP_STAT_ADD(&r->m_stats.s_bytesOut, n);
+    RTMP_HistAdd(&r->m_stats.s_write, RTMP_GetTimeUS() - start);
+}
+
 static int WriteN(RTMP *r, const char *buffer, int n)
 {
     const char *ptr = buffer;
+    uint64_t start = RTMP_GetTimeUS();
+
+    if (r->Link.protocol & RTMP_FEATURE_HTTP)
+    {   /* writes within the batching interval go out in one POST */
+        if (!HTTP_Queue(r, buffer, n) || (HTTP_Due(r) && HTTP_Flush(r) < 0))
+        {
+            RTMP_Log(RTMP_LOGERROR, "%s, RTMPT send error %d (%d bytes)", __FUNCTION__, GetSockError(), n);
+            RTMP_Close(r);
+            return FALSE;
+        }
+        StatsWrite(r, n, start);
+        return TRUE;
+    }
 
     while (n > 0)
     {
         int nBytes;
 
-        if (r->Link.protocol & RTMP_FEATURE_HTTP)
-            nBytes = HTTP_Post(r, RTMPT_SEND, ptr, n);
-        else
-            nBytes = RTMPSockBuf_Send(&r->m_sb, ptr, n);
+        nBytes = RTMPSockBuf_Send(&r->m_sb, ptr, n);
         /*RTMP_Log(RTMP_LOGDEBUG, "%s: %d\n", __FUNCTION__, nBytes); */
 
         if (nBytes < 0)
@@ -1388,7 +1816,72 @@ static int WriteN(RTMP *r, const char *buffer, int n)
         ptr += nBytes;
     }
 
-    return n == 0;
+    if (n)
+        return FALSE;
+    StatsWrite(r, (int)(ptr - buffer), start);
+    return TRUE;
+}
+
+/* a paced chunk may go out now, idle time gives no credit beyond a millisecond */
+static int PaceDue(RTMP *r)
+{
+    uint64_t now = RTMP_GetTimeUS();
+    if (r->m_paceNext + 1000 < now)
+        r->m_paceNext = now - 1000;
+    return r->m_paceNext <= now;
+}
+
+static int PaceWrite(RTMP *r, const char *buf, int n)
+{
+    r->m_paceNext += (uint64_t)n*1000000/r->m_paceRate;
+    return WriteN(r, buf, n);
+}
+
+/* sends the held chunks that are due, all of them unpaced with force */
+static int PaceDrain(RTMP *r, int force)
+{
+    while (r->m_paceHead < r->m_paceLen && (force || r->m_paceLen - r->m_paceHead > r->m_paceRate || PaceDue(r)))
+    {
+        int n;
+        memcpy(&n, r->m_paceOut + r->m_paceHead, sizeof(n));
+        r->m_paceHead += sizeof(n) + n;
+        /* a failed write closes r, which releases the held chunks */
+        if (!(force ? WriteN : PaceWrite)(r, r->m_paceOut + r->m_paceHead - n, n))
+            return FALSE;
+    }
+    if (r->m_paceHead == r->m_paceLen)
+        r->m_paceHead = r->m_paceLen = 0;
+    return TRUE;
+}
+
+/* one audio or video chunk, sent when due and nothing is held, else held */
+static int PaceSend(RTMP *r, const char *buf, int n)
+{
+    if (r->m_paceHead == r->m_paceLen && PaceDue(r))
+        return PaceWrite(r, buf, n);
+    if (r->m_paceLen + (int)sizeof(n) + n > r->m_paceSize)
+    {
+        int nSize = r->m_paceLen - r->m_paceHead + sizeof(n) + n;
+        if (r->m_paceHead && nSize <= r->m_paceSize)
+            memmove(r->m_paceOut, r->m_paceOut + r->m_paceHead, r->m_paceLen - r->m_paceHead);
+        else
+        {
+            char *out = malloc(nSize*2);
+            if (!out)
+                return FALSE;
+            if (r->m_paceOut)
+                memcpy(out, r->m_paceOut + r->m_paceHead, r->m_paceLen - r->m_paceHead);
+            free(r->m_paceOut);
+            r->m_paceOut = out;
+            r->m_paceSize = nSize*2;
+        }
+        r->m_paceLen -= r->m_paceHead;
+        r->m_paceHead = 0;
+    }
+    memcpy(r->m_paceOut + r->m_paceLen, &n, sizeof(n));
+    memcpy(r->m_paceOut + r->m_paceLen + sizeof(n), buf, n);
+    r->m_paceLen += sizeof(n) + n;
+    return PaceDrain(r, FALSE);
 }
 
 #define SAVC(x)    static const AVal av_##x = AVC(#x)
@@ -1410,6 +1903,49 @@ SAVC(secureTokenResponse);
 SAVC(type);
 SAVC(nonprivate);
 
+enum
+{
+    CMD_CONNECT = 0, CMD_CREATESTREAM, CMD_RELEASESTREAM, CMD_FCPUBLISH, CMD_FCUNPUBLISH,
+    CMD_PUBLISH, CMD_PLAY, CMD_DELETESTREAM
+};
+
+/* Command bodies depend only on Link and the connect options, so each one is
+ * encoded once and later sends copy it and patch the transaction id. The copy
+ * is needed because RTMP_SendPacket writes chunk headers into the body. */
+static char *UseCmdTemplate(RTMP *r, int cmd, char *enc)
+{
+    RTMP_CMDTEMPLATE *t = &r->m_cmdTemplates[cmd];
+    if (!t->t_body)
+        return NULL;
+    memcpy(enc, t->t_body, t->t_size);
+    AMF_EncodeNumber(enc + t->t_txn, enc + t->t_size, ++r->m_numInvokes);
+    return enc + t->t_size;
+}
+
+/* body starts with the method name string followed by the transaction id */
+static void SaveCmdTemplate(RTMP *r, int cmd, const char *body, int size)
+{
+    RTMP_CMDTEMPLATE *t = &r->m_cmdTemplates[cmd];
+    char *copy = malloc(size);
+    if (!copy)
+        return;
+    memcpy(copy, body, size);
+    free(t->t_body);
+    t->t_body = copy;
+    t->t_size = size;
+    t->t_txn  = 3 + AMF_DecodeInt16(body + 1);
+}
+
+static void ClearCmdTemplates(RTMP *r)
+{
+    int i;
+    for (i = 0; i < RTMP_CMD_TEMPLATES; i++)
+    {
+        free(r->m_cmdTemplates[i].t_body);
+        r->m_cmdTemplates[i].t_body = NULL;
+    }
+}
+
 static int SendConnectPacket(RTMP *r, RTMPPacket *cp)
 {
     RTMPPacket packet;
@@ -1427,6 +1963,8 @@ static int SendConnectPacket(RTMP *r, RTMPPacket *cp)
     packet.m_hasAbsTimestamp = 0;
     packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
 
+    if ((enc = UseCmdTemplate(r, CMD_CONNECT, packet.m_body)))
+        goto send;
     enc = packet.m_body;
     enc = AMF_EncodeString(enc, pend, &av_connect);
     enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
@@ -1515,6 +2053,8 @@ static int SendConnectPacket(RTMP *r, RTMPPacket *cp)
                 return FALSE;
         }
     }
+    SaveCmdTemplate(r, CMD_CONNECT, packet.m_body, enc - packet.m_body);
+send:
     packet.m_nBodySize = enc - packet.m_body;
 
     return RTMP_SendPacket(r, &packet, TRUE);
@@ -1536,10 +2076,14 @@ int RTMP_SendCreateStream(RTMP *r)
     packet.m_hasAbsTimestamp = 0;
     packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
 
-    enc = packet.m_body;
-    enc = AMF_EncodeString(enc, pend, &av_createStream);
-    enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
-    *enc++ = AMF_NULL;        /* NULL */
+    if (!(enc = UseCmdTemplate(r, CMD_CREATESTREAM, packet.m_body)))
+    {
+        enc = packet.m_body;
+        enc = AMF_EncodeString(enc, pend, &av_createStream);
+        enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
+        *enc++ = AMF_NULL;        /* NULL */
+        SaveCmdTemplate(r, CMD_CREATESTREAM, packet.m_body, enc - packet.m_body);
+    }
 
     packet.m_nBodySize = enc - packet.m_body;
 
@@ -1624,13 +2168,17 @@ static int SendReleaseStream(RTMP *r)
     packet.m_hasAbsTimestamp = 0;
     packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
 
-    enc = packet.m_body;
-    enc = AMF_EncodeString(enc, pend, &av_releaseStream);
-    enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
-    *enc++ = AMF_NULL;
-    enc = AMF_EncodeString(enc, pend, &r->Link.playpath);
-    if (!enc)
-        return FALSE;
+    if (!(enc = UseCmdTemplate(r, CMD_RELEASESTREAM, packet.m_body)))
+    {
+        enc = packet.m_body;
+        enc = AMF_EncodeString(enc, pend, &av_releaseStream);
+        enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
+        *enc++ = AMF_NULL;
+        enc = AMF_EncodeString(enc, pend, &r->Link.playpath);
+        if (!enc)
+            return FALSE;
+        SaveCmdTemplate(r, CMD_RELEASESTREAM, packet.m_body, enc - packet.m_body);
+    }
 
     packet.m_nBodySize = enc - packet.m_body;
 
@@ -1653,13 +2201,17 @@ static int SendFCPublish(RTMP *r)
     packet.m_hasAbsTimestamp = 0;
     packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
 
-    enc = packet.m_body;
-    enc = AMF_EncodeString(enc, pend, &av_FCPublish);
-    enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
-    *enc++ = AMF_NULL;
-    enc = AMF_EncodeString(enc, pend, &r->Link.playpath);
-    if (!enc)
-        return FALSE;
+    if (!(enc = UseCmdTemplate(r, CMD_FCPUBLISH, packet.m_body)))
+    {
+        enc = packet.m_body;
+        enc = AMF_EncodeString(enc, pend, &av_FCPublish);
+        enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
+        *enc++ = AMF_NULL;
+        enc = AMF_EncodeString(enc, pend, &r->Link.playpath);
+        if (!enc)
+            return FALSE;
+        SaveCmdTemplate(r, CMD_FCPUBLISH, packet.m_body, enc - packet.m_body);
+    }
 
     packet.m_nBodySize = enc - packet.m_body;
 
@@ -1682,13 +2234,17 @@ static int SendFCUnpublish(RTMP *r)
     packet.m_hasAbsTimestamp = 0;
     packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
 
-    enc = packet.m_body;
-    enc = AMF_EncodeString(enc, pend, &av_FCUnpublish);
-    enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
-    *enc++ = AMF_NULL;
-    enc = AMF_EncodeString(enc, pend, &r->Link.playpath);
-    if (!enc)
-        return FALSE;
+    if (!(enc = UseCmdTemplate(r, CMD_FCUNPUBLISH, packet.m_body)))
+    {
+        enc = packet.m_body;
+        enc = AMF_EncodeString(enc, pend, &av_FCUnpublish);
+        enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
+        *enc++ = AMF_NULL;
+        enc = AMF_EncodeString(enc, pend, &r->Link.playpath);
+        if (!enc)
+            return FALSE;
+        SaveCmdTemplate(r, CMD_FCUNPUBLISH, packet.m_body, enc - packet.m_body);
+    }
 
     packet.m_nBodySize = enc - packet.m_body;
 
@@ -1713,18 +2269,22 @@ static int SendPublish(RTMP *r)
     packet.m_hasAbsTimestamp = 0;
     packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
 
-    enc = packet.m_body;
-    enc = AMF_EncodeString(enc, pend, &av_publish);
-    enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
-    *enc++ = AMF_NULL;
-    enc = AMF_EncodeString(enc, pend, &r->Link.playpath);
-    if (!enc)
-        return FALSE;
+    if (!(enc = UseCmdTemplate(r, CMD_PUBLISH, packet.m_body)))
+    {
+        enc = packet.m_body;
+        enc = AMF_EncodeString(enc, pend, &av_publish);
+        enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
+        *enc++ = AMF_NULL;
+        enc = AMF_EncodeString(enc, pend, &r->Link.playpath);
+        if (!enc)
+            return FALSE;
 
-    /* FIXME: should we choose live based on Link.lFlags & RTMP_LF_LIVE? */
-    enc = AMF_EncodeString(enc, pend, &av_live);
-    if (!enc)
-        return FALSE;
+        /* FIXME: should we choose live based on Link.lFlags & RTMP_LF_LIVE? */
+        enc = AMF_EncodeString(enc, pend, &av_live);
+        if (!enc)
+            return FALSE;
+        SaveCmdTemplate(r, CMD_PUBLISH, packet.m_body, enc - packet.m_body);
+    }
 
     packet.m_nBodySize = enc - packet.m_body;
 
@@ -1747,10 +2307,14 @@ static int SendDeleteStream(RTMP *r, double dStreamId)
     packet.m_hasAbsTimestamp = 0;
     packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
 
-    enc = packet.m_body;
-    enc = AMF_EncodeString(enc, pend, &av_deleteStream);
-    enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
-    *enc++ = AMF_NULL;
+    if (!(enc = UseCmdTemplate(r, CMD_DELETESTREAM, packet.m_body)))
+    {
+        enc = packet.m_body;
+        enc = AMF_EncodeString(enc, pend, &av_deleteStream);
+        enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
+        *enc++ = AMF_NULL;
+        SaveCmdTemplate(r, CMD_DELETESTREAM, packet.m_body, enc - packet.m_body);
+    }
     enc = AMF_EncodeNumber(enc, pend, dStreamId);
 
     packet.m_nBodySize = enc - packet.m_body;
@@ -1984,16 +2548,19 @@ static int SendPlay(RTMP *r)
     packet.m_hasAbsTimestamp = 0;
     packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
 
-    enc = packet.m_body;
-    enc = AMF_EncodeString(enc, pend, &av_play);
-    enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
-    *enc++ = AMF_NULL;
-
     RTMP_Log(RTMP_LOGDEBUG, "%s, seekTime=%d, stopTime=%d, sending play: %s",
         __FUNCTION__, r->Link.seekTime, r->Link.stopTime, r->Link.playpath.av_val);
-    enc = AMF_EncodeString(enc, pend, &r->Link.playpath);
-    if (!enc)
-        return FALSE;
+    if (!(enc = UseCmdTemplate(r, CMD_PLAY, packet.m_body)))
+    {
+        enc = packet.m_body;
+        enc = AMF_EncodeString(enc, pend, &av_play);
+        enc = AMF_EncodeNumber(enc, pend, ++r->m_numInvokes);
+        *enc++ = AMF_NULL;
+        enc = AMF_EncodeString(enc, pend, &r->Link.playpath);
+        if (!enc)
+            return FALSE;
+        SaveCmdTemplate(r, CMD_PLAY, packet.m_body, enc - packet.m_body);
+    }
 
     /* Optional parameters start and len.
      *
@@ -2161,44 +2728,197 @@ int RTMP_SendCtrl(RTMP *r, short nType, unsigned int nObject, unsigned int nTime
     return RTMP_SendPacket(r, &packet, FALSE);
 }
 
-static void AV_erase(RTMP_METHOD *vals, int *num, int i, int freeit)
+/* the stamp is the low 32 bits of the microsecond clock, the pong echoes it
+ * back so the RTT needs no state beyond the one outstanding ping */
+int RTMP_SendPing(RTMP *r)
 {
-    if (freeit)
-        free(vals[i].name.av_val);
-    (*num)--;
-    for (; i < *num; i++)
-    {
-        vals[i] = vals[i + 1];
+    r->m_pingLast = RTMP_GetTimeUS();
+    r->m_pingStamp = (uint32_t)r->m_pingLast;
+    r->m_pingPending = TRUE;
+    return RTMP_SendCtrl(r, 0x06, r->m_pingStamp, 0);
+}
+
+/* methods we wait results for, index is the interned id */
+static const AVal *const g_callNames[] =
+{
+    NULL, &av_connect, &av_createStream, &av_FCSubscribe, &av_publish, &av_play,
+    &av_pause, &av_seek, &av__checkbw, &av_set_playlist
+};
+#define NUM_CALL_NAMES (int)(sizeof(g_callNames)/sizeof(g_callNames[0]))
+
+enum
+{
+    CALL_CONNECT = 1, CALL_CREATESTREAM, CALL_FCSUBSCRIBE, CALL_PUBLISH, CALL_PLAY,
+    CALL_PAUSE, CALL_SEEK, CALL_CHECKBW, CALL_SET_PLAYLIST
+};
+
+/* names outside the static list are copied once per connection, not per call */
+static int CallIntern(RTMP *r, const AVal *name)
+{
+    char *tmp;
+    int i;
+    for (i = 1; i < NUM_CALL_NAMES; i++)
+        if (AVMATCH(name, g_callNames[i]))
+            return i;
+    for (i = 0; i < r->m_numCallNames; i++)
+        if (AVMATCH(name, &r->m_callNames[i]))
+            return NUM_CALL_NAMES + i;
+    if (!(r->m_numCallNames & 0x0f))
+    {
+        AVal *names = realloc(r->m_callNames, (r->m_numCallNames + 16) * sizeof(AVal));
+        if (!names)
+            return 0;
+        r->m_callNames = names;
     }
-    vals[i].name.av_val = NULL;
-    vals[i].name.av_len = 0;
-    vals[i].num = 0;
+    tmp = malloc(name->av_len + 1);
+    if (!tmp)
+        return 0;
+    memcpy(tmp, name->av_val, name->av_len);
+    tmp[name->av_len] = '\0';
+    r->m_callNames[r->m_numCallNames].av_val = tmp;
+    r->m_callNames[r->m_numCallNames].av_len = name->av_len;
+    return NUM_CALL_NAMES + r->m_numCallNames++;
 }
 
-void RTMP_DropRequest(RTMP *r, int i, int freeit)
+static const AVal *CallName(RTMP *r, int method)
 {
-    AV_erase(r->m_methodCalls, &r->m_numCalls, i, freeit);
+    if (method < NUM_CALL_NAMES)
+        return g_callNames[method];
+    return &r->m_callNames[method - NUM_CALL_NAMES];
 }
 
-static void AV_queue(RTMP_METHOD **vals, int *num, AVal *av, int txn)
+/* txns are sequential, so the low bits spread them without collisions.
+ * A reused txn probes past the pending one, so both calls stay queued and
+ * CallTake answers them in send order, as the old call list did. */
+static void CallInsert(RTMP_METHOD *calls, int size, int txn, int method)
 {
-    char *tmp;
-    if (!(*num & 0x0f))
-        *vals = realloc(*vals, (*num + 16) * sizeof(RTMP_METHOD));
-    tmp = malloc(av->av_len + 1);
-    memcpy(tmp, av->av_val, av->av_len);
-    tmp[av->av_len] = '\0';
-    (*vals)[*num].num = txn;
-    (*vals)[*num].name.av_len = av->av_len;
-    (*vals)[(*num)++].name.av_val = tmp;
+    int i = txn & (size - 1);
+    while (calls[i].method)
+        i = (i + 1) & (size - 1);
+    calls[i].num = txn;
+    calls[i].method = method;
 }
 
-static void AV_clear(RTMP_METHOD *vals, int num)
+static void CallAdd(RTMP *r, int txn, int method)
+{
+    if (!method)
+        return;
+    if ((r->m_numCalls + 1)*2 > r->m_callsSize)
+    {   /* keep load at most one half */
+        int i, j = 0, size = r->m_callsSize ? r->m_callsSize*2 : 16;
+        RTMP_METHOD *calls = calloc(size, sizeof(RTMP_METHOD));
+        if (!calls)
+            return;
+        /* start behind an empty slot so no cluster wraps, reused txns keep their order */
+        while (j < r->m_callsSize && r->m_methodCalls[j].method)
+            j++;
+        for (i = 0; i < r->m_callsSize; i++)
+        {
+            RTMP_METHOD *call = &r->m_methodCalls[(j + i) & (r->m_callsSize - 1)];
+            if (call->method)
+                CallInsert(calls, size, call->num, call->method);
+        }
+        free(r->m_methodCalls);
+        r->m_methodCalls = calls;
+        r->m_callsSize = size;
+    }
+    CallInsert(r->m_methodCalls, r->m_callsSize, txn, method);
+    r->m_numCalls++;
+}
+
+/* backward shift deletion, leaves no tombstones behind */
+static void CallRemoveSlot(RTMP *r, int i)
+{
+    RTMP_METHOD *calls = r->m_methodCalls;
+    int mask = r->m_callsSize - 1, j = i;
+    calls[i].method = 0;
+    r->m_numCalls--;
+    for (;;)
+    {
+        int k;
+        j = (j + 1) & mask;
+        if (!calls[j].method)
+            break;
+        k = calls[j].num & mask;
+        /* entry at j may fill the hole unless its home slot lies cyclically in (i, j] */
+        if (i <= j ? (k <= i || k > j) : (k <= i && k > j))
+        {
+            calls[i] = calls[j];
+            calls[j].method = 0;
+            i = j;
+        }
+    }
+}
+
+/* returns the method id of the call answered by txn, 0 if none is pending */
+static int CallTake(RTMP *r, int txn)
+{
+    int i, mask = r->m_callsSize - 1;
+    if (!r->m_numCalls)
+        return 0;
+    for (i = txn & mask; r->m_methodCalls[i].method; i = (i + 1) & mask)
+    {
+        if (r->m_methodCalls[i].num == txn)
+        {
+            int method = r->m_methodCalls[i].method;
+            CallRemoveSlot(r, i);
+            return method;
+        }
+    }
+    return 0;
+}
+
+/* status notifications carry no txn, drop the oldest call of that method */
+static void CallDropMethod(RTMP *r, int method)
+{
+    int i, found = -1;
+    for (i = 0; i < r->m_callsSize && r->m_numCalls; i++)
+    {
+        if (r->m_methodCalls[i].method == method && (found < 0 || r->m_methodCalls[i].num < r->m_methodCalls[found].num))
+            found = i;
+    }
+    if (found >= 0)
+        CallRemoveSlot(r, found);
+}
+
+static void CallsClear(RTMP *r)
 {
     int i;
-    for (i = 0; i < num; i++)
-        free(vals[i].name.av_val);
-    free(vals);
+    for (i = 0; i < r->m_numCallNames; i++)
+        free(r->m_callNames[i].av_val);
+    free(r->m_callNames);
+    r->m_callNames = NULL;
+    r->m_numCallNames = 0;
+    free(r->m_methodCalls);
+    r->m_methodCalls = NULL;
+    r->m_callsSize = 0;
+    r->m_numCalls = 0;
+}
+
+/* drops the i-th pending call in the order the calls were sent */
+void RTMP_DropRequest(RTMP *r, int i, int freeit)
+{
+    RTMP_METHOD *calls = r->m_methodCalls;
+    int j, k, mask = r->m_callsSize - 1;
+    (void)freeit;    /* method names are interned, there is nothing to free */
+    if (i < 0 || i >= r->m_numCalls)
+        return;
+    for (j = 0; j < r->m_callsSize; j++)
+    {
+        int older = 0;
+        if (!calls[j].method)
+            continue;
+        /* a reused txn sits further from its home slot than the earlier call */
+        for (k = 0; k < r->m_callsSize; k++)
+            if (calls[k].method && (calls[k].num < calls[j].num || (calls[k].num == calls[j].num &&
+                ((k - calls[k].num) & mask) < ((j - calls[j].num) & mask))))
+                older++;
+        if (older == i)
+        {
+            CallRemoveSlot(r, j);
+            return;
+        }
+    }
 }
 
 SAVC(onBWDone);
@@ -2209,7 +2929,6 @@ SAVC(_onbwdone);
 SAVC(_error);
 SAVC(close);
 SAVC(code);
-SAVC(level);
 SAVC(description);
 SAVC(onStatus);
 SAVC(playlist_ready);
@@ -2227,88 +2946,146 @@ static const AVal av_NetStream_Play_UnpublishNotify = AVC("NetStream.Play.Unpubl
 static const AVal av_NetStream_Publish_Start        = AVC("NetStream.Publish.Start");
 static const AVal av_NetConnection_Connect_Rejected = AVC("NetConnection.Connect.Rejected");
 
+enum
+{
+    INVOKE_UNKNOWN = 0, INVOKE_RESULT, INVOKE_ONBWDONE, INVOKE_ONFCSUBSCRIBE, INVOKE_ONFCUNSUBSCRIBE, INVOKE_PING,
+    INVOKE_ONBWCHECK_, INVOKE_ONBWDONE_, INVOKE_ERROR, INVOKE_CLOSE, INVOKE_ONSTATUS, INVOKE_PLAYLIST_READY
+};
+
+/* length and at most one extra byte select the only candidate, a single compare confirms it */
+static int InvokeMethodId(const AVal *method)
+{
+    const AVal *av;
+    int id;
+    switch (method->av_len)
+    {
+    case 4:  av = &av_ping;            id = INVOKE_PING; break;
+    case 5:  av = &av_close;           id = INVOKE_CLOSE; break;
+    case 6:  av = &av__error;          id = INVOKE_ERROR; break;
+    case 7:  av = &av__result;         id = INVOKE_RESULT; break;
+    case 8:
+        if (method->av_val[2] == 'B')
+        {
+            av = &av_onBWDone;         id = INVOKE_ONBWDONE;
+        } else
+        {
+            av = &av_onStatus;         id = INVOKE_ONSTATUS;
+        }
+        break;
+    case 9:  av = &av__onbwdone;       id = INVOKE_ONBWDONE_; break;
+    case 10: av = &av__onbwcheck;      id = INVOKE_ONBWCHECK_; break;
+    case 13: av = &av_onFCSubscribe;   id = INVOKE_ONFCSUBSCRIBE; break;
+    case 14: av = &av_playlist_ready;  id = INVOKE_PLAYLIST_READY; break;
+    case 15: av = &av_onFCUnsubscribe; id = INVOKE_ONFCUNSUBSCRIBE; break;
+    default:
+        return INVOKE_UNKNOWN;
+    }
+    return AVMATCH(method, av) ? id : INVOKE_UNKNOWN;
+}
+
+/* what follows the connect _result: stream creation and publish/play prep */
+static void SendStreamSetup(RTMP *r)
+{
+    if (r->Link.protocol & RTMP_FEATURE_WRITE)
+    {
+        SendReleaseStream(r);
+        SendFCPublish(r);
+    } else
+    {
+        RTMP_SendServerBW(r);
+        RTMP_SendCtrl(r, 3, 0, 300);
+    }
+    RTMP_SendCreateStream(r);
+
+    if (!(r->Link.protocol & RTMP_FEATURE_WRITE))
+    {
+        /* Authenticate on Justin.tv legacy servers before sending FCSubscribe */
+        if (r->Link.usherToken.av_len)
+            SendUsherToken(r, &r->Link.usherToken);
+        /* Send the FCSubscribe if live stream or if subscribepath is set */
+        if (r->Link.subscribepath.av_len)
+            SendFCSubscribe(r, &r->Link.subscribepath);
+        else if (r->Link.lFlags & RTMP_LF_LIVE)
+            SendFCSubscribe(r, &r->Link.playpath);
+    }
+}
+
 /* Returns 0 for OK/Failed/error, 1 for 'Stop or Complete' */
 static int HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize)
 {
-    AMFObject obj;
+    AMFReader rd, args, val;
     AVal method;
     double txn;
-    int ret = 0, nRes;
+    int ret = 0;
     if (body[0] != 0x02)        /* make sure it is a string method name we start with */
     {
         RTMP_Log(RTMP_LOGWARNING, "%s, Sanity failed. no string method in invoke packet", __FUNCTION__);
         return 0;
     }
 
-    nRes = AMF_Decode(&obj, body, nBodySize, FALSE);
-    if (nRes < 0)
+#ifdef _DEBUG
+    {
+        AMFObject obj;
+        char scratch[AMF_SCRATCH_SIZE];
+        AMFArena arena;
+        AMF_ArenaInit(&arena, scratch, sizeof(scratch));
+        if (AMF_DecodeArena(&obj, body, nBodySize, FALSE, &arena) >= 0)
+            AMF_Dump(&obj);
+        AMF_ArenaFree(&arena);
+    }
+#endif
+    /* pull only the fields we act on straight from the body */
+    AMFReader_Init(&rd, body, nBodySize);
+    if (!AMFReader_GetString(&rd, &method))
     {
         RTMP_Log(RTMP_LOGERROR, "%s, error decoding invoke packet", __FUNCTION__);
         return 0;
     }
+    AMFReader_GetNumber(&rd, &txn);
+    args = rd; /* command object, then optional arguments */
+    RTMP_Log(RTMP_LOGDEBUG, "%s, server invoking <%.*s>", __FUNCTION__, method.av_len, method.av_val);
 
-    AMF_Dump(&obj);
-    AMFProp_GetString(AMF_GetProp(&obj, NULL, 0), &method);
-    txn = AMFProp_GetNumber(AMF_GetProp(&obj, NULL, 1));
-    RTMP_Log(RTMP_LOGDEBUG, "%s, server invoking <%s>", __FUNCTION__, method.av_val);
-
-    if (AVMATCH(&method, &av__result))
+    switch (InvokeMethodId(&method))
     {
-        AVal methodInvoked = { 0 };
-        int i;
-        for (i = 0; i<r->m_numCalls; i++)
-        {
-            if (r->m_methodCalls[i].num == (int)txn)
-            {
-                methodInvoked = r->m_methodCalls[i].name;
-                AV_erase(r->m_methodCalls, &r->m_numCalls, i, FALSE);
-                break;
-            }
-        }
-        if (!methodInvoked.av_val)
+    case INVOKE_RESULT:
+    {
+        int methodInvoked = CallTake(r, (int)txn);
+        if (!methodInvoked)
         {
             RTMP_Log(RTMP_LOGDEBUG, "%s, received result id %f without matching request", __FUNCTION__, txn);
-            goto leave;
+            break;
         }
 
-        RTMP_Log(RTMP_LOGDEBUG, "%s, received result for method call <%s>", __FUNCTION__, methodInvoked.av_val);
+        RTMP_Log(RTMP_LOGDEBUG, "%s, received result for method call <%s>", __FUNCTION__, CallName(r, methodInvoked)->av_val);
 
-        if (AVMATCH(&methodInvoked, &av_connect))
+        if (methodInvoked == CALL_CONNECT)
         {
             if (r->Link.token.av_len)
             {
-                AMFObjectProperty p;
-                if (RTMP_FindFirstMatchingProperty(&obj, &av_secureToken, &p))
+                AVal token;
+                while (AMFReader_Peek(&args) != AMF_INVALID)
                 {
-                    DecodeTEA(&r->Link.token, &p.p_vu.p_aval);
-                    SendSecureTokenResponse(r, &p.p_vu.p_aval);
+                    if (AMFReader_FindProp(&args, &av_secureToken, &val, TRUE))
+                    {
+                        if (AMFReader_GetString(&val, &token))
+                        {
+                            DecodeTEA(&r->Link.token, &token);
+                            SendSecureTokenResponse(r, &token);
+                        }
+                        break;
+                    }
+                    AMFReader_Skip(&args);
                 }
             }
-            if (r->Link.protocol & RTMP_FEATURE_WRITE)
-            {
-                SendReleaseStream(r);
-                SendFCPublish(r);
-            } else
-            {
-                RTMP_SendServerBW(r);
-                RTMP_SendCtrl(r, 3, 0, 300);
-            }
-            RTMP_SendCreateStream(r);
-
-            if (!(r->Link.protocol & RTMP_FEATURE_WRITE))
-            {
-                /* Authenticate on Justin.tv legacy servers before sending FCSubscribe */
-                if (r->Link.usherToken.av_len)
-                    SendUsherToken(r, &r->Link.usherToken);
-                /* Send the FCSubscribe if live stream or if subscribepath is set */
-                if (r->Link.subscribepath.av_len)
-                    SendFCSubscribe(r, &r->Link.subscribepath);
-                else if (r->Link.lFlags & RTMP_LF_LIVE)
-                    SendFCSubscribe(r, &r->Link.playpath);
-            }
-        } else if (AVMATCH(&methodInvoked, &av_createStream))
+            r->m_bConnected = TRUE;
+            if (!(r->Link.lFlags & RTMP_LF_HOLD))
+                SendStreamSetup(r);
+        } else if (methodInvoked == CALL_CREATESTREAM)
         {
-            r->m_stream_id = (int)AMFProp_GetNumber(AMF_GetProp(&obj, NULL, 3));
+            double stream_id;
+            AMFReader_Skip(&args);
+            AMFReader_GetNumber(&args, &stream_id);
+            r->m_stream_id = (int)stream_id;
 
             if (r->Link.protocol & RTMP_FEATURE_WRITE)
             {
@@ -2320,53 +3097,47 @@ static int HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize)
                 SendPlay(r);
                 RTMP_SendCtrl(r, 3, r->m_stream_id, r->m_nBufferMS);
             }
-        } else if (AVMATCH(&methodInvoked, &av_play) || AVMATCH(&methodInvoked, &av_publish))
+        } else if (methodInvoked == CALL_PLAY || methodInvoked == CALL_PUBLISH)
         {
             r->m_bPlaying = TRUE;
         }
-        free(methodInvoked.av_val);
-    } else if (AVMATCH(&method, &av_onBWDone))
-    {
+        break;
+    }
+    case INVOKE_ONBWDONE:
         if (!r->m_nBWCheckCounter)
             SendCheckBW(r);
-    } else if (AVMATCH(&method, &av_onFCSubscribe))
-    {
+        break;
+    case INVOKE_ONFCSUBSCRIBE:
         /* SendOnFCSubscribe(); */
-    } else if (AVMATCH(&method, &av_onFCUnsubscribe))
-    {
+        break;
+    case INVOKE_ONFCUNSUBSCRIBE:
         RTMP_Close(r);
         ret = 1;
-    } else if (AVMATCH(&method, &av_ping))
-    {
+        break;
+    case INVOKE_PING:
         SendPong(r, txn);
-    } else if (AVMATCH(&method, &av__onbwcheck))
-    {
+        break;
+    case INVOKE_ONBWCHECK_:
         SendCheckBWResult(r, txn);
-    } else if (AVMATCH(&method, &av__onbwdone))
-    {
-        int i;
-        for (i = 0; i < r->m_numCalls; i++)
-            if (AVMATCH(&r->m_methodCalls[i].name, &av__checkbw))
-            {
-                AV_erase(r->m_methodCalls, &r->m_numCalls, i, TRUE);
-                break;
-            }
-    } else if (AVMATCH(&method, &av__error))
-    {
+        break;
+    case INVOKE_ONBWDONE_:
+        CallDropMethod(r, CALL_CHECKBW);
+        break;
+    case INVOKE_ERROR:
         RTMP_Log(RTMP_LOGERROR, "rtmp server sent error");
-    } else if (AVMATCH(&method, &av_close))
-    {
+        break;
+    case INVOKE_CLOSE:
         RTMP_Log(RTMP_LOGERROR, "rtmp server requested close");
         RTMP_Close(r);
-    } else if (AVMATCH(&method, &av_onStatus))
+        break;
+    case INVOKE_ONSTATUS:
     {
-        AMFObject obj2;
-        AVal code, level;
-        AMFProp_GetObject(AMF_GetProp(&obj, NULL, 3), &obj2);
-        AMFProp_GetString(AMF_GetProp(&obj2, &av_code, -1), &code);
-        AMFProp_GetString(AMF_GetProp(&obj2, &av_level, -1), &level);
+        AVal code = { 0, 0 };
+        AMFReader_Skip(&args);
+        if (AMFReader_FindProp(&args, &av_code, &val, FALSE))
+            AMFReader_GetString(&val, &code);
 
-        RTMP_Log(RTMP_LOGDEBUG, "%s, onStatus: %s", __FUNCTION__, code.av_val);
+        RTMP_Log(RTMP_LOGDEBUG, "%s, onStatus: %.*s", __FUNCTION__, code.av_len, code.av_val);
         if (AVMATCH(&code, &av_NetStream_Failed)
          || AVMATCH(&code, &av_NetStream_Play_Failed)
          || AVMATCH(&code, &av_NetStream_Play_StreamNotFound)
@@ -2374,31 +3145,15 @@ static int HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize)
         {
             r->m_stream_id = -1;
             RTMP_Close(r);
-            RTMP_Log(RTMP_LOGERROR, "Closing connection: %s", code.av_val);
+            RTMP_Log(RTMP_LOGERROR, "Closing connection: %.*s", code.av_len, code.av_val);
         } else if (AVMATCH(&code, &av_NetStream_Play_Start) || AVMATCH(&code, &av_NetStream_Play_PublishNotify))
         {
-            int i;
             r->m_bPlaying = TRUE;
-            for (i = 0; i < r->m_numCalls; i++)
-            {
-                if (AVMATCH(&r->m_methodCalls[i].name, &av_play))
-                {
-                    AV_erase(r->m_methodCalls, &r->m_numCalls, i, TRUE);
-                    break;
-                }
-            }
+            CallDropMethod(r, CALL_PLAY);
         } else if (AVMATCH(&code, &av_NetStream_Publish_Start))
         {
-            int i;
             r->m_bPlaying = TRUE;
-            for (i = 0; i < r->m_numCalls; i++)
-            {
-                if (AVMATCH(&r->m_methodCalls[i].name, &av_publish))
-                {
-                    AV_erase(r->m_methodCalls, &r->m_numCalls, i, TRUE);
-                    break;
-                }
-            }
+            CallDropMethod(r, CALL_PUBLISH);
         } else if (AVMATCH(&code, &av_NetStream_Play_Complete)
                 || AVMATCH(&code, &av_NetStream_Play_Stop)
                 || AVMATCH(&code, &av_NetStream_Play_UnpublishNotify))
@@ -2416,20 +3171,12 @@ static int HandleInvoke(RTMP *r, const char *body, unsigned int nBodySize)
                 r->m_pausing = 3;
             }
         }
-    } else if (AVMATCH(&method, &av_playlist_ready))
-    {
-        int i;
-        for (i = 0; i < r->m_numCalls; i++)
-        {
-            if (AVMATCH(&r->m_methodCalls[i].name, &av_set_playlist))
-            {
-                AV_erase(r->m_methodCalls, &r->m_numCalls, i, TRUE);
-                break;
-            }
-        }
+        break;
+    }
+    case INVOKE_PLAYLIST_READY:
+        CallDropMethod(r, CALL_SET_PLAYLIST);
+        break;
     }
-leave:
-    AMF_Reset(&obj);
     return ret;
 }
 
@@ -2536,11 +3283,15 @@ static int HandleMetadata(RTMP *r, char *body, unsigned int len)
     AMFObject obj;
     AVal metastring;
     int ret = FALSE;
+    char scratch[AMF_SCRATCH_SIZE];
+    AMFArena arena;
 
-    int nRes = AMF_Decode(&obj, body, len, FALSE);
+    AMF_ArenaInit(&arena, scratch, sizeof(scratch));
+    int nRes = AMF_DecodeArena(&obj, body, len, FALSE, &arena);
     if (nRes < 0)
     {
         RTMP_Log(RTMP_LOGERROR, "%s, error decoding meta data packet", __FUNCTION__);
+        AMF_ArenaFree(&arena);
         return FALSE;
     }
 
@@ -2565,7 +3316,7 @@ static int HandleMetadata(RTMP *r, char *body, unsigned int len)
             r->m_read.dataType |= 4;
         ret = TRUE;
     }
-    AMF_Reset(&obj);
+    AMF_ArenaFree(&arena);
     return ret;
 }
 
@@ -2622,6 +3373,15 @@ static void HandleCtrl(RTMP *r, const RTMPPacket *packet)
             RTMP_Log(RTMP_LOGDEBUG, "%s, Ping %d", __FUNCTION__, tmp);
             RTMP_SendCtrl(r, 0x07, tmp, 0);
             break;
+        case 7:        /* pong to our RTMP_SendPing, echoes its stamp */
+            tmp = AMF_DecodeInt32(packet->m_body + 2);
+            RTMP_Log(RTMP_LOGDEBUG, "%s, Pong %u", __FUNCTION__, tmp);
+            if (r->m_pingPending && tmp == r->m_pingStamp)
+            {
+                RTMP_HistAdd(&r->m_stats.s_rtt, (uint32_t)RTMP_GetTimeUS() - tmp);
+                r->m_pingPending = FALSE;
+            }
+            break;
 
             /* FMS 3.5 servers send the following two controls to let the client
              * know when the server has sent a complete buffer. I.e., when the
@@ -2745,6 +3505,7 @@ int RTMP_ReadPacket(RTMP *r, RTMPPacket *packet)
     int didAlloc = FALSE;
     int extendedTimestamp;
 
+    RTMP_LogSetContext(r->m_connId, r->m_stream_id);
     RTMP_Log(RTMP_LOGDEBUG2, "%s: fd=%d", __FUNCTION__, r->m_sb.sb_socket);
 
     if (ReadN(r, (char *)hbuf, 1) == 0)
@@ -2864,6 +3625,7 @@ int RTMP_ReadPacket(RTMP *r, RTMPPacket *packet)
             return FALSE;
         }
         didAlloc = TRUE;
+        RTMP_STAT_ADD(&r->m_stats.s_allocs, 1);
         packet->m_headerType = (hbuf[0] & 0xc0) >> 6;
     }
 
@@ -2890,6 +3652,7 @@ int RTMP_ReadPacket(RTMP *r, RTMPPacket *packet)
     RTMP_LogHexString(RTMP_LOGDEBUG2, (uint8_t *)packet->m_body + packet->m_nBytesRead, nChunk);
 
     packet->m_nBytesRead += nChunk;
+    RTMP_STAT_ADD(&r->m_stats.s_chunksIn, 1);
 
     /* keep the packet as ref for other packets on this channel */
     if (!r->m_vecChannelsIn[packet->m_nChannel])
@@ -2907,6 +3670,7 @@ int RTMP_ReadPacket(RTMP *r, RTMPPacket *packet)
             packet->m_nTimeStamp += r->m_channelTimestamp[packet->m_nChannel];    /* timestamps seem to be always relative!! */
 
         r->m_channelTimestamp[packet->m_nChannel] = packet->m_nTimeStamp;
+        StatsMessage(r->m_stats.s_msgsIn, r->m_stats.s_msgBytesIn, packet);
 
         /* reset the data from the stored packet. we keep the header since we may use it later if a new packet for this channel */
         /* arrives and requests to re-use some info (small packet header) */
@@ -3063,6 +3827,8 @@ int RTMP_SendChunk(RTMP *r, RTMPChunk *chunk)
         memcpy(ptr, hbuf, chunk->c_headerSize);
     } else
         wrote = WriteN(r, chunk->c_header, chunk->c_headerSize);
+    if (wrote)
+        RTMP_STAT_ADD(&r->m_stats.s_chunksOut, 1);
     return wrote;
 }
 
@@ -3076,8 +3842,9 @@ int RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
     uint32_t t;
     char *buffer, *tbuf = NULL, *toff = NULL;
     int nChunkSize;
-    int tlen;
+    int tlen, paced;
 
+    RTMP_LogSetContext(r->m_connId, r->m_stream_id);
     if (packet->m_nChannel >= r->m_channelsAllocatedOut)
     {
         int n = packet->m_nChannel + 10;
@@ -3095,7 +3862,9 @@ int RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
     }
 
     prevPacket = r->m_vecChannelsOut[packet->m_nChannel];
-    if (prevPacket && packet->m_headerType != RTMP_PACKET_SIZE_LARGE)
+    if (!prevPacket)    /* nothing to be relative to, e.g. after a reconnect */
+        packet->m_headerType = RTMP_PACKET_SIZE_LARGE;
+    else if (packet->m_headerType != RTMP_PACKET_SIZE_LARGE)
     {
         /* compress a bit by using the prev packet's attributes */
         if (prevPacket->m_nBodySize == packet->m_nBodySize && prevPacket->m_packetType == packet->m_packetType &&
@@ -3189,6 +3958,11 @@ int RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
 
     RTMP_Log(RTMP_LOGDEBUG2, "%s: fd=%d, size=%d", __FUNCTION__, r->m_sb.sb_socket,
              nSize);
+    /* only media is paced, held chunks must not be read with a new chunk size */
+    paced = r->m_paceRate && !(r->Link.protocol & RTMP_FEATURE_HTTP) &&
+        (packet->m_packetType == RTMP_PACKET_TYPE_AUDIO || packet->m_packetType == RTMP_PACKET_TYPE_VIDEO);
+    if (packet->m_packetType == RTMP_PACKET_TYPE_CHUNK_SIZE && !PaceDrain(r, TRUE))
+        return FALSE;
     /* send all chunks in one HTTP request */
     if (r->Link.protocol & RTMP_FEATURE_HTTP)
     {
@@ -3199,6 +3973,7 @@ int RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
             tbuf = malloc(tlen);
             if (!tbuf)
                 return FALSE;
+            RTMP_STAT_ADD(&r->m_stats.s_allocs, 1);
             toff = tbuf;
         }
     }
@@ -3217,13 +3992,14 @@ int RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
             toff += nChunkSize + hSize;
         } else
         {
-            wrote = WriteN(r, header, nChunkSize + hSize);
+            wrote = paced ? PaceSend(r, header, nChunkSize + hSize) : WriteN(r, header, nChunkSize + hSize);
             if (!wrote)
                 return FALSE;
         }
         nSize  -= nChunkSize;
         buffer += nChunkSize;
         hSize = 0;
+        RTMP_STAT_ADD(&r->m_stats.s_chunksOut, 1);
 
         if (nSize > 0)
         {
@@ -3262,6 +4038,7 @@ int RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
         if (!wrote)
             return FALSE;
     }
+    StatsMessage(r->m_stats.s_msgsOut, r->m_stats.s_msgBytesOut, packet);
 
     /* we invoked a remote method */
     if (packet->m_packetType == RTMP_PACKET_TYPE_INVOKE)
@@ -3271,13 +4048,20 @@ int RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue)
         ptr = packet->m_body + 1;
         AMF_DecodeString(ptr, &method);
         RTMP_Log(RTMP_LOGDEBUG, "Invoking %s", method.av_val);
+        /* the answer is what the caller waits for, batching would only delay it */
+        if ((r->Link.protocol & RTMP_FEATURE_HTTP) && HTTP_Flush(r) < 0)
+        {
+            RTMP_Log(RTMP_LOGERROR, "%s, RTMPT send error %d", __FUNCTION__, GetSockError());
+            RTMP_Close(r);
+            return FALSE;
+        }
         /* keep it in call queue till result arrives */
         if (queue)
         {
             int txn;
             ptr += 3 + method.av_len;
             txn = (int)AMF_DecodeNumber(ptr);
-            AV_queue(&r->m_methodCalls, &r->m_numCalls, &method, txn);
+            CallAdd(r, txn, CallIntern(r, &method));
         }
     }
 
@@ -3302,6 +4086,11 @@ static void CloseInternal(RTMP *r, int reconnect)
     int i;
     if (RTMP_IsConnected(r))
     {
+        if (!reconnect && r->m_paceRate)
+        {   /* held media goes before the stream is deleted, not again from a close on a failed send */
+            r->m_paceRate = 0;
+            PaceDrain(r, TRUE);
+        }
         if (r->m_stream_id > 0)
         {
             i = r->m_stream_id;
@@ -3312,6 +4101,7 @@ static void CloseInternal(RTMP *r, int reconnect)
         }
         if (r->m_clientID.av_val)
         {
+            HTTP_Flush(r);    /* sends still held for batching go before the close */
             HTTP_Post(r, RTMPT_CLOSE, "", 1);
             free(r->m_clientID.av_val);
             r->m_clientID.av_val = NULL;
@@ -3319,6 +4109,7 @@ static void CloseInternal(RTMP *r, int reconnect)
         }
         RTMPSockBuf_Close(&r->m_sb);
     }
+    CaptureClose(&r->m_sb);
 
     r->m_stream_id = -1;
     r->m_sb.sb_socket = -1;
@@ -3366,17 +4157,29 @@ static void CloseInternal(RTMP *r, int reconnect)
     free(r->m_vecChannelsOut);
     r->m_vecChannelsOut = NULL;
     r->m_channelsAllocatedOut = 0;
-    AV_clear(r->m_methodCalls, r->m_numCalls);
-    r->m_methodCalls = NULL;
-    r->m_numCalls = 0;
+    CallsClear(r);
     r->m_numInvokes = 0;
 
     r->m_bPlaying = FALSE;
+    r->m_bConnected = FALSE;
     r->m_sb.sb_size = 0;
 
     r->m_msgCounter = 0;
     r->m_resplen = 0;
     r->m_unackd = 0;
+    r->m_pollEmpty = 0;
+    r->m_httpScan = r->m_httpHdr = r->m_httpLen = 0;
+    r->m_httpOutLen = 0;
+    r->m_paceHead = r->m_paceLen = 0;
+    if (!reconnect)
+    {
+        free(r->m_httpOut);
+        r->m_httpOut = NULL;
+        r->m_httpOutSize = 0;
+        free(r->m_paceOut);
+        r->m_paceOut = NULL;
+        r->m_paceSize = 0;
+    }
 
     if (r->Link.lFlags & RTMP_LF_FTCU && !reconnect)
     {
@@ -3395,24 +4198,107 @@ static void CloseInternal(RTMP *r, int reconnect)
     {
         free(r->Link.playpath0.av_val);
         r->Link.playpath0.av_val = NULL;
+        ClearCmdTemplates(r);
     }
 }
 
+struct RTMP_CAPTURE
+{
+    FILE *f;
+    uint64_t last;      /* arrival of the previous record */
+};
+
+static void CaptureRecord(RTMP_CAPTURE *c, const char *buf, int len)
+{
+    unsigned char hdr[20];
+    uint64_t now = RTMP_GetTimeUS(), v;
+    int n = 0, i;
+    for (i = 0; i < 2; i++)
+    {
+        v = i ? (uint64_t)len : now - c->last;
+        while (v >= 0x80)
+        {
+            hdr[n++] = (unsigned char)(v | 0x80);
+            v >>= 7;
+        }
+        hdr[n++] = (unsigned char)v;
+    }
+    c->last = now;
+    if (fwrite(hdr, 1, n, c->f) != (size_t)n || fwrite(buf, 1, len, c->f) != (size_t)len)
+        RTMP_Log(RTMP_LOGWARNING, "%s, capture write failed", __FUNCTION__);
+}
+
+static void CaptureClose(RTMPSockBuf *sb)
+{
+    if (sb->sb_capture)
+    {
+        fclose(sb->sb_capture->f);
+        free(sb->sb_capture);
+        sb->sb_capture = NULL;
+    }
+}
+
+int RTMP_CaptureOpen(RTMP *r, const char *path)
+{
+    RTMP_CAPTURE *c = calloc(1, sizeof(RTMP_CAPTURE));
+    if (!c || !(c->f = fopen(path, "wb")))
+    {
+        RTMP_Log(RTMP_LOGERROR, "%s, can't create %s", __FUNCTION__, path);
+        free(c);
+        return FALSE;
+    }
+    CaptureClose(&r->m_sb);
+    fwrite(RTMP_CAPTURE_MAGIC, 1, sizeof(RTMP_CAPTURE_MAGIC) - 1, c->f);
+    fputc(!r->m_nBytesIn, c->f);  /* handshake follows */
+    c->last = RTMP_GetTimeUS();
+    if (r->m_sb.sb_size > 0)
+        CaptureRecord(c, r->m_sb.sb_start, r->m_sb.sb_size);
+    r->m_sb.sb_capture = c;
+    return TRUE;
+}
+
+/* what a read gets without waiting on the socket, poll() sees neither part */
+int RTMPSockBuf_Pending(RTMPSockBuf *sb)
+{
+    int n = sb->sb_size;
+#ifdef CRYPTO
+    if (sb->sb_ssl)
+        n += TLS_pending(sb->sb_ssl);
+#endif
+    return n;
+}
+
 int RTMPSockBuf_Fill(RTMPSockBuf *sb)
 {
     int nBytes;
 
     if (!sb->sb_size)
         sb->sb_start = sb->sb_buf;
+    else if (sb->sb_start + sb->sb_size >= sb->sb_buf + sizeof(sb->sb_buf) - 1)
+    {   /* no room behind a partial message, move it to the front */
+        memmove(sb->sb_buf, sb->sb_start, sb->sb_size);
+        sb->sb_start = sb->sb_buf;
+    }
 
     while (1)
     {
         nBytes = sizeof(sb->sb_buf) - 1 - sb->sb_size - (sb->sb_start - sb->sb_buf);
+        RTMP_STAT_ADD(&sb->sb_recvs, 1);
+        if (sb->sb_transport)
+            nBytes = sb->sb_transport->recv(sb, sb->sb_start + sb->sb_size, nBytes);
+        else
         {
+#ifdef CRYPTO
+            if (sb->sb_ssl)
+                nBytes = TLS_read(sb->sb_ssl, sb->sb_start + sb->sb_size, nBytes);
+            else
+#endif
             nBytes = recv(sb->sb_socket, sb->sb_start + sb->sb_size, nBytes, 0);
         }
         if (nBytes != -1)
         {
+            if (sb->sb_capture && nBytes > 0)
+                CaptureRecord(sb->sb_capture, sb->sb_start + sb->sb_size, nBytes);
             sb->sb_size += nBytes;
         } else
         {
@@ -3435,16 +4321,149 @@ int RTMPSockBuf_Fill(RTMPSockBuf *sb)
 
 int RTMPSockBuf_Send(RTMPSockBuf *sb, const char *buf, int len)
 {
+    RTMP_STAT_ADD(&sb->sb_sends, 1);
+    if (sb->sb_transport)
+        return sb->sb_transport->send(sb, buf, len);
+#ifdef CRYPTO
+    if (sb->sb_ssl && !sb->sb_ktls)
+        return TLS_write(sb->sb_ssl, buf, len);
+#endif
     return send(sb->sb_socket, buf, len, 0);
 }
 
 int RTMPSockBuf_Close(RTMPSockBuf *sb)
 {
+    if (sb->sb_transport)
+    {
+        sb->sb_transport->close(sb);
+        sb->sb_transport = NULL;
+        sb->sb_tctx = NULL;
+    }
+#ifdef CRYPTO
+    if (sb->sb_ssl)
+    {
+        TLS_shutdown(sb->sb_ssl);
+        TLS_close(sb->sb_ssl);
+        sb->sb_ssl = NULL;
+        sb->sb_ktls = FALSE;
+    }
+#endif
     if (sb->sb_socket != -1)
         return closesocket(sb->sb_socket);
     return 0;
 }
 
+#ifdef CRYPTO
+/* TLS backend */
+
+static void TLS_Init(void)
+{
+    SSL_load_error_strings();
+    SSL_library_init();
+    RTMP_TLS_ctx = SSL_CTX_new(TLS_client_method());
+    if (!RTMP_TLS_ctx)
+        return;
+    SSL_CTX_set_min_proto_version(RTMP_TLS_ctx, TLS1_2_VERSION);
+    SSL_CTX_set_default_verify_paths(RTMP_TLS_ctx);
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL_CTX_set_options(RTMP_TLS_ctx, SSL_OP_ENABLE_KTLS);
+#endif
+}
+
+/* kernel TLS is negotiated by the library when the cipher and kernel allow it */
+static void TLS_CheckKTLS(RTMPSockBuf *sb)
+{
+    sb->sb_ktls = TLS_ktls_send((SSL *)sb->sb_ssl) ? TRUE : FALSE;
+    RTMP_Log(RTMP_LOGDEBUG, "%s, %s, kTLS send %s", __FUNCTION__,
+             SSL_get_version(sb->sb_ssl), sb->sb_ktls ? "on" : "off");
+}
+
+static int TLS_Connect(RTMP *r)
+{
+    char host[256];
+    SSL *ssl;
+    int bIP;
+
+    if (!RTMP_TLS_ctx || r->Link.hostname.av_len >= (int)sizeof(host))
+        return FALSE;
+    memcpy(host, r->Link.hostname.av_val, r->Link.hostname.av_len);
+    host[r->Link.hostname.av_len] = '\0';
+
+    TLS_client(RTMP_TLS_ctx, r->m_sb.sb_ssl);
+    ssl = r->m_sb.sb_ssl;
+    if (!ssl)
+        return FALSE;
+    TLS_setfd(ssl, r->m_sb.sb_socket);
+    bIP = X509_VERIFY_PARAM_set1_ip_asc(SSL_get0_param(ssl), host);
+    if (!bIP)
+        SSL_set_tlsext_host_name(ssl, host);    /* SNI is for names only */
+    if (!(r->Link.lFlags & RTMP_LF_NOVF))
+    {
+        if (!bIP && !X509_VERIFY_PARAM_set1_host(SSL_get0_param(ssl), host, 0))
+            return FALSE;
+        SSL_set_verify(ssl, SSL_VERIFY_PEER, NULL);
+    }
+    if (TLS_connect(ssl) <= 0)
+    {
+        RTMP_Log(RTMP_LOGERROR, "%s, TLS_Connect failed: %s", __FUNCTION__,
+                 ERR_reason_error_string(ERR_get_error()));
+        return FALSE;
+    }
+    TLS_CheckKTLS(&r->m_sb);
+    return TRUE;
+}
+#endif
+
+int RTMP_TLS_Accept(RTMP *r, void *ctx)
+{
+#ifdef CRYPTO
+    TLS_server((TLS_CTX)ctx, r->m_sb.sb_ssl);
+    if (!r->m_sb.sb_ssl)
+        return FALSE;
+    TLS_setfd(r->m_sb.sb_ssl, r->m_sb.sb_socket);
+    if (TLS_accept(r->m_sb.sb_ssl) <= 0)
+    {
+        RTMP_Log(RTMP_LOGERROR, "%s, TLS_Accept failed", __FUNCTION__);
+        return FALSE;
+    }
+    TLS_CheckKTLS(&r->m_sb);
+    return TRUE;
+#else
+    return FALSE;
+#endif
+}
+
+void *RTMP_TLS_AllocServerContext(const char* cert, const char* key)
+{
+    void *ctx = NULL;
+#ifdef CRYPTO
+    TLS_INIT();
+    ctx = SSL_CTX_new(TLS_server_method());
+    if (!ctx)
+        return NULL;
+    SSL_CTX_set_min_proto_version(ctx, TLS1_2_VERSION);
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+#endif
+    if (!SSL_CTX_use_certificate_chain_file(ctx, cert) ||
+        !SSL_CTX_use_PrivateKey_file(ctx, key, SSL_FILETYPE_PEM))
+    {
+        RTMP_Log(RTMP_LOGERROR, "%s, can't load certificate %s or key %s", __FUNCTION__, cert, key);
+        SSL_CTX_free(ctx);
+        return NULL;
+    }
+#endif
+    return ctx;
+}
+
+void RTMP_TLS_FreeServerContext(void *ctx)
+{
+#ifdef CRYPTO
+    SSL_CTX_free(ctx);
+#endif
+}
+
+
 #define HEX2BIN(a) (((a) & 0x40) ? ((a) & 0xf) + 9 : ((a) & 0xf))
 
 static void DecodeTEA(AVal *key, AVal *text)
@@ -3515,10 +4534,19 @@ static void DecodeTEA(AVal *key, AVal *text)
     free(out);
 }
 
+/* Posts are written as one buffer: the body sits in m_httpOut behind
+ * RTMPT_HDR_ROOM bytes and the header is copied right in front of it. */
 static int HTTP_Post(RTMP *r, RTMPTCmd cmd, const char *buf, int len)
 {
-    char hbuf[512];
-    int hlen = snprintf(hbuf, sizeof(hbuf),
+    char hbuf[RTMPT_HDR_ROOM], *out;
+    int hlen, n;
+
+    if (buf != r->m_httpOut + RTMPT_HDR_ROOM)
+    {   /* queued sends keep their place in front of other commands */
+        if ((r->m_httpOutLen && HTTP_Flush(r) < 0) || !HTTP_Queue(r, buf, len))
+            return -1;
+    }
+    hlen = snprintf(hbuf, sizeof(hbuf),
         "POST /%s%s/%d HTTP/1.1\r\n"
         "Host: %.*s:%d\r\n"
         "Accept: */*\r\n"
@@ -3530,53 +4558,171 @@ static int HTTP_Post(RTMP *r, RTMPTCmd cmd, const char *buf, int len)
         r->m_clientID.av_val ? r->m_clientID.av_val : "",
         r->m_msgCounter, r->Link.hostname.av_len, r->Link.hostname.av_val,
         r->Link.port, len);
-    if (RTMPSockBuf_Send(&r->m_sb, hbuf, hlen) < 0)
+    r->m_httpOutLen = 0;
+    if (hlen < 0 || hlen >= (int)sizeof(hbuf))
         return -1;
-    hlen = RTMPSockBuf_Send(&r->m_sb, buf, len);
+    out = r->m_httpOut + RTMPT_HDR_ROOM - hlen;
+    memcpy(out, hbuf, hlen);
     r->m_msgCounter++;
     r->m_unackd++;
-    return hlen;
+
+    n = hlen + len;
+    while (n > 0)
+    {
+        int nBytes = RTMPSockBuf_Send(&r->m_sb, out, n);
+        if (nBytes < 0)
+        {
+            if (GetSockError() == EINTR && !RTMP_ctrlC)
+                continue;
+            return -1;
+        }
+        out += nBytes;
+        n -= nBytes;
+    }
+    return len;
+}
+
+static int HTTP_Queue(RTMP *r, const char *buf, int len)
+{
+    if (RTMPT_HDR_ROOM + r->m_httpOutLen + len > r->m_httpOutSize)
+    {
+        int nSize = RTMPT_HDR_ROOM + r->m_httpOutLen + len + RTMPT_BATCH_MAX;
+        char *out = realloc(r->m_httpOut, nSize);
+        if (!out)
+            return FALSE;
+        r->m_httpOut = out;
+        r->m_httpOutSize = nSize;
+    }
+    if (!r->m_httpOutLen)
+        r->m_batchStart = RTMP_GetTimeUS();
+    memcpy(r->m_httpOut + RTMPT_HDR_ROOM + r->m_httpOutLen, buf, len);
+    r->m_httpOutLen += len;
+    return TRUE;
+}
+
+static int HTTP_Flush(RTMP *r)
+{
+    if (!r->m_httpOutLen)
+        return 0;
+    return HTTP_Post(r, RTMPT_SEND, r->m_httpOut + RTMPT_HDR_ROOM, r->m_httpOutLen);
+}
+
+/* the queue has been held for the batching interval or has grown too big */
+static int HTTP_Due(RTMP *r)
+{
+    return !r->m_batchMS || r->m_httpOutLen >= RTMPT_BATCH_MAX ||
+        RTMP_GetTimeUS() - r->m_batchStart >= (uint64_t)r->m_batchMS*1000;
+}
+
+int RTMP_Flush(RTMP *r)
+{
+    if (r->m_paceHead < r->m_paceLen)
+        return PaceDrain(r, FALSE);
+    if (!(r->Link.protocol & RTMP_FEATURE_HTTP) || !r->m_httpOutLen || !HTTP_Due(r))
+        return TRUE;
+    if (HTTP_Flush(r) < 0)
+    {
+        RTMP_Log(RTMP_LOGERROR, "%s, RTMPT send error %d", __FUNCTION__, GetSockError());
+        RTMP_Close(r);
+        return FALSE;
+    }
+    return TRUE;
 }
 
+int RTMP_FlushWait(RTMP *r)
+{
+    uint64_t now, due;
+    if (r->m_paceHead < r->m_paceLen)
+        due = r->m_paceNext;
+    else if ((r->Link.protocol & RTMP_FEATURE_HTTP) && r->m_httpOutLen)
+        due = r->m_batchStart + (uint64_t)r->m_batchMS*1000;
+    else
+        return -1;
+    now = RTMP_GetTimeUS();
+    return due > now ? (int)((due - now + 999)/1000) : 0;
+}
+
+/* Makes sure a response is on its way before waiting for data. Queued sends
+ * serve as the poll. While the server keeps answering with data a second
+ * idle request stays in flight, so the next answer is already on the wire.
+ * Empty answers back off exponentially, capped by the server polling hint.
+ * The back-off is time the read spends waiting like on a socket, so from the
+ * first empty answer *idleEnd bounds it by Link.timeout; returns -2 once that
+ * passed without data, as a socket timeout would. */
+static int HTTP_Poll(RTMP *r, uint64_t *idleEnd)
+{
+    if (r->m_httpOutLen)
+        return HTTP_Flush(r);
+    if (r->m_unackd >= (r->m_pollEmpty ? 1 : RTMPT_MAX_INFLIGHT))
+        return 0;
+    if (r->m_pollEmpty)
+    {
+        uint64_t now = RTMP_GetTimeUS();
+        int ms = RTMPT_POLL_UNIT << (r->m_pollEmpty < 6 ? r->m_pollEmpty - 1 : 5);
+        if (ms > r->m_polling*RTMPT_POLL_UNIT)
+            ms = r->m_polling*RTMPT_POLL_UNIT;
+        if (!*idleEnd && r->Link.timeout > 0)
+            *idleEnd = now + (uint64_t)r->Link.timeout*1000000;
+        if (*idleEnd && now + (uint64_t)ms*1000 >= *idleEnd)
+            return -2;
+        if (ms > 0)
+            msleep(ms);
+    }
+    return HTTP_Post(r, RTMPT_IDLE, "", 1);
+}
+
+/* Header lines are parsed once as they arrive, m_httpScan keeps the offset
+ * of the first line not seen yet across partial reads. */
 static int HTTP_read(RTMP *r, int fill)
 {
-    char *ptr;
+    char *ptr, *end;
     int hlen;
 
 restart:
-    if (fill)
-        RTMPSockBuf_Fill(&r->m_sb);
-    if (r->m_sb.sb_size < 13)
-    {
-        if (fill)
-            goto restart;
-        return -2;
-    }
-    if (strncmp(r->m_sb.sb_start, "HTTP/1.1 200 ", 13))
+    if (fill && RTMPSockBuf_Fill(&r->m_sb) < 1)
         return -1;
-    r->m_sb.sb_start[r->m_sb.sb_size] = '\0';
-    if (!strstr(r->m_sb.sb_start, "\r\n\r\n"))
+    if (r->m_sb.sb_size < 13)
     {
         if (fill)
             goto restart;
         return -2;
     }
-
-    ptr = r->m_sb.sb_start + sizeof("HTTP/1.1 200");
-    while ((ptr = strstr(ptr, "Content-")))
+    end = r->m_sb.sb_start + r->m_sb.sb_size;
+    if (!r->m_httpHdr)
     {
-        if (!strncasecmp(ptr + 8, "length:", 7))
-            break;
-        ptr += 8;
+        if (!r->m_httpScan)
+        {
+            if (strncmp(r->m_sb.sb_start, "HTTP/1.1 200 ", 13))
+                return -1;
+            r->m_httpScan = 12;     /* rest of the status line */
+        }
+        ptr = r->m_sb.sb_start + r->m_httpScan;
+        for (;;)
+        {
+            char *eol = memchr(ptr, '\n', end - ptr);
+            if (!eol)
+            {
+                r->m_httpScan = ptr - r->m_sb.sb_start;
+                if (fill)
+                    goto restart;
+                return -2;
+            }
+            if (eol == ptr || (eol == ptr + 1 && *ptr == '\r'))
+            {
+                ptr = eol + 1;
+                break;
+            }
+            if (eol - ptr > 15 && !strncasecmp(ptr, "Content-length:", 15))
+                r->m_httpLen = atoi(ptr + 15);
+            ptr = eol + 1;
+        }
+        r->m_httpHdr = ptr - r->m_sb.sb_start;
+        if (r->m_httpLen <= 0)
+            return -1;
     }
-    if (!ptr)
-        return -1;
-    hlen = atoi(ptr + 16);
-    ptr = strstr(ptr + 16, "\r\n\r\n");
-    if (!ptr)
-        return -1;
-    ptr += 4;
-    if (ptr + (r->m_clientID.av_val ? 1 : hlen) > r->m_sb.sb_start + r->m_sb.sb_size)
+    ptr = r->m_sb.sb_start + r->m_httpHdr;
+    hlen = r->m_httpLen;
+    if (ptr + (r->m_clientID.av_val ? 1 : hlen) > end)
     {
         if (fill)
             goto restart;
@@ -3585,6 +4731,7 @@ restart:
     r->m_sb.sb_size -= ptr - r->m_sb.sb_start;
     r->m_sb.sb_start = ptr;
     r->m_unackd--;
+    r->m_httpScan = r->m_httpHdr = r->m_httpLen = 0;
 
     if (!r->m_clientID.av_val)
     {
@@ -3600,6 +4747,7 @@ restart:
     {
         r->m_polling = *ptr++;
         r->m_resplen = hlen - 1;
+        r->m_pollEmpty = r->m_resplen ? 0 : r->m_pollEmpty + 1;
         r->m_sb.sb_start++;
         r->m_sb.sb_size--;
     }
@@ -3677,7 +4825,10 @@ static int Read_1_Packet(RTMP *r, char *buf, unsigned int buflen)
                 if (r->m_read.nMetaHeaderSize > 0 && packet.m_packetType == RTMP_PACKET_TYPE_INFO)
                 {
                     AMFObject metaObj;
-                    int nRes = AMF_Decode(&metaObj, packetBody, nPacketLen, FALSE);
+                    char scratch[AMF_SCRATCH_SIZE];
+                    AMFArena arena;
+                    AMF_ArenaInit(&arena, scratch, sizeof(scratch));
+                    int nRes = AMF_DecodeArena(&metaObj, packetBody, nPacketLen, FALSE, &arena);
                     if (nRes >= 0)
                     {
                         AVal metastring;
@@ -3692,10 +4843,10 @@ static int Read_1_Packet(RTMP *r, char *buf, unsigned int buflen)
                                 ret = RTMP_READ_ERROR;
                             }
                         }
-                        AMF_Reset(&metaObj);
-                        if (ret == RTMP_READ_ERROR)
-                            break;
                     }
+                    AMF_ArenaFree(&arena);
+                    if (ret == RTMP_READ_ERROR)
+                        break;
                 }
 
                 /* check first keyframe to make sure we got the right position
@@ -3832,6 +4983,7 @@ stopKeyframeSearch:
             {
                 RTMP_Log(RTMP_LOGWARNING, "Stream does not start with requested frame, ignoring data... ");
                 r->m_read.nIgnoredFrameCounter++;
+                RTMP_STAT_ADD(&r->m_stats.s_dropped, 1);
                 if (r->m_read.nIgnoredFrameCounter > MAX_IGNORED_FRAMES)
                     ret = RTMP_READ_ERROR;    /* fatal error, couldn't continue stream */
                 else
@@ -3843,6 +4995,7 @@ stopKeyframeSearch:
             {
                 RTMP_Log(RTMP_LOGWARNING, "Stream does not start with requested FLV frame, ignoring data... ");
                 r->m_read.nIgnoredFlvFrameCounter++;
+                RTMP_STAT_ADD(&r->m_stats.s_dropped, 1);
                 if (r->m_read.nIgnoredFlvFrameCounter > MAX_IGNORED_FRAMES)
                     ret = RTMP_READ_ERROR;
                 else
@@ -3999,9 +5152,7 @@ stopKeyframeSearch:
 
                     if (prevTagSize != (dataSize + 11))
                     {
-#ifdef _DEBUG
                         RTMP_Log(RTMP_LOGWARNING, "Tag and data size are not consitent, writing tag size according to dataSize+11: %d", dataSize + 11);
-#endif
 
                         prevTagSize = dataSize + 11;
                         AMF_EncodeInt32(ptr + pos + 11 + dataSize, pend, prevTagSize);
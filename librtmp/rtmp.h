@@ -44,6 +44,7 @@ extern "C"
 #define RTMP_FEATURE_MFP    0x08    /* not yet supported */
 #define RTMP_FEATURE_WRITE  0x10    /* publish, not play */
 #define RTMP_FEATURE_HTTP2  0x20    /* server-side rtmpt */
+#define RTMP_FEATURE_UNIX   0x40    /* Unix domain socket, its path is Link.hostname */
 
 #define RTMP_PROTOCOL_UNDEFINED -1
 #define RTMP_PROTOCOL_RTMP      0
@@ -53,6 +54,7 @@ extern "C"
 #define RTMP_PROTOCOL_RTMPTE    (RTMP_FEATURE_HTTP|RTMP_FEATURE_ENC)
 #define RTMP_PROTOCOL_RTMPTS    (RTMP_FEATURE_HTTP|RTMP_FEATURE_SSL)
 #define RTMP_PROTOCOL_RTMFP     RTMP_FEATURE_MFP
+#define RTMP_PROTOCOL_RTMP_UNIX RTMP_FEATURE_UNIX
 
 #define RTMP_DEFAULT_CHUNKSIZE  128
 
@@ -120,6 +122,9 @@ typedef struct RTMPPacket
     char *m_body;
 } RTMPPacket;
 
+typedef struct RTMP_CAPTURE RTMP_CAPTURE;
+typedef struct RTMP_TRANSPORT RTMP_TRANSPORT;
+
 typedef struct RTMPSockBuf
 {
     int sb_socket;
@@ -128,8 +133,25 @@ typedef struct RTMPSockBuf
     char sb_buf[RTMP_BUFFER_CACHE_SIZE];    /* data read from socket */
     int sb_timedout;
     void *sb_ssl;
+    int sb_ktls;           /* kernel encrypts sends, they bypass the TLS library */
+    uint64_t sb_recvs;     /* recv/read calls, for RTMP_GetStats */
+    uint64_t sb_sends;
+    RTMP_CAPTURE *sb_capture;  /* inbound bytes are recorded, see RTMP_CaptureOpen */
+    const RTMP_TRANSPORT *sb_transport;    /* NULL for sb_socket, with TLS when sb_ssl is set */
+    void *sb_tctx;
 } RTMPSockBuf;
 
+/* I/O under the chunk stream for connections without a socket. recv and
+ * send return bytes moved, or -1 on error with errno set. recv returns 0 at
+ * eof, or on timeout after setting sb_timedout. close releases sb_tctx. */
+struct RTMP_TRANSPORT
+{
+    const char *name;
+    int (*recv)(RTMPSockBuf *sb, char *buf, int len);
+    int (*send)(RTMPSockBuf *sb, const char *buf, int len);
+    void (*close)(RTMPSockBuf *sb);
+};
+
 void RTMPPacket_Reset(RTMPPacket *p);
 void RTMPPacket_Dump(RTMPPacket *p);
 int RTMPPacket_Alloc(RTMPPacket *p, uint32_t nSize);
@@ -137,6 +159,19 @@ void RTMPPacket_Free(RTMPPacket *p);
 
 #define RTMPPacket_IsReady(a)    ((a)->m_nBytesRead == (a)->m_nBodySize)
 
+/* socket tuning applied by RTMP_Connect0 and RTMP_Accept, 0 keeps the
+ * system default. Besides the buffer sizes these are Linux options,
+ * TCP_NOTSENT_LOWAT also exists on macOS, elsewhere they are ignored. */
+typedef struct RTMP_SOCKOPTS
+{
+    int sndbuf;             /* SO_SNDBUF bytes */
+    int rcvbuf;             /* SO_RCVBUF bytes */
+    int notsentLowat;       /* TCP_NOTSENT_LOWAT, unsent bytes the kernel queues */
+    int pacingRate;         /* SO_MAX_PACING_RATE bytes per second, smooth with the fq qdisc */
+    int busyPoll;           /* SO_BUSY_POLL microseconds */
+    char congestion[16];    /* TCP_CONGESTION, e.g. "bbr" */
+} RTMP_SOCKOPTS;
+
 typedef struct RTMP_LNK
 {
     AVal hostname;
@@ -168,6 +203,8 @@ typedef struct RTMP_LNK
 #define RTMP_LF_BUFX    0x0010    /* toggle stream on BufferEmpty msg */
 #define RTMP_LF_FTCU    0x0020    /* free tcUrl on close */
 #define RTMP_LF_FAPU    0x0040    /* free app on close */
+#define RTMP_LF_NOVF    0x0080    /* skip TLS certificate verification */
+#define RTMP_LF_HOLD    0x0100    /* stop after connect _result until RTMP_ResumeConnect */
     int lFlags;
 
     int swfAge;
@@ -180,6 +217,8 @@ typedef struct RTMP_LNK
     unsigned short socksport;
     unsigned short port;
 
+    RTMP_SOCKOPTS sockopts;
+
   } RTMP_LNK;
 
 /* state for read() wrapper */
@@ -214,12 +253,77 @@ typedef struct RTMP_READ
     uint32_t nIgnoredFlvFrameCounter;
 } RTMP_READ;
 
+/* pre-encoded command body, only the transaction id is patched per send */
+typedef struct RTMP_CMDTEMPLATE
+{
+    char *t_body;
+    int t_size;
+    int t_txn;      /* offset of the transaction id number */
+} RTMP_CMDTEMPLATE;
+
+#define RTMP_CMD_TEMPLATES 8
+
 typedef struct RTMP_METHOD
 {
-    AVal name;
-    int num;
+    int num;        /* transaction id */
+    int method;     /* interned method id, 0 marks a free slot */
 } RTMP_METHOD;
 
+/* Counters have a single writer each (the thread doing I/O on the connection,
+ * or the player thread for delivery), so an update is a relaxed load and store
+ * rather than a locked add. Any thread may read them, see RTMP_GetStats. */
+#if defined(__GNUC__) || defined(__clang__)
+#define RTMP_STAT_LOAD(p)       __atomic_load_n((p), __ATOMIC_RELAXED)
+#define RTMP_STAT_SET(p, v)     __atomic_store_n((p), (v), __ATOMIC_RELAXED)
+#else
+#define RTMP_STAT_LOAD(p)       (*(volatile uint64_t *)(p))
+#define RTMP_STAT_SET(p, v)     (*(volatile uint64_t *)(p) = (v))
+#endif
+#define RTMP_STAT_ADD(p, n)     RTMP_STAT_SET((p), RTMP_STAT_LOAD(p) + (uint64_t)(n))
+
+/* latency histogram in microseconds, RTMP_HIST_SUB linear buckets per power
+ * of two, so a bucket is never wider than 1/RTMP_HIST_SUB of its value */
+#define RTMP_HIST_SUB_BITS  3
+#define RTMP_HIST_SUB       (1 << RTMP_HIST_SUB_BITS)
+#define RTMP_HIST_BUCKETS   ((33 - RTMP_HIST_SUB_BITS) * RTMP_HIST_SUB)
+
+typedef struct RTMP_HIST
+{
+    uint64_t h_count;
+    uint64_t h_sum;
+    uint64_t h_max;
+    uint64_t h_bucket[RTMP_HIST_BUCKETS];
+} RTMP_HIST;
+
+#define RTMP_STATS_TYPES    0x17    /* per type counters, other types land in slot 0 */
+
+typedef struct RTMP_STATS
+{
+    uint64_t s_bytesIn;
+    uint64_t s_bytesOut;
+    uint64_t s_msgsIn[RTMP_STATS_TYPES];
+    uint64_t s_msgsOut[RTMP_STATS_TYPES];
+    uint64_t s_msgBytesIn[RTMP_STATS_TYPES];    /* message body bytes by type */
+    uint64_t s_msgBytesOut[RTMP_STATS_TYPES];
+    uint64_t s_chunksIn;
+    uint64_t s_chunksOut;
+    uint64_t s_recvCalls;       /* filled in from RTMPSockBuf by RTMP_GetStats */
+    uint64_t s_sendCalls;
+    uint64_t s_allocs;          /* packet bodies and send buffers */
+    uint64_t s_queueDepth;      /* packets received but not yet delivered */
+    uint64_t s_queueMax;
+    uint64_t s_dropped;         /* media frames discarded before delivery or send */
+    uint64_t s_reconnects;
+    uint64_t s_sndbuf;          /* socket options as the kernel took them, see RTMP_SOCKOPTS */
+    uint64_t s_rcvbuf;
+    uint64_t s_notsentLowat;
+    uint64_t s_pacingRate;      /* 0 for unlimited */
+    uint64_t s_busyPoll;
+    RTMP_HIST s_write;          /* one WriteN, first byte to last byte accepted */
+    RTMP_HIST s_deliver;        /* message read complete to user callback */
+    RTMP_HIST s_rtt;            /* ping request to pong */
+} RTMP_STATS;
+
 typedef struct RTMP
 {
     int m_inChunkSize;
@@ -239,10 +343,15 @@ typedef struct RTMP
     uint8_t m_bPlaying;
     uint8_t m_bSendEncoding;
     uint8_t m_bSendCounter;
+    uint8_t m_bConnected;    /* connect _result received */
 
     int m_numInvokes;
     int m_numCalls;
-    RTMP_METHOD *m_methodCalls;    /* remote method calls queue */
+    int m_callsSize;                /* power of two */
+    RTMP_METHOD *m_methodCalls;    /* remote method calls, open addressed by txn */
+    int m_numCallNames;
+    AVal *m_callNames;             /* interned names of methods without a static id */
+    RTMP_CMDTEMPLATE m_cmdTemplates[RTMP_CMD_TEMPLATES];    /* kept across reconnects */
 
     int m_channelsAllocatedIn;
     int m_channelsAllocatedOut;
@@ -261,13 +370,40 @@ typedef struct RTMP
     int m_resplen;
     int m_unackd;
     AVal m_clientID;
-
+    int m_pollEmpty;         /* idle polls in a row answered without data */
+    int m_httpScan;          /* response header bytes parsed so far */
+    int m_httpHdr;           /* header size once complete */
+    int m_httpLen;           /* Content-Length, 0 if not seen yet */
+    int m_batchMS;           /* RTMPT send batching interval, 0 posts every write */
+    uint64_t m_batchStart;   /* RTMP_GetTimeUS of the oldest queued send */
+    char *m_httpOut;         /* queued RTMPT_SEND body, behind room for the header */
+    int m_httpOutLen;
+    int m_httpOutSize;
+
+    int m_pingMS;            /* ping interval for RTT stats, 0 disables */
+    uint32_t m_pingStamp;    /* microsecond stamp of the unanswered ping */
+    int m_pingPending;
+    uint64_t m_pingLast;
+
+    int m_paceRate;          /* bytes per second audio and video are paced at when the kernel can't */
+    uint64_t m_paceNext;     /* microsecond stamp the next paced chunk is due */
+    char *m_paceOut;         /* held chunks, each behind its int size */
+    int m_paceHead;          /* offset of the oldest held chunk */
+    int m_paceLen;
+    int m_paceSize;
+
+    RTMP_STATS m_stats;
+    unsigned m_connId;       /* process unique, tags log records */
+    char m_congestion[16];   /* TCP_CONGESTION in effect, empty if unknown */
     RTMP_READ m_read;
     RTMPPacket m_write;
     RTMPSockBuf m_sb;
     RTMP_LNK Link;
 } RTMP;
 
+/* rtmp+unix:///run/rtmp.sock/app/playpath: the socket path is the longest
+ * prefix naming an existing socket, or the whole path when none does.
+ * rtmp+unix://@name/app/playpath is a Linux abstract socket. */
 int RTMP_ParseURL(const char *url, int *protocol, AVal *host, unsigned int *port, AVal *playpath, AVal *app);
 
 void RTMP_ParsePlaypath(AVal *in, AVal *out);
@@ -286,8 +422,19 @@ struct sockaddr;
 int RTMP_Connect0(RTMP *r, struct sockaddr *svc);
 int RTMP_Connect1(RTMP *r, RTMPPacket *cp);
 int RTMP_Serve(RTMP *r);
+
+/* Server side: RTMP_Listen binds rtmp://[host][:port] (any address when the
+ * host is empty, port 1935 when omitted) or rtmp+unix://path, replacing a
+ * stale socket file. Returns the listening socket or -1. RTMP_Accept takes
+ * the next connection into r, which then runs RTMP_Serve. */
+int RTMP_Listen(const char *url);
+int RTMP_Accept(RTMP *r, int listenfd);
 int RTMP_TLS_Accept(RTMP *r, void *ctx);
 
+/* Over RTMPT an idle read keeps polling, backing off between empty answers
+ * up to the server polling hint. The back-off sleeps in the reading thread
+ * and counts against Link.timeout: with no data for that long the read
+ * fails with RTMP_IsTimedout set, the connection stays open. */
 int RTMP_ReadPacket(RTMP *r, RTMPPacket *packet);
 int RTMP_SendPacket(RTMP *r, RTMPPacket *packet, int queue);
 int RTMP_SendChunk(RTMP *r, RTMPChunk *chunk);
@@ -298,6 +445,12 @@ double RTMP_GetDuration(RTMP *r);
 int RTMP_ToggleStream(RTMP *r);
 
 int RTMP_ConnectStream(RTMP *r, int seekTime);
+/* Warm connections: with RTMP_LF_HOLD the connect _result sends nothing,
+ * RTMP_WaitConnect reads up to it. RTMP_ResumeConnect then sends the
+ * stream setup for playpath (taking its malloc'ed av_val, NULL keeps the
+ * URL one) and RTMP_ConnectStream completes as usual. */
+int RTMP_WaitConnect(RTMP *r);
+int RTMP_ResumeConnect(RTMP *r, AVal *playpath);
 int RTMP_ReconnectStream(RTMP *r, int seekTime);
 void RTMP_DeleteStream(RTMP *r);
 int RTMP_GetNextMediaPacket(RTMP *r, RTMPPacket *packet);
@@ -315,7 +468,53 @@ void RTMP_TLS_FreeServerContext(void *ctx);
 int RTMP_LibVersion(void);
 void RTMP_UserInterrupt(void);    /* user typed Ctrl-C */
 
+/* bytes per second for the open connection and later ones, 0 turns pacing off;
+ * SO_MAX_PACING_RATE on TCP. Elsewhere audio and video chunks are held and go
+ * out as they come due at the rate, other messages are never held back. */
+void RTMP_SetPacing(RTMP *r, int rate);
+/* sends what was held and is due by now: RTMPT sends after the rtmptBatch
+ * interval, paced chunks at the pacing rate; the next write, read or command
+ * does the same on its own. Holding more than a second at the pacing rate
+ * sends the oldest chunks right away. */
+int RTMP_Flush(RTMP *r);
+/* milliseconds until RTMP_Flush has more to send, 0 if due now, -1 with
+ * nothing held; suits as a poll() timeout */
+int RTMP_FlushWait(RTMP *r);
+
 int RTMP_SendCtrl(RTMP *r, short nType, unsigned int nObject, unsigned int nTime);
+int RTMP_SendPing(RTMP *r);
+
+/* monotonic clock for stats, unlike RTMP_GetTime it is live in _DEBUG builds */
+uint64_t RTMP_GetTimeUS(void);
+/* consistent per counter, not across counters, safe while another thread does I/O */
+void RTMP_GetStats(RTMP *r, RTMP_STATS *stats);
+void RTMP_HistAdd(RTMP_HIST *h, uint64_t us);
+/* upper bound of the bucket holding the given percentile (0..100) */
+uint64_t RTMP_HistPercentile(const RTMP_HIST *h, double pct);
+
+/* Capture file: RTMP_CAPTURE_MAGIC, a byte set when the handshake was
+ * captured too, then one record per RTMPSockBuf_Fill holding varint
+ * microseconds since the previous record, varint length and the bytes.
+ * Open a capture before RTMP_Connect/RTMP_Serve or once either returned,
+ * bytes already buffered become the first record. Capturing stops when the
+ * connection closes or reconnects. Bytes are recorded after TLS, RTMPT
+ * captures hold the HTTP framing and can't be replayed.
+ * A replayed connection parses the file through RTMP_ReadPacket and
+ * RTMP_ClientPacket without a socket, sends are discarded. With realtime
+ * records are released at their recorded offsets, otherwise back to back.
+ * Reading past the last record closes the connection like a peer eof. */
+#define RTMP_CAPTURE_MAGIC "RTMPCAP1"
+int RTMP_CaptureOpen(RTMP *r, const char *path);
+int RTMP_ReplayOpen(RTMP *r, const char *path, int realtime);
+
+/* Connects two RTMP in this process, one runs RTMP_Connect1 and the other
+ * RTMP_Serve. RTMP_Pipe copies through a pair of in-memory rings of size
+ * bytes rounded up to a power of two (0 for RTMP_PIPE_SIZE) and never
+ * enters the kernel, RTMP_SocketPair uses a Unix domain socket pair.
+ * Reads time out after Link.timeout. */
+#define RTMP_PIPE_SIZE (256*1024)
+int RTMP_Pipe(RTMP *a, RTMP *b, int size);
+int RTMP_SocketPair(RTMP *a, RTMP *b);
 
 /* caller probably doesn't know current timestamp, should
  * just use RTMP_Pause instead
@@ -325,6 +524,7 @@ int RTMP_Pause(RTMP *r, int DoPause);
 
 int RTMP_FindFirstMatchingProperty(AMFObject *obj, const AVal *name, AMFObjectProperty * p);
 
+int RTMPSockBuf_Pending(RTMPSockBuf *sb);
 int RTMPSockBuf_Fill(RTMPSockBuf *sb);
 int RTMPSockBuf_Send(RTMPSockBuf *sb, const char *buf, int len);
 int RTMPSockBuf_Close(RTMPSockBuf *sb);
@@ -333,6 +533,7 @@ int RTMP_SendCreateStream(RTMP *r);
 int RTMP_SendSeek(RTMP *r, int dTime);
 int RTMP_SendServerBW(RTMP *r);
 int RTMP_SendClientBW(RTMP *r);
+/* drops the i-th oldest pending call, freeit is kept for compatibility and ignored */
 void RTMP_DropRequest(RTMP *r, int i, int freeit);
 int RTMP_Read(RTMP *r, char *buf, int size);
 int RTMP_Write(RTMP *r, const char *buf, int size);
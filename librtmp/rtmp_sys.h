@@ -51,7 +51,9 @@
 #else /* !_WIN32 */
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/times.h>
+#include <sys/un.h>
 #include <netdb.h>
 #include <unistd.h>
 #include <netinet/in.h>
@@ -65,6 +67,26 @@
 #define SET_RCVTIMEO(tv, s) struct timeval tv = { s, 0 }
 #endif
 
+#ifdef CRYPTO
+/* TLS backend, only OpenSSL is wired up. Another library plugs in by
+ * providing these macros and the backend helpers in rtmp.c. */
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/x509v3.h>
+typedef SSL_CTX *TLS_CTX;
+#define TLS_client(ctx,s)   s = SSL_new(ctx)
+#define TLS_server(ctx,s)   s = SSL_new(ctx)
+#define TLS_setfd(s,fd)     SSL_set_fd(s,fd)
+#define TLS_connect(s)      SSL_connect(s)
+#define TLS_accept(s)       SSL_accept(s)
+#define TLS_read(s,b,l)     SSL_read(s,b,l)
+#define TLS_pending(s)      SSL_pending(s)
+#define TLS_write(s,b,l)    SSL_write(s,b,l)
+#define TLS_shutdown(s)     SSL_shutdown(s)
+#define TLS_close(s)        SSL_free(s)
+#define TLS_ktls_send(s)    BIO_get_ktls_send(SSL_get_wbio(s))
+#endif
+
 #include "rtmp.h"
 
 #endif
@@ -0,0 +1,380 @@
+/*
+ *  This file is part of librtmp.
+ *
+ *  librtmp is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU Lesser General Public License as
+ *  published by the Free Software Foundation; either version 2.1,
+ *  or (at your option) any later version.
+ *
+ *  librtmp is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU Lesser General Public License
+ *  along with librtmp see the file COPYING.  If not, write to
+ *  the Free Software Foundation, Inc., 51 Franklin Street, Fifth Floor,
+ *  Boston, MA  02110-1301, USA.
+ *  http://www.gnu.org/copyleft/lgpl.html
+ */
+
+/* RTMPSockBuf transports other than the socket: in-memory pipe and capture replay */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "rtmp_sys.h"
+#include "log.h"
+
+#ifndef _WIN32
+#include <pthread.h>
+#endif
+
+#define HANDSHAKE_SIZE (1 + 1536*2)     /* either role reads a type byte and two signatures */
+
+static void Attach(RTMP *r, const RTMP_TRANSPORT *t, void *ctx)
+{
+    RTMPSockBuf_Close(&r->m_sb);
+    r->m_sb.sb_socket = -1;
+    r->m_sb.sb_transport = t;
+    r->m_sb.sb_tctx = ctx;
+    r->m_sb.sb_size = 0;
+    r->m_sb.sb_start = r->m_sb.sb_buf;
+    r->m_sb.sb_timedout = FALSE;
+}
+
+/* pipe: ring[i] carries data to side i, cond[i] signals its changes */
+
+typedef struct PipeRing
+{
+    char *buf;
+    uint32_t size, head, tail;  /* head - tail bytes are queued, size is a power of two */
+} PipeRing;
+
+typedef struct RTMP_PIPE
+{
+#ifdef _WIN32
+    SRWLOCK lock;
+    CONDITION_VARIABLE cond[2];
+#else
+    pthread_mutex_t lock;
+    pthread_cond_t cond[2];
+#endif
+    PipeRing ring[2];
+    int closed[2];
+    int refs;
+} RTMP_PIPE;
+
+typedef struct PipeEnd
+{
+    RTMP_PIPE *p;
+    int side;
+    int timeout;        /* ms */
+} PipeEnd;
+
+#ifdef _WIN32
+#define pipe_lock(p)    AcquireSRWLockExclusive(&(p)->lock)
+#define pipe_unlock(p)  ReleaseSRWLockExclusive(&(p)->lock)
+#define pipe_wake(p, i) WakeAllConditionVariable(&(p)->cond[i])
+#else
+#define pipe_lock(p)    pthread_mutex_lock(&(p)->lock)
+#define pipe_unlock(p)  pthread_mutex_unlock(&(p)->lock)
+#define pipe_wake(p, i) pthread_cond_broadcast(&(p)->cond[i])
+#endif
+
+/* FALSE once ms passed without a wakeup, 0 waits forever */
+static int PipeWait(RTMP_PIPE *p, int i, int ms)
+{
+#ifdef _WIN32
+    return SleepConditionVariableSRW(&p->cond[i], &p->lock, ms ? ms : INFINITE, 0);
+#else
+    struct timespec ts;
+    if (!ms)
+        return !pthread_cond_wait(&p->cond[i], &p->lock);
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += ms/1000;
+    ts.tv_nsec += (ms % 1000)*1000000;
+    if (ts.tv_nsec >= 1000000000)
+    {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    return pthread_cond_timedwait(&p->cond[i], &p->lock, &ts) != ETIMEDOUT;
+#endif
+}
+
+static int PipeRecv(RTMPSockBuf *sb, char *buf, int len)
+{
+    PipeEnd *e = (PipeEnd *)sb->sb_tctx;
+    RTMP_PIPE *p = e->p;
+    PipeRing *rg = &p->ring[e->side];
+    uint32_t n, off, first;
+
+    pipe_lock(p);
+    while (rg->head == rg->tail && !p->closed[!e->side])
+        if (!PipeWait(p, e->side, e->timeout))
+        {
+            sb->sb_timedout = TRUE;
+            break;
+        }
+    n = rg->head - rg->tail;
+    if (n > (uint32_t)len)
+        n = len;
+    off = rg->tail & (rg->size - 1);
+    first = rg->size - off < n ? rg->size - off : n;
+    memcpy(buf, rg->buf + off, first);
+    memcpy(buf + first, rg->buf, n - first);
+    rg->tail += n;
+    if (n)
+        pipe_wake(p, e->side);
+    pipe_unlock(p);
+    return n;
+}
+
+/* partial when the ring is full, WriteN sends the rest */
+static int PipeSend(RTMPSockBuf *sb, const char *buf, int len)
+{
+    PipeEnd *e = (PipeEnd *)sb->sb_tctx;
+    RTMP_PIPE *p = e->p;
+    PipeRing *rg = &p->ring[!e->side];
+    uint32_t n, off, first;
+
+    pipe_lock(p);
+    while (rg->head - rg->tail == rg->size && !p->closed[!e->side])
+        if (!PipeWait(p, !e->side, e->timeout))
+        {
+            pipe_unlock(p);
+            errno = EAGAIN;
+            return -1;
+        }
+    if (p->closed[!e->side])
+    {
+        pipe_unlock(p);
+        errno = EPIPE;
+        return -1;
+    }
+    n = rg->size - (rg->head - rg->tail);
+    if (n > (uint32_t)len)
+        n = len;
+    off = rg->head & (rg->size - 1);
+    first = rg->size - off < n ? rg->size - off : n;
+    memcpy(rg->buf + off, buf, first);
+    memcpy(rg->buf, buf + first, n - first);
+    rg->head += n;
+    pipe_wake(p, !e->side);
+    pipe_unlock(p);
+    return n;
+}
+
+static void PipeFree(RTMP_PIPE *p)
+{
+#ifndef _WIN32
+    pthread_mutex_destroy(&p->lock);
+    pthread_cond_destroy(&p->cond[0]);
+    pthread_cond_destroy(&p->cond[1]);
+#endif
+    free(p->ring[0].buf);
+    free(p->ring[1].buf);
+    free(p);
+}
+
+static void PipeClose(RTMPSockBuf *sb)
+{
+    PipeEnd *e = (PipeEnd *)sb->sb_tctx;
+    RTMP_PIPE *p = e->p;
+    int refs;
+
+    pipe_lock(p);
+    p->closed[e->side] = TRUE;
+    refs = --p->refs;
+    pipe_wake(p, 0);
+    pipe_wake(p, 1);
+    pipe_unlock(p);
+    if (!refs)
+        PipeFree(p);
+    free(e);
+}
+
+static const RTMP_TRANSPORT PipeTransport = { "pipe", PipeRecv, PipeSend, PipeClose };
+
+int RTMP_Pipe(RTMP *a, RTMP *b, int size)
+{
+    RTMP_PIPE *p = calloc(1, sizeof(RTMP_PIPE));
+    PipeEnd *ea = calloc(1, sizeof(PipeEnd)), *eb = calloc(1, sizeof(PipeEnd));
+    uint32_t ring = 1;
+    int i;
+
+    /* the free running 32 bit head and tail wrap evenly only over a power of two */
+    while (ring < (uint32_t)(size > 0 ? size : RTMP_PIPE_SIZE) && ring < 0x40000000)
+        ring *= 2;
+    if (p)
+        for (i = 0; i < 2; i++)
+        {
+            p->ring[i].buf = malloc(ring);
+            p->ring[i].size = ring;
+        }
+    if (!p || !ea || !eb || !p->ring[0].buf || !p->ring[1].buf)
+    {
+        RTMP_Log(RTMP_LOGERROR, "%s, out of memory", __FUNCTION__);
+        if (p)
+        {
+            free(p->ring[0].buf);
+            free(p->ring[1].buf);
+        }
+        free(p);
+        free(ea);
+        free(eb);
+        return FALSE;
+    }
+#ifdef _WIN32
+    InitializeSRWLock(&p->lock);
+    InitializeConditionVariable(&p->cond[0]);
+    InitializeConditionVariable(&p->cond[1]);
+#else
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond[0], NULL);
+    pthread_cond_init(&p->cond[1], NULL);
+#endif
+    p->refs = 2;
+    ea->p = eb->p = p;
+    ea->side = 0;
+    eb->side = 1;
+    ea->timeout = a->Link.timeout*1000;
+    eb->timeout = b->Link.timeout*1000;
+    Attach(a, &PipeTransport, ea);
+    Attach(b, &PipeTransport, eb);
+    return TRUE;
+}
+
+int RTMP_SocketPair(RTMP *a, RTMP *b)
+{
+#ifdef _WIN32
+    (void)a; (void)b;
+    RTMP_Log(RTMP_LOGERROR, "%s, no socketpair on this platform", __FUNCTION__);
+    return FALSE;
+#else
+    int fds[2], i;
+    RTMP *r[2];
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+    {
+        RTMP_Log(RTMP_LOGERROR, "%s, socketpair failed. %d (%s)", __FUNCTION__, errno, strerror(errno));
+        return FALSE;
+    }
+    r[0] = a;
+    r[1] = b;
+    for (i = 0; i < 2; i++)
+    {
+        SET_RCVTIMEO(tv, r[i]->Link.timeout);
+        Attach(r[i], NULL, NULL);
+        r[i]->m_sb.sb_socket = fds[i];
+        if (setsockopt(fds[i], SOL_SOCKET, SO_RCVTIMEO, (char *)&tv, sizeof(tv)))
+            RTMP_Log(RTMP_LOGERROR, "%s, Setting socket timeout to %ds failed!", __FUNCTION__, r[i]->Link.timeout);
+    }
+    return TRUE;
+#endif
+}
+
+/* replay of a capture written by RTMP_CaptureOpen, see rtmp.h */
+
+typedef struct RTMP_REPLAY
+{
+    unsigned char *buf, *pos, *end;
+    uint64_t at;        /* recorded offset of the current record */
+    uint64_t base;      /* clock at offset zero, realtime only */
+    uint64_t skip;      /* handshake bytes still to drop, replay doesn't handshake */
+    uint32_t left;      /* bytes of the current record not handed out yet */
+    int realtime;
+} RTMP_REPLAY;
+
+static int ReplayVarint(RTMP_REPLAY *rp, uint64_t *v)
+{
+    int shift;
+    *v = 0;
+    for (shift = 0; rp->pos < rp->end && shift < 64; shift += 7)
+    {
+        unsigned char b = *rp->pos++;
+        *v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return TRUE;
+    }
+    return FALSE;
+}
+
+/* a record larger than the free buffer space is handed out over several fills */
+static int ReplayRecv(RTMPSockBuf *sb, char *buf, int len)
+{
+    RTMP_REPLAY *rp = (RTMP_REPLAY *)sb->sb_tctx;
+    while (!rp->left)
+    {
+        uint64_t delta, size, skip;
+        if (!ReplayVarint(rp, &delta) || !ReplayVarint(rp, &size) || size > (uint64_t)(rp->end - rp->pos))
+            return 0;
+        rp->at += delta;
+        skip = size < rp->skip ? size : rp->skip;
+        rp->pos += skip;
+        rp->skip -= skip;
+        rp->left = (uint32_t)(size - skip);
+        if (rp->left && rp->realtime)
+        {
+            uint64_t now = RTMP_GetTimeUS();
+            if (!rp->base)
+                rp->base = now - rp->at;
+            if (rp->base + rp->at > now + 1000)
+                msleep((int)((rp->base + rp->at - now)/1000));
+        }
+    }
+    if ((uint32_t)len > rp->left)
+        len = rp->left;
+    memcpy(buf, rp->pos, len);
+    rp->pos += len;
+    rp->left -= len;
+    return len;
+}
+
+/* replies of the replayed connection go nowhere */
+static int ReplaySend(RTMPSockBuf *sb, const char *buf, int len)
+{
+    (void)sb; (void)buf;
+    return len;
+}
+
+static void ReplayClose(RTMPSockBuf *sb)
+{
+    RTMP_REPLAY *rp = (RTMP_REPLAY *)sb->sb_tctx;
+    free(rp->buf);
+    free(rp);
+}
+
+static const RTMP_TRANSPORT ReplayTransport = { "replay", ReplayRecv, ReplaySend, ReplayClose };
+
+int RTMP_ReplayOpen(RTMP *r, const char *path, int realtime)
+{
+    RTMP_REPLAY *rp = calloc(1, sizeof(RTMP_REPLAY));
+    FILE *f = fopen(path, "rb");
+    long size = -1;
+    if (f && !fseek(f, 0, SEEK_END))
+        size = ftell(f);
+    if (!rp || size < (long)sizeof(RTMP_CAPTURE_MAGIC) - 1 || fseek(f, 0, SEEK_SET) ||
+        !(rp->buf = malloc(size)) || fread(rp->buf, 1, size, f) != (size_t)size ||
+        memcmp(rp->buf, RTMP_CAPTURE_MAGIC, sizeof(RTMP_CAPTURE_MAGIC) - 1))
+    {
+        RTMP_Log(RTMP_LOGERROR, "%s, can't load capture %s", __FUNCTION__, path);
+        if (f)
+            fclose(f);
+        if (rp)
+            free(rp->buf);
+        free(rp);
+        return FALSE;
+    }
+    fclose(f);
+    rp->pos = rp->buf + sizeof(RTMP_CAPTURE_MAGIC) - 1;
+    rp->end = rp->buf + size;
+    if (rp->pos < rp->end && *rp->pos++)
+        rp->skip = HANDSHAKE_SIZE;
+    rp->realtime = realtime;
+    Attach(r, &ReplayTransport, rp);
+    return TRUE;
+}
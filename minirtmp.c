@@ -6,69 +6,289 @@
 #include <poll.h>
 #endif
 #include "minirtmp.h"
+#include "system.h"
+
+#if defined(__AVX2__)
+#define MINIRTMP_AVX2 1
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define MINIRTMP_SSE2 1
+#include <emmintrin.h>
+#endif
+#if MINIRTMP_AVX2
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define MINIRTMP_NEON 1
+#include <arm_neon.h>
+#endif
+#if defined(_MSC_VER) && (MINIRTMP_SSE2 || MINIRTMP_AVX2)
+#include <intrin.h>
+#endif
+
+#if MINIRTMP_SSE2 || MINIRTMP_AVX2
+static inline int ctz32(uint32_t x)
+{
+#ifdef _MSC_VER
+    unsigned long idx;
+    _BitScanForward(&idx, x);
+    return (int)idx;
+#else
+    return __builtin_ctz(x);
+#endif
+}
+#endif
+
+// offset of first 00 00 01 sequence or size if not found
+static int find_001(const uint8_t *buf, int size)
+{
+    const uint8_t *p, *end;
+    int i = 0;
+#if MINIRTMP_AVX2
+    {
+        const __m256i zero = _mm256_setzero_si256(), one = _mm256_set1_epi8(1);
+        for (; i + 34 <= size; i += 32)
+        {
+            __m256i a = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + i)), zero);
+            __m256i b = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + i + 1)), zero);
+            __m256i c = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i *)(buf + i + 2)), one);
+            uint32_t mask = (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(_mm256_and_si256(a, b), c));
+            if (mask)
+                return i + ctz32(mask);
+        }
+    }
+#endif
+#if MINIRTMP_SSE2
+    {
+        const __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi8(1);
+        for (; i + 18 <= size; i += 16)
+        {
+            __m128i a = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i)), zero);
+            __m128i b = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i + 1)), zero);
+            __m128i c = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(buf + i + 2)), one);
+            uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_and_si128(_mm_and_si128(a, b), c));
+            if (mask)
+                return i + ctz32(mask);
+        }
+    }
+#elif MINIRTMP_NEON
+    {
+        const uint8x16_t zero = vdupq_n_u8(0), one = vdupq_n_u8(1);
+        for (; i + 18 <= size; i += 16)
+        {
+            uint8x16_t a = vceqq_u8(vld1q_u8(buf + i), zero);
+            uint8x16_t b = vceqq_u8(vld1q_u8(buf + i + 1), zero);
+            uint8x16_t c = vceqq_u8(vld1q_u8(buf + i + 2), one);
+            uint64x2_t m = vreinterpretq_u64_u8(vandq_u8(vandq_u8(a, b), c));
+            if (vgetq_lane_u64(m, 0) | vgetq_lane_u64(m, 1))
+                break; // exact position found by scalar code below
+        }
+    }
+#endif
+    // memchr for zero bytes, then check the rest of the pattern
+    p = buf + i;
+    end = buf + size - 2;
+    while (p < end && (p = memchr(p, 0, end - p)))
+    {
+        if (!p[1] && p[2] == 1)
+            return (int)(p - buf);
+        p++;
+    }
+    return size;
+}
+
+int minirtmp_find_startcode(const uint8_t *buf, int size)
+{
+    int pos = find_001(buf, size);
+    if (pos < size && pos > 0 && !buf[pos - 1])
+        pos--; // 00 00 00 01
+    return pos;
+}
+
+int minirtmp_split_nals(uint8_t *buf, int size, MINIRTMP_NAL *nals, int max_nals)
+{
+    int n = 0, pos = minirtmp_find_startcode(buf, size);
+    while (pos < size && n < max_nals)
+    {
+        int start = pos + (buf[pos + 2] == 1 ? 3 : 4);
+        int next = start + minirtmp_find_startcode(buf + start, size - start), end = next;
+        while (end > start && !buf[end - 1])
+            end--; // trailing_zero_8bits
+        if (end > start)
+        {
+            nals[n].data = buf + start;
+            nals[n].size = end - start;
+            nals[n].type = buf[start] & 31;
+            n++;
+        }
+        pos = next;
+    }
+    return n;
+}
 
 #define GET_FLV_HEADER(have_audio, have_video) \
     char header[] = "FLV\x1\x5\0\0\0\x9\0\0\0\0"; \
     header[4] = (have_audio ? 0x04 : 0x00) | (have_video ? 0x01 : 0x00);
 
-static const int format_flv(uint8_t *buf, uint8_t *data, int size, int type, int64_t pts, int64_t dts, int keyframe, int stream_hdrs)
+static int codec_has_nals(uint32_t codec)
 {
-    uint8_t *orig_buf = buf;
-    int dataSize = size;
-    *buf++ = type;
-    dataSize += (9 == type) ? 5 : 2;
-    dataSize += (9 == type && !stream_hdrs) ? 4 : 0;
-    *buf++ = (dataSize >> 16) & 0xFF;
-    *buf++ = (dataSize >>  8) & 0xFF;
-    *buf++ = (dataSize >>  0) & 0xFF;
-
-    *buf++ = (dts >> 16) & 0xFF;
-    *buf++ = (dts >>  8) & 0xFF;
-    *buf++ = (dts >>  0) & 0xFF;
-    *buf++ = (dts >> 24) & 0xFF;
-
-    *buf++ = 0; // StreamId
-    *buf++ = 0;
-    *buf++ = 0;
-    if (9 == type)
-    {   // video
-        *buf++ = (keyframe ? 0x10 : 0x20) | 0x07; // FrameType + CodecID
-        *buf++ = stream_hdrs ? 0x00 : 0x01;
-
-        pts = stream_hdrs ? 0 : (pts - dts);
-        *buf++ = (pts >> 16) & 0xFF;
-        *buf++ = (pts >>  8) & 0xFF;
-        *buf++ = (pts >>  0) & 0xFF;
-        if (!stream_hdrs)
-        {
-            *buf++ = (size >> 24) & 0xFF;
-            *buf++ = (size >> 16) & 0xFF;
-            *buf++ = (size >> 8) & 0xFF;
-            *buf++ = size & 0xFF;
-        }
-    } else
-    {   //audio
-        *buf++ = 0xA0 | 0x0F; // CodecID + SoundFormat
-        *buf++ = stream_hdrs ? 0x00 : 0x01;
+    return MINIRTMP_CODEC_AVC == codec || MINIRTMP_CODEC_HEVC == codec;
+}
+
+static inline void put_be32(uint8_t *p, uint32_t v)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#elif defined(_MSC_VER)
+    v = _byteswap_ulong(v);
+#else
+    v = __builtin_bswap32(v);
+#endif
+    memcpy(p, &v, 4);
+}
+
+#if defined(_MSC_VER)
+#define FORCE_INLINE __forceinline
+#else
+#define FORCE_INLINE inline __attribute__((always_inline))
+#endif
+
+enum { TAG_VIDEO_HDR, TAG_VIDEO_KEY, TAG_VIDEO_INTER, TAG_VIDEO_KEY_CTS, TAG_VIDEO_INTER_CTS, TAG_VIDEO_KINDS };
+// header layouts: total header size, cts offset, nal length offset (0 if absent)
+#define LAYOUT_AVC_HDR    16, 13, 0
+#define LAYOUT_AVC        20, 13, 16
+#define LAYOUT_EX         16, 0, 0
+#define LAYOUT_EX_NAL     20, 0, 16
+#define LAYOUT_EX_NAL_CTS 23, 16, 19
+#define LAYOUT_AUDIO      13, 0, 0
+enum { TAG_AVC_HDR, TAG_AVC, TAG_EX, TAG_EX_NAL, TAG_EX_NAL_CTS, TAG_AUDIO };
+
+// precomputed tag header + video/audio header, only size, timestamp, cts and nal length are patched
+typedef struct TAG_TEMPLATE
+{
+    uint8_t hdr[24];
+    uint8_t layout, reserved[7];    // pads entries to 32 bytes
+} TAG_TEMPLATE;
+
+#define TAG_HDR(type, b0, b1, b2, b3, b4) { type, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, b0, b1, b2, b3, b4 }
+#define AVC_TAG(b0, b1, layout) { TAG_HDR(9, b0, b1, 0, 0, 0), layout, { 0 } }
+// ExVideoTagHeader: IsExHeader + FrameType + PacketType, FourCC
+#define EX_TAG(frame_packet, a, b, c, d, layout) { TAG_HDR(9, 0x80 | frame_packet, a, b, c, d), layout, { 0 } }
+
+static const TAG_TEMPLATE g_video_tags[4][TAG_VIDEO_KINDS] =
+{
+    { AVC_TAG(0x17, 0x00, TAG_AVC_HDR), AVC_TAG(0x17, 0x01, TAG_AVC), AVC_TAG(0x27, 0x01, TAG_AVC), AVC_TAG(0x17, 0x01, TAG_AVC), AVC_TAG(0x27, 0x01, TAG_AVC) },
+    { EX_TAG(0x10, 'h', 'v', 'c', '1', TAG_EX), EX_TAG(0x13, 'h', 'v', 'c', '1', TAG_EX_NAL), EX_TAG(0x23, 'h', 'v', 'c', '1', TAG_EX_NAL),
+      EX_TAG(0x11, 'h', 'v', 'c', '1', TAG_EX_NAL_CTS), EX_TAG(0x21, 'h', 'v', 'c', '1', TAG_EX_NAL_CTS) },
+    { EX_TAG(0x10, 'a', 'v', '0', '1', TAG_EX), EX_TAG(0x11, 'a', 'v', '0', '1', TAG_EX), EX_TAG(0x21, 'a', 'v', '0', '1', TAG_EX),
+      EX_TAG(0x11, 'a', 'v', '0', '1', TAG_EX), EX_TAG(0x21, 'a', 'v', '0', '1', TAG_EX) },
+    { EX_TAG(0x10, 'v', 'p', '0', '9', TAG_EX), EX_TAG(0x11, 'v', 'p', '0', '9', TAG_EX), EX_TAG(0x21, 'v', 'p', '0', '9', TAG_EX),
+      EX_TAG(0x11, 'v', 'p', '0', '9', TAG_EX), EX_TAG(0x21, 'v', 'p', '0', '9', TAG_EX) },
+};
+
+static const TAG_TEMPLATE g_audio_tags[2] =
+{
+    { TAG_HDR(8, 0xAF, 0x00, 0, 0, 0), TAG_AUDIO, { 0 } },
+    { TAG_HDR(8, 0xAF, 0x01, 0, 0, 0), TAG_AUDIO, { 0 } },
+};
+
+static const TAG_TEMPLATE *get_template(int is_video, uint32_t codec, int keyframe, int stream_hdrs, int32_t cts)
+{
+    int idx;
+    if (!is_video)
+        return &g_audio_tags[!stream_hdrs];
+    switch (codec)
+    {
+    case MINIRTMP_CODEC_AVC:  idx = 0; break;
+    case MINIRTMP_CODEC_HEVC: idx = 1; break;
+    case MINIRTMP_CODEC_AV1:  idx = 2; break;
+    case MINIRTMP_CODEC_VP9:  idx = 3; break;
+    default: return 0;
     }
+    if (stream_hdrs)
+        return &g_video_tags[idx][TAG_VIDEO_HDR];
+    return &g_video_tags[idx][(keyframe ? TAG_VIDEO_KEY : TAG_VIDEO_INTER) + (cts ? 2 : 0)];
+}
+
+// instantiated with constant layout, so all offsets are immediates and no branches left
+static FORCE_INLINE int put_tag(uint8_t *buf, const uint8_t *hdr, const uint8_t *data, int size, uint32_t dts, int32_t cts,
+    const int hdr_size, const int cts_pos, const int len_pos)
+{
+    int dataSize = hdr_size - 11 + size;
+    memcpy(buf, hdr, hdr_size <= 16 ? 16 : 24);
+    put_be32(buf, ((uint32_t)hdr[0] << 24) | dataSize);
+    put_be32(buf + 4, (dts << 8) | (dts >> 24)); // 24-bit timestamp + extended byte
+    if (cts_pos)
+        put_be32(buf + cts_pos - 1, ((uint32_t)hdr[cts_pos - 1] << 24) | (cts & 0xFFFFFF));
+    if (len_pos)
+        put_be32(buf + len_pos, size);
+    memcpy(buf + hdr_size, data, size);
+    put_be32(buf + hdr_size + size, dataSize + 11);
+    return dataSize + 11 + 4;
+}
 
-    memcpy(buf, data, size);
-    buf += size;
+#define PUT_TAG(layout) put_tag(buf, t->hdr, data, size, dts, cts, layout)
 
-    dataSize += 11;
-    *buf++ = (dataSize >> 24) & 0xFF;
-    *buf++ = (dataSize >> 16) & 0xFF;
-    *buf++ = (dataSize >>  8) & 0xFF;
-    *buf++ = (dataSize >>  0) & 0xFF;
-    assert((buf - orig_buf) == (dataSize + 4));
-    return buf - orig_buf;
+int minirtmp_format_flv(uint8_t *buf, uint8_t *data, int size, int is_video, uint32_t codec, uint32_t pts, uint32_t dts, int keyframe, int stream_hdrs)
+{
+    int32_t cts = stream_hdrs ? 0 : (int32_t)(pts - dts);
+    const TAG_TEMPLATE *t;
+    if (!stream_hdrs)
+    {   // hot paths: avc and audio frames
+        if (!is_video)
+        {
+            t = &g_audio_tags[1];
+            return PUT_TAG(LAYOUT_AUDIO);
+        }
+        if (MINIRTMP_CODEC_AVC == codec)
+        {
+            t = &g_video_tags[0][keyframe ? TAG_VIDEO_KEY : TAG_VIDEO_INTER];
+            return PUT_TAG(LAYOUT_AVC);
+        }
+    }
+    if (!(t = get_template(is_video, codec, keyframe, stream_hdrs, cts)))
+        return 0;
+    switch (t->layout)
+    {
+    case TAG_AVC_HDR:    return PUT_TAG(LAYOUT_AVC_HDR);
+    case TAG_AVC:        return PUT_TAG(LAYOUT_AVC);
+    case TAG_EX:         return PUT_TAG(LAYOUT_EX);
+    case TAG_EX_NAL:     return PUT_TAG(LAYOUT_EX_NAL);
+    case TAG_EX_NAL_CTS: return PUT_TAG(LAYOUT_EX_NAL_CTS);
+    default:             return PUT_TAG(LAYOUT_AUDIO);
+    }
 }
 
-int minirtmp_write(MINIRTMP *r, uint8_t *data, int size, uint32_t timestamp, int is_video, int keyframe, int stream_hdrs)
+// avcc/hvcc video tag with every nal prefixed by 4-byte length
+static int format_flv_nals(uint8_t *buf, const MINIRTMP_NAL *nals, int num_nals, uint32_t codec, uint32_t pts, uint32_t dts, int keyframe)
 {
-    if (!RTMP_IsConnected(r->rtmp) || RTMP_IsTimedout(r->rtmp))
-        return MINIRTMP_ERROR;
+    int32_t cts = (int32_t)(pts - dts);
+    const TAG_TEMPLATE *t = get_template(1, codec, keyframe, 0, cts);
+    uint8_t *p;
+    int i, flv_size;
+    // first nal goes through the template writer, the rest are appended over PreviousTagSize
+    switch (t->layout)
+    {
+    case TAG_AVC:    flv_size = put_tag(buf, t->hdr, nals[0].data, nals[0].size, dts, cts, LAYOUT_AVC); break;
+    case TAG_EX_NAL: flv_size = put_tag(buf, t->hdr, nals[0].data, nals[0].size, dts, cts, LAYOUT_EX_NAL); break;
+    default:         flv_size = put_tag(buf, t->hdr, nals[0].data, nals[0].size, dts, cts, LAYOUT_EX_NAL_CTS); break;
+    }
+    if (num_nals < 2)
+        return flv_size;
+    p = buf + flv_size - 4;
+    for (i = 1; i < num_nals; i++)
+    {
+        put_be32(p, nals[i].size);
+        memcpy(p + 4, nals[i].data, nals[i].size);
+        p += 4 + nals[i].size;
+    }
+    flv_size = (int)(p - buf);
+    put_be32(buf, (9u << 24) | (flv_size - 11));
+    put_be32(p, flv_size);
+    return flv_size + 4;
+}
 
+static int flv_reserve(MINIRTMP *r, int size)
+{
     if (r->flv_buf_size < (size + 32))
     {
         r->flv_buf_size = size + 32;
@@ -76,9 +296,116 @@ int minirtmp_write(MINIRTMP *r, uint8_t *data, int size, uint32_t timestamp, int
             free(r->flv_buf);
         r->flv_buf = malloc(r->flv_buf_size);
     }
+    return r->flv_buf ? MINIRTMP_OK : MINIRTMP_ERROR;
+}
+
+#define KEEP_FRAME     0
+#define KEEP_KEYFRAME  1
+#define KEEP_VIDEO_HDR 2
+#define KEEP_AUDIO_HDR 3
+#define KEEP_META      4
+
+static void keep_copy(uint8_t **dst, int *dst_size, const uint8_t *tag, int size)
+{
+    uint8_t *p = realloc(*dst, size);
+    if (!p)
+        return; // the older one is still better than none
+    memcpy(p, tag, size);
+    *dst = p;
+    *dst_size = size;
+}
+
+// what a reconnect resends, returns 1 if it includes this tag
+static int keep_tag(MINIRTMP *r, const uint8_t *tag, int size, int kind)
+{
+    switch (kind)
+    {
+    case KEEP_META:      keep_copy(&r->meta, &r->meta_size, tag, size); return 1;
+    case KEEP_VIDEO_HDR: keep_copy(&r->video_hdr, &r->video_hdr_size, tag, size); return 1;
+    case KEEP_AUDIO_HDR: keep_copy(&r->audio_hdr, &r->audio_hdr_size, tag, size); return 1;
+    case KEEP_KEYFRAME:  r->replay_len = 0; r->replay_ok = 1; break;
+    }
+    if (r->replay_ok && !r->replay && !(r->replay = malloc(r->replay_max)))
+        r->replay_ok = 0;
+    if (r->replay_ok && r->replay_len + size > r->replay_max)
+        r->replay_ok = 0; // gop doesn't fit, wait for the next keyframe
+    if (!r->replay_ok)
+        return 0;
+    memcpy(r->replay + r->replay_len, tag, size);
+    r->replay_len += size;
+    return 1;
+}
+
+static int flv_write(MINIRTMP *r, const uint8_t *tags, int size)
+{
+    return RTMP_Write(r->rtmp, (const char *)tags, size) > 0 && RTMP_IsConnected(r->rtmp) ? MINIRTMP_OK : MINIRTMP_ERROR;
+}
+
+// (re)connects r->rtmp to r->url
+static int rtmp_open(MINIRTMP *r, int stream)
+{
+    free(r->link_url);
+    r->rtmp->Link.sockopts = r->sockopts;
+    if (!(r->link_url = strdup(r->url)) || !RTMP_SetupURL(r->rtmp, r->link_url))
+        return MINIRTMP_ERROR;
+    if (stream)
+        RTMP_EnableWrite(r->rtmp);
+    if (!RTMP_Connect(r->rtmp, NULL) || !RTMP_ConnectStream(r->rtmp, 0))
+        return MINIRTMP_ERROR;
+    return MINIRTMP_OK;
+}
+
+// new connection, then what a player needs to pick up where the stream broke
+static int reconnect(MINIRTMP *r)
+{
+    uint64_t deadline = RTMP_GetTimeUS() + (uint64_t)r->reconnect_ms*1000;
+    int delay = MINIRTMP_BACKOFF_MIN_MS;
+    RTMP_STAT_ADD(&r->rtmp->m_stats.s_reconnects, 1);
+    RTMPPacket_Free(&r->rtmpPacket);
+    r->packet_reveived = 0;
+    for (;;)
+    {
+        RTMP *s;
+        RTMP_Close(r->rtmp);
+        if ((s = RTMP_Alloc()))
+        {   // RTMP_SetupURL expects a fresh one, stats go on
+            RTMP_Init(s);
+            s->m_stats = r->rtmp->m_stats;
+            RTMP_Free(r->rtmp);
+            r->rtmp = s;
+        }
+        if (s && !rtmp_open(r, 1) &&
+            (!r->meta || !flv_write(r, r->meta, r->meta_size)) &&
+            (!r->video_hdr || !flv_write(r, r->video_hdr, r->video_hdr_size)) &&
+            (!r->audio_hdr || !flv_write(r, r->audio_hdr, r->audio_hdr_size)) &&
+            (!r->replay_ok || !r->replay_len || !flv_write(r, r->replay, r->replay_len)))
+            return MINIRTMP_OK;
+        if (RTMP_GetTimeUS() + (uint64_t)delay*1000 >= deadline)
+            return MINIRTMP_ERROR;
+        thread_sleep(delay);
+        delay = delay*2 < MINIRTMP_BACKOFF_MAX_MS ? delay*2 : MINIRTMP_BACKOFF_MAX_MS;
+    }
+}
+
+// connected, or reconnected when that is enabled
+static int flv_ready(MINIRTMP *r)
+{
+    if (RTMP_IsConnected(r->rtmp) && !RTMP_IsTimedout(r->rtmp))
+        return MINIRTMP_OK;
+    return r->reconnect_ms ? reconnect(r) : MINIRTMP_ERROR;
+}
 
-    int flv_size = format_flv(r->flv_buf, data, size, is_video ? 9 : 8, timestamp, timestamp, keyframe, stream_hdrs);
-    RTMP_Write(r->rtmp, (const char *)r->flv_buf, flv_size);
+static int flv_send(MINIRTMP *r, const uint8_t *tag, int flv_size, int kind)
+{
+    int kept = r->reconnect_ms ? keep_tag(r, tag, flv_size, kind) : 0;
+    if (flv_write(r, tag, flv_size))
+    {   // resent by the reconnect if kept
+        if (!r->reconnect_ms || reconnect(r) || (!kept && flv_write(r, tag, flv_size)))
+            return MINIRTMP_ERROR;
+    }
+    // rtmpt batches and paced media are held, send what came due
+    if (!RTMP_Flush(r->rtmp))
+        return MINIRTMP_ERROR;
 #ifndef _WIN32
     struct pollfd pf;
     pf.fd = RTMP_Socket(r->rtmp);
@@ -93,9 +420,143 @@ int minirtmp_write(MINIRTMP *r, uint8_t *data, int size, uint32_t timestamp, int
         }
     }
 #endif
+    return RTMP_FlushWait(r->rtmp) < 0 ? MINIRTMP_OK : MINIRTMP_MORE_DATA;
+}
+
+// CompositionTime is SI24, dts of each kind must not go back
+static int check_ts(MINIRTMP *r, int is_video, uint32_t pts, uint32_t dts)
+{
+    int32_t cts = (int32_t)(pts - dts);
+    if (is_video && (cts < -0x800000 || cts > 0x7FFFFF))
+        return MINIRTMP_ERROR;
+    if (r->dts_valid[is_video] && (int32_t)(dts - r->last_dts[is_video]) < 0)
+        return MINIRTMP_ERROR;
     return MINIRTMP_OK;
 }
 
+// only once the tag was taken, a failed write may be retried with the same dts
+static int commit_ts(MINIRTMP *r, int is_video, uint32_t dts, int res)
+{
+    if (MINIRTMP_ERROR != res)
+    {
+        r->last_dts[is_video] = dts;
+        r->dts_valid[is_video] = 1;
+    }
+    return res;
+}
+
+int minirtmp_write_pts(MINIRTMP *r, uint8_t *data, int size, uint32_t pts, uint32_t dts, int is_video, int keyframe, int stream_hdrs)
+{
+    is_video = !!is_video;
+    if (flv_ready(r))
+        return MINIRTMP_ERROR;
+    if (!is_video)
+        pts = dts;
+    if (!stream_hdrs && check_ts(r, is_video, pts, dts))
+        return MINIRTMP_ERROR;
+    if (flv_reserve(r, size))
+        return MINIRTMP_ERROR;
+    int flv_size = minirtmp_format_flv(r->flv_buf, data, size, is_video, r->video_codec, pts, dts, keyframe, stream_hdrs);
+    if (!flv_size)
+        return MINIRTMP_ERROR;
+    if (stream_hdrs)
+        return flv_send(r, r->flv_buf, flv_size, is_video ? KEEP_VIDEO_HDR : KEEP_AUDIO_HDR);
+    return commit_ts(r, is_video, dts, flv_send(r, r->flv_buf, flv_size, is_video && keyframe ? KEEP_KEYFRAME : KEEP_FRAME));
+}
+
+int minirtmp_write(MINIRTMP *r, uint8_t *data, int size, uint32_t timestamp, int is_video, int keyframe, int stream_hdrs)
+{
+    return minirtmp_write_pts(r, data, size, timestamp, timestamp, is_video, keyframe, stream_hdrs);
+}
+
+static int save_param_set(uint8_t *dst, int *dst_size, const MINIRTMP_NAL *nal, int *changed)
+{
+    if (nal->size > MINIRTMP_MAX_PARAM_SET)
+        return MINIRTMP_ERROR;
+    if (*dst_size != nal->size || memcmp(dst, nal->data, nal->size))
+    {
+        memcpy(dst, nal->data, *dst_size = nal->size);
+        *changed = 1;
+    }
+    return MINIRTMP_OK;
+}
+
+int minirtmp_write_annexb(MINIRTMP *r, uint8_t *data, int size, uint32_t timestamp)
+{
+    return minirtmp_write_annexb_pts(r, data, size, timestamp, timestamp);
+}
+
+int minirtmp_write_annexb_pts(MINIRTMP *r, uint8_t *data, int size, uint32_t pts, uint32_t dts)
+{
+    MINIRTMP_NAL nals[MINIRTMP_MAX_AU_NALS + 1];
+    int i, num_nals, payload = 0, keyframe = 0, hevc = MINIRTMP_CODEC_HEVC == r->video_codec, n = 0;
+    if (flv_ready(r))
+        return MINIRTMP_ERROR;
+    if (!codec_has_nals(r->video_codec))
+        return MINIRTMP_ERROR;
+    num_nals = minirtmp_split_nals(data, size, nals, MINIRTMP_MAX_AU_NALS + 1);
+    if (num_nals > MINIRTMP_MAX_AU_NALS)
+        return MINIRTMP_ERROR; // would go out cut short
+    for (i = 0; i < num_nals; i++)
+    {   // keep only slice data nals, stream headers goes to sequence header
+        if (hevc)
+        {
+            int type = (nals[i].data[0] >> 1) & 63;
+            if (32 == type && save_param_set(r->vps, &r->vps_size, &nals[i], &r->hdrs_changed))
+                return MINIRTMP_ERROR;
+            if (33 == type && save_param_set(r->sps, &r->sps_size, &nals[i], &r->hdrs_changed))
+                return MINIRTMP_ERROR;
+            if (34 == type && save_param_set(r->pps, &r->pps_size, &nals[i], &r->hdrs_changed))
+                return MINIRTMP_ERROR;
+            if (type >= 32 && type <= 35)
+                continue; // vps, sps, pps, aud
+            keyframe |= type >= 16 && type <= 23; // irap
+        } else
+        {
+            switch (nals[i].type)
+            {
+            case 7:
+                if (save_param_set(r->sps, &r->sps_size, &nals[i], &r->hdrs_changed))
+                    return MINIRTMP_ERROR;
+                continue;
+            case 8:
+                if (save_param_set(r->pps, &r->pps_size, &nals[i], &r->hdrs_changed))
+                    return MINIRTMP_ERROR;
+                continue;
+            case 9: continue; // access unit delimiter is not allowed in avcc
+            case 5: keyframe = 1;
+            }
+        }
+        payload += 4 + nals[i].size;
+        nals[n++] = nals[i];
+    }
+    if (!r->sps_size || !r->pps_size || (hevc && !r->vps_size))
+    {   // nothing can be decoded before stream headers
+        if (n)
+            RTMP_STAT_ADD(&r->rtmp->m_stats.s_dropped, 1);
+        return MINIRTMP_OK;
+    }
+    if (n && check_ts(r, 1, pts, dts))
+        return MINIRTMP_ERROR; // before the sequence header goes out with this dts
+    if (r->hdrs_changed)
+    {
+        uint8_t cfg[3*MINIRTMP_MAX_PARAM_SET + 64];
+        int cfg_size = hevc ? minirtmp_format_hvcc(cfg, r->vps, r->vps_size, r->sps, r->sps_size, r->pps, r->pps_size) :
+            minirtmp_format_avcc(cfg, r->sps, r->sps_size, r->pps, r->pps_size);
+        if (cfg_size <= 0 || flv_reserve(r, cfg_size))
+            return MINIRTMP_ERROR;
+        if (MINIRTMP_ERROR == flv_send(r, r->flv_buf, minirtmp_format_flv(r->flv_buf, cfg, cfg_size, 1, r->video_codec, dts, dts, 1, 1), KEEP_VIDEO_HDR))
+            return MINIRTMP_ERROR;
+        r->hdrs_changed = 0;
+    }
+    if (!n)
+        return MINIRTMP_OK;
+    if (flv_reserve(r, payload))
+        return MINIRTMP_ERROR;
+    return commit_ts(r, 1, dts, flv_send(r, r->flv_buf, format_flv_nals(r->flv_buf, nals, n, r->video_codec, pts, dts, keyframe),
+        keyframe ? KEEP_KEYFRAME : KEEP_FRAME));
+}
+
 int minirtmp_read(MINIRTMP *r)
 {
     if (r->packet_reveived)
@@ -103,7 +564,7 @@ int minirtmp_read(MINIRTMP *r)
         r->packet_reveived = 0;
         RTMPPacket_Free(&r->rtmpPacket);
     }
-    if (!RTMP_ReadPacket(r->rtmp, &r->rtmpPacket))
+    if (!RTMP_Flush(r->rtmp) || !RTMP_ReadPacket(r->rtmp, &r->rtmpPacket))
         return MINIRTMP_EOF;
     if (RTMPPacket_IsReady(&r->rtmpPacket))
     {
@@ -114,37 +575,87 @@ int minirtmp_read(MINIRTMP *r)
 }
 
 int minirtmp_init(MINIRTMP *r, const char *url, int stream)
+{
+    return minirtmp_init_opts(r, url, stream, NULL);
+}
+
+int minirtmp_init_opts(MINIRTMP *r, const char *url, int stream, const RTMP_SOCKOPTS *opts)
 {
     memset(r, 0, sizeof(*r));
+    if (opts)
+        r->sockopts = *opts;
     r->rtmp = RTMP_Alloc();
     RTMP_Init(r->rtmp);
-    if (!RTMP_SetupURL(r->rtmp, (char *)url))
-        goto error;
-    if (stream)
-        RTMP_EnableWrite(r->rtmp);
-    if (!RTMP_Connect(r->rtmp, NULL))
-        goto error;
-    if (!RTMP_ConnectStream(r->rtmp, 0))
+    if (!(r->url = strdup(url)) || rtmp_open(r, stream))
         goto error;
+    r->video_codec = MINIRTMP_CODEC_AVC;
     return MINIRTMP_OK;
 error:
     minirtmp_close(r);
     return MINIRTMP_ERROR;
 }
 
+void minirtmp_set_pacing(MINIRTMP *r, int bitrate, int percent)
+{
+    int64_t rate = (int64_t)(bitrate > 0 ? bitrate : 0)/8*(percent > 0 ? percent : MINIRTMP_PACING_PERCENT)/100;
+    r->sockopts.pacingRate = rate < 0x7fffffff ? (int)rate : 0x7fffffff; // for reconnects
+    RTMP_SetPacing(r->rtmp, r->sockopts.pacingRate);
+}
+
+int minirtmp_flush(MINIRTMP *r)
+{
+    if (!RTMP_Flush(r->rtmp))
+        return MINIRTMP_ERROR;
+    return RTMP_FlushWait(r->rtmp) < 0 ? MINIRTMP_OK : MINIRTMP_MORE_DATA;
+}
+
+int minirtmp_flush_wait(MINIRTMP *r)
+{
+    return RTMP_FlushWait(r->rtmp);
+}
+
+void minirtmp_get_stats(MINIRTMP *r, RTMP_STATS *stats)
+{
+    if (r->rtmp)
+        RTMP_GetStats(r->rtmp, stats);
+    else
+        memset(stats, 0, sizeof(*stats));
+}
+
 void minirtmp_close(MINIRTMP *r)
 {
     if (r->flv_buf)
         free(r->flv_buf);
     if (r->rtmp)
     {
+        RTMP_Flush(r->rtmp);
         RTMP_Close(r->rtmp);
         RTMP_Free(r->rtmp);
     }
     RTMPPacket_Free(&r->rtmpPacket);
+    free(r->url);
+    free(r->link_url);
+    free(r->replay);
+    free(r->meta);
+    free(r->video_hdr);
+    free(r->audio_hdr);
     memset(r, 0, sizeof(*r));
 }
 
+void minirtmp_set_reconnect(MINIRTMP *r, int timeout_ms, int replay_size)
+{
+    r->reconnect_ms = timeout_ms > 0 ? timeout_ms : 0;
+    if (replay_size <= 0)
+        replay_size = MINIRTMP_REPLAY_SIZE;
+    if (replay_size != r->replay_max)
+    {
+        free(r->replay);
+        r->replay = NULL;
+        r->replay_len = r->replay_ok = 0;
+        r->replay_max = replay_size;
+    }
+}
+
 int minirtmp_metadata(MINIRTMP *r, int width, int height, int have_audio)
 {
     char buf[512];
@@ -178,7 +689,7 @@ static const AVal g_audiocodecid = AVC("audiocodecid");
     {
         pbuf = AMF_EncodeNamedNumber(pbuf, end, &g_width, width);
         pbuf = AMF_EncodeNamedNumber(pbuf, end, &g_height, height);
-        pbuf = AMF_EncodeNamedNumber(pbuf, end, &g_videocodecid, 7);
+        pbuf = AMF_EncodeNamedNumber(pbuf, end, &g_videocodecid, r->video_codec); // fourcc for enhanced rtmp
     }
     if (have_audio)
         pbuf = AMF_EncodeNamedNumber(pbuf, end, &g_audiocodecid, 10);
@@ -197,7 +708,7 @@ static const AVal g_audiocodecid = AVC("audiocodecid");
     *pbuf++ = (size >>  0) & 0xFF;
     assert((pbuf - buf) == (size + 4));
 
-    return RTMP_Write(r->rtmp, buf, pbuf - buf);
+    return flv_send(r, (uint8_t *)buf, pbuf - buf, KEEP_META);
 }
 
 int minirtmp_format_avcc(uint8_t *buf, uint8_t *sps, int sps_size, uint8_t *pps, int pps_size)
@@ -221,3 +732,534 @@ int minirtmp_format_avcc(uint8_t *buf, uint8_t *sps, int sps_size, uint8_t *pps,
     buf += pps_size;
     return buf - orig_buf;
 }
+
+typedef struct bit_reader
+{
+    const uint8_t *buf;
+    int size, pos; // in bits
+} bit_reader;
+
+static uint32_t get_bits(bit_reader *bs, int n)
+{
+    uint32_t val = 0;
+    while (n--)
+    {
+        int bit = 0;
+        if (bs->pos < bs->size)
+            bit = (bs->buf[bs->pos >> 3] >> (7 - (bs->pos & 7))) & 1;
+        bs->pos++;
+        val = (val << 1) | bit;
+    }
+    return val;
+}
+
+static uint32_t get_ue(bit_reader *bs)
+{
+    int zeros = 0;
+    while (bs->pos < bs->size && !get_bits(bs, 1))
+        if (++zeros >= 32)
+        {   // no valid code is that long
+            bs->pos = bs->size + 1; // fails the overrun check of the caller
+            return 0;
+        }
+    return ((1u << zeros) - 1) + get_bits(bs, zeros);
+}
+
+// removes emulation prevention bytes
+static int nal_to_rbsp(uint8_t *dst, const uint8_t *src, int size)
+{
+    int i, n = 0, zeros = 0;
+    for (i = 0; i < size; i++)
+    {
+        if (zeros >= 2 && 3 == src[i])
+        {
+            zeros = 0;
+            continue;
+        }
+        dst[n++] = src[i];
+        zeros = src[i] ? 0 : zeros + 1;
+    }
+    return n;
+}
+
+int minirtmp_format_hvcc(uint8_t *buf, uint8_t *vps, int vps_size, uint8_t *sps, int sps_size, uint8_t *pps, int pps_size)
+{
+    uint8_t rbsp[MINIRTMP_MAX_PARAM_SET], *orig_buf = buf;
+    uint8_t *nals[3] = { vps, sps, pps };
+    int sizes[3] = { vps_size, sps_size, pps_size };
+    int i, rbsp_size, max_sub_layers_minus1, temporal_id_nesting, chroma_format_idc, bit_depth_luma, bit_depth_chroma;
+    if (sps_size > MINIRTMP_MAX_PARAM_SET || sps_size < 15)
+        return 0;
+    rbsp_size = nal_to_rbsp(rbsp, sps, sps_size);
+    bit_reader bs = { rbsp, rbsp_size*8, 16 }; // skip nal header
+    get_bits(&bs, 4); // sps_video_parameter_set_id
+    max_sub_layers_minus1 = get_bits(&bs, 3);
+    temporal_id_nesting   = get_bits(&bs, 1);
+    const uint8_t *general_ptl = rbsp + 3; // profile_space..level_idc, 12 bytes
+    bs.pos += 12*8;
+    {   // sub layers of profile_tier_level
+        int sub_profile[8], sub_level[8];
+        for (i = 0; i < max_sub_layers_minus1; i++)
+        {
+            sub_profile[i] = get_bits(&bs, 1);
+            sub_level[i]   = get_bits(&bs, 1);
+        }
+        if (max_sub_layers_minus1 > 0)
+            bs.pos += (8 - max_sub_layers_minus1)*2;
+        for (i = 0; i < max_sub_layers_minus1; i++)
+            bs.pos += (sub_profile[i] ? 88 : 0) + (sub_level[i] ? 8 : 0);
+    }
+    get_ue(&bs); // sps_seq_parameter_set_id
+    chroma_format_idc = get_ue(&bs);
+    if (3 == chroma_format_idc)
+        get_bits(&bs, 1); // separate_colour_plane_flag
+    get_ue(&bs); // pic_width_in_luma_samples
+    get_ue(&bs); // pic_height_in_luma_samples
+    if (get_bits(&bs, 1))
+    {   // conformance_window
+        get_ue(&bs); get_ue(&bs); get_ue(&bs); get_ue(&bs);
+    }
+    bit_depth_luma   = get_ue(&bs);
+    bit_depth_chroma = get_ue(&bs);
+    if (bs.pos > bs.size)
+        return 0;
+
+    *buf++ = 0x01; // configurationVersion
+    memcpy(buf, general_ptl, 12);
+    buf += 12;
+    *buf++ = 0xF0; // reserved (4 bits), min_spatial_segmentation_idc (12 bits)
+    *buf++ = 0x00;
+    *buf++ = 0xFC; // reserved (6 bits), parallelismType (2 bits)
+    *buf++ = 0xFC | (chroma_format_idc & 3);
+    *buf++ = 0xF8 | (bit_depth_luma & 7);
+    *buf++ = 0xF8 | (bit_depth_chroma & 7);
+    *buf++ = 0; // avgFrameRate
+    *buf++ = 0;
+    // constantFrameRate (2 bits), numTemporalLayers (3 bits), temporalIdNested (1 bit), lengthSizeMinusOne (2 bits)
+    *buf++ = ((max_sub_layers_minus1 + 1) << 3) | (temporal_id_nesting << 2) | 3;
+    *buf++ = 3; // numOfArrays
+    for (i = 0; i < 3; i++)
+    {
+        *buf++ = 0x80 | (32 + i); // array_completeness, NAL_unit_type
+        *buf++ = 0; // numNalus
+        *buf++ = 1;
+        *buf++ = (sizes[i] >> 8) & 0xFF;
+        *buf++ = sizes[i] & 0xFF;
+        memcpy(buf, nals[i], sizes[i]);
+        buf += sizes[i];
+    }
+    return buf - orig_buf;
+}
+
+static int read_leb128(const uint8_t *buf, int size, uint32_t *val)
+{
+    int i;
+    *val = 0;
+    for (i = 0; i < 8 && i < size; i++)
+    {
+        *val |= (uint32_t)(buf[i] & 0x7F) << (i*7);
+        if (!(buf[i] & 0x80))
+            return i + 1;
+    }
+    return 0;
+}
+
+int minirtmp_format_av1c(uint8_t *buf, const uint8_t *obu, int obu_size)
+{
+    int i, hdr = 1, seq_profile, seq_level_idx_0 = 0, seq_tier_0 = 0, reduced_still_picture_header, operating_points_cnt;
+    int timing_info_present = 0, decoder_model_info_present = 0, initial_display_delay_present = 0, buffer_delay_length = 0;
+    int high_bitdepth, twelve_bit = 0, mono_chrome = 0, cp = 2, tc = 2, mc = 2, ss_x = 1, ss_y = 1, chroma_sample_position = 0;
+    uint32_t payload_size = obu_size - 1;
+    if (obu_size < 2 || ((obu[0] >> 3) & 15) != 1)
+        return 0; // not OBU_SEQUENCE_HEADER
+    if (obu[0] & 4)
+        hdr++; // extension header
+    if (obu[0] & 2)
+    {
+        int n = read_leb128(obu + hdr, obu_size - hdr, &payload_size);
+        if (!n)
+            return 0;
+        hdr += n;
+    } else
+        payload_size = obu_size - hdr;
+    if (payload_size > (uint32_t)(obu_size - hdr))
+        return 0;
+    bit_reader bs = { obu + hdr, payload_size*8, 0 };
+    seq_profile = get_bits(&bs, 3);
+    get_bits(&bs, 1); // still_picture
+    reduced_still_picture_header = get_bits(&bs, 1);
+    if (reduced_still_picture_header)
+        seq_level_idx_0 = get_bits(&bs, 5);
+    else
+    {
+        if ((timing_info_present = get_bits(&bs, 1)))
+        {
+            bs.pos += 64; // num_units_in_display_tick, time_scale
+            if (get_bits(&bs, 1))
+            {   // equal_picture_interval, num_ticks_per_picture_minus_1 uvlc
+                int zeros = 0;
+                while (bs.pos < bs.size && !get_bits(&bs, 1) && zeros < 32)
+                    zeros++;
+                bs.pos += zeros;
+            }
+            if ((decoder_model_info_present = get_bits(&bs, 1)))
+            {
+                buffer_delay_length = get_bits(&bs, 5) + 1;
+                bs.pos += 32 + 5 + 5; // num_units_in_decoding_tick, buffer_removal_time_length_minus_1, frame_presentation_time_length_minus_1
+            }
+        }
+        initial_display_delay_present = get_bits(&bs, 1);
+        operating_points_cnt = get_bits(&bs, 5) + 1;
+        for (i = 0; i < operating_points_cnt; i++)
+        {
+            int seq_level_idx, seq_tier = 0;
+            get_bits(&bs, 12); // operating_point_idc
+            seq_level_idx = get_bits(&bs, 5);
+            if (seq_level_idx > 7)
+                seq_tier = get_bits(&bs, 1);
+            if (decoder_model_info_present && get_bits(&bs, 1))
+                bs.pos += buffer_delay_length*2 + 1; // decoder_buffer_delay, encoder_buffer_delay, low_delay_mode_flag
+            if (initial_display_delay_present && get_bits(&bs, 1))
+                bs.pos += 4; // initial_display_delay_minus_1
+            if (!i)
+            {
+                seq_level_idx_0 = seq_level_idx;
+                seq_tier_0 = seq_tier;
+            }
+        }
+    }
+    {
+        int frame_width_bits = get_bits(&bs, 4) + 1, frame_height_bits = get_bits(&bs, 4) + 1;
+        bs.pos += frame_width_bits + frame_height_bits; // max_frame_width_minus_1, max_frame_height_minus_1
+    }
+    if (!reduced_still_picture_header && get_bits(&bs, 1))
+        bs.pos += 4 + 3; // delta_frame_id_length_minus_2, additional_frame_id_length_minus_1
+    bs.pos += 3; // use_128x128_superblock, enable_filter_intra, enable_intra_edge_filter
+    if (!reduced_still_picture_header)
+    {
+        int enable_order_hint, seq_force_screen_content_tools = 2;
+        bs.pos += 4; // enable_interintra_compound, enable_masked_compound, enable_warped_motion, enable_dual_filter
+        enable_order_hint = get_bits(&bs, 1);
+        if (enable_order_hint)
+            bs.pos += 2; // enable_jnt_comp, enable_ref_frame_mvs
+        if (!get_bits(&bs, 1)) // seq_choose_screen_content_tools
+            seq_force_screen_content_tools = get_bits(&bs, 1);
+        if (seq_force_screen_content_tools > 0 && !get_bits(&bs, 1)) // seq_choose_integer_mv
+            get_bits(&bs, 1); // seq_force_integer_mv
+        if (enable_order_hint)
+            bs.pos += 3; // order_hint_bits_minus_1
+    }
+    bs.pos += 3; // enable_superres, enable_cdef, enable_restoration
+    // color_config
+    high_bitdepth = get_bits(&bs, 1);
+    if (2 == seq_profile && high_bitdepth)
+        twelve_bit = get_bits(&bs, 1);
+    if (1 != seq_profile)
+        mono_chrome = get_bits(&bs, 1);
+    if (get_bits(&bs, 1))
+    {   // color_description_present_flag
+        cp = get_bits(&bs, 8);
+        tc = get_bits(&bs, 8);
+        mc = get_bits(&bs, 8);
+    }
+    if (mono_chrome)
+        get_bits(&bs, 1); // color_range
+    else if (1 == cp && 13 == tc && 0 == mc)
+        ss_x = ss_y = 0; // srgb
+    else
+    {
+        get_bits(&bs, 1); // color_range
+        if (1 == seq_profile)
+            ss_x = ss_y = 0;
+        else if (2 == seq_profile)
+        {
+            if (twelve_bit)
+            {
+                ss_x = get_bits(&bs, 1);
+                ss_y = ss_x ? get_bits(&bs, 1) : 0;
+            } else
+                ss_y = 0;
+        }
+        if (ss_x && ss_y)
+            chroma_sample_position = get_bits(&bs, 2);
+    }
+    if (bs.pos > bs.size)
+        return 0;
+
+    *buf++ = 0x81; // marker, version
+    *buf++ = (seq_profile << 5) | seq_level_idx_0;
+    *buf++ = (seq_tier_0 << 7) | (high_bitdepth << 6) | (twelve_bit << 5) | (mono_chrome << 4) | (ss_x << 3) | (ss_y << 2) | chroma_sample_position;
+    *buf++ = 0; // reserved, initial_presentation_delay_present
+    memcpy(buf, obu, hdr + payload_size); // configOBUs
+    return 4 + hdr + payload_size;
+}
+
+int minirtmp_format_vpcc(uint8_t *buf, const uint8_t *frame, int frame_size, int level)
+{
+    static const uint8_t cs_matrix[8] = { 2, 6, 1, 6, 7, 9, 2, 0 };
+    int profile, bit_depth = 8, color_space, full_range = 0, ss_x = 1, ss_y = 1, chroma;
+    bit_reader bs = { frame, frame_size*8, 0 };
+    if (2 != get_bits(&bs, 2)) // frame_marker
+        return 0;
+    profile = get_bits(&bs, 1);
+    profile |= get_bits(&bs, 1) << 1;
+    if (3 == profile)
+        get_bits(&bs, 1); // reserved_zero
+    if (get_bits(&bs, 1) || get_bits(&bs, 1)) // show_existing_frame, frame_type
+        return 0; // not a key frame
+    bs.pos += 2; // show_frame, error_resilient_mode
+    if (0x498342 != get_bits(&bs, 24))
+        return 0; // frame_sync_code
+    if (profile >= 2)
+        bit_depth = get_bits(&bs, 1) ? 12 : 10;
+    color_space = get_bits(&bs, 3);
+    if (7 != color_space)
+    {
+        full_range = get_bits(&bs, 1);
+        if (1 == profile || 3 == profile)
+        {
+            ss_x = get_bits(&bs, 1);
+            ss_y = get_bits(&bs, 1);
+        }
+    } else
+    {
+        full_range = 1;
+        ss_x = ss_y = 0;
+    }
+    if (bs.pos > bs.size)
+        return 0;
+    chroma = ss_x ? (ss_y ? 1 : 2) : 3; // 4:2:0 colocated, 4:2:2, 4:4:4
+
+    *buf++ = 1; // version
+    *buf++ = 0; // flags
+    *buf++ = 0;
+    *buf++ = 0;
+    *buf++ = profile;
+    *buf++ = level;
+    *buf++ = (bit_depth << 4) | (chroma << 1) | full_range;
+    *buf++ = 2 == color_space ? 1 : 2; // colourPrimaries
+    *buf++ = 2 == color_space ? 1 : 2; // transferCharacteristics
+    *buf++ = cs_matrix[color_space];   // matrixCoefficients
+    *buf++ = 0; // codecIntializationDataSize
+    *buf++ = 0;
+    return 12;
+}
+
+int minirtmp_parse_video_tag(uint8_t *data, int size, MINIRTMP_VIDEO_TAG *tag)
+{
+    int hdr = 5;
+    memset(tag, 0, sizeof(*tag));
+    if (size < 1)
+        return MINIRTMP_ERROR;
+    tag->keyframe = 1 == ((data[0] >> 4) & 7);
+    if (data[0] & 0x80)
+    {   // ExVideoTagHeader
+        if (size < 5)
+            return MINIRTMP_ERROR;
+        tag->packet_type = data[0] & 15;
+        tag->codec = ((uint32_t)data[1] << 24) | ((uint32_t)data[2] << 16) | ((uint32_t)data[3] << 8) | data[4];
+        if (MINIRTMP_PACKET_CODED_FRAMES == tag->packet_type && MINIRTMP_CODEC_HEVC == tag->codec)
+        {
+            if (size < 8)
+                return MINIRTMP_ERROR;
+            tag->cts = (int32_t)(((uint32_t)data[5] << 24) | ((uint32_t)data[6] << 16) | ((uint32_t)data[7] << 8)) >> 8;
+            hdr = 8;
+        } else if (MINIRTMP_PACKET_CODED_FRAMES_X == tag->packet_type)
+            tag->packet_type = MINIRTMP_PACKET_CODED_FRAMES;
+    } else
+    {
+        tag->codec = data[0] & 15;
+        if (MINIRTMP_CODEC_AVC != tag->codec)
+            hdr = 1;
+        else
+        {
+            if (size < 5)
+                return MINIRTMP_ERROR;
+            tag->packet_type = data[1];
+            tag->cts = (int32_t)(((uint32_t)data[2] << 24) | ((uint32_t)data[3] << 16) | ((uint32_t)data[4] << 8)) >> 8;
+        }
+    }
+    tag->data = data + hdr;
+    tag->size = size - hdr;
+    return MINIRTMP_OK;
+}
+
+static int depack_reserve(MINIRTMP_DEPACKETIZER *d, int size)
+{
+    if (d->buf_size < size)
+    {
+        uint8_t *buf = realloc(d->buf, size);
+        if (!buf)
+            return MINIRTMP_ERROR;
+        d->buf = buf;
+        d->buf_size = size;
+    }
+    return MINIRTMP_OK;
+}
+
+// unsigned, a 4-byte length may not fit int until checked against the bytes left
+static uint32_t depack_get(const uint8_t *p, int n)
+{
+    uint32_t v = 0;
+    while (n--)
+        v = (v << 8) | *p++;
+    return v;
+}
+
+// avcc/hvcc parameter set arrays to annex-b in d->buf, picks up the nal length size
+static int depack_config(MINIRTMP_DEPACKETIZER *d, uint8_t *data, int size, uint32_t codec, MINIRTMP_FRAME *frame)
+{
+    uint8_t *p = data, *end = data + size, *out;
+    int i, j, num_arrays, nal_length_size;
+    if (MINIRTMP_CODEC_HEVC == codec)
+    {
+        if (size < 23)
+            return MINIRTMP_ERROR;
+        nal_length_size = (p[21] & 3) + 1;
+        num_arrays = p[22];
+        p += 23;
+    } else
+    {
+        if (size < 6 || 1 != p[0])
+            return MINIRTMP_ERROR;
+        nal_length_size = (p[4] & 3) + 1;
+        num_arrays = 2; // sps, then pps
+        p += 5;
+    }
+    if (3 == nal_length_size || depack_reserve(d, 2*size)) // 2-byte lengths become 4-byte start codes
+        return MINIRTMP_ERROR;
+    out = d->buf;
+    for (i = 0; i < num_arrays; i++)
+    {
+        int num_nals;
+        if (MINIRTMP_CODEC_HEVC == codec)
+        {
+            if (end - p < 3)
+                return MINIRTMP_ERROR;
+            num_nals = (int)depack_get(p + 1, 2);
+            p += 3;
+        } else
+        {
+            if (end - p < 1)
+                return MINIRTMP_ERROR;
+            num_nals = i ? p[0] : p[0] & 31;
+            p++;
+        }
+        for (j = 0; j < num_nals; j++)
+        {
+            uint32_t nal_size;
+            if (end - p < 2 || (nal_size = depack_get(p, 2)) > (uint32_t)(end - p - 2))
+                return MINIRTMP_ERROR;
+            put_be32(out, 1);
+            memcpy(out + 4, p + 2, nal_size);
+            out += 4 + nal_size;
+            p += 2 + nal_size;
+        }
+    }
+    d->nal_length_size = nal_length_size;
+    frame->data = d->buf;
+    frame->size = (int)(out - d->buf);
+    frame->config = 1;
+    frame->keyframe = 1;
+    return MINIRTMP_OK;
+}
+
+// length prefixed nals to annex-b: 4-byte lengths are overwritten in place,
+// shorter ones can't hold a start code and go to d->buf with 3-byte ones
+static int depack_nals(MINIRTMP_DEPACKETIZER *d, uint8_t *data, int size, MINIRTMP_FRAME *frame)
+{
+    int len = d->nal_length_size ? d->nal_length_size : 4, out_size = 0, pos;
+    uint8_t *out;
+    for (pos = 0; pos < size; )
+    {   // validate all before touching the body
+        uint32_t nal_size;
+        if (size - pos < len || (nal_size = depack_get(data + pos, len)) > (uint32_t)(size - pos - len))
+            return MINIRTMP_ERROR;
+        pos += len + (int)nal_size;
+        out_size += nal_size ? 3 + (int)nal_size : 0;
+    }
+    if (4 == len)
+    {
+        for (pos = 0; pos < size; )
+        {
+            int nal_size = (int)depack_get(data + pos, 4);
+            put_be32(data + pos, 1);
+            pos += 4 + nal_size;
+        }
+        frame->data = data;
+        frame->size = size;
+        return MINIRTMP_OK;
+    }
+    if (depack_reserve(d, out_size))
+        return MINIRTMP_ERROR;
+    out = d->buf;
+    for (pos = 0; pos < size; )
+    {
+        int nal_size = (int)depack_get(data + pos, len);
+        pos += len + nal_size;
+        if (!nal_size)
+            continue; // padding
+        out[0] = 0; out[1] = 0; out[2] = 1;
+        memcpy(out + 3, data + pos - nal_size, nal_size);
+        out += 3 + nal_size;
+    }
+    frame->data = d->buf;
+    frame->size = out_size;
+    return MINIRTMP_OK;
+}
+
+int minirtmp_depacketize(MINIRTMP_DEPACKETIZER *d, int type, uint8_t *data, int size, uint32_t timestamp, MINIRTMP_FRAME *frame)
+{
+    memset(frame, 0, sizeof(*frame));
+    frame->pts = frame->dts = timestamp;
+    if (RTMP_PACKET_TYPE_AUDIO == type)
+    {   // SoundFormat, aac has AACPacketType after it
+        if (size < 1)
+            return MINIRTMP_ERROR;
+        frame->codec = data[0] >> 4;
+        frame->keyframe = 1;
+        if (MINIRTMP_SOUND_AAC == frame->codec)
+        {
+            if (size < 2)
+                return MINIRTMP_ERROR;
+            frame->config = !data[1];
+            frame->data = data + 2;
+            frame->size = size - 2;
+        } else
+        {
+            frame->data = data + 1;
+            frame->size = size - 1;
+        }
+        return MINIRTMP_OK;
+    }
+    if (RTMP_PACKET_TYPE_VIDEO != type)
+        return MINIRTMP_MORE_DATA;
+    MINIRTMP_VIDEO_TAG tag;
+    if (minirtmp_parse_video_tag(data, size, &tag))
+        return MINIRTMP_ERROR;
+    frame->is_video = 1;
+    frame->codec = tag.codec;
+    frame->keyframe = tag.keyframe;
+    frame->pts = timestamp + tag.cts;
+    if (MINIRTMP_PACKET_SEQUENCE_END == tag.packet_type)
+        return MINIRTMP_MORE_DATA;
+    if (!codec_has_nals(tag.codec))
+    {   // av1 obus / vp9 frame as is, av1c/vpcc as config
+        frame->config = MINIRTMP_PACKET_SEQUENCE_START == tag.packet_type;
+        frame->data = tag.data;
+        frame->size = tag.size;
+        return MINIRTMP_OK;
+    }
+    if (MINIRTMP_PACKET_SEQUENCE_START == tag.packet_type)
+        return depack_config(d, tag.data, tag.size, tag.codec, frame);
+    if (MINIRTMP_PACKET_CODED_FRAMES != tag.packet_type)
+        return MINIRTMP_MORE_DATA;
+    return depack_nals(d, tag.data, tag.size, frame);
+}
+
+void minirtmp_depacketizer_free(MINIRTMP_DEPACKETIZER *d)
+{
+    if (d->buf)
+        free(d->buf);
+    memset(d, 0, sizeof(*d));
+}
@@ -9,6 +9,30 @@
 #define MINIRTMP_MORE_DATA 2
 #define MINIRTMP_EOF   3
 
+#define MINIRTMP_FOURCC(a, b, c, d) (((uint32_t)(a) << 24) | ((uint32_t)(b) << 16) | ((uint32_t)(c) << 8) | (uint32_t)(d))
+
+// video codecs, avc uses legacy flv header, others enhanced rtmp ExVideoTagHeader
+#define MINIRTMP_CODEC_AVC  7
+#define MINIRTMP_CODEC_HEVC MINIRTMP_FOURCC('h', 'v', 'c', '1')
+#define MINIRTMP_CODEC_AV1  MINIRTMP_FOURCC('a', 'v', '0', '1')
+#define MINIRTMP_CODEC_VP9  MINIRTMP_FOURCC('v', 'p', '0', '9')
+// audio codecs are flv SoundFormat values
+#define MINIRTMP_SOUND_AAC  10
+
+// video packet types, legacy AVCPacketType values are the same for 0..2
+#define MINIRTMP_PACKET_SEQUENCE_START 0
+#define MINIRTMP_PACKET_CODED_FRAMES   1
+#define MINIRTMP_PACKET_SEQUENCE_END   2
+#define MINIRTMP_PACKET_CODED_FRAMES_X 3
+
+#define MINIRTMP_MAX_PARAM_SET 256
+#define MINIRTMP_MAX_AU_NALS   128
+
+#define MINIRTMP_REPLAY_SIZE    (4*1024*1024)
+#define MINIRTMP_PACING_PERCENT 150
+#define MINIRTMP_BACKOFF_MIN_MS 100
+#define MINIRTMP_BACKOFF_MAX_MS 5000
+
 typedef struct MINIRTMP
 {
 #ifdef LIBRTMP
@@ -16,20 +40,112 @@ typedef struct MINIRTMP
     RTMPPacket rtmpPacket;
 #endif
     uint8_t  *flv_buf;
+    char *url;      // as given, kept for reconnects
+    char *link_url; // copy the Link strings point into
+    RTMP_SOCKOPTS sockopts; // applied on each (re)connect, url options override
     int flv_buf_size, packet_reveived;
+    // last stream headers seen by minirtmp_write_annexb
+    uint8_t vps[MINIRTMP_MAX_PARAM_SET], sps[MINIRTMP_MAX_PARAM_SET], pps[MINIRTMP_MAX_PARAM_SET];
+    int vps_size, sps_size, pps_size, hdrs_changed;
+    uint32_t video_codec; // MINIRTMP_CODEC_*, can be changed after minirtmp_init
+    // last frame dts per audio/video, each must not go back
+    uint32_t last_dts[2];
+    int dts_valid[2];
+    // reconnect, off unless minirtmp_set_reconnect
+    int reconnect_ms;
+    uint8_t *replay; // flv tags from the last video keyframe on
+    int replay_len, replay_max, replay_ok;
+    uint8_t *meta, *video_hdr, *audio_hdr; // last sent of each, as flv tags
+    int meta_size, video_hdr_size, audio_hdr_size;
 } MINIRTMP;
 
+typedef struct MINIRTMP_NAL
+{
+    uint8_t *data;
+    int size, type;
+} MINIRTMP_NAL;
+
+typedef struct MINIRTMP_VIDEO_TAG
+{
+    uint32_t codec;
+    int keyframe, packet_type; // MINIRTMP_PACKET_*, CodedFramesX reported as CodedFrames
+    int32_t cts;
+    uint8_t *data;
+    int size;
+} MINIRTMP_VIDEO_TAG;
+
+// access unit out of an flv audio/video tag body
+typedef struct MINIRTMP_FRAME
+{
+    uint8_t *data; // annex-b for avc/hevc, as sent otherwise
+    int size;
+    uint32_t pts, dts;
+    uint32_t codec; // MINIRTMP_CODEC_* for video, flv SoundFormat for audio
+    int is_video, keyframe;
+    int config; // stream headers: annex-b parameter sets, av1c/vpcc, AudioSpecificConfig
+} MINIRTMP_FRAME;
+
+typedef struct MINIRTMP_DEPACKETIZER
+{
+    uint8_t *buf; // config and frames with 1/2-byte nal lengths
+    int buf_size;
+    int nal_length_size; // from the last avcc/hvcc, 4 until one is seen
+} MINIRTMP_DEPACKETIZER;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
 int minirtmp_init(MINIRTMP *r, const char *url, int stream);
+// minirtmp_init with socket tuning, opts may be NULL; effective values end up in the stats
+int minirtmp_init_opts(MINIRTMP *r, const char *url, int stream, const RTMP_SOCKOPTS *opts);
 void minirtmp_close(MINIRTMP *r);
-// nals without sync point, stream headers in avcc format
+// publisher only: a write that finds the connection dropped reconnects with backoff for up to
+// timeout_ms, resends metadata and sequence headers, then the tags since the last video keyframe
+// if they fit in replay_size bytes (0 for MINIRTMP_REPLAY_SIZE); timeout_ms 0 turns it off
+void minirtmp_set_reconnect(MINIRTMP *r, int timeout_ms, int replay_size);
+// spreads audio and video at percent of the stream bitrate in bits per second (0 for MINIRTMP_PACING_PERCENT),
+// so keyframes go out over several frame intervals instead of in one burst; bitrate 0 turns it off.
+// The kernel paces tcp, elsewhere (unix sockets, no SO_MAX_PACING_RATE) writes hold what is not due yet
+// and return MINIRTMP_MORE_DATA, see minirtmp_flush
+void minirtmp_set_pacing(MINIRTMP *r, int bitrate, int percent);
+// sends held data that came due (paced media, rtmpt batches): MINIRTMP_MORE_DATA while some is still held,
+// next due in minirtmp_flush_wait ms (-1 with nothing held, usable as a poll timeout); writes and reads flush too
+int minirtmp_flush(MINIRTMP *r);
+int minirtmp_flush_wait(MINIRTMP *r);
+// nals without sync point (av1 obus / vp9 frame as is), stream headers in avcc/hvcc/av1c/vpcc format;
+// writes return MINIRTMP_MORE_DATA when the data was taken but part of it is held, not an error
 int minirtmp_write(MINIRTMP *r, uint8_t *data, int size, uint32_t timestamp, int is_video, int keyframe, int stream_hdrs);
+// whole annex-b access unit, all nals packed into one tag, sps/pps tracked and sent as stream headers on change
+// (an error for over MINIRTMP_MAX_AU_NALS nals or a parameter set over MINIRTMP_MAX_PARAM_SET bytes)
+int minirtmp_write_annexb(MINIRTMP *r, uint8_t *data, int size, uint32_t timestamp);
+// same with b-frames: frames in decode order, pts - dts goes to CompositionTime and must fit signed 24 bits,
+// a frame with dts before the previous one of the same kind is rejected, audio pts is ignored
+int minirtmp_write_pts(MINIRTMP *r, uint8_t *data, int size, uint32_t pts, uint32_t dts, int is_video, int keyframe, int stream_hdrs);
+int minirtmp_write_annexb_pts(MINIRTMP *r, uint8_t *data, int size, uint32_t pts, uint32_t dts);
 int minirtmp_metadata(MINIRTMP *r, int width, int height, int have_audio);
 int minirtmp_read(MINIRTMP *r);
+// flv tag with trailing PreviousTagSize, buf must have size + 32 bytes
+int minirtmp_format_flv(uint8_t *buf, uint8_t *data, int size, int is_video, uint32_t codec, uint32_t pts, uint32_t dts, int keyframe, int stream_hdrs);
 int minirtmp_format_avcc(uint8_t *buf, uint8_t *sps, int sps_size, uint8_t *pps, int pps_size);
+int minirtmp_format_hvcc(uint8_t *buf, uint8_t *vps, int vps_size, uint8_t *sps, int sps_size, uint8_t *pps, int pps_size);
+// config record from sequence header obu
+int minirtmp_format_av1c(uint8_t *buf, const uint8_t *obu, int obu_size);
+// config record from vp9 key frame uncompressed header
+int minirtmp_format_vpcc(uint8_t *buf, const uint8_t *frame, int frame_size, int level);
+// parses legacy or enhanced rtmp video tag body
+int minirtmp_parse_video_tag(uint8_t *data, int size, MINIRTMP_VIDEO_TAG *tag);
+// MINIRTMP_OK with the frame filled, MINIRTMP_MORE_DATA for packets without media (metadata, end of
+// sequence). 4-byte nal lengths are rewritten to start codes in the packet body itself, the frame points
+// into it; config and 1/2-byte lengths are converted into d->buf, valid until the next call.
+int minirtmp_depacketize(MINIRTMP_DEPACKETIZER *d, int type, uint8_t *data, int size, uint32_t timestamp, MINIRTMP_FRAME *frame);
+void minirtmp_depacketizer_free(MINIRTMP_DEPACKETIZER *d);
+// counters and latency histograms of the connection, callable from any thread
+void minirtmp_get_stats(MINIRTMP *r, RTMP_STATS *stats);
+// returns offset of next 00 00 01 or 00 00 00 01 start code, or size if none
+int minirtmp_find_startcode(const uint8_t *buf, int size);
+// splits annex-b buffer into nals (without start codes) in one pass, returns nals count
+int minirtmp_split_nals(uint8_t *buf, int size, MINIRTMP_NAL *nals, int max_nals);
 
 #ifdef __cplusplus
 }
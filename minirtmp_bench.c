@@ -0,0 +1,1998 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include "librtmp/rtmp_sys.h"
+#include "minirtmp.h"
+#include "minirtmp_player.h"
+#include "minirtmp_mux.h"
+#include "minirtmp_pool.h"
+#include "system.h"
+#include "librtmp/amf.h"
+#include "librtmp/log.h"
+#ifdef CRYPTO
+#include <openssl/pem.h>
+#endif
+
+#define BENCH_SIZE  (64*1024*1024)
+#define BENCH_LOOPS 8
+#define MAX_NALS    (BENCH_SIZE/64)
+
+static uint32_t rnd_state = 0x12345678;
+
+static uint32_t rnd()
+{
+    rnd_state ^= rnd_state << 13;
+    rnd_state ^= rnd_state >> 17;
+    rnd_state ^= rnd_state << 5;
+    return rnd_state;
+}
+
+// synthetic annex-b stream: random nal payloads with emulation prevention applied
+static uint8_t *gen_annexb(int size, int *nals)
+{
+    uint8_t *buf = (uint8_t *)malloc(size);
+    int pos = 0, n = 0;
+    while (pos < size - 64)
+    {
+        int nal_size = 16 + rnd() % 20000, zeros = 0, i;
+        if (!(n & 1))
+            buf[pos++] = 0;
+        buf[pos++] = 0; buf[pos++] = 0; buf[pos++] = 1;
+        buf[pos++] = 0x65;
+        for (i = 0; i < nal_size && pos < size - 8; i++)
+        {
+            uint8_t b = (rnd() & 3) ? (uint8_t)rnd() : 0;
+            if (zeros >= 2 && b <= 3)
+            {
+                buf[pos++] = 3;
+                zeros = 0;
+            }
+            buf[pos++] = b;
+            zeros = b ? 0 : zeros + 1;
+        }
+        buf[pos++] = 0x80; // rbsp_stop_one_bit
+        n++;
+    }
+    memset(buf + pos, 0, size - pos);
+    *nals = n;
+    return buf;
+}
+
+// byte-wise reference, the way minirtmp_test.c used to split nals
+static int get_nal_size(uint8_t *buf, int size)
+{
+    int pos = 3;
+    while ((size - pos) > 3)
+    {
+        if (buf[pos] == 0 && buf[pos + 1] == 0 && buf[pos + 2] == 1)
+            return pos;
+        if (buf[pos] == 0 && buf[pos + 1] == 0 && buf[pos + 2] == 0 && buf[pos + 3] == 1)
+            return pos;
+        pos++;
+    }
+    return size;
+}
+
+static int split_naive(uint8_t *buf, int size, MINIRTMP_NAL *nals, int max_nals)
+{
+    int n = 0;
+    while (size > 4 && n < max_nals)
+    {
+        int nal_size = get_nal_size(buf, size);
+        int startcode_size = (buf[0] == 0 && buf[1] == 0 && buf[2] == 1) ? 3 : 4;
+        nals[n].data = buf + startcode_size;
+        nals[n].size = nal_size - startcode_size;
+        nals[n].type = buf[startcode_size] & 31;
+        n++;
+        buf  += nal_size;
+        size -= nal_size;
+    }
+    return n;
+}
+
+static void bench_nals()
+{
+    int expected, n = 0, i;
+    uint8_t *buf = gen_annexb(BENCH_SIZE, &expected);
+    MINIRTMP_NAL *nals = (MINIRTMP_NAL *)malloc(MAX_NALS*sizeof(MINIRTMP_NAL));
+    uint64_t t0, t1;
+    double naive, simd;
+
+    t0 = GetTime();
+    for (i = 0; i < BENCH_LOOPS; i++)
+        n = split_naive(buf, BENCH_SIZE, nals, MAX_NALS);
+    t1 = GetTime();
+    naive = (double)BENCH_SIZE*BENCH_LOOPS/((t1 - t0)*1000.0);
+    printf("nal split naive:   %6.2f GB/s, nals=%d\n", naive, n);
+
+    t0 = GetTime();
+    for (i = 0; i < BENCH_LOOPS; i++)
+        n = minirtmp_split_nals(buf, BENCH_SIZE, nals, MAX_NALS);
+    t1 = GetTime();
+    simd = (double)BENCH_SIZE*BENCH_LOOPS/((t1 - t0)*1000.0);
+    printf("nal split library: %6.2f GB/s, nals=%d (%.1fx)\n", simd, n, simd/naive);
+    if (n != expected)
+        printf("error: expected %d nals\n", expected);
+    free(nals);
+    free(buf);
+}
+
+// per byte writer with runtime branches, the way format_flv used to work
+static uint8_t *ref_tag_header(uint8_t *buf, int type, int dataSize, int64_t dts)
+{
+    *buf++ = type;
+    *buf++ = (dataSize >> 16) & 0xFF;
+    *buf++ = (dataSize >>  8) & 0xFF;
+    *buf++ = (dataSize >>  0) & 0xFF;
+
+    *buf++ = (dts >> 16) & 0xFF;
+    *buf++ = (dts >>  8) & 0xFF;
+    *buf++ = (dts >>  0) & 0xFF;
+    *buf++ = (dts >> 24) & 0xFF;
+
+    *buf++ = 0; // StreamId
+    *buf++ = 0;
+    *buf++ = 0;
+    return buf;
+}
+
+static int ref_video_header_size(uint32_t codec, int stream_hdrs, int64_t cts)
+{
+    if (MINIRTMP_CODEC_AVC == codec)
+        return 5;
+    // ExVideoTagHeader + FourCC, CodedFrames carries cts for hevc only
+    return (MINIRTMP_CODEC_HEVC == codec && !stream_hdrs && cts) ? 8 : 5;
+}
+
+static uint8_t *ref_video_header(uint8_t *buf, uint32_t codec, int keyframe, int stream_hdrs, int64_t cts)
+{
+    int frame_type = keyframe ? 1 : 2;
+    if (stream_hdrs)
+        cts = 0;
+    if (MINIRTMP_CODEC_AVC == codec)
+    {
+        *buf++ = (frame_type << 4) | 0x07; // FrameType + CodecID
+        *buf++ = stream_hdrs ? 0x00 : 0x01;
+        *buf++ = (cts >> 16) & 0xFF;
+        *buf++ = (cts >>  8) & 0xFF;
+        *buf++ = (cts >>  0) & 0xFF;
+        return buf;
+    }
+    int packet_type = MINIRTMP_PACKET_SEQUENCE_START;
+    if (!stream_hdrs)
+        packet_type = (MINIRTMP_CODEC_HEVC == codec && !cts) ? MINIRTMP_PACKET_CODED_FRAMES_X : MINIRTMP_PACKET_CODED_FRAMES;
+    *buf++ = 0x80 | (frame_type << 4) | packet_type; // IsExHeader + FrameType + PacketType
+    *buf++ = (codec >> 24) & 0xFF; // FourCC
+    *buf++ = (codec >> 16) & 0xFF;
+    *buf++ = (codec >>  8) & 0xFF;
+    *buf++ = (codec >>  0) & 0xFF;
+    if (MINIRTMP_PACKET_CODED_FRAMES == packet_type && MINIRTMP_CODEC_HEVC == codec)
+    {
+        *buf++ = (cts >> 16) & 0xFF;
+        *buf++ = (cts >>  8) & 0xFF;
+        *buf++ = (cts >>  0) & 0xFF;
+    }
+    return buf;
+}
+
+// kept out of line, a call like minirtmp_format_flv from another unit
+#ifdef _MSC_VER
+__declspec(noinline)
+#else
+__attribute__((noinline))
+#endif
+static int format_flv_shifts(uint8_t *buf, uint8_t *data, int size, int type, uint32_t codec, int64_t pts, int64_t dts, int keyframe, int stream_hdrs)
+{
+    uint8_t *orig_buf = buf;
+    int dataSize = size, nal_prefix = 9 == type && !stream_hdrs && (MINIRTMP_CODEC_AVC == codec || MINIRTMP_CODEC_HEVC == codec);
+    dataSize += (9 == type) ? ref_video_header_size(codec, stream_hdrs, pts - dts) : 2;
+    dataSize += nal_prefix ? 4 : 0;
+    buf = ref_tag_header(buf, type, dataSize, dts);
+    if (9 == type)
+    {   // video
+        buf = ref_video_header(buf, codec, keyframe, stream_hdrs, pts - dts);
+        if (nal_prefix)
+        {
+            *buf++ = (size >> 24) & 0xFF;
+            *buf++ = (size >> 16) & 0xFF;
+            *buf++ = (size >> 8) & 0xFF;
+            *buf++ = size & 0xFF;
+        }
+    } else
+    {   //audio
+        *buf++ = 0xA0 | 0x0F; // CodecID + SoundFormat
+        *buf++ = stream_hdrs ? 0x00 : 0x01;
+    }
+
+    memcpy(buf, data, size);
+    buf += size;
+
+    dataSize += 11;
+    *buf++ = (dataSize >> 24) & 0xFF;
+    *buf++ = (dataSize >> 16) & 0xFF;
+    *buf++ = (dataSize >>  8) & 0xFF;
+    *buf++ = (dataSize >>  0) & 0xFF;
+    return buf - orig_buf;
+}
+
+#define TAG_LOOPS  4000000
+#define TAG_TRIALS 5
+
+volatile int g_payload_size = 16;
+volatile uint32_t g_codecs[2] = { MINIRTMP_CODEC_AVC, MINIRTMP_CODEC_HEVC };
+
+// payload copy only, subtracted from both writers to get header cost
+#ifdef _MSC_VER
+__declspec(noinline)
+#else
+__attribute__((noinline))
+#endif
+static int copy_only(uint8_t *buf, uint8_t *data, int size, int64_t dts)
+{
+    memcpy(buf + 20, data, size);
+    memcpy(buf + 20 + size, &dts, 4);
+    return size + 24;
+}
+
+static void bench_flv()
+{
+    uint8_t payload[16] = { 0x65 }, buf[16 + 32];
+    uint64_t t0, t1, check = 0, best[3] = { ~(uint64_t)0, ~(uint64_t)0, ~(uint64_t)0 };
+    uint32_t i;
+    int trial, size = g_payload_size; // runtime size and codecs, so compiler can't specialize reference writer
+    uint32_t codecs[2] = { g_codecs[0], g_codecs[1] };
+
+    for (trial = 0; trial < TAG_TRIALS; trial++)
+    {   // best of several runs, timings are noisy on shared machines
+        t0 = GetTime();
+        for (i = 0; i < TAG_LOOPS; i++)
+            check += copy_only(buf, payload, size, i);
+        t1 = GetTime();
+        if (t1 - t0 < best[0])
+            best[0] = t1 - t0;
+        t0 = GetTime();
+        for (i = 0; i < TAG_LOOPS; i++)
+            check += format_flv_shifts(buf, payload, size, (i & 3) ? 9 : 8, codecs[(i >> 4) & 1], i, i, !(i & 63), 0);
+        t1 = GetTime();
+        if (t1 - t0 < best[1])
+            best[1] = t1 - t0;
+        t0 = GetTime();
+        for (i = 0; i < TAG_LOOPS; i++)
+            check += minirtmp_format_flv(buf, payload, size, i & 3, codecs[(i >> 4) & 1], i, i, !(i & 63), 0);
+        t1 = GetTime();
+        if (t1 - t0 < best[2])
+            best[2] = t1 - t0;
+    }
+    double copy = best[0]*1000.0/TAG_LOOPS, shifts = best[1]*1000.0/TAG_LOOPS, templates = best[2]*1000.0/TAG_LOOPS;
+    printf("flv tag copy only: %6.2f ns/tag\n", copy);
+    printf("flv tag shifts:    %6.2f ns/tag, header %5.2f ns\n", shifts, shifts - copy);
+    printf("flv tag templates: %6.2f ns/tag, header %5.2f ns (%.1fx) (%u)\n", templates, templates - copy,
+        (shifts - copy)/(templates - copy), (uint32_t)(check & 1));
+}
+
+#define AMF_LOOPS 1000000
+
+// connect command followed by onMetaData sized object, 24 props forces a props regrow
+static int gen_amf(char *buf, int size)
+{
+    static const AVal av_connect = AVC("connect"), av_app = AVC("app"), av_live = AVC("live");
+    static const AVal av_tcUrl = AVC("tcUrl"), av_url = AVC("rtmp://localhost/live");
+    char *p = buf, *end = buf + size, name[16];
+    int i;
+    p = AMF_EncodeString(p, end, &av_connect);
+    p = AMF_EncodeNumber(p, end, 1.0);
+    *p++ = AMF_OBJECT;
+    p = AMF_EncodeNamedString(p, end, &av_app, &av_live);
+    p = AMF_EncodeNamedString(p, end, &av_tcUrl, &av_url);
+    for (i = 0; i < 24; i++)
+    {
+        AVal av_name = { name, snprintf(name, sizeof(name), "prop%d", i) };
+        p = AMF_EncodeNamedNumber(p, end, &av_name, i);
+    }
+    p = AMF_EncodeInt24(p, end, AMF_OBJECT_END);
+    return p - buf;
+}
+
+static void bench_amf()
+{
+    char body[1024], scratch[4096];
+    int size = gen_amf(body, sizeof(body)), i, check = 0;
+    AMFObject obj;
+    AMFArena arena;
+    uint64_t t0, t1;
+    double heap, arena_ns, reader;
+
+    t0 = GetTime();
+    for (i = 0; i < AMF_LOOPS; i++)
+    {
+        check += AMF_Decode(&obj, body, size, FALSE);
+        check += obj.o_props[2].p_vu.p_object.o_num;
+        AMF_Reset(&obj);
+    }
+    t1 = GetTime();
+    heap = (t1 - t0)*1000.0/AMF_LOOPS;
+    printf("amf decode heap:   %6.1f ns/cmd\n", heap);
+
+    AMF_ArenaInit(&arena, scratch, sizeof(scratch));
+    t0 = GetTime();
+    for (i = 0; i < AMF_LOOPS; i++)
+    {
+        check -= AMF_DecodeArena(&obj, body, size, FALSE, &arena);
+        check -= obj.o_props[2].p_vu.p_object.o_num;
+        AMF_ArenaReset(&arena);
+    }
+    t1 = GetTime();
+    AMF_ArenaFree(&arena);
+    arena_ns = (t1 - t0)*1000.0/AMF_LOOPS;
+    printf("amf decode arena:  %6.1f ns/cmd (%.1fx)\n", arena_ns, heap/arena_ns);
+    if (check)
+        printf("error: arena decode mismatch\n");
+
+    // pull method, txn and one property the way HandleInvoke does
+    t0 = GetTime();
+    for (i = 0; i < AMF_LOOPS; i++)
+    {
+        static const AVal av_tcUrl = AVC("tcUrl");
+        AMFReader rd, val;
+        AVal method, url;
+        double txn;
+        AMFReader_Init(&rd, body, size);
+        AMFReader_GetString(&rd, &method);
+        AMFReader_GetNumber(&rd, &txn);
+        if (AMFReader_FindProp(&rd, &av_tcUrl, &val, FALSE) && AMFReader_GetString(&val, &url))
+            check += url.av_len + method.av_len + (int)txn;
+    }
+    t1 = GetTime();
+    reader = (t1 - t0)*1000.0/AMF_LOOPS;
+    printf("amf pull reader:   %6.1f ns/cmd (%.1fx) (%d)\n", reader, heap/reader, check & 1);
+}
+
+// command object re-encoded as AMF3, the way flex clients send it
+static char *put_amf_name(char *p, char *end, const AVal *name)
+{
+    p = AMF_EncodeInt16(p, end, name->av_len);
+    memcpy(p, name->av_val, name->av_len);
+    return p + name->av_len;
+}
+
+// nested objects share their traits, repeated names and values go out as string refs
+static int gen_amf_nested(char *buf, int size)
+{
+    static const AVal av_app = AVC("app"), av_live = AVC("live"), av_stream = AVC("stream");
+    static const AVal av_video = AVC("video"), av_audio = AVC("audio"), av_codec = AVC("codec"), av_level = AVC("level");
+    static const AVal av_avc = AVC("avc"), av_aac = AVC("aac"), av_rate = AVC("rate"), av_big = AVC("big"), av_flag = AVC("flag");
+    char *p = buf, *end = buf + size;
+    *p++ = AMF_OBJECT;
+    p = AMF_EncodeNamedString(p, end, &av_app, &av_live);
+    p = AMF_EncodeNamedString(p, end, &av_stream, &av_live);
+    p = AMF_EncodeNamedNumber(p, end, &av_rate, 29.97);
+    p = AMF_EncodeNamedNumber(p, end, &av_big, 1e12);
+    p = AMF_EncodeNamedBoolean(p, end, &av_flag, TRUE);
+    p = put_amf_name(p, end, &av_video);
+    *p++ = AMF_OBJECT;
+    p = AMF_EncodeNamedString(p, end, &av_codec, &av_avc);
+    p = AMF_EncodeNamedString(p, end, &av_level, &av_live);
+    p = AMF_EncodeInt24(p, end, AMF_OBJECT_END);
+    p = put_amf_name(p, end, &av_audio);
+    *p++ = AMF_OBJECT;
+    p = AMF_EncodeNamedString(p, end, &av_codec, &av_aac);
+    p = AMF_EncodeNamedNumber(p, end, &av_level, -5);
+    p = AMF_EncodeInt24(p, end, AMF_OBJECT_END);
+    p = AMF_EncodeInt24(p, end, AMF_OBJECT_END);
+    return p - buf;
+}
+
+static int amf_same(const AMFObject *a, const AMFObject *b)
+{
+    int i;
+    if (a->o_num != b->o_num)
+        return 0;
+    for (i = 0; i < a->o_num; i++)
+    {
+        const AMFObjectProperty *pa = &a->o_props[i], *pb = &b->o_props[i];
+        if (!AVMATCH(&pa->p_name, &pb->p_name) || pa->p_type != pb->p_type)
+            return 0;
+        if ((pa->p_type == AMF_NUMBER || pa->p_type == AMF_BOOLEAN) && pa->p_vu.p_number != pb->p_vu.p_number)
+            return 0;
+        if (pa->p_type == AMF_STRING && !AVMATCH(&pa->p_vu.p_aval, &pb->p_vu.p_aval))
+            return 0;
+        if (pa->p_type == AMF_OBJECT && !amf_same(&pa->p_vu.p_object, &pb->p_vu.p_object))
+            return 0;
+    }
+    return 1;
+}
+
+static int count_str(const char *buf, int size, const char *str)
+{
+    int i, n = 0, len = strlen(str);
+    for (i = 0; i + len <= size; i++)
+        n += !memcmp(buf + i, str, len);
+    return n;
+}
+
+// encode -> decode must give back the source tree, with refs actually in use
+static int check_amf3_roundtrip()
+{
+    char body[512], buf3[512], *end3;
+    int size = gen_amf_nested(body, sizeof(body)), size3, ok;
+    AMF3Encoder enc;
+    AMFObjectProperty src, dst;
+
+    memset(&src, 0, sizeof(src));
+    src.p_type = AMF_OBJECT;
+    if (AMF_Decode(&src.p_vu.p_object, body + 1, size - 1, TRUE) < 0)
+        return 0;
+    AMF3Encoder_Init(&enc);
+    end3 = AMF3Prop_Encode(&enc, &src, buf3, buf3 + sizeof(buf3));
+    ok = end3 != NULL;
+    if (ok)
+    {
+        size3 = end3 - buf3;
+        ok = AMF3_DecodeValue(&dst, buf3, size3, NULL) == size3 && dst.p_type == AMF_OBJECT &&
+            amf_same(&src.p_vu.p_object, &dst.p_vu.p_object);
+        if (dst.p_type == AMF_OBJECT)
+            AMF_Reset(&dst.p_vu.p_object);
+        // three objects with one traits entry, each repeated string written once
+        ok = ok && enc.e_numTraits == 1 && count_str(buf3, size3, "live") == 1 &&
+            count_str(buf3, size3, "codec") == 1 && count_str(buf3, size3, "level") == 1;
+    }
+    AMF_Reset(&src.p_vu.p_object);
+    return ok;
+}
+
+static void bench_amf3()
+{
+    char body[1024], buf3[1024], scratch[4096], *end3;
+    int size = gen_amf(body, sizeof(body)), size3, i, check = 0;
+    AMF3Encoder enc;
+    AMFObject obj;
+    AMFObjectProperty prop;
+    AMFArena arena;
+    uint64_t t0, t1;
+    double heap, arena_ns;
+
+    AMF_Decode(&obj, body, size, FALSE);
+    AMF3Encoder_Init(&enc);
+    end3 = AMF3Prop_Encode(&enc, &obj.o_props[2], buf3, buf3 + sizeof(buf3));
+    AMF_Reset(&obj);
+    if (!end3)
+    {
+        printf("error: amf3 encode failed\n");
+        return;
+    }
+    size3 = end3 - buf3;
+
+    t0 = GetTime();
+    for (i = 0; i < AMF_LOOPS; i++)
+    {
+        check += AMF3_DecodeValue(&prop, buf3, size3, NULL);
+        check += prop.p_vu.p_object.o_num;
+        AMFProp_Reset(&prop);
+    }
+    t1 = GetTime();
+    heap = (t1 - t0)*1000.0/AMF_LOOPS;
+    printf("amf3 decode heap:  %6.1f ns/cmd (%d bytes, amf0 %d)\n", heap, size3, size);
+
+    AMF_ArenaInit(&arena, scratch, sizeof(scratch));
+    t0 = GetTime();
+    for (i = 0; i < AMF_LOOPS; i++)
+    {
+        check -= AMF3_DecodeValue(&prop, buf3, size3, &arena);
+        check -= prop.p_vu.p_object.o_num;
+        AMF_ArenaReset(&arena);
+    }
+    t1 = GetTime();
+    AMF_ArenaFree(&arena);
+    arena_ns = (t1 - t0)*1000.0/AMF_LOOPS;
+    printf("amf3 decode arena: %6.1f ns/cmd (%.1fx)\n", arena_ns, heap/arena_ns);
+    if (check)
+        printf("error: amf3 arena decode mismatch\n");
+    if (!check_amf3_roundtrip())
+        printf("error: amf3 encode/decode roundtrip mismatch\n");
+}
+
+#define CMD_LOOPS 4000000
+
+static const AVal av_connect = AVC("connect"), av_app = AVC("app"), av_type = AVC("type"), av_nonprivate = AVC("nonprivate");
+static const AVal av_flashVer = AVC("flashVer"), av_tcUrl = AVC("tcUrl"), av_objectEncoding = AVC("objectEncoding");
+static const AVal av_publish = AVC("publish"), av_live = AVC("live");
+volatile int g_txn;
+
+// field by field, the way SendConnectPacket/SendPublish encode without templates
+#ifdef _MSC_VER
+__declspec(noinline)
+#else
+__attribute__((noinline))
+#endif
+static int encode_cmds(char *buf, char *pend, const AVal *app, const AVal *flashVer, const AVal *tcUrl, const AVal *playpath, int txn)
+{
+    char *enc = buf;
+    enc = AMF_EncodeString(enc, pend, &av_connect);
+    enc = AMF_EncodeNumber(enc, pend, txn);
+    *enc++ = AMF_OBJECT;
+    enc = AMF_EncodeNamedString(enc, pend, &av_app, app);
+    enc = AMF_EncodeNamedString(enc, pend, &av_type, &av_nonprivate);
+    enc = AMF_EncodeNamedString(enc, pend, &av_flashVer, flashVer);
+    enc = AMF_EncodeNamedString(enc, pend, &av_tcUrl, tcUrl);
+    enc = AMF_EncodeNamedNumber(enc, pend, &av_objectEncoding, 0.0);
+    enc = AMF_EncodeInt24(enc, pend, AMF_OBJECT_END);
+    enc = AMF_EncodeString(enc, pend, &av_publish);
+    enc = AMF_EncodeNumber(enc, pend, txn + 1);
+    *enc++ = AMF_NULL;
+    enc = AMF_EncodeString(enc, pend, playpath);
+    enc = AMF_EncodeString(enc, pend, &av_live);
+    return enc - buf;
+}
+
+// copy of the pre-encoded bodies with transaction ids patched, as the command templates do
+#ifdef _MSC_VER
+__declspec(noinline)
+#else
+__attribute__((noinline))
+#endif
+static int patch_cmds(char *buf, const char *tmpl, int connect_size, int publish_size, int txn)
+{
+    memcpy(buf, tmpl, connect_size);
+    AMF_EncodeNumber(buf + 3 + av_connect.av_len, buf + connect_size, txn);
+    memcpy(buf + connect_size, tmpl + connect_size, publish_size);
+    AMF_EncodeNumber(buf + connect_size + 3 + av_publish.av_len, buf + connect_size + publish_size, txn + 1);
+    return connect_size + publish_size;
+}
+
+static void bench_cmds()
+{
+    AVal app = AVC("live"), flashVer = AVC("FMLE/3.0 (compatible; FMSc/1.0)"), tcUrl = AVC("rtmp://localhost:1935/live"), playpath = AVC("stream");
+    char tmpl[1024], buf[1024], *pend = buf + sizeof(buf);
+    int i, connect_size, publish_size, size;
+    uint64_t t0, t1;
+    double fields, patched;
+
+    size = encode_cmds(tmpl, tmpl + sizeof(tmpl), &app, &flashVer, &tcUrl, &playpath, 1);
+    publish_size = 3 + av_publish.av_len + 9 + 1 + 3 + playpath.av_len + 3 + av_live.av_len;
+    connect_size = size - publish_size;
+    if (patch_cmds(buf, tmpl, connect_size, publish_size, 1) != size || memcmp(buf, tmpl, size))
+        printf("error: template mismatch\n");
+
+    t0 = GetTime();
+    for (i = 0; i < CMD_LOOPS; i++)
+        size += encode_cmds(buf, pend, &app, &flashVer, &tcUrl, &playpath, g_txn + i);
+    t1 = GetTime();
+    fields = 2.0*CMD_LOOPS/(t1 - t0);
+    printf("amf cmd fields:    %6.1f M cmd/s\n", fields);
+
+    t0 = GetTime();
+    for (i = 0; i < CMD_LOOPS; i++)
+        size += patch_cmds(buf, tmpl, connect_size, publish_size, g_txn + i);
+    t1 = GetTime();
+    patched = 2.0*CMD_LOOPS/(t1 - t0);
+    printf("amf cmd templates: %6.1f M cmd/s (%.1fx) (%d)\n", patched, patched/fields, size & 1);
+}
+
+#define LOG_CHUNKS 20000000
+#define LOG_CHUNK  128
+
+// the debug2 logging RTMP_SendPacket does per chunk: a call with an in-function
+// level check (as before the ceiling) against the macros, which drop it here
+static void bench_log()
+{
+    static char body[LOG_CHUNK], out[LOG_CHUNK + 1];
+    int i, sum = 0;
+    uint64_t t0, t1;
+    double called, ceiling;
+
+    t0 = GetTime();
+    for (i = 0; i < LOG_CHUNKS; i++)
+    {
+        RTMP_LogAt(RTMP_LOGDEBUG2, "%s: fd=%d, size=%d", __FUNCTION__, i, LOG_CHUNK);
+        RTMP_LogHexStringAt(RTMP_LOGDEBUG2, (uint8_t *)out, 1);
+        RTMP_LogHexStringAt(RTMP_LOGDEBUG2, (uint8_t *)body, LOG_CHUNK);
+        out[0] = (char)(0xc0 | i);
+        memcpy(out + 1, body, LOG_CHUNK);
+        sum += out[i & (LOG_CHUNK - 1)];
+    }
+    t1 = GetTime();
+    called = (t1 - t0)*1000.0/LOG_CHUNKS;
+    printf("log per chunk call: %6.2f ns/chunk\n", called);
+
+    t0 = GetTime();
+    for (i = 0; i < LOG_CHUNKS; i++)
+    {
+        RTMP_Log(RTMP_LOGDEBUG2, "%s: fd=%d, size=%d", __FUNCTION__, i, LOG_CHUNK);
+        RTMP_LogHexString(RTMP_LOGDEBUG2, (uint8_t *)out, 1);
+        RTMP_LogHexString(RTMP_LOGDEBUG2, (uint8_t *)body, LOG_CHUNK);
+        out[0] = (char)(0xc0 | i);
+        memcpy(out + 1, body, LOG_CHUNK);
+        sum += out[i & (LOG_CHUNK - 1)];
+    }
+    t1 = GetTime();
+    ceiling = (t1 - t0)*1000.0/LOG_CHUNKS;
+    printf("log per chunk ceil: %6.2f ns/chunk (%.2f ns saved) (%d)\n", ceiling, called - ceiling, sum & 1);
+}
+
+// loopback tcp pair, so the chunk benchmarks pay the same syscalls as real traffic
+static int tcp_listen(int *port)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 8) ||
+        getsockname(fd, (struct sockaddr *)&addr, &len))
+    {
+        if (fd >= 0)
+            closesocket(fd);
+        return -1;
+    }
+    *port = ntohs(addr.sin_port);
+    return fd;
+}
+
+static int tcp_pair(int fds[2])
+{
+    struct sockaddr_in addr;
+    int port, on = 1, lfd = tcp_listen(&port);
+    if (lfd < 0)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    fds[0] = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (fds[0] < 0 || connect(fds[0], (struct sockaddr *)&addr, sizeof(addr)))
+        fds[1] = -1;
+    else
+        fds[1] = accept(lfd, NULL, NULL);
+    closesocket(lfd);
+    if (fds[1] < 0)
+    {
+        if (fds[0] >= 0)
+            closesocket(fds[0]);
+        return -1;
+    }
+    setsockopt(fds[0], IPPROTO_TCP, TCP_NODELAY, (char *)&on, sizeof(on));
+    setsockopt(fds[1], IPPROTO_TCP, TCP_NODELAY, (char *)&on, sizeof(on));
+    return 0;
+}
+
+typedef struct BENCH_SINK
+{
+    int fd;
+    char *buf;      // keeps what was read when set, else discards
+    int size, len;
+} BENCH_SINK;
+
+static THREAD_RET THRAPI sink_thread(void *arg)
+{
+    BENCH_SINK *s = (BENCH_SINK *)arg;
+    char tmp[64*1024];
+    int n;
+    while ((n = recv(s->fd, s->buf ? s->buf + s->len : tmp, s->buf ? s->size - s->len : (int)sizeof(tmp), 0)) > 0)
+        if (s->buf)
+            s->len += n;
+    return 0;
+}
+
+typedef struct BENCH_SOURCE
+{
+    int fd, size, loops;
+    const char *buf;
+} BENCH_SOURCE;
+
+static THREAD_RET THRAPI source_thread(void *arg)
+{
+    BENCH_SOURCE *s = (BENCH_SOURCE *)arg;
+    int i, pos, n;
+    for (i = 0; i < s->loops; i++)
+        for (pos = 0; pos < s->size; pos += n)
+            if ((n = send(s->fd, s->buf + pos, s->size - pos, 0)) <= 0)
+                return 0;
+    return 0;
+}
+
+static void bench_packet_init(RTMPPacket *pkt, char *buf, int i, int size)
+{
+    memset(pkt, 0, sizeof(*pkt));
+    pkt->m_headerType = i ? RTMP_PACKET_SIZE_MEDIUM : RTMP_PACKET_SIZE_LARGE;
+    pkt->m_packetType = RTMP_PACKET_TYPE_VIDEO;
+    pkt->m_nChannel = 6;
+    pkt->m_nTimeStamp = i*33;
+    pkt->m_nInfoField2 = 1;
+    pkt->m_nBodySize = size;
+    pkt->m_body = buf + RTMP_MAX_HEADER_SIZE;
+}
+
+static int call_invoke(RTMP *r, const AVal *method, int txn, int send)
+{
+    char pbuf[RTMP_MAX_HEADER_SIZE + 64], *pend = pbuf + sizeof(pbuf), *enc;
+    RTMPPacket packet;
+    memset(&packet, 0, sizeof(packet));
+    packet.m_nChannel = 0x03;
+    packet.m_headerType = RTMP_PACKET_SIZE_LARGE;
+    packet.m_packetType = RTMP_PACKET_TYPE_INVOKE;
+    packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
+    enc = AMF_EncodeString(packet.m_body, pend, method);
+    enc = AMF_EncodeNumber(enc, pend, txn);
+    *enc++ = AMF_NULL;
+    packet.m_nBodySize = enc - packet.m_body;
+    return send ? RTMP_SendPacket(r, &packet, TRUE) : RTMP_ClientPacket(r, &packet) >= 0;
+}
+
+#define CALL_DUPS 20
+
+// calls reusing a pending txn all stay queued and are answered in send order,
+// enough of them to grow the call table twice
+static int check_call_txn()
+{
+    static const AVal av_pause = AVC("pause"), av_play = AVC("play"), av__result = AVC("_result");
+    RTMP *r = RTMP_Alloc();
+    int fds[2], i, ok = 1;
+    RTMP_Init(r);
+    if (tcp_pair(fds))
+    {
+        RTMP_Free(r);
+        return 0;
+    }
+    r->m_sb.sb_socket = fds[0];
+    for (i = 0; i < CALL_DUPS && ok; i++)
+        ok = call_invoke(r, i == CALL_DUPS - 1 ? &av_play : &av_pause, 5, 1);
+    ok = ok && r->m_numCalls == CALL_DUPS;
+    // only the last _result may answer the play call
+    for (i = 0; i < CALL_DUPS && ok; i++)
+        ok = call_invoke(r, &av__result, 5, 0) && r->m_numCalls == CALL_DUPS - 1 - i &&
+            r->m_bPlaying == (i == CALL_DUPS - 1);
+    RTMP_Close(r);
+    RTMP_Free(r);
+    closesocket(fds[1]);
+    return ok;
+}
+
+#define CHUNK_MSGS  20000
+#define CHUNK_MSG   8192
+
+static void bench_chunks(int chunk_size)
+{
+    static char body[RTMP_MAX_HEADER_SIZE + CHUNK_MSG], *stream;
+    int fds[2], i, n, msgs;
+    RTMP *w = RTMP_Alloc(), *r = RTMP_Alloc();
+    RTMPPacket pkt;
+    BENCH_SINK sink = { 0 };
+    BENCH_SOURCE source = { 0 };
+    HANDLE thread;
+    uint64_t t0, t1;
+    double send_us, read_us;
+
+    RTMP_Init(w);
+    RTMP_Init(r);
+    w->m_outChunkSize = r->m_inChunkSize = chunk_size;
+    if (tcp_pair(fds))
+        goto done;
+    // RTMP_SendPacket chunking, the far end only drains
+    w->m_sb.sb_socket = fds[0];
+    sink.fd = fds[1];
+    thread = thread_create(sink_thread, &sink);
+    t0 = GetTime();
+    for (i = 0; i < CHUNK_MSGS; i++)
+    {
+        bench_packet_init(&pkt, body, i, CHUNK_MSG);
+        RTMP_SendPacket(w, &pkt, FALSE);
+    }
+    t1 = GetTime();
+    send_us = (double)(t1 - t0);
+    shutdown(fds[0], SHUT_WR);
+    thread_wait(thread);
+    thread_close(thread);
+    RTMP_Close(w);
+    closesocket(fds[1]);
+
+    // the same stream captured once, then replayed into RTMP_ReadPacket
+    msgs = 1000;
+    stream = (char *)malloc(msgs*(CHUNK_MSG + CHUNK_MSG/chunk_size*4 + 64));
+    if (!stream || tcp_pair(fds))
+        goto done;
+    w->m_sb.sb_socket = fds[0];
+    sink.fd = fds[1];
+    sink.buf = stream;
+    sink.size = msgs*(CHUNK_MSG + CHUNK_MSG/chunk_size*4 + 64);
+    thread = thread_create(sink_thread, &sink);
+    for (i = 0; i < msgs; i++)
+    {
+        bench_packet_init(&pkt, body, i, CHUNK_MSG);
+        RTMP_SendPacket(w, &pkt, FALSE);
+    }
+    shutdown(fds[0], SHUT_WR);
+    thread_wait(thread);
+    thread_close(thread);
+    RTMP_Close(w);
+    closesocket(fds[1]);
+    if (tcp_pair(fds))
+        goto done;
+    r->m_sb.sb_socket = fds[1];
+    source.fd = fds[0];
+    source.buf = stream;
+    source.size = sink.len;
+    source.loops = CHUNK_MSGS/msgs;
+    thread = thread_create(source_thread, &source);
+    memset(&pkt, 0, sizeof(pkt));
+    t0 = GetTime();
+    for (n = 0; n < CHUNK_MSGS && RTMP_ReadPacket(r, &pkt); )
+        if (RTMPPacket_IsReady(&pkt))
+        {
+            RTMPPacket_Free(&pkt);
+            n++;
+        }
+    t1 = GetTime();
+    read_us = (double)(t1 - t0);
+    thread_wait(thread);
+    thread_close(thread);
+    closesocket(fds[0]);
+    RTMP_Close(r);
+    printf("rtmp send %5d chunk: %7.0f msg/s %7.1f MB/s\n", chunk_size, CHUNK_MSGS*1e6/send_us, (double)CHUNK_MSGS*CHUNK_MSG/send_us);
+    printf("rtmp read %5d chunk: %7.0f msg/s %7.1f MB/s%s\n", chunk_size, n*1e6/read_us, (double)n*CHUNK_MSG/read_us,
+        n == CHUNK_MSGS ? "" : " (error: short read)");
+done:
+    free(stream);
+    stream = NULL;
+    RTMP_Close(w);
+    RTMP_Close(r);
+    RTMP_Free(w);
+    RTMP_Free(r);
+}
+
+typedef struct BENCH_WRITER
+{
+    RTMP *r;
+    int msgs;
+} BENCH_WRITER;
+
+static THREAD_RET THRAPI writer_thread(void *arg)
+{
+    static char body[RTMP_MAX_HEADER_SIZE + CHUNK_MSG];
+    BENCH_WRITER *w = (BENCH_WRITER *)arg;
+    RTMPPacket pkt;
+    int i;
+    for (i = 0; i < w->msgs; i++)
+    {
+        bench_packet_init(&pkt, body, i, CHUNK_MSG);
+        if (!RTMP_SendPacket(w->r, &pkt, FALSE))
+            break;
+    }
+    return 0;
+}
+
+// one chunk stream end to end over each transport, the difference to the
+// memory pipe is what the kernel costs
+static void bench_transports()
+{
+    static const char *names[] = { "tcp loopback", "unix socketpair", "memory pipe" };
+    int t, n, fds[2];
+    for (t = 0; t < 3; t++)
+    {
+        RTMP *w = RTMP_Alloc(), *r = RTMP_Alloc();
+        BENCH_WRITER wr;
+        RTMPPacket pkt;
+        HANDLE thread;
+        uint64_t t0, t1;
+        int ok;
+        RTMP_Init(w);
+        RTMP_Init(r);
+        w->m_outChunkSize = r->m_inChunkSize = 4096;
+        if (0 == t && (ok = !tcp_pair(fds)))
+        {
+            w->m_sb.sb_socket = fds[0];
+            r->m_sb.sb_socket = fds[1];
+        } else if (t)
+            ok = 1 == t ? RTMP_SocketPair(w, r) : RTMP_Pipe(w, r, 0);
+        if (ok)
+        {
+            wr.r = w;
+            wr.msgs = CHUNK_MSGS;
+            memset(&pkt, 0, sizeof(pkt));
+            t0 = GetTime();
+            thread = thread_create(writer_thread, &wr);
+            for (n = 0; n < CHUNK_MSGS && RTMP_ReadPacket(r, &pkt); )
+                if (RTMPPacket_IsReady(&pkt))
+                {
+                    RTMPPacket_Free(&pkt);
+                    n++;
+                }
+            t1 = GetTime();
+            thread_wait(thread);
+            thread_close(thread);
+            printf("transport %-16s %7.0f msg/s %7.1f MB/s%s\n", names[t], n*1e6/(t1 - t0), (double)n*CHUNK_MSG/(t1 - t0),
+                n == CHUNK_MSGS ? "" : " (error: short read)");
+        }
+        RTMP_Close(w);
+        RTMP_Close(r);
+        RTMP_Free(w);
+        RTMP_Free(r);
+    }
+}
+
+#ifndef _WIN32
+#define SPLIT_MSGS 40
+#define SPLIT_MSG  300
+
+typedef struct BENCH_SPLIT
+{
+    int fd, size;
+    const char *wire;
+} BENCH_SPLIT;
+
+// the chunk stream as RTMPT responses of random length, each sent in pieces
+// of up to 16 bytes with pauses, so header lines arrive cut at any point
+static THREAD_RET THRAPI split_thread(void *arg)
+{
+    BENCH_SPLIT *s = (BENCH_SPLIT *)arg;
+    char resp[512];
+    int pos, len, n, off, piece;
+    for (pos = 0; pos < s->size; pos += len)
+    {
+        len = 1 + rnd() % 400;
+        if (len > s->size - pos)
+            len = s->size - pos;
+        n = snprintf(resp, sizeof(resp), "HTTP/1.1 200 OK\r\nContent-Type: application/x-fcs\r\nContent-Length: %d\r\n\r\n", len + 1);
+        resp[n++] = 1;  // polling hint
+        memcpy(resp + n, s->wire + pos, len);
+        n += len;
+        for (off = 0; off < n; off += piece)
+        {
+            piece = 1 + rnd() % 16;
+            if (piece > n - off)
+                piece = n - off;
+            if (send(s->fd, resp + off, piece, 0) != piece)
+                return 0;
+            if (!(rnd() % 4))
+                thread_sleep(1);
+        }
+    }
+    return 0;
+}
+
+static void rtmpt_setup(RTMP *r)
+{
+    static char host[] = "localhost";
+    r->Link.protocol = RTMP_PROTOCOL_RTMPT;
+    r->Link.hostname.av_val = host;
+    r->Link.hostname.av_len = sizeof(host) - 1;
+    r->m_clientID.av_val = strdup("/1");
+    r->m_clientID.av_len = 2;
+}
+
+// HTTP_read against responses split inside headers, then the batching deadline:
+// a queued send stays back until the interval is over and RTMP_Flush posts it
+static void bench_rtmpt()
+{
+    static char body[RTMP_MAX_HEADER_SIZE + SPLIT_MSG], wire[SPLIT_MSGS*(SPLIT_MSG + 64)];
+    RTMP *w = RTMP_Alloc(), *sink = RTMP_Alloc(), *feed = RTMP_Alloc(), *r = RTMP_Alloc();
+    BENCH_SPLIT split;
+    RTMPPacket pkt;
+    HANDLE thread;
+    char post[1024];
+    int i, n, size = 0, bad = 0, held, posted;
+
+    RTMP_Init(w);
+    RTMP_Init(sink);
+    RTMP_Init(feed);
+    RTMP_Init(r);
+    if (RTMP_SocketPair(w, sink) && RTMP_SocketPair(feed, r))
+    {
+        for (i = 0; i < SPLIT_MSGS; i++)
+        {
+            bench_packet_init(&pkt, body, i, SPLIT_MSG);
+            memset(pkt.m_body, i, SPLIT_MSG);
+            if (!RTMP_SendPacket(w, &pkt, FALSE))
+                break;
+        }
+        while (size < (int)sizeof(wire) && (n = recv(sink->m_sb.sb_socket, wire + size, sizeof(wire) - size, MSG_DONTWAIT)) > 0)
+            size += n;
+        rtmpt_setup(r);
+        split.fd = feed->m_sb.sb_socket;
+        split.wire = wire;
+        split.size = size;
+        thread = thread_create(split_thread, &split);
+        memset(&pkt, 0, sizeof(pkt));
+        for (n = 0; n < SPLIT_MSGS && RTMP_ReadPacket(r, &pkt); )
+            if (RTMPPacket_IsReady(&pkt))
+            {
+                bad += pkt.m_nBodySize != SPLIT_MSG || pkt.m_body[0] != (char)n || pkt.m_body[SPLIT_MSG - 1] != (char)n;
+                RTMPPacket_Free(&pkt);
+                n++;
+            }
+        thread_wait(thread);
+        thread_close(thread);
+        printf("rtmpt split responses: %d/%d messages%s\n", n, SPLIT_MSGS,
+            n == SPLIT_MSGS && !bad ? "" : " (error: lost or corrupt)");
+
+        RTMP_Close(w);
+        RTMP_Close(sink);
+        rtmpt_setup(w);
+        w->m_batchMS = 20;
+        RTMP_SocketPair(w, sink);
+        bench_packet_init(&pkt, body, 0, SPLIT_MSG);
+        RTMP_SendPacket(w, &pkt, FALSE);
+        held = recv(sink->m_sb.sb_socket, post, sizeof(post), MSG_DONTWAIT) <= 0;
+        RTMP_Flush(w);
+        thread_sleep(w->m_batchMS + 5);
+        RTMP_Flush(w);
+        posted = recv(sink->m_sb.sb_socket, post, sizeof(post) - 1, MSG_DONTWAIT);
+        posted = posted > 0 && !strncmp(post, "POST /send/1/", 13);
+        printf("rtmpt batch deadline: %s\n", held && posted ? "held, then posted by RTMP_Flush" : "error: not posted on time");
+    }
+    RTMP_Close(w);
+    RTMP_Close(sink);
+    RTMP_Close(feed);
+    RTMP_Close(r);
+    RTMP_Free(w);
+    RTMP_Free(sink);
+    RTMP_Free(feed);
+    RTMP_Free(r);
+}
+#endif
+
+#define MUX_SECONDS 40   // of stream time
+#define MUX_SPEED   20   // faster than realtime
+
+typedef struct BENCH_MUX_SRC
+{
+    MRTMP_Mux *mux;
+    uint64_t start;
+    int track, period_ms, size;
+} BENCH_MUX_SRC;
+
+// an encoder: frames at its own rate, a burst now and then
+static THREAD_RET THRAPI mux_src_thread(void *arg)
+{
+    static uint8_t frame[2][4096];
+    BENCH_MUX_SRC *src = (BENCH_MUX_SRC *)arg;
+    uint32_t dts, n;
+    for (n = dts = 0; dts < MUX_SECONDS*1000; n++, dts += src->period_ms)
+    {   // video in I P B B decode order, pts one frame behind
+        uint32_t pts = dts + (MRTMP_MUX_AUDIO == src->track ? 0 : n % 3 == 1 ? 3*src->period_ms : n ? 0 : src->period_ms);
+        uint64_t due = src->start + (uint64_t)dts*1000/MUX_SPEED;
+        if (!(rnd() % 50))
+            due += 200000/MUX_SPEED;
+        while (GetTime() < due)
+            thread_sleep(1);
+        if (mrtmp_mux_write(src->mux, src->track, frame[src->track], src->size, pts, dts, MRTMP_MUX_KEYFRAME))
+            break;
+    }
+    return 0;
+}
+
+typedef struct BENCH_MUX_SINK
+{
+    RTMP *r;
+    int frames, backwards, bframes;
+} BENCH_MUX_SINK;
+
+static THREAD_RET THRAPI mux_sink_thread(void *arg)
+{
+    BENCH_MUX_SINK *s = (BENCH_MUX_SINK *)arg;
+    RTMPPacket pkt;
+    uint32_t last = 0;
+    memset(&pkt, 0, sizeof(pkt));
+    while (RTMP_ReadPacket(s->r, &pkt))
+        if (RTMPPacket_IsReady(&pkt))
+        {
+            MINIRTMP_VIDEO_TAG tag;
+            if (s->frames++ && pkt.m_nTimeStamp < last)
+                s->backwards++;
+            if (RTMP_PACKET_TYPE_VIDEO == pkt.m_packetType && !minirtmp_parse_video_tag((uint8_t *)pkt.m_body, pkt.m_nBodySize, &tag))
+                s->bframes += tag.cts > 0;
+            last = pkt.m_nTimeStamp;
+            RTMPPacket_Free(&pkt);
+        }
+    RTMPPacket_Free(&pkt);
+    return 0;
+}
+
+// audio and video from their own threads through the interleaver, the far
+// end of a memory pipe checks the timestamps never go back
+static void bench_mux()
+{
+    MINIRTMP pub;
+    MRTMP_Mux mux;
+    BENCH_MUX_SRC src[2];
+    BENCH_MUX_SINK sink;
+    HANDLE threads[3];
+    uint64_t t0, t1;
+    int i;
+
+    memset(&pub, 0, sizeof(pub));
+    memset(&sink, 0, sizeof(sink));
+    pub.rtmp = RTMP_Alloc();
+    sink.r = RTMP_Alloc();
+    RTMP_Init(pub.rtmp);
+    RTMP_Init(sink.r);
+    pub.video_codec = MINIRTMP_CODEC_AVC;
+    if (!RTMP_Pipe(pub.rtmp, sink.r, 0) ||
+        mrtmp_mux_init(&mux, &pub, 1 << MRTMP_MUX_VIDEO | 1 << MRTMP_MUX_AUDIO, 0, 0))
+        goto done;
+    threads[2] = thread_create(mux_sink_thread, &sink);
+    t0 = GetTime();
+    for (i = 0; i < 2; i++)
+    {
+        src[i].mux = &mux;
+        src[i].start = t0;
+        src[i].track = i;
+        src[i].period_ms = MRTMP_MUX_VIDEO == i ? 33 : 21;
+        src[i].size = MRTMP_MUX_VIDEO == i ? 4096 : 256;
+        threads[i] = thread_create(mux_src_thread, &src[i]);
+    }
+    for (i = 0; i < 2; i++)
+    {
+        thread_wait(threads[i]);
+        thread_close(threads[i]);
+    }
+    mrtmp_mux_close(&mux);
+    t1 = GetTime();
+    RTMP_Close(pub.rtmp);
+    thread_wait(threads[2]);
+    thread_close(threads[2]);
+    printf("mux %d frames in %.1f s, %llu late, %d backwards at the sink, %d with cts%s\n", sink.frames, (t1 - t0)/1e6,
+        (unsigned long long)mux.late, sink.backwards, sink.bframes, sink.frames == (int)mux.frames ? "" : " (error: lost frames)");
+done:
+    minirtmp_close(&pub);
+    RTMP_Close(sink.r);
+    RTMP_Free(sink.r);
+}
+
+// In-process peer: answers connect, createStream, publish and play, then
+// relays media from the publishing connection to the playing one.
+#define PEER_CONNS 16
+
+typedef struct BENCH_PEER
+{
+    int fd, port, nconns;
+    HANDLE thread, conns[PEER_CONNS];
+    RTMP *players[PEER_CONNS];
+    volatile int nplayers;  // media goes to the latest one
+    int delay_ms;           // simulated rtt, before the handshake and each reply
+    int burst_us;           // with it set, burst_peak is the most bytes read from a
+    uint64_t burst_peak;    // connection within one such window
+    void *tls;              // server context, connections start with RTMP_TLS_Accept
+} BENCH_PEER;
+
+typedef struct BENCH_CONN
+{
+    BENCH_PEER *peer;
+    RTMP *r;
+} BENCH_CONN;
+
+#define PEER_STREAM_ID 1
+#define PEER_CHUNK     4096
+
+static const AVal av__result = AVC("_result"), av_onStatus = AVC("onStatus"), av_createStream = AVC("createStream");
+static const AVal av_play = AVC("play"), av_level = AVC("level"), av_status = AVC("status"), av_code = AVC("code");
+static const AVal av_Connect_Success = AVC("NetConnection.Connect.Success");
+static const AVal av_Publish_Start = AVC("NetStream.Publish.Start"), av_Play_Start = AVC("NetStream.Play.Start");
+
+static int peer_reply(BENCH_PEER *peer, RTMP *r, const AVal *method, double txn, const AVal *code, double number)
+{
+    char pbuf[512], *pend = pbuf + sizeof(pbuf), *enc;
+    RTMPPacket packet;
+    if (peer->delay_ms)
+        thread_sleep(peer->delay_ms);
+    memset(&packet, 0, sizeof(packet));
+    packet.m_nChannel = 0x03;
+    packet.m_headerType = RTMP_PACKET_SIZE_LARGE;
+    packet.m_packetType = RTMP_PACKET_TYPE_INVOKE;
+    packet.m_nInfoField2 = AVMATCH(method, &av_onStatus) ? PEER_STREAM_ID : 0;
+    packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
+    enc = AMF_EncodeString(packet.m_body, pend, method);
+    enc = AMF_EncodeNumber(enc, pend, txn);
+    *enc++ = AMF_NULL;
+    if (code)
+    {
+        *enc++ = AMF_OBJECT;
+        enc = AMF_EncodeNamedString(enc, pend, &av_level, &av_status);
+        enc = AMF_EncodeNamedString(enc, pend, &av_code, code);
+        enc = AMF_EncodeInt24(enc, pend, AMF_OBJECT_END);
+    } else
+        enc = AMF_EncodeNumber(enc, pend, number);
+    packet.m_nBodySize = enc - packet.m_body;
+    return RTMP_SendPacket(r, &packet, FALSE);
+}
+
+// returns 1 once the connection became the player
+static int peer_invoke(BENCH_PEER *peer, RTMP *r, RTMPPacket *pkt)
+{
+    AMFReader rd;
+    AVal method;
+    double txn = 0;
+    AMFReader_Init(&rd, pkt->m_body, pkt->m_nBodySize);
+    if (!AMFReader_GetString(&rd, &method))
+        return 0;
+    AMFReader_GetNumber(&rd, &txn);
+    if (AVMATCH(&method, &av_connect))
+    {
+        peer_reply(peer, r, &av__result, txn, &av_Connect_Success, 0);
+        RTMP_SendCtrl(r, 0, 0, 0);
+    } else if (AVMATCH(&method, &av_createStream))
+        peer_reply(peer, r, &av__result, txn, NULL, PEER_STREAM_ID);
+    else if (AVMATCH(&method, &av_publish))
+        peer_reply(peer, r, &av_onStatus, 0, &av_Publish_Start, 0);
+    else if (AVMATCH(&method, &av_play))
+    {
+        RTMPPacket packet;
+        char pbuf[RTMP_MAX_HEADER_SIZE + 4];
+        memset(&packet, 0, sizeof(packet));
+        packet.m_nChannel = 0x02;
+        packet.m_packetType = RTMP_PACKET_TYPE_CHUNK_SIZE;
+        packet.m_nBodySize = 4;
+        packet.m_body = pbuf + RTMP_MAX_HEADER_SIZE;
+        AMF_EncodeInt32(packet.m_body, pbuf + sizeof(pbuf), PEER_CHUNK);
+        RTMP_SendPacket(r, &packet, FALSE);
+        r->m_outChunkSize = PEER_CHUNK;
+        peer_reply(peer, r, &av_onStatus, 0, &av_Play_Start, 0);
+        peer->players[peer->nplayers] = r;
+        peer->nplayers++;
+        return 1;
+    }
+    return 0;
+}
+
+static void peer_relay(BENCH_PEER *peer, RTMPPacket *pkt)
+{
+    int ch = RTMP_PACKET_TYPE_AUDIO == pkt->m_packetType ? 4 : 6;
+    RTMP *player;
+    if (!peer->nplayers)
+        return;
+    player = peer->players[peer->nplayers - 1];
+    pkt->m_nChannel = ch;
+    pkt->m_nInfoField2 = PEER_STREAM_ID;
+    pkt->m_headerType = ch < player->m_channelsAllocatedOut && player->m_vecChannelsOut[ch] ?
+        RTMP_PACKET_SIZE_MEDIUM : RTMP_PACKET_SIZE_LARGE;
+    RTMP_SendPacket(player, pkt, FALSE);
+}
+
+// tumbling windows over the connection input, closed by the next read
+static void peer_burst(BENCH_PEER *peer, RTMP *r, uint64_t *start, uint64_t *bytes)
+{
+    uint64_t now = GetTime(), in = RTMP_STAT_LOAD(&r->m_stats.s_bytesIn);
+    if (now - *start < (uint64_t)peer->burst_us)
+        return;
+    if (in - *bytes > peer->burst_peak)
+        peer->burst_peak = in - *bytes;
+    *start = now;
+    *bytes = in;
+}
+
+static THREAD_RET THRAPI peer_conn_thread(void *arg)
+{
+    BENCH_CONN *c = (BENCH_CONN *)arg;
+    RTMP *r = c->r;
+    RTMPPacket pkt;
+    uint64_t win_start = 0, win_bytes = 0;
+    int player = 0;
+    memset(&pkt, 0, sizeof(pkt));
+    if (c->peer->delay_ms)
+        thread_sleep(2*c->peer->delay_ms); // tcp connect and handshake
+    if ((!c->peer->tls || RTMP_TLS_Accept(r, c->peer->tls)) && RTMP_Serve(r))
+        while (!player && RTMP_ReadPacket(r, &pkt))
+        {
+            if (c->peer->burst_us)
+                peer_burst(c->peer, r, &win_start, &win_bytes);
+            if (!RTMPPacket_IsReady(&pkt))
+                continue;
+            switch (pkt.m_packetType)
+            {
+            case RTMP_PACKET_TYPE_CHUNK_SIZE:
+            case RTMP_PACKET_TYPE_CONTROL: // answers pings
+                RTMP_ClientPacket(r, &pkt);
+                break;
+            case RTMP_PACKET_TYPE_INVOKE:
+                player = peer_invoke(c->peer, r, &pkt);
+                break;
+            case RTMP_PACKET_TYPE_AUDIO:
+            case RTMP_PACKET_TYPE_VIDEO:
+            case RTMP_PACKET_TYPE_INFO:
+                peer_relay(c->peer, &pkt);
+                break;
+            }
+            RTMPPacket_Free(&pkt);
+        }
+    if (!player)
+    {   // the player connection is closed by peer_stop, its reads stop after play
+        RTMP_Close(r);
+        RTMP_Free(r);
+    }
+    free(c);
+    return 0;
+}
+
+static THREAD_RET THRAPI peer_thread(void *arg)
+{
+    BENCH_PEER *peer = (BENCH_PEER *)arg;
+    while (peer->nconns < PEER_CONNS)
+    {
+        BENCH_CONN *c = (BENCH_CONN *)malloc(sizeof(BENCH_CONN));
+        c->peer = peer;
+        c->r = RTMP_Alloc();
+        RTMP_Init(c->r);
+        if (!RTMP_Accept(c->r, peer->fd))
+        {
+            RTMP_Free(c->r);
+            free(c);
+            break;
+        }
+        peer->conns[peer->nconns++] = thread_create(peer_conn_thread, c);
+    }
+    return 0;
+}
+
+// listens on loopback tcp with an ephemeral port unless a url is given
+static int peer_start(BENCH_PEER *peer, const char *url)
+{
+    memset(peer, 0, sizeof(*peer));
+    if ((peer->fd = url ? RTMP_Listen(url) : tcp_listen(&peer->port)) < 0)
+        return -1;
+    peer->thread = thread_create(peer_thread, peer);
+    return 0;
+}
+
+// call after the clients closed, their connection threads end on eof
+static void peer_stop(BENCH_PEER *peer)
+{
+    int i;
+    shutdown(peer->fd, SHUT_RDWR);
+    closesocket(peer->fd);
+    thread_wait(peer->thread);
+    thread_close(peer->thread);
+    for (i = 0; i < peer->nconns; i++)
+    {
+        thread_wait(peer->conns[i]);
+        thread_close(peer->conns[i]);
+    }
+    for (i = 0; i < peer->nplayers; i++)
+    {
+        RTMP_Close(peer->players[i]);
+        RTMP_Free(peer->players[i]);
+    }
+}
+
+typedef struct BENCH_PLAY
+{
+    MINIRTMP rtmp;
+    RTMP_HIST lat;
+    volatile int received;
+    int expect;
+} BENCH_PLAY;
+
+// video body is the avc tag header and nal length, then the send time
+static void bench_note(RTMP_HIST *lat, const char *body, int size)
+{
+    uint64_t sent;
+    if (size < 9 + 8)
+        return;
+    memcpy(&sent, body + 9, 8);
+    RTMP_HistAdd(lat, RTMP_GetTimeUS() - sent);
+}
+
+static THREAD_RET THRAPI play_thread(void *arg)
+{
+    BENCH_PLAY *p = (BENCH_PLAY *)arg;
+    int ret;
+    while (p->received < p->expect && (ret = minirtmp_read(&p->rtmp)) != MINIRTMP_EOF)
+        if (MINIRTMP_OK == ret && RTMP_PACKET_TYPE_VIDEO == p->rtmp.rtmpPacket.m_packetType)
+        {
+            bench_note(&p->lat, p->rtmp.rtmpPacket.m_body, p->rtmp.rtmpPacket.m_nBodySize);
+            p->received++;
+        }
+    return 0;
+}
+
+static void player_cb(void *user, MRTMP_Packet *pkt)
+{
+    BENCH_PLAY *p = (BENCH_PLAY *)user;
+    if (RTMP_PACKET_TYPE_VIDEO == pkt->type)
+    {
+        bench_note(&p->lat, (const char *)pkt->data, pkt->size);
+        p->received++;
+    }
+}
+
+static int publish(MINIRTMP *pub, uint8_t *frame, int size, int count, int pace_us, volatile int *received)
+{
+    uint32_t ts = pub->dts_valid[1] ? pub->last_dts[1] + 1 : 0; // phases share the stream, dts goes on
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        uint64_t now = RTMP_GetTimeUS();
+        memcpy(frame, &now, 8);
+        if (minirtmp_write(pub, frame, size, ts + i, 1, !(i % 30), 0))
+            return i;
+        if (pace_us)
+            while (RTMP_GetTimeUS() - now < (uint64_t)pace_us)
+                thread_sleep(0);
+    }
+    for (i = 0; i < 2000 && *received < count; i++)
+        thread_sleep(1);
+    return count;
+}
+
+// allocations are counted from the stats taken before the run
+static void report(const char *name, int count, int size, uint64_t us, BENCH_PLAY *p, RTMP *pub, RTMP *play, RTMP_STATS st[2])
+{
+    RTMP_STATS ps, ss;
+    RTMP_GetStats(pub, &ps);
+    RTMP_GetStats(play, &ss);
+    ps.s_allocs -= st[0].s_allocs;
+    ss.s_allocs -= st[1].s_allocs;
+    printf("%-18s %7.0f msg/s %6.1f MB/s p50 %5llu us p99 %6llu us, allocs/msg pub %.2f play %.2f%s\n", name,
+        p->received*1e6/us, (double)p->received*size/us,
+        (unsigned long long)RTMP_HistPercentile(&p->lat, 50), (unsigned long long)RTMP_HistPercentile(&p->lat, 99),
+        (double)ps.s_allocs/count, (double)ss.s_allocs/(p->received ? p->received : 1),
+        p->received == count ? "" : " (error: lost messages)");
+}
+
+typedef struct BENCH_CAPTURE
+{
+    const char *url, *path;
+    int expect;             // video messages to record, 0 to run for the whole time
+    int seconds;
+    volatile int ready, received;
+} BENCH_CAPTURE;
+
+// plays the url with its inbound bytes recorded from the handshake on
+static THREAD_RET THRAPI capture_thread(void *arg)
+{
+    BENCH_CAPTURE *c = (BENCH_CAPTURE *)arg;
+    RTMP *r = RTMP_Alloc();
+    RTMPPacket pkt;
+    uint64_t end = GetTime() + (uint64_t)c->seconds*1000000;
+    memset(&pkt, 0, sizeof(pkt));
+    RTMP_Init(r);
+    if (!RTMP_SetupURL(r, (char *)c->url) || !RTMP_CaptureOpen(r, c->path) ||
+        !RTMP_Connect(r, NULL) || !RTMP_ConnectStream(r, 0))
+    {
+        c->ready = -1;
+        goto done;
+    }
+    c->ready = 1;
+    while ((!c->expect || c->received < c->expect) && GetTime() < end && RTMP_ReadPacket(r, &pkt))
+        if (RTMPPacket_IsReady(&pkt))
+        {
+            if (RTMP_PACKET_TYPE_VIDEO == pkt.m_packetType)
+                c->received++;
+            RTMP_ClientPacket(r, &pkt);
+            RTMPPacket_Free(&pkt);
+        }
+done:
+    RTMPPacket_Free(&pkt);
+    RTMP_Close(r);
+    RTMP_Free(r);
+    return 0;
+}
+
+// parses a capture the way the player did, nothing touches the network
+static void bench_replay(const char *name, const char *path, int realtime)
+{
+    RTMP *r = RTMP_Alloc();
+    RTMPPacket pkt;
+    RTMP_STATS st;
+    uint64_t t0, t1, bytes = 0;
+    int msgs = 0;
+    memset(&pkt, 0, sizeof(pkt));
+    RTMP_Init(r);
+    if (!RTMP_ReplayOpen(r, path, realtime))
+    {
+        printf("%s can't load %s\n", name, path);
+        RTMP_Free(r);
+        return;
+    }
+    t0 = GetTime();
+    while (RTMP_ReadPacket(r, &pkt))
+        if (RTMPPacket_IsReady(&pkt))
+        {
+            bytes += pkt.m_nBodySize;
+            msgs++;
+            RTMP_ClientPacket(r, &pkt);
+            RTMPPacket_Free(&pkt);
+        }
+    t1 = GetTime() + 1;
+    RTMP_GetStats(r, &st);
+    printf("%s %7.0f msg/s %7.1f MB/s, %d msgs in %llu chunks, allocs/msg %.2f\n", name,
+        msgs*1e6/(t1 - t0), (double)bytes/(t1 - t0), msgs, (unsigned long long)st.s_chunksIn,
+        (double)st.s_allocs/(msgs ? msgs : 1));
+    RTMPPacket_Free(&pkt);
+    RTMP_Close(r);
+    RTMP_Free(r);
+}
+
+#define LOOP_MSGS    50000
+#define LOOP_MSG     1024
+#define LATENCY_MSGS 1000
+#define LATENCY_MSG  4096
+#define LATENCY_US   1000
+#define BENCH_CAPTURE_FILE "minirtmp_bench.cap"
+#define BENCH_UNIX_URL     "rtmp+unix:///tmp/minirtmp_bench.sock"
+
+// unpaced for throughput, then paced so latency is not queueing behind the previous frames
+static void loopback_phases(const char *name, const char *url, MINIRTMP *pub, BENCH_PLAY *play)
+{
+    static uint8_t frame[LATENCY_MSG];
+    RTMP_STATS st[2];
+    HANDLE thread;
+    char label[32];
+    int phase;
+    uint64_t t0, t1;
+
+    if (minirtmp_init(&play->rtmp, url, 0))
+    {
+        printf("%s: can't play from peer\n", name);
+        return;
+    }
+    for (phase = 0; phase < 2; phase++)
+    {
+        int count = phase ? LATENCY_MSGS : LOOP_MSGS, size = phase ? LATENCY_MSG : LOOP_MSG;
+        memset(&play->lat, 0, sizeof(play->lat));
+        play->received = 0;
+        play->expect = count;
+        RTMP_GetStats(pub->rtmp, &st[0]);
+        RTMP_GetStats(play->rtmp.rtmp, &st[1]);
+        thread = thread_create(play_thread, play);
+        t0 = GetTime();
+        count = publish(pub, frame, size, count, phase ? LATENCY_US : 0, &play->received);
+        t1 = GetTime();
+        thread_wait(thread);
+        thread_close(thread);
+        snprintf(label, sizeof(label), "%s %s:", name, phase ? "paced" : "publish");
+        report(label, count, size, t1 - t0, play, pub->rtmp, play->rtmp.rtmp, st);
+    }
+    minirtmp_close(&play->rtmp);
+}
+
+// publish -> peer -> play through the library over loopback tcp, then the
+// same stream captured and replayed, and played through MRTMP_Player
+static void bench_loopback()
+{
+    static uint8_t frame[LATENCY_MSG];
+    BENCH_PEER peer;
+    BENCH_PLAY *play = (BENCH_PLAY *)calloc(1, sizeof(BENCH_PLAY));
+    MINIRTMP pub;
+    MRTMP_Player *player = (MRTMP_Player *)calloc(1, sizeof(MRTMP_Player));
+    BENCH_CAPTURE cap;
+    HANDLE thread;
+    RTMP_STATS st[2];
+    char url[64];
+    int n;
+    uint64_t t0, t1;
+
+    if (!play || !player || peer_start(&peer, NULL))
+        goto done;
+    snprintf(url, sizeof(url), "rtmp://127.0.0.1:%d/live/bench", peer.port);
+    if (minirtmp_init(&pub, url, 1))
+    {
+        printf("loopback: can't connect to peer\n");
+        goto stop;
+    }
+    loopback_phases("loopback", url, &pub, play);
+
+    // the unpaced run recorded by a player of its own, then parsed from the capture
+    memset(&cap, 0, sizeof(cap));
+    cap.url = url;
+    cap.path = BENCH_CAPTURE_FILE;
+    cap.expect = LOOP_MSGS;
+    cap.seconds = 10;
+    n = peer.nplayers;
+    thread = thread_create(capture_thread, &cap);
+    while (cap.ready >= 0 && peer.nplayers == n)
+        thread_sleep(1);
+    if (cap.ready >= 0)
+        publish(&pub, frame, LOOP_MSG, LOOP_MSGS, 0, &cap.received);
+    thread_wait(thread);
+    thread_close(thread);
+    if (cap.received == LOOP_MSGS)
+        bench_replay("replay capture:   ", BENCH_CAPTURE_FILE, 0);
+    else
+        printf("replay capture: error: recorded %d of %d messages\n", cap.received, LOOP_MSGS);
+    remove(BENCH_CAPTURE_FILE);
+
+    // same paced run through the player and its packet queue
+    mrtmp_player_init(player);
+    mrtmp_set_packet_callback(player, player_cb, play);
+    memset(&play->lat, 0, sizeof(play->lat));
+    play->received = 0;
+    if (MRTMP_OK == mrtmp_open_url(player, url))
+    {
+        RTMP_GetStats(pub.rtmp, &st[0]);
+        RTMP_GetStats(player->rtmp.rtmp, &st[1]);
+        mrtmp_play(player);
+        t0 = GetTime();
+        publish(&pub, frame, LATENCY_MSG, LATENCY_MSGS, LATENCY_US, &play->received);
+        t1 = GetTime();
+        report("loopback player:", LATENCY_MSGS, LATENCY_MSG, t1 - t0, play, pub.rtmp, player->rtmp.rtmp, st);
+        // the reader blocks in recv, eof lets mrtmp_stop join it without the read timeout
+        shutdown(RTMP_Socket(player->rtmp.rtmp), SHUT_RDWR);
+    }
+    mrtmp_close_url(player);
+    minirtmp_close(&pub);
+stop:
+    peer_stop(&peer);
+done:
+    free(play);
+    free(player);
+}
+
+#define POOL_STARTS  4
+#define POOL_PING_MS 20
+#define POOL_RTT_MS  5
+
+// publisher start time over a link with POOL_RTT_MS, connecting from scratch
+// against claiming a warm session, the fast ping keeps health checks going
+static void bench_pool()
+{
+    BENCH_PEER peer;
+    MRTMP_Pool pool;
+    MINIRTMP pub;
+    RTMP_STATS st;
+    char origin[64], url[80];
+    uint64_t t0, cold = 0, warm = 0;
+    int i, n;
+    uint64_t pings = 0;
+
+    if (peer_start(&peer, NULL))
+        return;
+    peer.delay_ms = POOL_RTT_MS;
+    snprintf(origin, sizeof(origin), "rtmp://127.0.0.1:%d/live", peer.port);
+    snprintf(url, sizeof(url), "%s/bench", origin);
+    for (i = 0; i < POOL_STARTS; i++)
+    {
+        t0 = GetTime();
+        if (minirtmp_init(&pub, url, 1))
+            break;
+        cold += GetTime() - t0;
+        minirtmp_close(&pub);
+    }
+    if (!mrtmp_pool_init(&pool, POOL_PING_MS))
+    {
+        mrtmp_pool_add(&pool, origin, 1, 1);
+        for (i = 0; i < POOL_STARTS; i++)
+        {
+            for (n = 0; n < 1000 && !pool.origins[0].num_warm; n++)
+                thread_sleep(1);
+            thread_sleep(5*POOL_PING_MS); // a few pings on the idle session
+            t0 = GetTime();
+            if (mrtmp_pool_claim(&pool, &pub, url, 1))
+                break;
+            warm += GetTime() - t0;
+            RTMP_GetStats(pub.rtmp, &st);
+            pings += st.s_rtt.h_count;
+            minirtmp_close(&pub);
+        }
+        mrtmp_pool_close(&pool);
+        printf("pool start cold %6.0f us, claimed %6.0f us, %d/%d warm, %llu pongs while idle, %llu evicted\n",
+            (double)cold/POOL_STARTS, (double)warm/POOL_STARTS, (int)pool.hits, POOL_STARTS, (unsigned long long)pings,
+            (unsigned long long)pool.evicted);
+    }
+    peer_stop(&peer);
+}
+
+#define RECONNECT_MSGS 300
+#define RECONNECT_CUT  100 // cut after this one, the last keyframe was 90
+#define RECONNECT_US   2000
+
+// publisher connection dropped mid stream: stall of the write that
+// reconnects and what the player gets, headers and gop again plus the rest
+static void bench_reconnect()
+{
+    static uint8_t frame[LATENCY_MSG];
+    BENCH_PEER peer;
+    BENCH_PLAY *play = (BENCH_PLAY *)calloc(1, sizeof(BENCH_PLAY));
+    MINIRTMP pub;
+    RTMP_STATS st;
+    HANDLE thread;
+    char url[64];
+    uint64_t t0, stall = 0;
+    int i, sent, expect = RECONNECT_MSGS + RECONNECT_CUT % 30 + 1;
+
+    if (!play || peer_start(&peer, NULL))
+        goto done;
+    snprintf(url, sizeof(url), "rtmp://127.0.0.1:%d/live/bench", peer.port);
+    if (minirtmp_init(&pub, url, 1))
+        goto stop;
+    minirtmp_set_reconnect(&pub, 2000, 0);
+    if (minirtmp_init(&play->rtmp, url, 0))
+        goto close;
+    play->expect = expect;
+    thread = thread_create(play_thread, play);
+    while (!peer.nplayers)
+        thread_sleep(1);
+    for (i = 0; i < RECONNECT_MSGS; i++)
+    {
+        t0 = RTMP_GetTimeUS();
+        memcpy(frame, &t0, 8);
+        if (minirtmp_write(&pub, frame, sizeof(frame), i, 1, !(i % 30), 0))
+            break;
+        if (RTMP_GetTimeUS() - t0 > stall)
+            stall = RTMP_GetTimeUS() - t0;
+        if (RECONNECT_CUT == i)
+            shutdown(RTMP_Socket(pub.rtmp), SHUT_RDWR);
+        while (RTMP_GetTimeUS() - t0 < RECONNECT_US)
+            thread_sleep(0);
+    }
+    sent = i;
+    for (i = 0; i < 2000 && play->received < expect; i++)
+        thread_sleep(1);
+    RTMP_GetStats(pub.rtmp, &st);
+    printf("reconnect: %llu in %d frames, longest write %6.0f us, player got %d of %d messages%s\n",
+        (unsigned long long)st.s_reconnects, sent, (double)stall,
+        play->received, expect, play->received == expect ? "" : " (error: lost messages)");
+    shutdown(RTMP_Socket(play->rtmp.rtmp), SHUT_RDWR);
+    thread_wait(thread);
+    thread_close(thread);
+    minirtmp_close(&play->rtmp);
+close:
+    minirtmp_close(&pub);
+stop:
+    peer_stop(&peer);
+done:
+    free(play);
+}
+
+// loopback runs again with tuned sockets, the effective options as read back
+static void bench_sockopts()
+{
+    BENCH_PEER peer;
+    BENCH_PLAY *play = (BENCH_PLAY *)calloc(1, sizeof(BENCH_PLAY));
+    RTMP_SOCKOPTS opts;
+    MINIRTMP pub;
+    RTMP_STATS st;
+    char url[64];
+
+    if (!play || peer_start(&peer, NULL))
+    {
+        free(play);
+        return;
+    }
+    memset(&opts, 0, sizeof(opts));
+    opts.sndbuf = 4*1024*1024;
+    opts.notsentLowat = 128*1024;
+    opts.pacingRate = 1024*1024*1024;
+    strcpy(opts.congestion, "bbr"); // falls back to the default where the module is missing
+    snprintf(url, sizeof(url), "rtmp://127.0.0.1:%d/live/bench", peer.port);
+    if (minirtmp_init_opts(&pub, url, 1, &opts))
+        printf("sockopts: can't connect to peer\n");
+    else
+    {
+        minirtmp_get_stats(&pub, &st);
+        printf("sockopts: sndbuf %llu rcvbuf %llu notsent_lowat %llu pacing %llu B/s busy_poll %llu cc %s\n",
+            (unsigned long long)st.s_sndbuf, (unsigned long long)st.s_rcvbuf, (unsigned long long)st.s_notsentLowat,
+            (unsigned long long)st.s_pacingRate, (unsigned long long)st.s_busyPoll,
+            pub.rtmp->m_congestion[0] ? pub.rtmp->m_congestion : "?");
+        loopback_phases("tuned", url, &pub, play);
+        minirtmp_close(&pub);
+    }
+    peer_stop(&peer);
+    free(play);
+}
+
+#define PACING_FRAMES   60
+#define PACING_FPS      30
+#define PACING_KEY      (192*1024)
+#define PACING_DELTA    (8*1024)
+#define PACING_BITRATE  ((PACING_KEY + (PACING_FPS - 1)*PACING_DELTA)*8)
+#define PACING_BURST_US 5000
+
+// 30 fps with a keyframe a second to the peer, the most bytes it got within
+// 5 ms unpaced and paced: kernel pacing over tcp, held chunks over a unix
+// socket, flushed between frames as minirtmp_flush_wait says they come due.
+// Loopback tcp paces whole 64 KB segments, on a real link they are an mtu.
+static void bench_pacing(const char *name, const char *url_base, int percent)
+{
+    static uint8_t frame[PACING_KEY];
+    BENCH_PEER peer;
+    MINIRTMP pub;
+    RTMP_STATS st;
+    char url[128];
+    uint64_t t0, t, due, longest = 0;
+    int i, wait, res = MINIRTMP_OK;
+
+    if (peer_start(&peer, url_base))
+        return;
+    if (url_base)
+        snprintf(url, sizeof(url), "%s/live/bench", url_base);
+    else
+        snprintf(url, sizeof(url), "rtmp://127.0.0.1:%d/live/bench", peer.port);
+    if (minirtmp_init(&pub, url, 1))
+    {
+        printf("%s: can't connect to peer\n", name);
+        peer_stop(&peer);
+        return;
+    }
+    if (percent)
+        minirtmp_set_pacing(&pub, PACING_BITRATE, percent);
+    minirtmp_get_stats(&pub, &st);
+    peer.burst_us = PACING_BURST_US;
+    t0 = GetTime();
+    for (i = 0; i < PACING_FRAMES && MINIRTMP_ERROR != res; i++)
+    {
+        int key = !(i % PACING_FPS);
+        due = t0 + (uint64_t)i*1000000/PACING_FPS;
+        while ((t = GetTime()) < due && MINIRTMP_ERROR != res)
+        {
+            if (!(wait = minirtmp_flush_wait(&pub)))
+                res = minirtmp_flush(&pub);
+            else
+                thread_sleep(wait > 0 && wait < (int)((due - t + 999)/1000) ? wait : (int)((due - t + 999)/1000));
+        }
+        t = GetTime();
+        if (MINIRTMP_ERROR == res || MINIRTMP_ERROR == (res = minirtmp_write(&pub, frame, key ? PACING_KEY : PACING_DELTA, i*1000/PACING_FPS, 1, key, 0)))
+            break;
+        if (GetTime() - t > longest)
+            longest = GetTime() - t;
+    }
+    while (MINIRTMP_MORE_DATA == res && (wait = minirtmp_flush_wait(&pub)) >= 0)
+    {
+        thread_sleep(wait);
+        res = minirtmp_flush(&pub);
+    }
+    thread_sleep(PACING_BURST_US/1000*2);
+    printf("%-18s %3d frames, peak %4.0f KB per 5 ms, longest write %6.0f us, pacing %llu B/s%s\n", name, i,
+        peer.burst_peak/1024.0, (double)longest, (unsigned long long)st.s_pacingRate,
+        percent && !pub.rtmp->m_paceRate ? " in the kernel" : "");
+    minirtmp_close(&pub);
+    peer_stop(&peer);
+    if (url_base)
+        remove(url_base + sizeof("rtmp+unix://") - 1);
+}
+
+#ifdef CRYPTO
+#define BENCH_TLS_CERT "minirtmp_bench.crt"
+#define BENCH_TLS_KEY  "minirtmp_bench.key"
+
+// throwaway self-signed P-256 certificate for the loopback server
+static int tls_selfsigned(const char *cert, const char *key)
+{
+    EVP_PKEY_CTX *kctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC, NULL);
+    EVP_PKEY *pkey = NULL;
+    X509 *x = X509_new();
+    FILE *f;
+    int ok = kctx && x && EVP_PKEY_keygen_init(kctx) > 0 &&
+        EVP_PKEY_CTX_set_ec_paramgen_curve_nid(kctx, NID_X9_62_prime256v1) > 0 &&
+        EVP_PKEY_keygen(kctx, &pkey) > 0;
+    if (ok)
+    {
+        ASN1_INTEGER_set(X509_get_serialNumber(x), 1);
+        X509_gmtime_adj(X509_getm_notBefore(x), 0);
+        X509_gmtime_adj(X509_getm_notAfter(x), 3600);
+        X509_set_pubkey(x, pkey);
+        X509_NAME_add_entry_by_txt(X509_get_subject_name(x), "CN", MBSTRING_ASC, (const unsigned char *)"127.0.0.1", -1, -1, 0);
+        X509_set_issuer_name(x, X509_get_subject_name(x));
+        ok = X509_sign(x, pkey, EVP_sha256()) > 0;
+    }
+    if (ok && (ok = NULL != (f = fopen(key, "w"))))
+    {
+        ok = PEM_write_PrivateKey(f, pkey, NULL, NULL, 0, NULL, NULL);
+        fclose(f);
+    }
+    if (ok && (ok = NULL != (f = fopen(cert, "w"))))
+    {
+        ok = PEM_write_X509(f, x);
+        fclose(f);
+    }
+    X509_free(x);
+    EVP_PKEY_free(pkey);
+    EVP_PKEY_CTX_free(kctx);
+    return ok;
+}
+
+// the loopback publish -> play over rtmps, the server side is RTMP_TLS_Accept
+static void bench_tls()
+{
+    BENCH_PEER peer;
+    BENCH_PLAY *play = (BENCH_PLAY *)calloc(1, sizeof(BENCH_PLAY));
+    MINIRTMP pub;
+    char url[96];
+    void *ctx = NULL;
+
+    if (!play || !tls_selfsigned(BENCH_TLS_CERT, BENCH_TLS_KEY) ||
+        !(ctx = RTMP_TLS_AllocServerContext(BENCH_TLS_CERT, BENCH_TLS_KEY)))
+        printf("tls: can't set up the server certificate\n");
+    else if (!peer_start(&peer, NULL))
+    {
+        peer.tls = ctx;
+        snprintf(url, sizeof(url), "rtmps://127.0.0.1:%d/live/bench tlsNoVerify=1", peer.port);
+        if (minirtmp_init(&pub, url, 1))
+            printf("tls: can't connect to peer\n");
+        else
+        {
+            printf("tls: %s, kTLS send %s\n", SSL_get_version((SSL *)pub.rtmp->m_sb.sb_ssl), pub.rtmp->m_sb.sb_ktls ? "on" : "off");
+            loopback_phases("tls", url, &pub, play);
+            minirtmp_close(&pub);
+        }
+        peer_stop(&peer);
+    }
+    RTMP_TLS_FreeServerContext(ctx);
+    remove(BENCH_TLS_CERT);
+    remove(BENCH_TLS_KEY);
+    free(play);
+}
+#endif
+
+// the same publish -> play over rtmp+unix://, no tcp stack on the hop
+static void bench_unix()
+{
+    BENCH_PEER peer;
+    BENCH_PLAY *play = (BENCH_PLAY *)calloc(1, sizeof(BENCH_PLAY));
+    MINIRTMP pub;
+
+    if (!play || peer_start(&peer, BENCH_UNIX_URL))
+    {
+        free(play);
+        return;
+    }
+    if (minirtmp_init(&pub, BENCH_UNIX_URL "/live/bench", 1))
+        printf("unix: can't connect to peer\n");
+    else
+    {
+        loopback_phases("unix", BENCH_UNIX_URL "/live/bench", &pub, play);
+        minirtmp_close(&pub);
+    }
+    peer_stop(&peer);
+    remove(BENCH_UNIX_URL + sizeof("rtmp+unix://") - 1);
+    free(play);
+}
+
+int main(int argc, char **argv)
+{
+    RTMP_LogSetLevel(RTMP_LOGCRIT); // teardown of the loopback runs logs expected send errors
+#ifndef _WIN32
+    signal(SIGPIPE, SIG_IGN);
+#endif
+    // minirtmp_bench capture <url> <file> [seconds] records a live stream,
+    // minirtmp_bench replay <file> [realtime] parses it again offline
+    if (argc >= 4 && !strcmp(argv[1], "capture"))
+    {
+        BENCH_CAPTURE cap;
+        memset(&cap, 0, sizeof(cap));
+        cap.url = argv[2];
+        cap.path = argv[3];
+        cap.seconds = argc > 4 ? atoi(argv[4]) : 10;
+        capture_thread(&cap);
+        printf("captured %d video messages\n", cap.received);
+        return cap.ready > 0 ? 0 : 1;
+    }
+    if (argc >= 3 && !strcmp(argv[1], "replay"))
+    {
+        bench_replay("replay:", argv[2], argc > 3 && atoi(argv[3]));
+        return 0;
+    }
+    bench_nals();
+    bench_flv();
+    bench_amf();
+    bench_amf3();
+    bench_cmds();
+    bench_log();
+    if (!check_call_txn())
+        printf("error: calls sharing a txn lost or answered out of order\n");
+    bench_chunks(RTMP_DEFAULT_CHUNKSIZE);
+    bench_chunks(4096);
+    bench_transports();
+#ifndef _WIN32
+    bench_rtmpt();
+#endif
+    bench_mux();
+    bench_loopback();
+    bench_pool();
+    bench_reconnect();
+    bench_sockopts();
+    bench_pacing("pacing tcp off:", NULL, 0);
+    bench_pacing("pacing tcp 150%:", NULL, MINIRTMP_PACING_PERCENT);
+#ifndef _WIN32
+    bench_pacing("pacing unix off:", BENCH_UNIX_URL, 0);
+    bench_pacing("pacing unix 150%:", BENCH_UNIX_URL, MINIRTMP_PACING_PERCENT);
+#endif
+#ifndef _WIN32
+    bench_unix();
+#endif
+#ifdef CRYPTO
+    bench_tls();
+#endif
+    return 0;
+}
@@ -0,0 +1,236 @@
+#include "minirtmp_mux.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#ifdef _DEBUG
+#define dbglog(...) fprintf(stderr, __VA_ARGS__);
+#else
+#define dbglog(...)
+#endif
+
+#if defined(__GNUC__) || defined(__clang__)
+#define MUX_LOAD(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define MUX_STORE(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#else // msvc volatile accesses are acquire/release
+#define MUX_LOAD(p)     (*(volatile uint32_t *)(p))
+#define MUX_STORE(p, v) (*(volatile uint32_t *)(p) = (v))
+#endif
+
+#define MUX_WRAP 0x80000000 // rest of the ring is unused, next frame is at 0
+
+// queued frame, followed by its data padded to a multiple of the header size
+typedef struct MRTMP_MuxFrame
+{
+    uint32_t size, dts, flags;
+    int32_t cts;
+} MRTMP_MuxFrame;
+
+#define MUX_ALIGN(n) (((n) + sizeof(MRTMP_MuxFrame) - 1) & ~(uint32_t)(sizeof(MRTMP_MuxFrame) - 1))
+#define MUX_BEFORE(a, b) ((int32_t)((a) - (b)) < 0)
+
+static void mux_send(MRTMP_Mux *m, int track, MRTMP_MuxFrame *f)
+{
+    uint8_t *data = (uint8_t *)(f + 1);
+    uint32_t dts = f->dts, pts = f->dts + f->cts;
+    int ret;
+    if (m->sent && MUX_BEFORE(dts, m->last_dts))
+    {
+        dts = m->last_dts;
+        m->late++;
+    }
+    m->last_dts = dts;
+    m->sent = 1;
+    m->frames++;
+    if (m->error)
+        return;
+    if (f->flags & MRTMP_MUX_ANNEXB)
+        ret = minirtmp_write_annexb_pts(m->rtmp, data, f->size, pts, dts);
+    else
+        ret = minirtmp_write_pts(m->rtmp, data, f->size, pts, dts, MRTMP_MUX_VIDEO == track,
+            !!(f->flags & MRTMP_MUX_KEYFRAME), !!(f->flags & MRTMP_MUX_STREAM_HDRS));
+    if (MINIRTMP_ERROR == ret)
+    {
+        dbglog("error: mux write failed\n");
+        MUX_STORE(&m->error, 1);
+    }
+}
+
+// oldest queued frame of the track, NULL if none
+static MRTMP_MuxFrame *mux_peek(MRTMP_MuxTrack *t)
+{
+    uint32_t head = MUX_LOAD(&t->head);
+    MRTMP_MuxFrame *f;
+    if (head == t->tail)
+        return NULL;
+    f = (MRTMP_MuxFrame *)(t->buf + (t->tail & (t->size - 1)));
+    if (f->flags & MUX_WRAP)
+    {
+        MUX_STORE(&t->tail, t->tail + t->size - (t->tail & (t->size - 1)));
+        if (head == t->tail)
+            return NULL;
+        f = (MRTMP_MuxFrame *)t->buf;
+    }
+    return f;
+}
+
+// Sends while the oldest queued frame can't be preceded by a later arrival:
+// every other enabled track has a frame queued or queued past it already,
+// or the newest queued dts is window_ms ahead of it. flush sends all.
+static void mux_drain(MRTMP_Mux *m, int flush)
+{
+    for (;;)
+    {
+        MRTMP_MuxFrame *f[MRTMP_MUX_TRACKS];
+        uint32_t newest = 0, last[MRTMP_MUX_TRACKS] = { 0 };
+        int i, best = -1, any = 0, ready = 1;
+        for (i = 0; i < MRTMP_MUX_TRACKS; i++)
+        {
+            MRTMP_MuxTrack *t = &m->tracks[i];
+            f[i] = NULL;
+            if (!t->enabled || !MUX_LOAD(&t->active))
+                continue;
+            last[i] = MUX_LOAD(&t->last_dts);
+            if (!any || MUX_BEFORE(newest, last[i]))
+                newest = last[i];
+            any = 1;
+            if ((f[i] = mux_peek(t)) && (best < 0 || MUX_BEFORE(f[i]->dts, f[best]->dts)))
+                best = i;
+        }
+        if (best < 0)
+            return;
+        for (i = 0; i < MRTMP_MUX_TRACKS && !flush; i++)
+        {
+            MRTMP_MuxTrack *t = &m->tracks[i];
+            if (i == best || !t->enabled || f[i])
+                continue;
+            if (MUX_LOAD(&t->active) && !MUX_BEFORE(last[i], f[best]->dts))
+                continue;
+            if (MUX_BEFORE(f[best]->dts + m->window_ms, newest + 1))
+                continue;
+            ready = 0;
+        }
+        if (!ready)
+            return;
+        mux_send(m, best, f[best]);
+        {
+            MRTMP_MuxTrack *t = &m->tracks[best];
+            MUX_STORE(&t->tail, t->tail + sizeof(MRTMP_MuxFrame) + MUX_ALIGN(f[best]->size));
+        }
+    }
+}
+
+static THREAD_RET THRAPI mux_thread(void *lpThreadParameter)
+{
+    MRTMP_Mux *m = (MRTMP_Mux *)lpThreadParameter;
+    thread_name("mrtmp_mux");
+    while (!MUX_LOAD(&m->stop_flag))
+    {
+        int wait;
+        mux_drain(m, 0);
+        // paced media held by the connection goes out as it comes due
+        if (!MUX_LOAD(&m->error) && MINIRTMP_ERROR == minirtmp_flush(m->rtmp))
+        {
+            dbglog("error: mux flush failed\n");
+            MUX_STORE(&m->error, 1);
+        }
+        wait = minirtmp_flush_wait(m->rtmp);
+        event_wait(m->wake, wait >= 0 && wait < 10 ? wait : 10);
+    }
+    mux_drain(m, 1);
+    return 0;
+}
+
+int mrtmp_mux_init(MRTMP_Mux *m, MINIRTMP *rtmp, int tracks, uint32_t window_ms, int queue_size)
+{
+    uint32_t size = 4096;
+    int i;
+    memset(m, 0, sizeof(*m));
+    m->rtmp = rtmp;
+    m->window_ms = window_ms ? window_ms : MRTMP_MUX_WINDOW;
+    while (size < (uint32_t)(queue_size > 0 ? queue_size : MRTMP_MUX_QUEUE) && size < 0x40000000)
+        size *= 2;
+    for (i = 0; i < MRTMP_MUX_TRACKS; i++)
+    {
+        MRTMP_MuxTrack *t = &m->tracks[i];
+        if (!(tracks & (1 << i)))
+            continue;
+        t->enabled = 1;
+        t->size = size;
+        if (!(t->buf = (uint8_t *)malloc(size)))
+            goto error;
+    }
+    if (!(m->wake = event_create(FALSE, FALSE)))
+        goto error;
+    if (!(m->thread = thread_create(mux_thread, m)))
+        goto error;
+    return MINIRTMP_OK;
+error:
+    dbglog("error: can't start mux\n");
+    if (m->wake)
+        event_destroy(m->wake);
+    for (i = 0; i < MRTMP_MUX_TRACKS; i++)
+        free(m->tracks[i].buf);
+    memset(m, 0, sizeof(*m));
+    return MINIRTMP_ERROR;
+}
+
+int mrtmp_mux_write(MRTMP_Mux *m, int track, const uint8_t *data, int size, uint32_t pts, uint32_t dts, int flags)
+{
+    MRTMP_MuxTrack *t;
+    MRTMP_MuxFrame *f;
+    uint32_t need, pos, wrap;
+    if (track < 0 || track >= MRTMP_MUX_TRACKS || !m->tracks[track].enabled || size < 0)
+        return MINIRTMP_ERROR;
+    t = &m->tracks[track];
+    need = sizeof(MRTMP_MuxFrame) + MUX_ALIGN((uint32_t)size);
+    if (need > t->size/2)
+    {
+        dbglog("error: frame of %d bytes doesn't fit mux queue\n", size);
+        return MINIRTMP_ERROR;
+    }
+    for (;;)
+    {
+        if (MUX_LOAD(&m->error) || MUX_LOAD(&m->stop_flag))
+            return MINIRTMP_ERROR;
+        pos = t->head & (t->size - 1);
+        wrap = t->size - pos < need ? t->size - pos : 0;
+        if (t->size - (t->head - MUX_LOAD(&t->tail)) >= wrap + need)
+            break;
+        thread_sleep(1);
+    }
+    if (wrap)
+    {
+        ((MRTMP_MuxFrame *)(t->buf + pos))->flags = MUX_WRAP;
+        pos = 0;
+    }
+    f = (MRTMP_MuxFrame *)(t->buf + pos);
+    f->size = size;
+    f->dts = dts;
+    f->cts = (int32_t)(pts - dts);
+    f->flags = flags & ~MUX_WRAP;
+    memcpy(f + 1, data, size);
+    MUX_STORE(&t->head, t->head + wrap + need);
+    MUX_STORE(&t->last_dts, dts);
+    MUX_STORE(&t->active, 1);
+    event_set(m->wake);
+    return MINIRTMP_OK;
+}
+
+void mrtmp_mux_close(MRTMP_Mux *m)
+{
+    int i;
+    if (!m->thread)
+        return;
+    MUX_STORE(&m->stop_flag, 1);
+    event_set(m->wake);
+    thread_wait(m->thread);
+    thread_close(m->thread);
+    event_destroy(m->wake);
+    for (i = 0; i < MRTMP_MUX_TRACKS; i++)
+    {
+        free(m->tracks[i].buf);
+        m->tracks[i].buf = NULL;
+    }
+    m->thread = m->wake = NULL;  // frames and late stay readable
+}
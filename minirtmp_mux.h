@@ -0,0 +1,58 @@
+#pragma once
+#include "minirtmp.h"
+#include "system.h"
+
+// A/V interleaver in front of minirtmp_write: each track is fed by its own
+// thread through a lock-free single producer queue, the mux thread sends
+// frames in dts order, waiting at most window_ms of stream time for a
+// lagging track. Frames older than what was already sent go out with the
+// last sent dts, so the output is always monotonic.
+
+#define MRTMP_MUX_VIDEO  0
+#define MRTMP_MUX_AUDIO  1
+#define MRTMP_MUX_TRACKS 2
+
+// mrtmp_mux_write flags
+#define MRTMP_MUX_KEYFRAME    1
+#define MRTMP_MUX_STREAM_HDRS 2
+#define MRTMP_MUX_ANNEXB      4 // video access unit for minirtmp_write_annexb
+
+#define MRTMP_MUX_QUEUE  (4*1024*1024)
+#define MRTMP_MUX_WINDOW 500
+
+typedef struct MRTMP_MuxTrack
+{
+    uint8_t *buf;
+    uint32_t size;      // power of two, frames up to half of it fit
+    uint32_t head;      // bytes queued, written by the producer only
+    uint32_t tail;      // bytes consumed, written by the mux thread only
+    uint32_t last_dts;  // newest queued, valid once active
+    int enabled, active;
+} MRTMP_MuxTrack;
+
+typedef struct MRTMP_Mux
+{
+    MINIRTMP *rtmp;
+    MRTMP_MuxTrack tracks[MRTMP_MUX_TRACKS];
+    HANDLE thread, wake;
+    uint32_t window_ms, last_dts;
+    int stop_flag, error, sent;
+    uint64_t frames, late; // late: sent with a raised dts
+} MRTMP_Mux;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// tracks is a mask of 1 << MRTMP_MUX_*, only enabled tracks are waited for;
+// 0 for window_ms and queue_size picks the defaults
+int mrtmp_mux_init(MRTMP_Mux *m, MINIRTMP *rtmp, int tracks, uint32_t window_ms, int queue_size);
+// copies the frame, blocks while the track queue is full; frames are ordered by dts,
+// which must not go back within a track, pts is kept relative to it (b-frames)
+int mrtmp_mux_write(MRTMP_Mux *m, int track, const uint8_t *data, int size, uint32_t pts, uint32_t dts, int flags);
+// sends what is queued and stops the mux thread, producers must be done
+void mrtmp_mux_close(MRTMP_Mux *m);
+
+#ifdef __cplusplus
+}
+#endif
@@ -15,6 +15,12 @@ void mrtmp_set_packet_callback(MRTMP_Player *p, MRTMP_PACKET_CALLBACK cb, void *
     p->packet_user_data = user_data;
 }
 
+void mrtmp_set_frame_callback(MRTMP_Player *p, MRTMP_FRAME_CALLBACK cb, void *user_data)
+{
+    p->frame_cb = cb;
+    p->frame_user_data = user_data;
+}
+
 void mrtmp_set_event_callback(MRTMP_Player *p, MRTMP_EVENT_CALLBACK cb, void *user_data)
 {
     p->event_cb = cb;
@@ -87,6 +93,9 @@ static THREAD_RET THRAPI mrtmp_reader_thread(void *lpThreadParameter)
         {
             RTMPPacket *rpkt = &p->rtmp.rtmpPacket;
             MRTMP_Packet *pkt = calloc(1, sizeof(MRTMP_Packet));
+            RTMP_STATS *st = &p->rtmp.rtmp->m_stats;
+            pkt->recv_time = RTMP_GetTimeUS();
+            RTMP_STAT_ADD(&st->s_allocs, 1);
             pkt->data = rpkt->m_body;
             pkt->size = rpkt->m_nBodySize;
             pkt->type = rpkt->m_packetType;
@@ -98,6 +107,9 @@ static THREAD_RET THRAPI mrtmp_reader_thread(void *lpThreadParameter)
                 p->packets = pkt;
             p->tail = pkt;
             p->packets_in_buf++;
+            RTMP_STAT_SET(&st->s_queueDepth, p->packets_in_buf);
+            if ((uint64_t)p->packets_in_buf > RTMP_STAT_LOAD(&st->s_queueMax))
+                RTMP_STAT_SET(&st->s_queueMax, p->packets_in_buf);
             if (rpkt->m_body)
             {
                 rpkt->m_body = NULL;
@@ -126,6 +138,7 @@ static MRTMP_Packet *read_packet(MRTMP_Player *p)
     EnterCriticalSection(&p->pkt_lock);
     if (p->packets_in_buf > 0)
         p->packets_in_buf--;
+    RTMP_STAT_SET(&p->rtmp.rtmp->m_stats.s_queueDepth, p->packets_in_buf);
     MRTMP_Packet *pkt = p->packets;
     if (p->packets)
         p->packets = p->packets->next;
@@ -161,7 +174,21 @@ static THREAD_RET THRAPI mrtmp_player_thread(void *lpThreadParameter)
     MRTMP_Packet *pkt;
     while (!p->stop_flag && (pkt = read_packet(p)))
     {
-        p->packet_cb(p->packet_user_data, pkt);
+        RTMP_HistAdd(&p->rtmp.rtmp->m_stats.s_deliver, RTMP_GetTimeUS() - pkt->recv_time);
+        if (p->packet_cb)
+            p->packet_cb(p->packet_user_data, pkt);
+        if (p->frame_cb)
+        {   // after packet_cb, nal lengths are rewritten in the body
+            MINIRTMP_FRAME frame;
+            int res = minirtmp_depacketize(&p->depack, pkt->type, pkt->data, pkt->size, pkt->pts, &frame);
+            if (MINIRTMP_OK == res)
+                p->frame_cb(p->frame_user_data, &frame);
+            else if (MINIRTMP_ERROR == res)
+            {
+                dbglog("error: malformed media packet\n");
+                RTMP_STAT_ADD(&p->rtmp.rtmp->m_stats.s_dropped, 1);
+            }
+        }
         if (pkt->data)
             free(pkt->data - RTMP_MAX_HEADER_SIZE);
         free(pkt);
@@ -193,6 +220,7 @@ exit:
         free(p->packets);
         p->packets = pkt;
     }
+    minirtmp_depacketizer_free(&p->depack);
     p->stopped_flag = 1;
     return 0;
 }
@@ -208,6 +236,11 @@ void mrtmp_play(MRTMP_Player *p)
         p->stopped_flag = 1;
 }
 
+void mrtmp_get_stats(MRTMP_Player *p, RTMP_STATS *stats)
+{
+    minirtmp_get_stats(&p->rtmp, stats);
+}
+
 void mrtmp_pause(MRTMP_Player *p)
 {
     p->paused_flag = 1;
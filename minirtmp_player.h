@@ -13,11 +13,14 @@ typedef struct MRTMP_Packet
 {
     void *data;
     struct MRTMP_Packet *next;
+    uint64_t recv_time; // RTMP_GetTimeUS when the reader queued it
     uint32_t pts;
     int size, type;
 } MRTMP_Packet;
 
 typedef void (*MRTMP_PACKET_CALLBACK)(void *user, MRTMP_Packet *pkt);
+// access units from the depacketizer, the frame is valid during the call only
+typedef void (*MRTMP_FRAME_CALLBACK)(void *user, MINIRTMP_FRAME *frame);
 typedef void (*MRTMP_EVENT_CALLBACK)(void *user, int event, int code);
 
 typedef struct MRTMP_Player
@@ -29,6 +32,9 @@ typedef struct MRTMP_Player
 
     MRTMP_PACKET_CALLBACK packet_cb;
     void *packet_user_data;
+    MRTMP_FRAME_CALLBACK frame_cb;
+    void *frame_user_data;
+    MINIRTMP_DEPACKETIZER depack;
     MRTMP_EVENT_CALLBACK event_cb;
     void *event_user_data;
 
@@ -49,6 +55,7 @@ extern "C" {
 
 void mrtmp_player_init(MRTMP_Player *p);
 void mrtmp_set_packet_callback(MRTMP_Player *p, MRTMP_PACKET_CALLBACK cb, void *user_data);
+void mrtmp_set_frame_callback(MRTMP_Player *p, MRTMP_FRAME_CALLBACK cb, void *user_data);
 void mrtmp_set_event_callback(MRTMP_Player *p, MRTMP_EVENT_CALLBACK cb, void *user_data);
 int mrtmp_open_url(MRTMP_Player *p, const char *url);
 int mrtmp_open_url_async(MRTMP_Player *p, const char *url_str);
@@ -56,6 +63,7 @@ void mrtmp_close_url(MRTMP_Player *p);
 void mrtmp_play(MRTMP_Player *p);
 void mrtmp_pause(MRTMP_Player *p);
 void mrtmp_stop(MRTMP_Player *p);
+void mrtmp_get_stats(MRTMP_Player *p, RTMP_STATS *stats);
 
 #ifdef __cplusplus
 }
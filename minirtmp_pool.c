@@ -0,0 +1,283 @@
+#include "minirtmp_pool.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#ifdef _WIN32
+#define poll WSAPoll
+#else
+#include <poll.h>
+#endif
+
+#ifdef _DEBUG
+#define dbglog(...) fprintf(stderr, __VA_ARGS__);
+#else
+#define dbglog(...)
+#endif
+
+static unsigned int pool_port(int protocol, unsigned int port)
+{   // same defaults as RTMP_SetupURL
+    if (port)
+        return port;
+    if (protocol & RTMP_FEATURE_SSL)
+        return 443;
+    if (protocol & RTMP_FEATURE_HTTP)
+        return 80;
+    return 1935;
+}
+
+static void pool_free_session(RTMP *s, char *url)
+{
+    RTMP_Close(s);
+    RTMP_Free(s);
+    free(url);
+}
+
+// handshake and connect, stops at the connect _result
+static RTMP *pool_connect(MRTMP_PoolOrigin *o, char **url)
+{
+    RTMP *s = RTMP_Alloc();
+    if (!s)
+        return NULL;
+    RTMP_Init(s);
+    if (!(*url = strdup(o->url)))
+    {
+        RTMP_Free(s);
+        return NULL;
+    }
+    if (!RTMP_SetupURL(s, *url))
+        goto error;
+    if (o->stream)
+        RTMP_EnableWrite(s);
+    s->Link.lFlags |= RTMP_LF_HOLD;
+    if (!RTMP_Connect(s, NULL) || !RTMP_WaitConnect(s))
+        goto error;
+    return s;
+error:
+    dbglog("error: can't warm up %s\n", o->url);
+    pool_free_session(s, *url);
+    *url = NULL;
+    return NULL;
+}
+
+static void pool_count(MRTMP_Pool *pool, uint64_t *counter)
+{
+    EnterCriticalSection(&pool->lock);
+    (*counter)++;
+    LeaveCriticalSection(&pool->lock);
+}
+
+// reads what the server sent meanwhile and pings, 0 when the session is gone
+static int pool_check(MRTMP_Pool *pool, RTMP *s)
+{
+    uint64_t now = RTMP_GetTimeUS(), interval = (uint64_t)pool->ping_ms*1000;
+    struct pollfd pf;
+    if (!RTMP_IsConnected(s) || RTMP_IsTimedout(s))
+        return 0;
+    pf.fd = RTMP_Socket(s);
+    pf.events = POLLIN;
+    while (RTMPSockBuf_Pending(&s->m_sb) > 0 || poll(&pf, 1, 0) > 0)
+    {
+        RTMPPacket pkt = { 0 };
+        if (pf.revents & (POLLHUP | POLLERR) || !RTMP_ReadPacket(s, &pkt))
+            return 0;
+        if (RTMPPacket_IsReady(&pkt))
+        {
+            if (pkt.m_nBodySize)
+                RTMP_ClientPacket(s, &pkt);
+            RTMPPacket_Free(&pkt);
+        }
+        pf.revents = 0;
+    }
+    if (now - s->m_pingLast < interval)
+        return 1;
+    if (s->m_pingPending)
+        return 0; // no pong for a whole interval
+    return RTMP_SendPing(s);
+}
+
+static THREAD_RET THRAPI pool_thread(void *lpThreadParameter)
+{
+    MRTMP_Pool *pool = (MRTMP_Pool *)lpThreadParameter;
+    int tick = pool->ping_ms/4 < 1000 ? pool->ping_ms/4 : 1000;
+    thread_name("mrtmp_pool");
+    while (!pool->stop_flag)
+    {
+        int i, j, n;
+        for (i = 0; i < pool->num_origins && !pool->stop_flag; i++)
+        {
+            MRTMP_PoolOrigin *o = &pool->origins[i];
+            EnterCriticalSection(&pool->lock);
+            n = o->num_warm;
+            LeaveCriticalSection(&pool->lock);
+            for (j = 0; j < n; j++)
+            {   // the oldest out of warm[], a read may block so check it unlocked
+                RTMP *s;
+                char *url;
+                EnterCriticalSection(&pool->lock);
+                if (!o->num_warm)
+                {
+                    LeaveCriticalSection(&pool->lock);
+                    break; // claimed meanwhile
+                }
+                s = o->warm[0];
+                url = o->urls[0];
+                o->num_warm--;
+                memmove(o->warm, o->warm + 1, o->num_warm*sizeof(o->warm[0]));
+                memmove(o->urls, o->urls + 1, o->num_warm*sizeof(o->urls[0]));
+                LeaveCriticalSection(&pool->lock);
+                if (!pool_check(pool, s))
+                {
+                    pool_free_session(s, url);
+                    pool_count(pool, &pool->evicted);
+                    continue;
+                }
+                EnterCriticalSection(&pool->lock);
+                o->warm[o->num_warm] = s; // back as the newest
+                o->urls[o->num_warm] = url;
+                o->num_warm++;
+                LeaveCriticalSection(&pool->lock);
+            }
+            while (!pool->stop_flag && o->num_warm < o->want)
+            {   // connect unlocked, claims go on meanwhile
+                char *url;
+                RTMP *s = pool_connect(o, &url);
+                if (!s)
+                    break; // retried next tick
+                EnterCriticalSection(&pool->lock);
+                o->warm[o->num_warm] = s;
+                o->urls[o->num_warm] = url;
+                o->num_warm++;
+                LeaveCriticalSection(&pool->lock);
+            }
+        }
+        event_wait(pool->wake, tick > 10 ? tick : 10);
+    }
+    return 0;
+}
+
+int mrtmp_pool_init(MRTMP_Pool *pool, int ping_ms)
+{
+    memset(pool, 0, sizeof(*pool));
+    pool->ping_ms = ping_ms > 0 ? ping_ms : MRTMP_POOL_PING_MS;
+    InitializeCriticalSection(&pool->lock);
+    if (!(pool->wake = event_create(FALSE, FALSE)))
+        goto error;
+    if (!(pool->thread = thread_create(pool_thread, pool)))
+        goto error;
+    return MINIRTMP_OK;
+error:
+    dbglog("error: can't start pool\n");
+    if (pool->wake)
+        event_destroy(pool->wake);
+    DeleteCriticalSection(&pool->lock);
+    memset(pool, 0, sizeof(*pool));
+    return MINIRTMP_ERROR;
+}
+
+int mrtmp_pool_add(MRTMP_Pool *pool, const char *url, int stream, int warm)
+{
+    MRTMP_PoolOrigin *o;
+    AVal playpath = { 0 };
+    int ret = MINIRTMP_ERROR;
+    if (strlen(url) >= MRTMP_POOL_URL || strchr(url, ' '))
+        return MINIRTMP_ERROR;
+    EnterCriticalSection(&pool->lock);
+    if (pool->num_origins < MRTMP_POOL_ORIGINS)
+    {
+        o = &pool->origins[pool->num_origins];
+        memset(o, 0, sizeof(*o));
+        strcpy(o->url, url);
+        if (RTMP_ParseURL(o->url, &o->protocol, &o->host, &o->port, &playpath, &o->app) && o->app.av_val)
+        {
+            o->port = pool_port(o->protocol, o->port);
+            o->stream = stream;
+            o->want = warm < MRTMP_POOL_WARM ? warm : MRTMP_POOL_WARM;
+            pool->num_origins++;
+            ret = MINIRTMP_OK;
+        }
+        free(playpath.av_val);
+    }
+    LeaveCriticalSection(&pool->lock);
+    if (!ret)
+        event_set(pool->wake);
+    return ret;
+}
+
+// takes a warm session of the origin, NULL if none
+static RTMP *pool_take(MRTMP_Pool *pool, const char *url, int stream, AVal *playpath, char **session_url)
+{
+    AVal host, app = { 0 };
+    unsigned int port;
+    int i, protocol;
+    RTMP *s = NULL;
+    if (strchr(url, ' ') || !RTMP_ParseURL(url, &protocol, &host, &port, playpath, &app) || !app.av_val)
+        return NULL; // options need a connection of their own
+    port = pool_port(protocol, port);
+    EnterCriticalSection(&pool->lock);
+    for (i = 0; i < pool->num_origins; i++)
+    {
+        MRTMP_PoolOrigin *o = &pool->origins[i];
+        if (o->protocol != protocol || o->port != port || o->stream != stream || !AVMATCH(&o->host, &host) || !AVMATCH(&o->app, &app))
+            continue;
+        if (o->num_warm)
+        {
+            o->num_warm--;
+            s = o->warm[o->num_warm];
+            *session_url = o->urls[o->num_warm];
+        }
+        break;
+    }
+    LeaveCriticalSection(&pool->lock);
+    if (s)
+        event_set(pool->wake); // refill
+    return s;
+}
+
+int mrtmp_pool_claim(MRTMP_Pool *pool, MINIRTMP *r, const char *url, int stream)
+{
+    AVal playpath = { 0 };
+    char *session_url;
+    RTMP *s;
+    while ((s = pool_take(pool, url, stream, &playpath, &session_url)))
+    {
+        if (RTMP_ResumeConnect(s, &playpath) && RTMP_ConnectStream(s, 0))
+        {
+            memset(r, 0, sizeof(*r));
+            r->rtmp = s;
+            r->url = strdup(url);
+            r->link_url = session_url;
+            r->video_codec = MINIRTMP_CODEC_AVC;
+            pool_count(pool, &pool->hits);
+            return MINIRTMP_OK;
+        }
+        // died since the last check, try the next one
+        free(playpath.av_val);
+        playpath.av_val = NULL;
+        pool_free_session(s, session_url);
+        pool_count(pool, &pool->evicted);
+    }
+    free(playpath.av_val);
+    pool_count(pool, &pool->misses);
+    return minirtmp_init(r, url, stream);
+}
+
+void mrtmp_pool_close(MRTMP_Pool *pool)
+{
+    int i, j;
+    if (!pool->thread)
+        return;
+    pool->stop_flag = 1;
+    event_set(pool->wake);
+    thread_wait(pool->thread);
+    thread_close(pool->thread);
+    event_destroy(pool->wake);
+    for (i = 0; i < pool->num_origins; i++)
+    {
+        MRTMP_PoolOrigin *o = &pool->origins[i];
+        for (j = 0; j < o->num_warm; j++)
+            pool_free_session(o->warm[j], o->urls[j]);
+        o->num_warm = 0;
+    }
+    DeleteCriticalSection(&pool->lock);
+    pool->thread = pool->wake = NULL; // hits, misses and evicted stay readable
+}
@@ -0,0 +1,48 @@
+#pragma once
+#include "minirtmp.h"
+#include "system.h"
+
+// Warm connection pool: keeps sessions per origin (scheme, host, port, app)
+// handshaked and past connect/_result, so claiming one only costs
+// createStream and publish/play. Idle sessions are pinged, ones that stop
+// answering are replaced. A process typically keeps a single pool.
+
+#define MRTMP_POOL_ORIGINS 8
+#define MRTMP_POOL_WARM    4     // max per origin
+#define MRTMP_POOL_PING_MS 10000 // an unanswered ping evicts after as long
+#define MRTMP_POOL_URL     256
+
+typedef struct MRTMP_PoolOrigin
+{
+    char url[MRTMP_POOL_URL]; // as added, host and app point into it
+    AVal host, app;
+    unsigned int port;
+    int protocol, stream, want, num_warm;
+    RTMP *warm[MRTMP_POOL_WARM];
+    char *urls[MRTMP_POOL_WARM]; // copy per session, its Link points into it
+} MRTMP_PoolOrigin;
+
+typedef struct MRTMP_Pool
+{
+    CRITICAL_SECTION lock;
+    HANDLE thread, wake;
+    MRTMP_PoolOrigin origins[MRTMP_POOL_ORIGINS];
+    int num_origins, ping_ms, stop_flag;
+    uint64_t hits, misses, evicted; // updated under lock
+} MRTMP_Pool;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// 0 for ping_ms picks MRTMP_POOL_PING_MS
+int mrtmp_pool_init(MRTMP_Pool *pool, int ping_ms);
+// url is rtmp://host[:port]/app, stream as for minirtmp_init, warm up to MRTMP_POOL_WARM
+int mrtmp_pool_add(MRTMP_Pool *pool, const char *url, int stream, int warm);
+// minirtmp_init on a warm session of the url origin, a fresh connection when there is none
+int mrtmp_pool_claim(MRTMP_Pool *pool, MINIRTMP *r, const char *url, int stream);
+void mrtmp_pool_close(MRTMP_Pool *pool);
+
+#ifdef __cplusplus
+}
+#endif
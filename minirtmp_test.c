@@ -1,7 +1,6 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <assert.h>
 #include "minirtmp.h"
 #include "system.h"
 #include "minirtmp_player.h"
@@ -40,102 +39,57 @@ static uint8_t *preload(const char *path, int *data_size)
     return data;
 }
 
-static int get_nal_size(uint8_t *buf, int size)
-{
-    int pos = 3;
-    while ((size - pos) > 3)
-    {
-        if (buf[pos] == 0 && buf[pos + 1] == 0 && buf[pos + 2] == 1)
-            return pos;
-        if (buf[pos] == 0 && buf[pos + 1] == 0 && buf[pos + 2] == 0 && buf[pos + 3] == 1)
-            return pos;
-        pos++;
-    }
-    return size;
-}
-
-void on_packet(void *user, MRTMP_Packet *pkt)
+void on_frame(void *user, MINIRTMP_FRAME *frame)
 {
     FILE *f = (FILE *)user;
     static int packet = 0;
-    if (pkt->type == RTMP_PACKET_TYPE_VIDEO || pkt->type == RTMP_PACKET_TYPE_AUDIO)
+    printf("frame %d %s size=%d pts=%u dts=%u%s%s\n", packet++, frame->is_video ? "video" : "audio", frame->size,
+        frame->pts, frame->dts, frame->keyframe ? " key" : "", frame->config ? " config" : "");
+    if (frame->is_video)
+    {   // avc/hevc frames and parameter sets are annex-b already
+        if (f && (MINIRTMP_CODEC_AVC == frame->codec || MINIRTMP_CODEC_HEVC == frame->codec))
+            fwrite(frame->data, frame->size, 1, f);
+    } else if (MINIRTMP_SOUND_AAC == frame->codec)
     {
-        printf("packet %d %s size=%d\n", packet++, pkt->type == RTMP_PACKET_TYPE_VIDEO ? "video" : "audio", pkt->size);
-        if (pkt->type == RTMP_PACKET_TYPE_VIDEO)
+#if ENABLE_AUDIO
+        static HANDLE_AACDECODER dec;
+        static FILE *audiof;
+        UCHAR *buf = frame->data;
+        UINT frame_size = frame->size;
+        if (frame->config && !dec)
         {
-            uint8_t *nal = (uint8_t *)pkt->data;
-            if (!nal[1])
-            {   // stream headers in avcc format
-                uint32_t startcode = 0x01000000;
-                uint8_t *avcc = nal + 5;
-                assert(avcc[0] == 1);
-                assert(avcc[4] == 0xFF);
-                assert(avcc[5] == 0xE1);
-                int sps_size = ((int)avcc[6] << 8) | avcc[7];
-                if (f)
-                {
-                    fwrite(&startcode, 4, 1, f);
-                    fwrite(avcc + 8, sps_size, 1, f);
-                }
-                avcc += 8 + sps_size;
-                assert(avcc[0] == 1);
-                int pps_size = ((int)avcc[1] << 8) | avcc[2];
-                if (f)
-                {
-                    fwrite(&startcode, 4, 1, f);
-                    fwrite(avcc + 3, pps_size, 1, f);
-                }
-            } else if (pkt->size > 9)
+            dec = aacDecoder_Open(TT_MP4_RAW, 1);
+            if (AAC_DEC_OK != aacDecoder_ConfigRaw(dec, &buf, &frame_size))
             {
-                nal += 5;
-                *(uint32_t *)nal = 0x01000000;
-                if (f)
-                    fwrite(nal, pkt->size - 5, 1, f);
+                printf("error: aac config fail\n");
+                exit(1);
             }
-        } else if (pkt->size > 2)
+            audiof = fopen("audio.raw", "wb");
+        } else if (dec && frame_size)
         {
-#if ENABLE_AUDIO
-            uint8_t *buf = (uint8_t *)pkt->data;
-            static HANDLE_AACDECODER dec;
-            static FILE *audiof;
-            UCHAR *frame = buf + 2;
-            UINT frame_size = pkt->size - 2;
-            if (!buf[1] && !dec)
+            UINT valid = frame_size;
+            if (AAC_DEC_OK != aacDecoder_Fill(dec, &buf, &frame_size, &valid))
             {
-                dec = aacDecoder_Open(TT_MP4_RAW, 1);
-                if (AAC_DEC_OK != aacDecoder_ConfigRaw(dec, &frame, &frame_size))
-                {
-                    printf("error: aac config fail\n");
-                    exit(1);
-                }
-                audiof = fopen("audio.raw", "wb");
-            } else if (dec)
+                printf("error: aac decode fail\n");
+                exit(1);
+            }
+            INT_PCM pcm[2048*8];
+            int err = aacDecoder_DecodeFrame(dec, pcm, sizeof(pcm), 0);
+            if (AAC_DEC_OK != err/*err == AAC_DEC_NOT_ENOUGH_BITS*/)
             {
-                UINT valid = frame_size;
-                if (AAC_DEC_OK != aacDecoder_Fill(dec, &frame, &frame_size, &valid))
-                {
-                    printf("error: aac decode fail\n");
-                    exit(1);
-                }
-                INT_PCM pcm[2048*8];
-                int err = aacDecoder_DecodeFrame(dec, pcm, sizeof(pcm), 0);
-                if (AAC_DEC_OK != err/*err == AAC_DEC_NOT_ENOUGH_BITS*/)
-                {
-                    printf("error: aac decode fail %d\n", err);
-                    exit(1);
-                }
-                CStreamInfo *info = aacDecoder_GetStreamInfo(dec);
-                if (!info)
-                {
-                    printf("error: aac decode fail\n");
-                    exit(1);
-                }
-                fwrite(pcm, sizeof(INT_PCM)*info->frameSize*info->numChannels, 1, audiof);
+                printf("error: aac decode fail %d\n", err);
+                exit(1);
             }
-#endif
+            CStreamInfo *info = aacDecoder_GetStreamInfo(dec);
+            if (!info)
+            {
+                printf("error: aac decode fail\n");
+                exit(1);
+            }
+            fwrite(pcm, sizeof(INT_PCM)*info->frameSize*info->numChannels, 1, audiof);
         }
-    } else
-        printf("packet %d type=%d size=%d\n", packet++, pkt->type, pkt->size);
+#endif
+    }
 }
 
 void on_event(void *user, int event, int code)
@@ -152,6 +106,8 @@ int do_receive(const char *fname, const char *play_url)
         return 0;
     }
     MINIRTMP r;
+    MINIRTMP_DEPACKETIZER d;
+    memset(&d, 0, sizeof(d));
     if (minirtmp_init(&r, play_url, 0))
     {
         fclose(f);
@@ -166,14 +122,16 @@ int do_receive(const char *fname, const char *play_url)
         if (MINIRTMP_OK == res)
         {
             RTMPPacket *pkt = &r.rtmpPacket;
-            MRTMP_Packet p;
-            p.data = pkt->m_body;
-            p.size = pkt->m_nBodySize;
-            p.type = pkt->m_packetType;
-            on_packet(f, &p);
+            MINIRTMP_FRAME frame;
+            res = minirtmp_depacketize(&d, pkt->m_packetType, (uint8_t *)pkt->m_body, pkt->m_nBodySize, pkt->m_nTimeStamp, &frame);
+            if (MINIRTMP_OK == res)
+                on_frame(f, &frame);
+            else if (MINIRTMP_ERROR == res)
+                printf("error: malformed packet type=%d size=%d\n", pkt->m_packetType, pkt->m_nBodySize);
         }
     }
     fclose(f);
+    minirtmp_depacketizer_free(&d);
     minirtmp_close(&r);
     return 0;
 }
@@ -182,7 +140,7 @@ int do_receive_async(const char *fname, const char *play_url)
 {
     MRTMP_Player p;
     mrtmp_player_init(&p);
-    mrtmp_set_packet_callback(&p, on_packet, 0);
+    mrtmp_set_frame_callback(&p, on_frame, 0);
     mrtmp_set_event_callback(&p, on_event, 0);
     mrtmp_open_url_async(&p, play_url);
     mrtmp_play(&p);
@@ -200,7 +158,7 @@ int main(int argc, char **argv)
                "  if first param is file name, then player mode is used.\n"
                "  streamer mode:\n"
                "    first param  - destination URL to stream\n"
-               "    second param - h264 file to stream (%s default).\n"
+               "    second param - h264 (or h265 with .h265/.hevc extension) file to stream (%s default).\n"
                "  player mode:\n"
                "    first param  - destination file to save h264\n"
                "    second param - URL to play (%s default).\n", DEF_STREAM_FILE, DEF_PLAY_URL);
@@ -209,9 +167,8 @@ int main(int argc, char **argv)
 #ifdef WIN32
     RTMP_InitWinSock();
 #endif
-    int h264_size, pcm_size, last_sps_bytes = 0, last_pps_bytes = 0, header_sent = 0, frame = 0, avcc_size;
-    unsigned char last_sps[100], last_pps[100], avcc[200];
-    uint32_t start_time;
+    int h264_size, pcm_size, frame = 0;
+    uint32_t start_time = 0;
     int stream = 0 != strstr(argv[1], "rtmp://");
     const char *param2 = 0;
     if (argc > 2)
@@ -226,9 +183,13 @@ int main(int argc, char **argv)
         printf("error: can't open RTMP url %s\n", argv[1]);
         return 0;
     }
+    const char *file_name = param2 ? param2 : DEF_STREAM_FILE;
+    int hevc = strstr(file_name, ".h265") || strstr(file_name, ".hevc");
+    if (hevc)
+        r.video_codec = MINIRTMP_CODEC_HEVC;
     minirtmp_metadata(&r, 240, 160, 0);
     uint8_t *alloc_buf;
-    uint8_t *buf_h264 = alloc_buf = preload(param2 ? param2 : DEF_STREAM_FILE, &h264_size);
+    uint8_t *buf_h264 = alloc_buf = preload(file_name, &h264_size);
     if (!buf_h264)
     {
         printf("error: can't open h264 file\n");
@@ -255,37 +216,26 @@ int main(int argc, char **argv)
     aacEncInfo(aacenc, &info);
     minirtmp_write(&r, info.confBuf, info.confSize, 0, 0, 1, 1);
 #endif
-    while (h264_size > 0)
+    MINIRTMP_NAL nals[64];
+    int num_nals, i;
+    uint8_t *au = buf_h264;
+    while (h264_size > 0 && (num_nals = minirtmp_split_nals(buf_h264, h264_size, nals, 64)))
     {
-        int nal_size = get_nal_size(buf_h264, h264_size);
-        int startcode_size = 4;
-        if (buf_h264[0] == 0 && buf_h264[1] == 0 && buf_h264[2] == 1)
-            startcode_size = 3;
-        buf_h264 += startcode_size;
-        nal_size -= startcode_size;
-        h264_size -= startcode_size;
-
-        int nal_type = buf_h264[0] & 31;
-        if (nal_size < (signed)sizeof(last_sps) && (nal_type == 7))
-            memcpy(last_sps, buf_h264, last_sps_bytes = nal_size);
-        if (nal_size < (signed)sizeof(last_pps) && (nal_type == 8))
-            memcpy(last_pps, buf_h264, last_pps_bytes = nal_size);
-        if (last_sps_bytes < 1 || last_pps_bytes < 1)
-            goto done;
-        uint32_t ts = (uint64_t)frame*1000/VIDEO_FPS;
-        uint32_t rts = (uint32_t)(GetTime()/1000);
-        if (!header_sent)
-        {
-            avcc_size = minirtmp_format_avcc(avcc, last_sps, last_sps_bytes, last_pps, last_pps_bytes);
-            minirtmp_write(&r, avcc, avcc_size, 0, 1, 1, 1);
-            header_sent = 1;
-            start_time = rts;
-        } else if ((nal_type != 7) && (nal_type != 8))
-        {
-            int is_intra = nal_type == 5;
+        for (i = 0; i < num_nals; i++)
+        {   // access unit ends with vcl nal (single slice per picture)
+            int nal_type = hevc ? (nals[i].data[0] >> 1) & 63 : nals[i].type;
+            if (hevc ? nal_type > 31 : (nal_type < 1 || nal_type > 5))
+                continue;
+            uint8_t *au_end = nals[i].data + nals[i].size;
+            uint32_t ts = (uint64_t)frame*1000/VIDEO_FPS;
+            uint32_t rts = (uint32_t)(GetTime()/1000);
+            if (!frame)
+                start_time = rts;
+            int is_intra = hevc ? (nal_type >= 16 && nal_type <= 23) : nal_type == 5;
             rts -= start_time;
-            printf("frame %d, intra=%d, time=%.3f, size=%d\n", frame++, is_intra, ts/1000.0, nal_size);
-            minirtmp_write(&r, buf_h264, nal_size, ts, 1, is_intra, 0);
+            printf("frame %d, intra=%d, time=%.3f, size=%d\n", frame++, is_intra, ts/1000.0, (int)(au_end - au));
+            minirtmp_write_annexb(&r, au, au_end - au, ts);
+            au = au_end;
 #if ENABLE_AUDIO
             while (ats < ts)
             {
@@ -334,9 +284,8 @@ int main(int argc, char **argv)
             if (ts > rts)
                 thread_sleep(ts - rts);
         }
-done:
-        buf_h264 += nal_size;
-        h264_size -= nal_size;
+        h264_size -= (int)(nals[num_nals - 1].data + nals[num_nals - 1].size - buf_h264);
+        buf_h264 = nals[num_nals - 1].data + nals[num_nals - 1].size;
     }
     if (alloc_buf)
         free(alloc_buf);